@@ -0,0 +1,770 @@
+#ifndef CUSTOM_DRIVERS_CLIENT_HPP
+#define CUSTOM_DRIVERS_CLIENT_HPP
+
+// Header only C++17 client library of the custom drivers, for userspace programs that drive leds and gpio sequences
+// without going through text writes to one open device per led.
+//
+//   - led_device is one open custom_gpio_led_N device. Single commands are ioctls, and led_cmd_batch builds a batch of
+//     text commands that is sent as one write(), which the kernel checks as a whole and applies as one update.
+//   - led_bank is the custom_gpio_led_bank device. led_bank_frame updates any number of leds with one write(), and
+//     led_shm_writer updates them through the mmapped shared control page without any syscalls.
+//   - gpio_events is the custom_gpio_events device, used here to run timed gpio_sequence step lists.
+//   - gpio_pin, pwm_pin and led_num check their values at compile time when made with make<N>(), and at runtime
+//     (returning nothing for a bad value) when made with from() from a value that is only known then.
+//   - Fades and sequences have async versions that return right away with a completion to wait on or poll.
+//
+// Like the kernel modules, everything returns 0 or a negative errno and nothing throws. Handles are move only and
+// close (or unmap) what they own when destroyed.
+//
+// Only needs the C++17 standard library and the driver headers, e.g.
+//   g++ -std=c++17 -O2 -I custom-drivers/client my_service.cpp -pthread
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <optional>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../custom-led-ioctl.h"
+#include "../custom-gpio-ioctl.h"
+
+namespace custom_drivers
+{
+
+/***************    Constants    ***************/
+
+// Same as the drivers
+constexpr uint32_t MIN_PIN_NUM = 2;                 // Pins 0 and 1 are reserved for the HAT ID EEPROM
+constexpr uint32_t MAX_PIN_NUM = 27;                // Highest pin on the 40 pin header
+constexpr uint32_t MAX_LED_DEVICES = (MAX_PIN_NUM - MIN_PIN_NUM + 1);
+constexpr uint32_t VALID_PIN_MASK = ((1U << (MAX_PIN_NUM + 1)) - 1U) & ~((1U << MIN_PIN_NUM) - 1U);
+constexpr uint32_t LED_BRIGHTNESS_MAX = LED_IOC_BRIGHTNESS_MAX;
+constexpr size_t LED_WRITE_MAX_SIZE = 4096;         // PAGE_SIZE of the Pi kernels
+
+constexpr char const LED_DEVICE_PATH_PREFIX[] = "/dev/custom_gpio_led_";
+constexpr char const LED_BANK_DEVICE_PATH[] = "/dev/custom_gpio_led_bank";
+constexpr char const GPIO_EVENTS_DEVICE_PATH[] = "/dev/custom_gpio_events";
+
+
+/***************    Type definitions    ***************/
+
+// Same as pwm_channel_t of the drivers
+enum class pwm_channel : uint32_t
+{
+  pwm_0,
+  pwm_1,
+  not_pwm
+};
+
+enum class led_fade_curve : uint32_t
+{
+  linear = LED_FADE_CURVE_LINEAR,
+  ease_in_out = LED_FADE_CURVE_EASE_IN_OUT,
+  gamma = LED_FADE_CURVE_GAMMA
+};
+
+enum class led_state
+{
+  off,
+  on,
+  blink_on,     // Blinking and in the on part of the blink
+  blink_off
+};
+
+constexpr bool is_valid_pin(uint32_t pin_num)
+{
+  return ((MIN_PIN_NUM <= pin_num) && (MAX_PIN_NUM >= pin_num));
+}
+
+constexpr bool is_valid_pin_mask(uint32_t pin_mask)
+{
+  return (0 == (pin_mask & ~VALID_PIN_MASK));
+}
+
+// Channel of the pins that have one, pins 12 and 18 share PWM_0 and pins 13 and 19 share PWM_1
+constexpr pwm_channel get_pin_pwm_channel(uint32_t pin_num)
+{
+  return ((12 == pin_num) || (18 == pin_num)) ? pwm_channel::pwm_0
+         : (((13 == pin_num) || (19 == pin_num)) ? pwm_channel::pwm_1 : pwm_channel::not_pwm);
+}
+
+constexpr bool is_pwm_pin(uint32_t pin_num)
+{
+  return (pwm_channel::not_pwm != get_pin_pwm_channel(pin_num));
+}
+
+// A gpio pin from 2 to 27
+class gpio_pin
+{
+  public:
+    template <uint32_t pin_num>
+    static constexpr gpio_pin make()
+    {
+      static_assert(is_valid_pin(pin_num), "gpio pins must be between 2 and 27");
+      return gpio_pin(pin_num);
+    }
+
+    // Ret values:  The pin, or nothing if pin_num is outside 2 to 27
+    static constexpr std::optional<gpio_pin> from(uint32_t pin_num)
+    {
+      return is_valid_pin(pin_num) ? std::optional<gpio_pin>(gpio_pin(pin_num)) : std::nullopt;
+    }
+
+    constexpr uint32_t num() const { return pin_num; }
+    constexpr uint32_t mask() const { return (1U << pin_num); }
+    constexpr pwm_channel channel() const { return get_pin_pwm_channel(pin_num); }
+
+  protected:
+    constexpr explicit gpio_pin(uint32_t pin_num) : pin_num(pin_num) {}
+
+  private:
+    uint32_t pin_num;
+};
+
+// A gpio pin with a hardware pwm channel (12, 13, 18 or 19)
+class pwm_pin : public gpio_pin
+{
+  public:
+    template <uint32_t pin_num>
+    static constexpr pwm_pin make()
+    {
+      static_assert(is_pwm_pin(pin_num), "pwm pins must be 12, 13, 18 or 19");
+      return pwm_pin(pin_num);
+    }
+
+    // Ret values:  The pin, or nothing if pin_num doesn't have a pwm channel
+    static constexpr std::optional<pwm_pin> from(uint32_t pin_num)
+    {
+      return is_pwm_pin(pin_num) ? std::optional<pwm_pin>(pwm_pin(pin_num)) : std::nullopt;
+    }
+
+  private:
+    constexpr explicit pwm_pin(uint32_t pin_num) : gpio_pin(pin_num) {}
+};
+
+// Number N of a custom_gpio_led_N device
+class led_num
+{
+  public:
+    template <uint32_t num>
+    static constexpr led_num make()
+    {
+      static_assert(MAX_LED_DEVICES > num, "there are at most 26 led devices");
+      return led_num(num);
+    }
+
+    // Ret values:  The led num, or nothing if there can't be a custom_gpio_led_<num>
+    static constexpr std::optional<led_num> from(uint32_t num)
+    {
+      return (MAX_LED_DEVICES > num) ? std::optional<led_num>(led_num(num)) : std::nullopt;
+    }
+
+    constexpr uint32_t get() const { return num; }
+    constexpr uint32_t mask() const { return (1U << num); }
+
+  private:
+    constexpr explicit led_num(uint32_t num) : num(num) {}
+
+    uint32_t num;
+};
+
+// Owns a file descriptor and closes it when destroyed
+class unique_fd
+{
+  public:
+    unique_fd() = default;
+    explicit unique_fd(int fd) : fd(fd) {}
+    ~unique_fd() { reset(); }
+
+    unique_fd(unique_fd const &) = delete;
+    unique_fd &operator=(unique_fd const &) = delete;
+    unique_fd(unique_fd &&other) noexcept : fd(std::exchange(other.fd, -1)) {}
+
+    unique_fd &operator=(unique_fd &&other) noexcept
+    {
+      if (this != &other)
+      {
+        reset(std::exchange(other.fd, -1));
+      }
+
+      return *this;
+    }
+
+    int get() const { return fd; }
+    bool is_open() const { return (0 <= fd); }
+
+    void reset(int new_fd = -1)
+    {
+      if (0 <= fd)
+      {
+        ::close(fd);
+      }
+
+      fd = new_fd;
+    }
+
+    // Ret values:  0         - success
+    //              other     - failure, -errno of open()
+    int open(char const *path, int flags)
+    {
+      int new_fd = ::open(path, flags | O_CLOEXEC);
+
+      if (0 > new_fd)
+      {
+        return -errno;
+      }
+
+      reset(new_fd);
+      return 0;
+    }
+
+  private:
+    int fd = -1;
+};
+
+// Ret values:  0 or -errno of an ioctl() or write() call
+inline int sys_ret(long ret)
+{
+  return (0 > ret) ? -errno : 0;
+}
+
+// Completion of a fade. The kernel runs the whole fade from an hrtimer and doesn't report when it ends, so the fade is
+// done once its duration has passed from when the kernel accepted it. Nothing runs in the background to wait for it.
+class led_fade_completion
+{
+  public:
+    led_fade_completion() = default;
+    led_fade_completion(int error, std::chrono::steady_clock::time_point end_time) : error(error), end_time(end_time) {}
+
+    bool is_done() const { return (0 != error) || (std::chrono::steady_clock::now() >= end_time); }
+    std::chrono::steady_clock::time_point get_end_time() const { return end_time; }
+
+    // Ret values:  0         - success, the fade is done
+    //              other     - failure, the fade wasn't started (-errno of the ioctl)
+    int wait() const
+    {
+      if (0 == error)
+      {
+        std::this_thread::sleep_until(end_time);
+      }
+
+      return error;
+    }
+
+    // Ret values:  0           - success, the fade is done
+    //              -ETIMEDOUT  - failure, the fade is still running at timeout_time
+    //              other       - failure, the fade wasn't started (-errno of the ioctl)
+    int wait_until(std::chrono::steady_clock::time_point timeout_time) const
+    {
+      if ((0 != error) || (timeout_time >= end_time))
+      {
+        return wait();
+      }
+
+      std::this_thread::sleep_until(timeout_time);
+      return -ETIMEDOUT;
+    }
+
+  private:
+    int error = 0;
+    std::chrono::steady_clock::time_point end_time;
+};
+
+// Batch of text commands for one led device, sent with a single write() by led_device::flush(). The kernel parses
+// the whole batch before applying any of it and folds it down to the state it adds up to, so a bad command fails the
+// whole batch and the led only changes once. Commands that don't fit (see LED_WRITE_MAX_SIZE) fail the flush with -EMSGSIZE.
+class led_cmd_batch
+{
+  public:
+    led_cmd_batch &on() { return add("on"); }
+    led_cmd_batch &off() { return add("off"); }
+    led_cmd_batch &toggle() { return add("toggle"); }
+    led_cmd_batch &blink() { return add("blink"); }       // Uses the blink timing module parameters of the led module
+
+    // Ret values:  the batch, with brightness_percent clamped to 100
+    led_cmd_batch &brightness(uint32_t brightness_percent)
+    {
+      return add("br " + std::to_string(clamp_percent(brightness_percent)));
+    }
+
+    led_cmd_batch &fade(uint32_t target_percent, uint32_t duration_ms, led_fade_curve curve = led_fade_curve::linear)
+    {
+      static char const * const curve_names[] = { "linear", "ease", "gamma" };
+
+      fade_duration_ms = duration_ms;
+
+      return add("fade " + std::to_string(clamp_percent(target_percent)) + " " + std::to_string(duration_ms) + " "
+                 + curve_names[static_cast<uint32_t>(curve)]);
+    }
+
+    bool is_empty() const { return msg.empty(); }
+    std::string const &get_msg() const { return msg; }
+    uint32_t get_fade_duration_ms() const { return fade_duration_ms; }   // Duration of the last fade in the batch, 0 for none
+
+    void clear()
+    {
+      msg.clear();
+      fade_duration_ms = 0;
+    }
+
+  private:
+    static uint32_t clamp_percent(uint32_t percent) { return (100 < percent) ? 100 : percent; }
+
+    led_cmd_batch &add(std::string const &cmd)
+    {
+      msg += cmd;
+      msg += '\n';
+      return *this;
+    }
+
+    std::string msg;
+    uint32_t fade_duration_ms = 0;
+};
+
+// One open custom_gpio_led_N device
+class led_device
+{
+  public:
+    // Ret values:  0         - success
+    //              other     - failure, -errno of open()
+    int open(led_num led)
+    {
+      std::string path = LED_DEVICE_PATH_PREFIX + std::to_string(led.get());
+
+      return fd.open(path.c_str(), O_RDWR);
+    }
+
+    bool is_open() const { return fd.is_open(); }
+    int get_fd() const { return fd.get(); }
+
+    // Ret values for the commands: 0 or -errno of the ioctl
+    int on() { return sys_ret(::ioctl(fd.get(), LED_IOC_ON)); }
+    int off() { return sys_ret(::ioctl(fd.get(), LED_IOC_OFF)); }
+    int toggle() { return sys_ret(::ioctl(fd.get(), LED_IOC_TOGGLE)); }
+
+    int set_on(bool is_on) { return is_on ? on() : off(); }
+
+    int blink(std::chrono::microseconds on_period, std::chrono::microseconds off_period,
+              std::chrono::microseconds phase_offset = std::chrono::microseconds(0))
+    {
+      led_ioc_blink_t blink_args = { static_cast<__u32>(on_period.count()), static_cast<__u32>(off_period.count()),
+                                     static_cast<__u32>(phase_offset.count()) };
+
+      return sys_ret(::ioctl(fd.get(), LED_IOC_BLINK, &blink_args));
+    }
+
+    // brightness is 0 (off) to LED_BRIGHTNESS_MAX (fully on)
+    int set_brightness(uint32_t brightness)
+    {
+      led_ioc_brightness_t brightness_args = { brightness };
+
+      return sys_ret(::ioctl(fd.get(), LED_IOC_SET_BRIGHTNESS, &brightness_args));
+    }
+
+    int fade(uint32_t target_brightness, std::chrono::milliseconds duration, led_fade_curve curve = led_fade_curve::linear)
+    {
+      led_ioc_fade_t fade_args = { target_brightness, static_cast<__u32>(duration.count()), static_cast<__u32>(curve) };
+
+      return sys_ret(::ioctl(fd.get(), LED_IOC_FADE, &fade_args));
+    }
+
+    // Starts the fade and returns right away, see led_fade_completion
+    led_fade_completion fade_async(uint32_t target_brightness, std::chrono::milliseconds duration,
+                                   led_fade_curve curve = led_fade_curve::linear)
+    {
+      int error = fade(target_brightness, duration, curve);
+
+      return led_fade_completion(error, std::chrono::steady_clock::now() + duration);
+    }
+
+    // Sends the whole batch with one write() and clears it. A batch with a fade in it completes when its last fade does.
+    //
+    // Completion errors:  -EMSGSIZE   - the batch is longer than LED_WRITE_MAX_SIZE
+    //                     other       - -errno of the write
+    // The batch is kept on an error.
+    led_fade_completion flush(led_cmd_batch &batch)
+    {
+      std::string const &msg = batch.get_msg();
+
+      if (LED_WRITE_MAX_SIZE < msg.size())
+      {
+        return led_fade_completion(-EMSGSIZE, std::chrono::steady_clock::now());
+      }
+
+      if (msg.empty())
+      {
+        return led_fade_completion(0, std::chrono::steady_clock::now());
+      }
+
+      ssize_t written = ::write(fd.get(), msg.data(), msg.size());
+
+      if (static_cast<ssize_t>(msg.size()) != written)
+      {
+        return led_fade_completion((0 > written) ? -errno : -EIO, std::chrono::steady_clock::now());
+      }
+
+      auto end_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(batch.get_fade_duration_ms());
+
+      batch.clear();
+
+      return led_fade_completion(0, end_time);
+    }
+
+    // Reads the current state, which also marks it as seen for wait_for_change()
+    //
+    // Ret values:  0         - success
+    //              -EPROTO   - failure, the device returned a state this library doesn't know about
+    //              other     - failure, -errno of the read
+    int read_state(led_state *p_state)
+    {
+      char msg[LED_READ_MSG_SIZE] = { 0 };
+      ssize_t msg_len = ::pread(fd.get(), msg, sizeof(msg) - 1, 0);
+
+      if (0 > msg_len)
+      {
+        return -errno;
+      }
+
+      static struct { char const *msg; led_state state; } const states[] =
+      {
+        { "off\n", led_state::off },
+        { "on\n", led_state::on },
+        { "blink on\n", led_state::blink_on },
+        { "blink off\n", led_state::blink_off },
+      };
+
+      for (auto const &state : states)
+      {
+        if (0 == std::strcmp(msg, state.msg))
+        {
+          *p_state = state.state;
+          return 0;
+        }
+      }
+
+      return -EPROTO;
+    }
+
+    // Waits for the led state to change since read_state() was last called on this device (every toggle of a
+    // blinking led is a change). A negative timeout waits forever.
+    //
+    // Ret values:  0           - success, the state changed
+    //              -ETIMEDOUT  - failure, it didn't change in time
+    //              other       - failure, -errno of poll()
+    int wait_for_change(std::chrono::milliseconds timeout)
+    {
+      struct pollfd poll_fd = { fd.get(), POLLIN, 0 };
+      int ret = ::poll(&poll_fd, 1, static_cast<int>(timeout.count()));
+
+      if (0 > ret)
+      {
+        return -errno;
+      }
+
+      return (0 == ret) ? -ETIMEDOUT : 0;
+    }
+
+  private:
+    static constexpr size_t LED_READ_MSG_SIZE = 16;   // Longest state is "blink off\n", same as the driver
+
+    unique_fd fd;
+};
+
+// Frame of the led bank, every led set in it changes with a single write
+class led_bank_frame
+{
+  public:
+    led_bank_frame() { std::memset(&frame, 0, sizeof(frame)); }
+
+    led_bank_frame &set_on(led_num led, bool is_on)
+    {
+      frame.update_mask |= led.mask();
+      frame.on_mask = is_on ? (frame.on_mask | led.mask()) : (frame.on_mask & ~led.mask());
+      return *this;
+    }
+
+    // brightness is 0 (off) to LED_BRIGHTNESS_MAX (fully on)
+    led_bank_frame &set_brightness(led_num led, uint16_t brightness)
+    {
+      frame.brightness_mask |= led.mask();
+      frame.brightness[led.get()] = brightness;
+      return *this;
+    }
+
+    // Turns every led of led_mask (bit n is led n) on or off from on_mask, e.g. for a whole bar graph at once
+    //
+    // Ret values:  0         - success
+    //              -EINVAL   - failure, led_mask has leds past the last led device there can be
+    int set_on_mask(uint32_t led_mask, uint32_t on_mask)
+    {
+      if (0 != (led_mask & ~((1U << MAX_LED_DEVICES) - 1U)))
+      {
+        return -EINVAL;
+      }
+
+      frame.update_mask |= led_mask;
+      frame.on_mask = (frame.on_mask & ~led_mask) | (on_mask & led_mask);
+      return 0;
+    }
+
+    bool is_empty() const { return (0 == (frame.update_mask | frame.brightness_mask)); }
+    led_bank_frame_t const &get() const { return frame; }
+    void clear() { std::memset(&frame, 0, sizeof(frame)); }
+
+  private:
+    led_bank_frame_t frame;
+};
+
+// Updates leds through the shared control page (see led_shm_page_t). Every change made between begin() and commit()
+// shows up together, with plain stores and no syscalls. Only one writer may use the page at a time.
+class led_shm_writer
+{
+  public:
+    led_shm_writer() = default;
+    ~led_shm_writer() { unmap(); }
+
+    led_shm_writer(led_shm_writer const &) = delete;
+    led_shm_writer &operator=(led_shm_writer const &) = delete;
+    led_shm_writer(led_shm_writer &&other) noexcept : p_page(std::exchange(other.p_page, nullptr)) {}
+
+    led_shm_writer &operator=(led_shm_writer &&other) noexcept
+    {
+      if (this != &other)
+      {
+        unmap();
+        p_page = std::exchange(other.p_page, nullptr);
+      }
+
+      return *this;
+    }
+
+    // Ret values:  0         - success
+    //              other     - failure, -errno of mmap()
+    int map(int bank_fd)
+    {
+      void *p_map = ::mmap(nullptr, sizeof(led_shm_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, bank_fd, 0);
+
+      if (MAP_FAILED == p_map)
+      {
+        return -errno;
+      }
+
+      unmap();
+      p_page = static_cast<led_shm_page_t *>(p_map);
+      return 0;
+    }
+
+    bool is_mapped() const { return (nullptr != p_page); }
+
+    // Makes seq odd, so the kernel skips the page while the targets are written
+    void begin()
+    {
+      store_u32(&(p_page->seq), load_u32(&(p_page->seq)) + 1);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void set_off(led_num led) { set_state(led, LED_SHM_STATE_OFF); }
+    void set_on(led_num led) { set_state(led, LED_SHM_STATE_ON); }
+
+    void set_blink(led_num led, std::chrono::microseconds on_period, std::chrono::microseconds off_period,
+                   std::chrono::microseconds phase_offset = std::chrono::microseconds(0))
+    {
+      led_shm_led_t *p_led = &(p_page->leds[led.get()]);
+
+      store_u32(&(p_led->blink_on_period_us), static_cast<uint32_t>(on_period.count()));
+      store_u32(&(p_led->blink_off_period_us), static_cast<uint32_t>(off_period.count()));
+      store_u32(&(p_led->blink_phase_offset_us), static_cast<uint32_t>(phase_offset.count()));
+      set_state(led, LED_SHM_STATE_BLINK);
+    }
+
+    void set_brightness(led_num led, uint32_t brightness)
+    {
+      store_u32(&(p_page->leds[led.get()].brightness), brightness);
+    }
+
+    // Makes seq even again, and the kernel applies the page on its next check
+    //
+    // Ret values:  The seq to pass to wait_applied()
+    uint32_t commit()
+    {
+      std::atomic_thread_fence(std::memory_order_release);
+
+      uint32_t seq = load_u32(&(p_page->seq)) + 1;
+
+      store_u32(&(p_page->seq), seq);
+      return seq;
+    }
+
+    // Async completion of a commit. The kernel checks the page every shm_poll_us (module parameter of the led module),
+    // so this polls the page at about that rate.
+    //
+    // Ret values:  0           - success, the targets of seq were applied
+    //              -ETIMEDOUT  - failure, they weren't applied by timeout_time
+    //              other       - failure, error from the kernel applying them
+    int wait_applied(uint32_t seq, std::chrono::steady_clock::time_point timeout_time,
+                     std::chrono::microseconds poll_period = std::chrono::microseconds(100)) const
+    {
+      // Later commits can be applied before this wait starts, so anything at or after seq counts
+      while (static_cast<int32_t>(load_u32(&(p_page->applied_seq)) - seq) < 0)
+      {
+        if (std::chrono::steady_clock::now() >= timeout_time)
+        {
+          return -ETIMEDOUT;
+        }
+
+        std::this_thread::sleep_for(poll_period);
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      return static_cast<int>(static_cast<int32_t>(load_u32(reinterpret_cast<__u32 const *>(&(p_page->last_error)))));
+    }
+
+  private:
+    // The page is shared with the kernel, so every access is a single 32 bit load or store the compiler can't merge or drop
+    static uint32_t load_u32(__u32 const *p_val) { return __atomic_load_n(p_val, __ATOMIC_RELAXED); }
+    static void store_u32(__u32 *p_val, uint32_t val) { __atomic_store_n(p_val, val, __ATOMIC_RELAXED); }
+
+    void set_state(led_num led, uint32_t state) { store_u32(&(p_page->leds[led.get()].state), state); }
+
+    void unmap()
+    {
+      if (nullptr != p_page)
+      {
+        ::munmap(p_page, sizeof(led_shm_page_t));
+        p_page = nullptr;
+      }
+    }
+
+    led_shm_page_t *p_page = nullptr;
+};
+
+// The custom_gpio_led_bank device
+class led_bank
+{
+  public:
+    // Ret values:  0         - success
+    //              other     - failure, -errno of open()
+    int open() { return fd.open(LED_BANK_DEVICE_PATH, O_RDWR); }
+
+    bool is_open() const { return fd.is_open(); }
+    int get_fd() const { return fd.get(); }
+
+    // Ret values:  0         - success, every led in the frame was updated
+    //              other     - failure, -errno of the write
+    int apply(led_bank_frame const &frame)
+    {
+      ssize_t written = ::write(fd.get(), &(frame.get()), sizeof(led_bank_frame_t));
+
+      if (static_cast<ssize_t>(sizeof(led_bank_frame_t)) != written)
+      {
+        return (0 > written) ? -errno : -EIO;
+      }
+
+      return 0;
+    }
+
+    // Ret values:  0         - success
+    //              other     - failure, -errno of mmap()
+    int map_shm(led_shm_writer *p_writer) { return p_writer->map(fd.get()); }
+
+  private:
+    unique_fd fd;
+};
+
+typedef struct gpio_sequence_result_s
+{
+  int error;                          // 0 on success, -errno of the ioctl otherwise
+  std::chrono::nanoseconds max_late;  // How late the latest step ran
+} gpio_sequence_result_t;
+
+// Timed list of output steps for gpio_events::run_sequence(). The pins have to be outputs (e.g. led pins) already.
+class gpio_sequence
+{
+  public:
+    // Ret values:  0         - success
+    //              -EINVAL   - failure, a mask has pins outside 2 to 27, a pin is in both masks or there are too many steps
+    int add_step(uint32_t set_mask, uint32_t clear_mask, std::chrono::nanoseconds delay)
+    {
+      if (!is_valid_pin_mask(set_mask | clear_mask) || (0 != (set_mask & clear_mask)) || (GPIO_SEQ_MAX_STEPS <= steps.size())
+          || (0 > delay.count()) || (UINT32_MAX < static_cast<uint64_t>(delay.count())))
+      {
+        return -EINVAL;
+      }
+
+      steps.push_back({ set_mask, clear_mask, static_cast<__u32>(delay.count()) });
+      return 0;
+    }
+
+    int set_pin(gpio_pin pin, std::chrono::nanoseconds delay) { return add_step(pin.mask(), 0, delay); }
+    int clear_pin(gpio_pin pin, std::chrono::nanoseconds delay) { return add_step(0, pin.mask(), delay); }
+
+    bool is_empty() const { return steps.empty(); }
+    std::vector<gpio_seq_step_t> const &get_steps() const { return steps; }
+    void clear() { steps.clear(); }
+
+  private:
+    std::vector<gpio_seq_step_t> steps;
+};
+
+// The custom_gpio_events device
+class gpio_events
+{
+  public:
+    // Ret values:  0         - success
+    //              other     - failure, -errno of open()
+    int open() { return fd.open(GPIO_EVENTS_DEVICE_PATH, O_RDWR); }
+
+    bool is_open() const { return fd.is_open(); }
+    int get_fd() const { return fd.get(); }
+
+    // Plays the sequence repeat_cnt times (0 plays it once) and returns once it is done
+    gpio_sequence_result_t run_sequence(gpio_sequence const &sequence, uint32_t repeat_cnt = 0, uint32_t mode = GPIO_SEQ_MODE_TIMER,
+                                        uint32_t flags = 0, std::chrono::microseconds budget = std::chrono::microseconds(0)) const
+    {
+      gpio_ioc_sequence_t seq_args;
+
+      std::memset(&seq_args, 0, sizeof(seq_args));
+      seq_args.steps = reinterpret_cast<__u64>(sequence.get_steps().data());
+      seq_args.step_cnt = static_cast<__u32>(sequence.get_steps().size());
+      seq_args.repeat_cnt = repeat_cnt;
+      seq_args.mode = mode;
+      seq_args.flags = flags;
+      seq_args.budget_us = static_cast<__u32>(budget.count());
+
+      int error = sys_ret(::ioctl(fd.get(), GPIO_IOC_RUN_SEQUENCE, &seq_args));
+
+      return { error, std::chrono::nanoseconds(seq_args.max_late_ns) };
+    }
+
+    // run_sequence() on its own thread, since the ioctl only returns once the sequence is done. The sequence is copied,
+    // so it can be changed or destroyed right away, but this device has to stay open until the future is ready.
+    std::future<gpio_sequence_result_t> run_sequence_async(gpio_sequence sequence, uint32_t repeat_cnt = 0,
+                                                           uint32_t mode = GPIO_SEQ_MODE_TIMER, uint32_t flags = 0,
+                                                           std::chrono::microseconds budget = std::chrono::microseconds(0)) const
+    {
+      return std::async(std::launch::async, [this, sequence = std::move(sequence), repeat_cnt, mode, flags, budget]()
+                        {
+                          return run_sequence(sequence, repeat_cnt, mode, flags, budget);
+                        });
+    }
+
+  private:
+    unique_fd fd;
+};
+
+}   // namespace custom_drivers
+
+#endif
@@ -0,0 +1,1055 @@
+// Benchmark module for the hot paths of the gpio and pwm modules.
+// Writing a benchmark name (or "all") to /sys/kernel/debug/custom_bench/run runs it, and
+// /sys/kernel/debug/custom_bench/results shows the min/median/p99/max latency per call and the call rate of every
+// benchmark that has been run. The userspace tool in tools/custom-bench-tool.c benchmarks the led device write
+// path and adds its results to the same file, so runs of different builds can be compared from one place.
+//
+// Each sample times bench_batch back to back calls with ktime_get_ns() and divides by the batch. ktime runs off
+// of the arch timer, which only ticks at 19.2 MHz (52 ns) on the Pi 3, and the ARM cycle counter belongs to perf, so
+// batching is what gets the resolution below a tick. Preemption is off while a sample is taken, but interrupts aren't, so they
+// show up in the p99 and max like they would for any caller.
+//
+// The loopback self-test drives bench_pin from gpio_output_ctl(), the soft pwm engine or a pwm channel (or leaves it
+// to something else, like a blinking led, for "capture") while timestamping the rising edges of loopback_pin,
+// which is wired to it, from its interrupt. /sys/kernel/debug/custom_bench/loopback then shows the frequency the
+// input saw, the jitter of the periods and the edges that were missed, with no scope needed.
+
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/sort.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+
+#include "custom-driver-shared-info.h"
+#include "custom-gpio-driver.h"
+#include "custom-pwm-driver.h"
+#include "custom-errno.h"
+
+
+/***************    Macros    ***************/
+
+#define BENCH_DEBUGFS_DIR_NAME        "custom_bench"
+
+#define BENCH_DEFAULT_SAMPLES         (10000U)
+#define BENCH_MAX_SAMPLES             (1000000U)
+#define BENCH_DEFAULT_BATCH           (16U)
+#define BENCH_MAX_BATCH               (1024U)
+#define BENCH_DEFAULT_PIN             (21U)
+#define BENCH_MIN_PIN                 (2U)        // Same pin range as the gpio module
+#define BENCH_MAX_PIN                 (27U)
+#define BENCH_TOGGLE_CNT              (100000U)   // Toggles timed as one run for the toggle rate
+
+#define BENCH_NAME_LEN                (32)
+#define BENCH_MAX_USER_RESULTS        (8)         // Results added by userspace, see bench_results_write()
+#define BENCH_MAX_CMD_LEN             (64)
+
+#define BENCH_LB_DEFAULT_EDGES        (10000U)    // Rising edges driven by the toggle source, and the most that are stored
+#define BENCH_LB_DEFAULT_DURATION_MS  (1000U)
+#define BENCH_LB_MAX_DURATION_MS      (60000U)
+#define BENCH_LB_DEFAULT_PWM_FREQ_HZ  (1000U)
+#define BENCH_LB_SETTLE_MS            (2)         // Time for the interrupt of the last edge to run before the capture is stopped
+#define BENCH_LB_HIST_BUCKET_CNT      (16)        // Bucket 0 counts jitter under 128 ns and bucket n 2^(n+6) to 2^(n+7) ns, the last one has the rest
+#define BENCH_LB_HIST_SHIFT           (7)
+
+// Percentile of a sorted array of cnt samples
+#define BENCH_PERCENTILE_INDEX(cnt, percent)   ((((cnt) - 1) * (percent)) / 100)
+
+
+/***************    Type definitions    ***************/
+
+typedef struct bench_result_s
+{
+  char name[BENCH_NAME_LEN];
+  bool is_valid;
+  int error;                // The error the benchmark stopped with, the stats are only valid for ENONE
+  uint32_t sample_cnt;
+  uint32_t batch;
+  u64 min_ns;               // Per call stats
+  u64 median_ns;
+  u64 p99_ns;
+  u64 max_ns;
+  u64 rate_hz;              // Calls per second at the median, or the square wave frequency for the toggle benchmark
+} bench_result_t;
+
+// What drives bench_pin in a loopback test
+typedef enum bench_lb_source_e
+{
+  BENCH_LB_SOURCE_TOGGLE = 0,     // gpio_output_ctl() as fast as it goes, loopback_edges times
+  BENCH_LB_SOURCE_SOFT_PWM,       // The gpio module's soft pwm engine at 50%, for loopback_duration_ms
+  BENCH_LB_SOURCE_PWM,            // The pwm channel of bench_pin at loopback_pwm_freq_hz and 50%, for loopback_duration_ms
+  BENCH_LB_SOURCE_CAPTURE,        // Nothing, loopback_pin is only captured for loopback_duration_ms
+  BENCH_LB_SOURCE_CNT
+} bench_lb_source_t;
+
+typedef struct bench_lb_result_s
+{
+  bool is_valid;
+  int error;                      // The error the test stopped with, the stats are only valid for ENONE
+  uint32_t driven_edge_cnt;       // Rising edges the source drove, 0 when it isn't known
+  uint32_t edge_cnt;              // Rising edges the input saw
+  uint32_t stored_edge_cnt;       // Edges the stats are from, up to loopback_edges
+  uint32_t missed_edge_cnt;
+  u64 drive_hz;                   // Frequency the toggle source drove the pin at
+  u64 freq_mhz;                   // Frequency the input saw, in mHz
+  u64 ref_period_ns;              // Period the jitter is measured from, the pwm period or else the median period
+  u64 min_period_ns;
+  u64 max_period_ns;
+  u64 jitter_p50_ns;              // Distance of the periods from ref_period_ns
+  u64 jitter_p99_ns;
+  u64 jitter_max_ns;
+  u64 jitter_hist[BENCH_LB_HIST_BUCKET_CNT];
+} bench_lb_result_t;
+
+typedef struct bench_case_s
+{
+  char const *name;
+  int (*setup)(void);                       // Optional, a -ENODEV return skips the benchmark
+  int (*run)(uint32_t iter_num);            // One call of the function being benchmarked
+  void (*teardown)(void);                   // Optional
+} bench_case_t;
+
+
+/***************    Function declarations    ***************/
+
+// Inline functions
+static inline uint32_t bench_pin_mask(void);
+
+// Static functions
+static int __init bench_driver_init(void);
+static void __exit bench_driver_exit(void);
+static int bench_run_case(bench_case_t const *p_case, bench_result_t *p_result);
+static int bench_run_toggle_rate(bench_result_t *p_result);
+static int bench_cmp_u64(const void *p_a, const void *p_b);
+static void bench_show_result(struct seq_file *p_seq, bench_result_t const *p_result);
+static int bench_lb_run(bench_lb_source_t source, bench_lb_result_t *p_result);
+static int bench_lb_drive(bench_lb_source_t source, bench_lb_result_t *p_result);
+static int bench_lb_analyze(u64 const *p_timestamps, bench_lb_result_t *p_result);
+static void bench_lb_show_result(struct seq_file *p_seq, bench_lb_source_t source, bench_lb_result_t const *p_result);
+
+static int bench_setup_gpio(void);
+static void bench_teardown_gpio(void);
+static int bench_setup_pwm(void);
+static void bench_teardown_pwm(void);
+static int bench_run_gpio_output_ctl(uint32_t iter_num);
+static int bench_run_gpio_output_ctl_mask(uint32_t iter_num);
+static int bench_run_gpio_set_pin_to_output(uint32_t iter_num);
+static int bench_run_gpio_get_pin_function(uint32_t iter_num);
+static int bench_run_gpio_get_level(uint32_t iter_num);
+static int bench_run_pwm_set_duty_cycle(uint32_t iter_num);
+static int bench_run_pwm_set_duty_u16(uint32_t iter_num);
+static int bench_run_pwm_enable(uint32_t iter_num);
+
+// File operation functions
+static ssize_t bench_run_write(struct file *p_file, const char __user *buf, size_t len, loff_t *p_offset);
+static int bench_results_open(struct inode *p_inode, struct file *p_file);
+static int bench_results_show(struct seq_file *p_seq, void *p_data);
+static ssize_t bench_results_write(struct file *p_file, const char __user *buf, size_t len, loff_t *p_offset);
+static ssize_t bench_loopback_write(struct file *p_file, const char __user *buf, size_t len, loff_t *p_offset);
+static int bench_loopback_open(struct inode *p_inode, struct file *p_file);
+static int bench_loopback_show(struct seq_file *p_seq, void *p_data);
+
+
+/***************    Private variables    ***************/
+
+static unsigned int bench_samples = BENCH_DEFAULT_SAMPLES;
+module_param(bench_samples, uint, 0644);
+MODULE_PARM_DESC(bench_samples, "Samples taken per benchmark (default 10000, max 1000000)");
+
+static unsigned int bench_batch = BENCH_DEFAULT_BATCH;
+module_param(bench_batch, uint, 0644);
+MODULE_PARM_DESC(bench_batch, "Calls timed together in one sample (default 16, max 1024)");
+
+static unsigned int bench_pin = BENCH_DEFAULT_PIN;
+module_param(bench_pin, uint, 0444);
+MODULE_PARM_DESC(bench_pin, "Free gpio pin (2-27) the gpio benchmarks toggle, it is left as a low output (default 21)");
+
+static int bench_pwm_channel = -1;
+module_param(bench_pwm_channel, int, 0644);
+MODULE_PARM_DESC(bench_pwm_channel, "Pwm channel (0 or 1) for the pwm benchmarks, which set it up again, so it must not be used by another module (default -1, skipped)");
+
+static int loopback_pin = -1;
+module_param(loopback_pin, int, 0644);
+MODULE_PARM_DESC(loopback_pin, "Input pin wired to bench_pin for the loopback tests (default -1, skipped)");
+
+static unsigned int loopback_edges = BENCH_LB_DEFAULT_EDGES;
+module_param(loopback_edges, uint, 0644);
+MODULE_PARM_DESC(loopback_edges, "Edges the toggle loopback test drives, and the most edges any loopback test stores (default 10000, max 1000000)");
+
+static unsigned int loopback_duration_ms = BENCH_LB_DEFAULT_DURATION_MS;
+module_param(loopback_duration_ms, uint, 0644);
+MODULE_PARM_DESC(loopback_duration_ms, "Time in ms the soft_pwm, pwm and capture loopback tests run for (default 1000, max 60000)");
+
+static unsigned int loopback_pwm_freq_hz = BENCH_LB_DEFAULT_PWM_FREQ_HZ;
+module_param(loopback_pwm_freq_hz, uint, 0644);
+MODULE_PARM_DESC(loopback_pwm_freq_hz, "Frequency in Hz of the pwm loopback test (default 1000)");
+
+static char const * const bench_lb_source_names[BENCH_LB_SOURCE_CNT] =
+{
+  [BENCH_LB_SOURCE_TOGGLE] = "toggle",
+  [BENCH_LB_SOURCE_SOFT_PWM] = "soft_pwm",
+  [BENCH_LB_SOURCE_PWM] = "pwm",
+  [BENCH_LB_SOURCE_CAPTURE] = "capture",
+};
+
+static bench_case_t const bench_cases[] =
+{
+  { "gpio_output_ctl",        bench_setup_gpio, bench_run_gpio_output_ctl,        bench_teardown_gpio },
+  { "gpio_output_ctl_mask",   bench_setup_gpio, bench_run_gpio_output_ctl_mask,   bench_teardown_gpio },
+  { "gpio_set_pin_to_output", bench_setup_gpio, bench_run_gpio_set_pin_to_output, bench_teardown_gpio },
+  { "gpio_get_pin_function",  bench_setup_gpio, bench_run_gpio_get_pin_function,  bench_teardown_gpio },
+  { "gpio_get_level",         bench_setup_gpio, bench_run_gpio_get_level,         bench_teardown_gpio },
+  { "pwm_set_duty_cycle",     bench_setup_pwm,  bench_run_pwm_set_duty_cycle,     bench_teardown_pwm },
+  { "pwm_set_duty_u16",       bench_setup_pwm,  bench_run_pwm_set_duty_u16,       bench_teardown_pwm },
+  { "pwm_enable",             bench_setup_pwm,  bench_run_pwm_enable,             bench_teardown_pwm },
+};
+
+#define BENCH_CASE_CNT        (ARRAY_SIZE(bench_cases))
+#define BENCH_TOGGLE_INDEX    (BENCH_CASE_CNT)          // The toggle rate result comes after the cases
+
+// Protects the results and serializes the benchmark runs
+static DEFINE_MUTEX(bench_mutex);
+static bench_result_t bench_results[BENCH_CASE_CNT + 1];
+static bench_result_t bench_user_results[BENCH_MAX_USER_RESULTS];
+static bench_lb_result_t bench_lb_results[BENCH_LB_SOURCE_CNT];
+
+static struct dentry *p_bench_debugfs_dir = NULL;
+
+static struct file_operations const bench_run_fops =
+{
+  .owner = THIS_MODULE,
+  .write = bench_run_write,
+};
+
+static struct file_operations const bench_loopback_fops =
+{
+  .owner = THIS_MODULE,
+  .open = bench_loopback_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+  .write = bench_loopback_write,
+};
+
+static struct file_operations const bench_results_fops =
+{
+  .owner = THIS_MODULE,
+  .open = bench_results_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+  .write = bench_results_write,
+};
+
+
+/***************    Function Definitions    ***************/
+
+static int __init bench_driver_init(void)
+{
+  // The pin is shifted into masks, so it is checked here once. The parameter is read only, so it stays valid.
+  if ((BENCH_MIN_PIN > bench_pin) || (BENCH_MAX_PIN < bench_pin))
+  {
+    pr_err("Benchmark bench_pin must be between %u and %u!\n", BENCH_MIN_PIN, BENCH_MAX_PIN);
+    return -EINVAL;
+  }
+
+  p_bench_debugfs_dir = debugfs_create_dir(BENCH_DEBUGFS_DIR_NAME, NULL);
+
+  if (IS_ERR_OR_NULL(p_bench_debugfs_dir))
+  {
+    pr_err("Couldn't create the benchmark debugfs directory! Is debugfs mounted?\n");
+    return -ENODEV;
+  }
+
+  debugfs_create_file("run", 0200, p_bench_debugfs_dir, NULL, &bench_run_fops);
+  debugfs_create_file("results", 0644, p_bench_debugfs_dir, NULL, &bench_results_fops);
+  debugfs_create_file("loopback", 0644, p_bench_debugfs_dir, NULL, &bench_loopback_fops);
+
+  printk("Benchmark driver initialized\n");
+
+  return ENONE;
+}
+
+static void __exit bench_driver_exit(void)
+{
+  // Waits for any open file of the directory to be done
+  debugfs_remove_recursive(p_bench_debugfs_dir);
+
+  printk("Benchmark driver exited\n");
+}
+
+static inline uint32_t bench_pin_mask(void)
+{
+  return (1U << READ_ONCE(bench_pin));
+}
+
+// Runs one benchmark into p_result. Must be called with bench_mutex held.
+//
+// Ret values:  ENONE     - success
+//              -ENODEV   - the benchmark was skipped, e.g. no pwm channel was picked
+//              -EINVAL   - failure, bench_samples or bench_batch are out of range
+//              -ENOMEM   - failure, couldn't allocate the samples
+//              <other>   - failure, the error of the function being benchmarked
+static int bench_run_case(bench_case_t const *p_case, bench_result_t *p_result)
+{
+  uint32_t sample_cnt = READ_ONCE(bench_samples);
+  uint32_t batch = READ_ONCE(bench_batch);
+
+  memset(p_result, 0, sizeof(*p_result));
+  strscpy(p_result->name, p_case->name, sizeof(p_result->name));
+  p_result->is_valid = true;
+  p_result->sample_cnt = sample_cnt;
+  p_result->batch = batch;
+
+  if ((0 == sample_cnt) || (BENCH_MAX_SAMPLES < sample_cnt) || (0 == batch) || (BENCH_MAX_BATCH < batch))
+  {
+    p_result->error = -EINVAL;
+    return p_result->error;
+  }
+
+  u64 *p_samples = kvmalloc_array(sample_cnt, sizeof(u64), GFP_KERNEL);
+
+  if (NULL == p_samples)
+  {
+    p_result->error = -ENOMEM;
+    return p_result->error;
+  }
+
+  int error = (NULL != p_case->setup) ? p_case->setup() : ENONE;
+
+  if (ENONE != error)
+  {
+    goto free_samples;
+  }
+
+  uint32_t iter_num = 0;
+
+  for (uint32_t sample_num = 0; (ENONE == error) && (sample_num < sample_cnt); sample_num++)
+  {
+    preempt_disable();
+
+    u64 start_ns = ktime_get_ns();
+
+    for (uint32_t call_num = 0; call_num < batch; call_num++)
+    {
+      error |= p_case->run(iter_num++);
+    }
+
+    p_samples[sample_num] = ktime_get_ns() - start_ns;
+
+    preempt_enable();
+
+    cond_resched();
+  }
+
+  if (NULL != p_case->teardown)
+  {
+    p_case->teardown();
+  }
+
+  if (ENONE != error)
+  {
+    // One of the calls failed, run it again alone to get its actual error
+    error = p_case->run(0);
+    error = (ENONE != error) ? error : -EINTERNAL;
+    goto free_samples;
+  }
+
+  sort(p_samples, sample_cnt, sizeof(u64), bench_cmp_u64, NULL);
+
+  u64 median_raw_ns = p_samples[BENCH_PERCENTILE_INDEX(sample_cnt, 50)];
+
+  p_result->min_ns = div_u64(p_samples[0], batch);
+  p_result->median_ns = div_u64(median_raw_ns, batch);
+  p_result->p99_ns = div_u64(p_samples[BENCH_PERCENTILE_INDEX(sample_cnt, 99)], batch);
+  p_result->max_ns = div_u64(p_samples[sample_cnt - 1], batch);
+  p_result->rate_hz = (0 != median_raw_ns) ? div64_u64((u64)(NSEC_PER_SEC) * batch, median_raw_ns) : 0;
+
+free_samples:
+  kvfree(p_samples);
+
+  p_result->error = error;
+
+  return error;
+}
+
+// Toggles bench_pin as fast as gpio_output_ctl() allows for BENCH_TOGGLE_CNT toggles with preemption off,
+// and works out the frequency of the square wave that makes. Must be called with bench_mutex held.
+//
+// Ret values:  ENONE     - success
+//              <other>   - failure, the error of gpio_set_pin_to_output() or gpio_output_ctl()
+static int bench_run_toggle_rate(bench_result_t *p_result)
+{
+  memset(p_result, 0, sizeof(*p_result));
+  strscpy(p_result->name, "gpio_toggle_rate", sizeof(p_result->name));
+  p_result->is_valid = true;
+  p_result->sample_cnt = 1;
+  p_result->batch = BENCH_TOGGLE_CNT;
+
+  int error = bench_setup_gpio();
+
+  if (ENONE != error)
+  {
+    p_result->error = error;
+    return error;
+  }
+
+  uint32_t pin_num = READ_ONCE(bench_pin);
+
+  preempt_disable();
+
+  u64 start_ns = ktime_get_ns();
+
+  for (uint32_t toggle_num = 0; toggle_num < BENCH_TOGGLE_CNT; toggle_num++)
+  {
+    error |= gpio_output_ctl(pin_num, (0 == (toggle_num & 1)));
+  }
+
+  u64 elapsed_ns = ktime_get_ns() - start_ns;
+
+  preempt_enable();
+
+  bench_teardown_gpio();
+
+  if (ENONE != error)
+  {
+    p_result->error = -EINTERNAL;
+    return p_result->error;
+  }
+
+  p_result->min_ns = div_u64(elapsed_ns, BENCH_TOGGLE_CNT);
+  p_result->median_ns = p_result->min_ns;
+  p_result->p99_ns = p_result->min_ns;
+  p_result->max_ns = p_result->min_ns;
+
+  // Two toggles make one cycle of the square wave
+  p_result->rate_hz = (0 != elapsed_ns) ? div64_u64((u64)(NSEC_PER_SEC) * (BENCH_TOGGLE_CNT / 2), elapsed_ns) : 0;
+
+  return ENONE;
+}
+
+static int bench_cmp_u64(const void *p_a, const void *p_b)
+{
+  u64 a = *((u64 const *)(p_a));
+  u64 b = *((u64 const *)(p_b));
+
+  return (a > b) - (a < b);
+}
+
+static void bench_show_result(struct seq_file *p_seq, bench_result_t const *p_result)
+{
+  if (!p_result->is_valid)
+  {
+    return;
+  }
+
+  if (-ENODEV == p_result->error)
+  {
+    seq_printf(p_seq, "%-24s skipped\n", p_result->name);
+  }
+  else if (ENONE != p_result->error)
+  {
+    seq_printf(p_seq, "%-24s error %d\n", p_result->name, p_result->error);
+  }
+  else
+  {
+    seq_printf(p_seq, "%-24s %10u %6u %10llu %10llu %10llu %10llu %12llu\n", p_result->name, p_result->sample_cnt,
+               p_result->batch, p_result->min_ns, p_result->median_ns, p_result->p99_ns, p_result->max_ns, p_result->rate_hz);
+  }
+}
+
+// Runs one loopback test into p_result, capturing the rising edges of loopback_pin while the source drives bench_pin.
+// Must be called with bench_mutex held.
+//
+// Ret values:  ENONE     - success
+//              -ENODEV   - the test was skipped, no loopback_pin was picked or bench_pin has no free pwm channel
+//              -EINVAL   - failure, loopback_pin is bench_pin, or a loopback parameter is out of range
+//              -ENODATA  - failure, the input saw less than two edges (is the loopback wired?)
+//              -ENOMEM   - failure, couldn't allocate the timestamps
+//              <other>   - failure, error from the gpio or pwm module
+static int bench_lb_run(bench_lb_source_t source, bench_lb_result_t *p_result)
+{
+  int in_pin = READ_ONCE(loopback_pin);
+  uint32_t max_edge_cnt = READ_ONCE(loopback_edges);
+
+  memset(p_result, 0, sizeof(*p_result));
+  p_result->is_valid = true;
+
+  if (0 > in_pin)
+  {
+    p_result->error = -ENODEV;
+    return p_result->error;
+  }
+
+  if (   ((uint32_t)(in_pin) == READ_ONCE(bench_pin)) || (0 == max_edge_cnt) || (BENCH_MAX_SAMPLES < max_edge_cnt)
+      || (BENCH_LB_MAX_DURATION_MS < READ_ONCE(loopback_duration_ms)) || (0 == READ_ONCE(loopback_pwm_freq_hz))
+     )
+  {
+    p_result->error = -EINVAL;
+    return p_result->error;
+  }
+
+  u64 *p_timestamps = kvmalloc_array(max_edge_cnt, sizeof(u64), GFP_KERNEL);
+
+  if (NULL == p_timestamps)
+  {
+    p_result->error = -ENOMEM;
+    return p_result->error;
+  }
+
+  // The output is set up first so setting it up doesn't make an edge on the input
+  int error = bench_setup_gpio();
+
+  if (ENONE == error)
+  {
+    error = gpio_capture_start((uint32_t)(in_pin), GPIO_PULL_DOWN, GPIO_EDGE_RISING, p_timestamps, max_edge_cnt);
+  }
+
+  if (ENONE != error)
+  {
+    goto free_timestamps;
+  }
+
+  int drive_error = bench_lb_drive(source, p_result);
+
+  msleep(BENCH_LB_SETTLE_MS);
+
+  error = gpio_capture_stop((uint32_t)(in_pin), &(p_result->edge_cnt));
+  error = (ENONE != drive_error) ? drive_error : error;
+
+  if (ENONE == error)
+  {
+    p_result->stored_edge_cnt = min(p_result->edge_cnt, max_edge_cnt);
+    error = bench_lb_analyze(p_timestamps, p_result);
+  }
+
+free_timestamps:
+  kvfree(p_timestamps);
+
+  p_result->error = error;
+
+  return error;
+}
+
+// Drives bench_pin from the source while the input is captured, and leaves it as a low output.
+//
+// Ret values:  same as bench_lb_run()
+static int bench_lb_drive(bench_lb_source_t source, bench_lb_result_t *p_result)
+{
+  uint32_t pin_num = READ_ONCE(bench_pin);
+  int error = ENONE;
+
+  switch (source)
+  {
+    case BENCH_LB_SOURCE_TOGGLE:
+    {
+      uint32_t cycle_cnt = READ_ONCE(loopback_edges);
+
+      preempt_disable();
+
+      u64 start_ns = ktime_get_ns();
+
+      for (uint32_t cycle_num = 0; cycle_num < cycle_cnt; cycle_num++)
+      {
+        error |= gpio_output_ctl(pin_num, true);
+        error |= gpio_output_ctl(pin_num, false);
+      }
+
+      u64 elapsed_ns = ktime_get_ns() - start_ns;
+
+      preempt_enable();
+
+      p_result->driven_edge_cnt = cycle_cnt;
+      p_result->drive_hz = (0 != elapsed_ns) ? div64_u64((u64)(cycle_cnt) * NSEC_PER_SEC, elapsed_ns) : 0;
+
+      return (ENONE != error) ? -EINTERNAL : ENONE;
+    }
+
+    case BENCH_LB_SOURCE_SOFT_PWM:
+      error = gpio_soft_pwm_set_duty(pin_num, GPIO_SOFT_PWM_DUTY_MAX / 2);
+
+      // The engine only runs pins that are on, and bench_setup_gpio() left the pin off
+      if (ENONE == error)
+      {
+        error = gpio_output_ctl(pin_num, true);
+      }
+
+      if (ENONE == error)
+      {
+        msleep(READ_ONCE(loopback_duration_ms));
+      }
+
+      // A full duty makes the pin a plain output again
+      gpio_soft_pwm_set_duty(pin_num, GPIO_SOFT_PWM_DUTY_MAX);
+      gpio_output_ctl(pin_num, false);
+      return error;
+
+    case BENCH_LB_SOURCE_PWM:
+    {
+      pwm_channel_t pwm_channel = gpio_is_pin_pwm(pin_num);
+      uint32_t freq_hz = READ_ONCE(loopback_pwm_freq_hz);
+
+      // Only a channel picked with bench_pwm_channel is known to be free
+      if ((NOT_PWM == pwm_channel) || ((int)(pwm_channel) != READ_ONCE(bench_pwm_channel)))
+      {
+        return -ENODEV;
+      }
+
+      error = pwm_init_user_device(pwm_channel, 50, freq_hz, PWM_MODE_MARK_SPACE, true);
+
+      if (ENONE == error)
+      {
+        error = gpio_set_pin_to_pwm(pin_num);
+      }
+
+      if (ENONE == error)
+      {
+        p_result->ref_period_ns = div_u64(NSEC_PER_SEC, freq_hz);
+        msleep(READ_ONCE(loopback_duration_ms));
+      }
+
+      pwm_enable(pwm_channel, false);
+      bench_setup_gpio();
+      return error;
+    }
+
+    case BENCH_LB_SOURCE_CAPTURE:
+      msleep(READ_ONCE(loopback_duration_ms));
+      return ENONE;
+
+    default:
+      return -EINVAL;
+  }
+}
+
+// Works out the frequency, period jitter and missed edges from the stored rising edge timestamps.
+//
+// Ret values:  ENONE     - success
+//              -ENODATA  - failure, less than two edges were stored
+//              -ENOMEM   - failure, couldn't allocate the periods
+static int bench_lb_analyze(u64 const *p_timestamps, bench_lb_result_t *p_result)
+{
+  uint32_t stored_cnt = p_result->stored_edge_cnt;
+
+  if (2 > stored_cnt)
+  {
+    pr_err("Loopback test only saw %u edges, is loopback_pin wired to bench_pin?\n", p_result->edge_cnt);
+    return -ENODATA;
+  }
+
+  uint32_t period_cnt = stored_cnt - 1;
+  u64 *p_periods = kvmalloc_array(period_cnt, sizeof(u64), GFP_KERNEL);
+
+  if (NULL == p_periods)
+  {
+    return -ENOMEM;
+  }
+
+  for (uint32_t period_num = 0; period_num < period_cnt; period_num++)
+  {
+    p_periods[period_num] = p_timestamps[period_num + 1] - p_timestamps[period_num];
+  }
+
+  sort(p_periods, period_cnt, sizeof(u64), bench_cmp_u64, NULL);
+
+  u64 span_ns = p_timestamps[stored_cnt - 1] - p_timestamps[0];
+
+  p_result->min_period_ns = p_periods[0];
+  p_result->max_period_ns = p_periods[period_cnt - 1];
+  p_result->freq_mhz = (0 != span_ns) ? div64_u64((u64)(period_cnt) * NSEC_PER_SEC * 1000, span_ns) : 0;
+
+  if (0 == p_result->ref_period_ns)
+  {
+    p_result->ref_period_ns = p_periods[BENCH_PERCENTILE_INDEX(period_cnt, 50)];
+  }
+
+  u64 ref_ns = max(p_result->ref_period_ns, (u64)(1));
+
+  // A source that drove a known number of edges tells how many were missed. Otherwise every period that is about
+  // n reference periods long had n - 1 edges in it that were missed.
+  if (0 != p_result->driven_edge_cnt)
+  {
+    p_result->missed_edge_cnt = (p_result->driven_edge_cnt > p_result->edge_cnt) ? (p_result->driven_edge_cnt - p_result->edge_cnt) : 0;
+  }
+
+  for (uint32_t period_num = 0; period_num < period_cnt; period_num++)
+  {
+    u64 period_ns = p_periods[period_num];
+
+    if (0 == p_result->driven_edge_cnt)
+    {
+      u64 ref_cnt = div64_u64(period_ns + (ref_ns / 2), ref_ns);
+
+      p_result->missed_edge_cnt += (1 < ref_cnt) ? (uint32_t)(ref_cnt - 1) : 0;
+    }
+
+    u64 jitter_ns = (period_ns > ref_ns) ? (period_ns - ref_ns) : (ref_ns - period_ns);
+    uint32_t bucket = min((uint32_t)(fls64(jitter_ns >> BENCH_LB_HIST_SHIFT)), (uint32_t)(BENCH_LB_HIST_BUCKET_CNT - 1));
+
+    p_result->jitter_hist[bucket]++;
+    p_periods[period_num] = jitter_ns;
+  }
+
+  sort(p_periods, period_cnt, sizeof(u64), bench_cmp_u64, NULL);
+
+  p_result->jitter_p50_ns = p_periods[BENCH_PERCENTILE_INDEX(period_cnt, 50)];
+  p_result->jitter_p99_ns = p_periods[BENCH_PERCENTILE_INDEX(period_cnt, 99)];
+  p_result->jitter_max_ns = p_periods[period_cnt - 1];
+
+  kvfree(p_periods);
+
+  return ENONE;
+}
+
+static void bench_lb_show_result(struct seq_file *p_seq, bench_lb_source_t source, bench_lb_result_t const *p_result)
+{
+  char const *name = bench_lb_source_names[source];
+
+  if (!p_result->is_valid)
+  {
+    return;
+  }
+
+  if (-ENODEV == p_result->error)
+  {
+    seq_printf(p_seq, "%s: skipped\n", name);
+    return;
+  }
+
+  if (ENONE != p_result->error)
+  {
+    seq_printf(p_seq, "%s: error %d\n", name, p_result->error);
+    return;
+  }
+
+  seq_printf(p_seq, "%s_edges: %u\n", name, p_result->edge_cnt);
+  seq_printf(p_seq, "%s_edges_stored: %u\n", name, p_result->stored_edge_cnt);
+  seq_printf(p_seq, "%s_edges_missed: %u\n", name, p_result->missed_edge_cnt);
+
+  if (0 != p_result->driven_edge_cnt)
+  {
+    seq_printf(p_seq, "%s_edges_driven: %u\n", name, p_result->driven_edge_cnt);
+    seq_printf(p_seq, "%s_drive_hz: %llu\n", name, p_result->drive_hz);
+  }
+
+  u32 freq_mhz_rem = 0;
+  u64 freq_hz = div_u64_rem(p_result->freq_mhz, 1000, &freq_mhz_rem);
+
+  seq_printf(p_seq, "%s_freq_hz: %llu.%03u\n", name, freq_hz, freq_mhz_rem);
+  seq_printf(p_seq, "%s_period_ref_ns: %llu\n", name, p_result->ref_period_ns);
+  seq_printf(p_seq, "%s_period_min_ns: %llu\n", name, p_result->min_period_ns);
+  seq_printf(p_seq, "%s_period_max_ns: %llu\n", name, p_result->max_period_ns);
+  seq_printf(p_seq, "%s_jitter_p50_ns: %llu\n", name, p_result->jitter_p50_ns);
+  seq_printf(p_seq, "%s_jitter_p99_ns: %llu\n", name, p_result->jitter_p99_ns);
+  seq_printf(p_seq, "%s_jitter_max_ns: %llu\n", name, p_result->jitter_max_ns);
+  seq_printf(p_seq, "%s_jitter_hist_ns:", name);
+
+  for (uint32_t bucket = 0; bucket < BENCH_LB_HIST_BUCKET_CNT; bucket++)
+  {
+    // Buckets are shown by the lowest jitter in them
+    seq_printf(p_seq, " %u+:%llu", (0 == bucket) ? 0 : (1U << (bucket + BENCH_LB_HIST_SHIFT - 1)), p_result->jitter_hist[bucket]);
+  }
+
+  seq_puts(p_seq, "\n");
+}
+
+// Leaves bench_pin as a low output
+static int bench_setup_gpio(void)
+{
+  return gpio_set_pin_to_output(READ_ONCE(bench_pin), false);
+}
+
+static void bench_teardown_gpio(void)
+{
+  gpio_output_ctl(READ_ONCE(bench_pin), false);
+}
+
+static int bench_setup_pwm(void)
+{
+  int pwm_channel = READ_ONCE(bench_pwm_channel);
+
+  if ((PWM_0 != pwm_channel) && (PWM_1 != pwm_channel))
+  {
+    return -ENODEV;
+  }
+
+  // The channel is left disabled, so the benchmark only writes the data register and nothing is output
+  return pwm_init_user_device((pwm_channel_t)(pwm_channel), 0, PWM_FREQ_20_kHZ, PWM_MODE_BALANCED, false);
+}
+
+static void bench_teardown_pwm(void)
+{
+  pwm_set_duty_cycle((pwm_channel_t)(READ_ONCE(bench_pwm_channel)), 0);
+  pwm_enable((pwm_channel_t)(READ_ONCE(bench_pwm_channel)), false);
+}
+
+static int bench_run_gpio_output_ctl(uint32_t iter_num)
+{
+  return gpio_output_ctl(bench_pin, (0 != (iter_num & 1)));
+}
+
+static int bench_run_gpio_output_ctl_mask(uint32_t iter_num)
+{
+  uint32_t pin_mask = bench_pin_mask();
+
+  return (0 != (iter_num & 1)) ? gpio_output_ctl_mask(pin_mask, 0) : gpio_output_ctl_mask(0, pin_mask);
+}
+
+// gpio_set_pin_to_output() is the exported way into gpio_set_pin_function()
+static int bench_run_gpio_set_pin_to_output(uint32_t iter_num)
+{
+  return gpio_set_pin_to_output(bench_pin, false);
+}
+
+static int bench_run_gpio_get_pin_function(uint32_t iter_num)
+{
+  return (GPIO_OUTPUT_FUNC == gpio_get_pin_function(bench_pin)) ? ENONE : -EINVFUNC;
+}
+
+static int bench_run_gpio_get_level(uint32_t iter_num)
+{
+  bool is_high;
+
+  return gpio_get_level(bench_pin, &is_high);
+}
+
+static int bench_run_pwm_set_duty_cycle(uint32_t iter_num)
+{
+  return pwm_set_duty_cycle((pwm_channel_t)(bench_pwm_channel), (int)(iter_num % 101));
+}
+
+static int bench_run_pwm_set_duty_u16(uint32_t iter_num)
+{
+  return pwm_set_duty_u16((pwm_channel_t)(bench_pwm_channel), (uint16_t)(iter_num));
+}
+
+// Alternates disabling and enabling the channel (at 0% duty, so nothing is output). While the other channel is idle
+// every enable wakes the gated clock, so this is the cost of the first pwm_enable(true) after idling.
+static int bench_run_pwm_enable(uint32_t iter_num)
+{
+  return pwm_enable((pwm_channel_t)(bench_pwm_channel), (0 != (iter_num & 1)));
+}
+
+// Runs the benchmark named in the write, or every benchmark for "all". The write returns once they are done.
+//
+// Ret values:  len       - success
+//              -EINVAL   - failure, unknown benchmark name
+//              -EFAULT   - failure, couldn't copy the name from userspace
+//              -EINTR    - failure, interrupted while waiting for another run
+static ssize_t bench_run_write(struct file *p_file, const char __user *buf, size_t len, loff_t *p_offset)
+{
+  char cmd[BENCH_MAX_CMD_LEN];
+  size_t copy_len = min(len, sizeof(cmd) - 1);
+
+  if (copy_from_user(cmd, buf, copy_len))
+  {
+    return -EFAULT;
+  }
+
+  cmd[copy_len] = '\0';
+
+  char *p_name = strim(cmd);
+  bool is_all = (0 == strcmp(p_name, "all"));
+  bool is_found = false;
+
+  if (mutex_lock_interruptible(&bench_mutex))
+  {
+    return -EINTR;
+  }
+
+  for (uint32_t case_num = 0; case_num < BENCH_CASE_CNT; case_num++)
+  {
+    if (is_all || (0 == strcmp(p_name, bench_cases[case_num].name)))
+    {
+      bench_run_case(&(bench_cases[case_num]), &(bench_results[case_num]));
+      is_found = true;
+    }
+  }
+
+  if (is_all || (0 == strcmp(p_name, "gpio_toggle_rate")))
+  {
+    bench_run_toggle_rate(&(bench_results[BENCH_TOGGLE_INDEX]));
+    is_found = true;
+  }
+
+  mutex_unlock(&bench_mutex);
+
+  // Errors of the benchmarks themselves are shown in the results
+  return is_found ? (ssize_t)(len) : -EINVAL;
+}
+
+// Runs the loopback test of the source named in the write, or of every source besides "capture" for "all".
+// The write returns once they are done.
+//
+// Ret values:  len       - success
+//              -EINVAL   - failure, unknown source name
+//              -EFAULT   - failure, couldn't copy the name from userspace
+//              -EINTR    - failure, interrupted while waiting for another run
+static ssize_t bench_loopback_write(struct file *p_file, const char __user *buf, size_t len, loff_t *p_offset)
+{
+  char cmd[BENCH_MAX_CMD_LEN];
+  size_t copy_len = min(len, sizeof(cmd) - 1);
+
+  if (copy_from_user(cmd, buf, copy_len))
+  {
+    return -EFAULT;
+  }
+
+  cmd[copy_len] = '\0';
+
+  char *p_name = strim(cmd);
+  bool is_all = (0 == strcmp(p_name, "all"));
+  bool is_found = false;
+
+  if (mutex_lock_interruptible(&bench_mutex))
+  {
+    return -EINTR;
+  }
+
+  for (uint32_t source = 0; source < BENCH_LB_SOURCE_CNT; source++)
+  {
+    // Capturing needs something else to drive the pin, so it's only run by name
+    if ((is_all && (BENCH_LB_SOURCE_CAPTURE != source)) || (0 == strcmp(p_name, bench_lb_source_names[source])))
+    {
+      bench_lb_run((bench_lb_source_t)(source), &(bench_lb_results[source]));
+      is_found = true;
+    }
+  }
+
+  mutex_unlock(&bench_mutex);
+
+  // Errors of the tests themselves are shown in the results
+  return is_found ? (ssize_t)(len) : -EINVAL;
+}
+
+static int bench_loopback_open(struct inode *p_inode, struct file *p_file)
+{
+  return single_open(p_file, bench_loopback_show, NULL);
+}
+
+static int bench_loopback_show(struct seq_file *p_seq, void *p_data)
+{
+  if (mutex_lock_interruptible(&bench_mutex))
+  {
+    return -EINTR;
+  }
+
+  for (uint32_t source = 0; source < BENCH_LB_SOURCE_CNT; source++)
+  {
+    bench_lb_show_result(p_seq, (bench_lb_source_t)(source), &(bench_lb_results[source]));
+  }
+
+  mutex_unlock(&bench_mutex);
+
+  return ENONE;
+}
+
+static int bench_results_open(struct inode *p_inode, struct file *p_file)
+{
+  return single_open(p_file, bench_results_show, NULL);
+}
+
+static int bench_results_show(struct seq_file *p_seq, void *p_data)
+{
+  if (mutex_lock_interruptible(&bench_mutex))
+  {
+    return -EINTR;
+  }
+
+  seq_printf(p_seq, "%-24s %10s %6s %10s %10s %10s %10s %12s\n", "name", "samples", "batch", "min_ns", "median_ns",
+             "p99_ns", "max_ns", "rate_hz");
+
+  for (uint32_t result_num = 0; result_num < ARRAY_SIZE(bench_results); result_num++)
+  {
+    bench_show_result(p_seq, &(bench_results[result_num]));
+  }
+
+  for (uint32_t result_num = 0; result_num < BENCH_MAX_USER_RESULTS; result_num++)
+  {
+    bench_show_result(p_seq, &(bench_user_results[result_num]));
+  }
+
+  mutex_unlock(&bench_mutex);
+
+  return ENONE;
+}
+
+// Adds a result measured in userspace, written as one line in the same format the results are shown in.
+// A result with the name of an earlier one replaces it, up to BENCH_MAX_USER_RESULTS names.
+//
+// Ret values:  len       - success
+//              -EINVAL   - failure, the line isn't a result
+//              -ENOSPC   - failure, there is no room for another name
+//              -EFAULT   - failure, couldn't copy the line from userspace
+//              -EINTR    - failure, interrupted while waiting for a run
+static ssize_t bench_results_write(struct file *p_file, const char __user *buf, size_t len, loff_t *p_offset)
+{
+  char line[128];
+  size_t copy_len = min(len, sizeof(line) - 1);
+  bench_result_t result = { 0 };
+
+  if (copy_from_user(line, buf, copy_len))
+  {
+    return -EFAULT;
+  }
+
+  line[copy_len] = '\0';
+
+  // The name width is BENCH_NAME_LEN - 1
+  if (8 != sscanf(line, "%31s %u %u %llu %llu %llu %llu %llu", result.name, &(result.sample_cnt), &(result.batch),
+                  &(result.min_ns), &(result.median_ns), &(result.p99_ns), &(result.max_ns), &(result.rate_hz)))
+  {
+    return -EINVAL;
+  }
+
+  result.is_valid = true;
+
+  if (mutex_lock_interruptible(&bench_mutex))
+  {
+    return -EINTR;
+  }
+
+  bench_result_t *p_slot = NULL;
+
+  for (uint32_t result_num = 0; result_num < BENCH_MAX_USER_RESULTS; result_num++)
+  {
+    bench_result_t *p_user_result = &(bench_user_results[result_num]);
+
+    if (p_user_result->is_valid && (0 == strcmp(p_user_result->name, result.name)))
+    {
+      p_slot = p_user_result;
+      break;
+    }
+
+    if (!p_user_result->is_valid && (NULL == p_slot))
+    {
+      p_slot = p_user_result;
+    }
+  }
+
+  if (NULL != p_slot)
+  {
+    *p_slot = result;
+  }
+
+  mutex_unlock(&bench_mutex);
+
+  return (NULL != p_slot) ? (ssize_t)(len) : -ENOSPC;
+}
+
+module_init(bench_driver_init);
+module_exit(bench_driver_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Trevor Foland");
+MODULE_DESCRIPTION("A practice Linux driver that benchmarks the hot paths of the custom gpio and pwm modules.");
+MODULE_VERSION("1.0");
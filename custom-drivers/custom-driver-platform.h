@@ -0,0 +1,126 @@
+#ifndef CUSTOM_DRIVER_PLATFORM_H
+#define CUSTOM_DRIVER_PLATFORM_H
+
+// Platform driver helpers shared by the gpio, pwm and led modules.
+//
+// Each module is a platform driver bound to its node in the custom-drivers device tree overlay (see custom-drivers-overlay.dts),
+// which gives the register ranges as VideoCore bus addresses that the kernel translates for the board it is running on.
+// Without the overlay a device is made from the peripheral base of the detected SoC instead, so the modules still load
+// the way they always have.
+
+#include <linux/of.h>
+#include <linux/platform_device.h>
+#include <linux/ioport.h>
+#include <linux/version.h>
+
+#include "custom-errno.h"
+
+/***************    Macros    ***************/
+
+// Where the ARM sees the peripherals, only used for the fallback devices
+#define BCM2835_PERI_BASE     (0x20000000)    // Pi 1 and Zero
+#define BCM2836_PERI_BASE     (0x3F000000)    // Pi 2 and 3 (BCM2836 and BCM2837)
+#define BCM2711_PERI_BASE     (0xFE000000)    // Pi 4 (low peripheral mode, which is the default)
+
+// platform_driver.remove returns void since 6.11
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+  #define CUSTOM_PLATFORM_REMOVE_RET_T    void
+  #define CUSTOM_PLATFORM_REMOVE_RETURN   return
+#else
+  #define CUSTOM_PLATFORM_REMOVE_RET_T    int
+  #define CUSTOM_PLATFORM_REMOVE_RETURN   return ENONE
+#endif
+
+
+/***************    Function Definitions    ***************/
+
+static inline bool custom_soc_is_bcm2711(void)
+{
+  return of_machine_is_compatible("brcm,bcm2711");
+}
+
+static inline phys_addr_t custom_get_peri_base(void)
+{
+  if (custom_soc_is_bcm2711())
+  {
+    return BCM2711_PERI_BASE;
+  }
+
+  if (of_machine_is_compatible("brcm,bcm2836") || of_machine_is_compatible("brcm,bcm2837"))
+  {
+    return BCM2836_PERI_BASE;
+  }
+
+  if (of_machine_is_compatible("brcm,bcm2835"))
+  {
+    return BCM2835_PERI_BASE;
+  }
+
+  // Unknown board, the modules were written for the Pi 3 so assume it
+  return BCM2836_PERI_BASE;
+}
+
+// Registers p_driver and, if no device tree node bound to it, a fallback device with the p_fallback_res resources.
+// The fallback device (or NULL when the device tree one is used) is put in *pp_fallback_dev for
+// custom_platform_driver_unregister(). The devices probe synchronously, so a driver is bound once this returns ENONE.
+//
+// Ret values:  ENONE     - success
+//              -ENODEV   - failure, neither device could be probed
+//              other     - failure, error from registering the driver or the fallback device
+static inline int custom_platform_driver_register(struct platform_driver *p_driver, struct resource const *p_fallback_res,
+                                                  unsigned int fallback_res_cnt, struct platform_device **pp_fallback_dev)
+{
+  *pp_fallback_dev = NULL;
+
+  int error = platform_driver_register(p_driver);
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  struct device *p_dev = driver_find_next_device(&(p_driver->driver), NULL);
+
+  if (NULL == p_dev)
+  {
+    struct platform_device *p_fallback_dev = platform_device_register_simple(p_driver->driver.name, PLATFORM_DEVID_NONE,
+                                                                             p_fallback_res, fallback_res_cnt);
+
+    if (IS_ERR(p_fallback_dev))
+    {
+      platform_driver_unregister(p_driver);
+      return PTR_ERR(p_fallback_dev);
+    }
+
+    *pp_fallback_dev = p_fallback_dev;
+    p_dev = driver_find_next_device(&(p_driver->driver), NULL);
+  }
+
+  if (NULL == p_dev)
+  {
+    if (NULL != *pp_fallback_dev)
+    {
+      platform_device_unregister(*pp_fallback_dev);
+      *pp_fallback_dev = NULL;
+    }
+
+    platform_driver_unregister(p_driver);
+    return -ENODEV;
+  }
+
+  put_device(p_dev);
+
+  return ENONE;
+}
+
+static inline void custom_platform_driver_unregister(struct platform_driver *p_driver, struct platform_device *p_fallback_dev)
+{
+  if (NULL != p_fallback_dev)
+  {
+    platform_device_unregister(p_fallback_dev);
+  }
+
+  platform_driver_unregister(p_driver);
+}
+
+#endif
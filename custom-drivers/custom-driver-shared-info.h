@@ -1,7 +1,7 @@
 #ifndef CUSTOM_DRIVER_SHARED_INFO_H
 #define CUSTOM_DRIVER_SHARED_INFO_H
 
-#define BCM2837_PERI_BASE     (0x3F000000)
+#define BCM283X_PERI_BUS_BASE (0x7E000000)   // Where the peripherals are on the VideoCore bus, which is what the DMA engine uses
 
 typedef enum pwm_channel_e
 {
@@ -0,0 +1,17 @@
+#ifndef CUSTOM_DRIVER_TRACE_H
+#define CUSTOM_DRIVER_TRACE_H
+
+#include <linux/printk.h>
+
+// Trace sites for the register and control paths of the custom drivers.
+//
+// When the modules are built with "make CUSTOM_DRIVERS_TRACE=y" these are dynamic debug sites. They are off by default
+// and cost almost nothing until turned on through /sys/kernel/debug/dynamic_debug/control (or with the "dyndbg" module parameter).
+// Otherwise they are compiled out completely. The format string and arguments are still type checked, but never evaluated.
+#ifdef CUSTOM_DRIVERS_TRACE
+#define custom_trace(fmt, ...)    pr_debug(fmt, ##__VA_ARGS__)
+#else
+#define custom_trace(fmt, ...)    no_printk(fmt, ##__VA_ARGS__)
+#endif
+
+#endif
@@ -1,118 +1,474 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/moduleparam.h>
+#include <linux/version.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/miscdevice.h>
+#include <linux/interrupt.h>
+#include <linux/gpio.h>
+#include <linux/percpu.h>
+#include <linux/math64.h>
+#include <linux/overflow.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
 #include <asm/io.h>
 
 #include "custom-gpio-driver.h"
+#include "custom-driver-platform.h"
+#include "custom-peri-core.h"
 #include "custom-errno.h"
+#include "custom-driver-trace.h"
 
 
 /***************    Macros    ***************/
 
-// Peripheral addresses
-#define GPIO_BASE             (BCM2837_PERI_BASE + 0x200000)
-#define GPIO_SIZE             (0xB1)               // GPIO peripheral memory area in bytes
+// Platform device. The registers come from the device tree node, or from the peripheral base of the SoC without one.
+#define GPIO_PLATFORM_NAME      "custom-gpio"
+#define GPIO_DT_COMPATIBLE      "custom,bcm2835-gpio"
+#define GPIO_PERI_OFFSET        (0x200000)           // Offset of the GPIO registers from the peripheral base
+#define GPIO_BCM2835_SIZE       (0xB1)               // GPIO peripheral memory area in bytes (BCM2835 to BCM2837)
+#define GPIO_BCM2711_SIZE       (0xF4)               // The BCM2711 has its pull registers after the old ones
 
 // All offsets are defined in bytes
 #define GPFSEL_OFFSET           (0x00)
 #define GPSET_OFFSET            (0x1C)
 #define GPCLR_OFFSET            (0x28)
 #define GPLEV_OFFSET            (0x2C)
+#define GPPUD_OFFSET            (0x94)
+#define GPPUDCLK_OFFSET         (0x98)
+#define GPIO_PUP_PDN_OFFSET     (0xE4)    // BCM2711 only, GPIO_PUP_PDN_CNTRL_REG0 to 3 replace GPPUD/GPPUDCLK
+#define GPIO_REG_SIZE           (sizeof(uint32_t))
+#define GPIO_BANK1_REG(offset)  ((offset) + GPIO_REG_SIZE)    // GPSET1, GPCLR1 and GPLEV1 follow the bank 0 registers
+
+// Pin banks. GPSET, GPCLR and GPLEV have one register per bank of 32 pins.
+#define GPIO_BANK_PIN_CNT         (32)
+#define BCM2835_GPIO_PIN_CNT      (54)  // BCM2835 to BCM2837
+#define BCM2711_GPIO_PIN_CNT      (58)
+#define GPIO_MAX_PIN_CNT          (BCM2711_GPIO_PIN_CNT)
 
 // GPSEL register defines
 #define MIN_PIN_NUM               (2)   // lowest gpio pin that is usable (inclusive)
 #define MAX_PIN_NUM               (27)  // highest gpio pin that is usable (inclusive)
 #define GPFSEL_GPIO_PINS_PER_REG  (10)
-#define GPFSEL_MAX_REG_OFFSET     (MAX_PIN_NUM / GPFSEL_GPIO_PINS_PER_REG)
+#define GPFSEL_MAX_REG_OFFSET     ((GPIO_MAX_PIN_CNT - 1) / GPFSEL_GPIO_PINS_PER_REG)
 #define GPFSEL_FIELD_BIT_WIDTH    (3)       // Each GPFSEL pin/field has a width of 3 bits in its register.
 #define GPFSEL_FIELD_MASK         (0x07U)   // Each GPFSEL pin/field has a width of 3 bits so 0x07U is the mask for a field.
-#define GPFSEL_INPUT              (0x00U)
-#define GPFSEL_OUTPUT             (0x01U)
-#define GPFSEL_ALT_FUNC_0         (0x04U)
-#define GPFSEL_ALT_FUNC_1         (0x05U)
-#define GPFSEL_ALT_FUNC_2         (0x06U)
-#define GPFSEL_ALT_FUNC_3         (0x07U)
-#define GPFSEL_ALT_FUNC_4         (0x03U)
-#define GPFSEL_ALT_FUNC_5         (0x02U)
-
-#define GPIO_INPUT_FUNC           (GPFSEL_INPUT)
-#define GPIO_OUTPUT_FUNC          (GPFSEL_OUTPUT)
-#define GPIO_ALT_FUNC_0           (GPFSEL_ALT_FUNC_0)
-#define GPIO_ALT_FUNC_1           (GPFSEL_ALT_FUNC_1)
-#define GPIO_ALT_FUNC_2           (GPFSEL_ALT_FUNC_2)
-#define GPIO_ALT_FUNC_3           (GPFSEL_ALT_FUNC_3)
-#define GPIO_ALT_FUNC_4           (GPFSEL_ALT_FUNC_4)
-#define GPIO_ALT_FUNC_5           (GPFSEL_ALT_FUNC_5)
-#define GPIO_INVALID_FUNC         (0xFFU) // Picked max byte value
+#define GPFSEL_REG_CNT            (GPFSEL_MAX_REG_OFFSET + 1)
 
 // Output Control register defines
 #define OUTPUT_CTL_WRT_VAL    (0x01U)                 // Output control requires writing a 1 to the appropriate GPCLR or GPSET register
 #define GPSET_SET_OUTPUT      (OUTPUT_CTL_WRT_VAL)    // Setting an output requires a 1 to be written (to the appropriate GPSET register)
 #define GPCLR_CLEAR_OUTPUT    (OUTPUT_CTL_WRT_VAL)    // Clearing an output requires a 1 to be written (to the appropriate GPCLR register)
 
+// Mask of every pin that can be passed to gpio_output_ctl_mask(). Bits below MIN_PIN_NUM
+// and above MAX_PIN_NUM are not usable pins and are rejected.
+#define GPIO_VALID_PIN_MASK   (((1U << (MAX_PIN_NUM + 1)) - 1U) & ~((1U << MIN_PIN_NUM) - 1U))
+
+// Software pwm defines
+#define GPIO_SOFT_PWM_STEPS             (256U)    // Duty cycle resolution, every pwm period is split into this many time slices
+#define GPIO_SOFT_PWM_DEFAULT_FREQ_HZ   (200U)
+#define GPIO_SOFT_PWM_MAX_FREQ_HZ       (500U)    // Keeps a time slice at ~8 us or longer
+#define GPIO_SOFT_PWM_MAX_EDGES         (MAX_PIN_NUM - MIN_PIN_NUM + 1)
+
+// Input defines
+#define GPIO_PUD_SETUP_DELAY_US   (1)       // The pull control needs 150 core clock cycles to set up and hold
+#define GPIO_PUP_PDN_PINS_PER_REG (16)      // BCM2711 pull fields are 2 bits per pin
+#define GPIO_PUP_PDN_FIELD_MASK   (0x03U)
+#define GPIO_PUP_PDN_UP           (0x01U)
+#define GPIO_PUP_PDN_DOWN         (0x02U)
+#define GPIO_PUP_PDN_REG_CNT      ((BCM2711_GPIO_PIN_CNT + GPIO_PUP_PDN_PINS_PER_REG - 1) / GPIO_PUP_PDN_PINS_PER_REG)
+#define GPIO_EVENTS_DEVICE_NAME   "custom_gpio_events"
+#define GPIO_EVENT_RING_SIZE      (256U)    // Events buffered per input pin, must be a power of 2
+#define GPIO_EVENTS_READ_CHUNK    (16U)     // Events copied to userspace at a time
+
+// Sequence player defines
+#define GPIO_SEQ_DEFAULT_BUSY_MAX_US  (2000U)   // Longest a busy sequence can keep a cpu by default
+
+// Linux gpio number of our pin 0, needed to look up the interrupts of the pins.
+// Since 6.6 the gpio chips get their numbers from 512 up.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+  #define GPIO_DEFAULT_LINUX_BASE (512)
+#else
+  #define GPIO_DEFAULT_LINUX_BASE (0)
+#endif
+
 /***************    Type definitions    ***************/
 
-// The enum value is also the FSEL value for that function type.
-typedef uint32_t gpio_func_type_t;
+// Pins whose duty cycle ends at the same time slice of the period share one edge, which clears them all at once.
+typedef struct gpio_soft_pwm_edge_s
+{
+  uint32_t level;         // Time slice of the period that the pins are cleared at
+  uint32_t clear_mask;
+} gpio_soft_pwm_edge_t;
+
+typedef struct gpio_soft_pwm_schedule_s
+{
+  uint32_t pin_mask;      // Every pin driven by the engine
+  uint32_t lit_mask;      // Pins with a duty cycle above 0, which are set (if on) at the start of every period
+  uint32_t zero_mask;     // Pins with a duty cycle of 0, which are held low
+  uint32_t edge_cnt;
+  gpio_soft_pwm_edge_t edges[GPIO_SOFT_PWM_MAX_EDGES];   // Sorted by level
+} gpio_soft_pwm_schedule_t;
+
+// Single producer, single consumer ring of the edge events of one pin. The producer is the pin's irq handler, which
+// never runs concurrently with itself, and the consumer is a reader holding gpio_input_mutex, so neither side locks.
+typedef struct gpio_event_ring_s
+{
+  uint32_t head ____cacheline_aligned;   // Only written by the irq handler
+  uint32_t tail ____cacheline_aligned;   // Only written by readers
+  gpio_event_t events[GPIO_EVENT_RING_SIZE];
+} gpio_event_ring_t;
+
+// Edge counts of a counting pin on one cpu. The irq handler only updates the counter of the cpu it runs on, so it
+// needs no atomics, and the syncp lets readers get a consistent copy of the 64 bit fields on 32 bit kernels too.
+typedef struct gpio_pin_counter_s
+{
+  struct u64_stats_sync syncp;
+  u64 count;
+  u64 first_edge_ns;
+  u64 last_edge_ns;
+  u64 min_period_ns;                // Only of periods between two edges handled on this cpu
+  u64 max_period_ns;
+} gpio_pin_counter_t;
+
+// What the interrupt of an input pin does with its edges
+typedef enum gpio_input_mode_e
+{
+  GPIO_INPUT_MODE_EVENTS = 0,     // Queues them for the custom_gpio_events device
+  GPIO_INPUT_MODE_COUNTER,        // Counts them (GPIO_IOC_SET_COUNTER)
+  GPIO_INPUT_MODE_CAPTURE         // Timestamps them into a kernel buffer (gpio_capture_start())
+} gpio_input_mode_t;
+
+typedef struct gpio_input_s
+{
+  uint32_t pin_num;
+  uint32_t edge_flags;                        // GPIO_EDGE_* requested, 0 when the pin has no edge interrupt
+  int irq;
+  gpio_event_ring_t *p_ring;                  // Only set for pins reporting edge events
+  gpio_pin_counter_t __percpu *p_counters;    // Only set for counting pins
+  u64 *p_capture_buf;                         // The capture fields are only set for capturing pins
+  uint32_t capture_max_cnt;
+  atomic_t capture_cnt;                       // Edges seen, can be more than capture_max_cnt
+} gpio_input_t;
 
 
 /***************    Function declarations    ***************/
 
 // Inline functions
 static inline bool gpio_is_valid_pin(uint32_t pin_num);
+static inline bool gpio_is_valid_bank1_pin(uint32_t pin_num);
+static inline bool gpio_is_valid_output_pin(uint32_t pin_num);
 static inline bool gpio_is_valid_pin_func(gpio_func_type_t gpio_func_type);
+static inline bool gpio_is_valid_pin_mask(uint32_t pin_mask);
+static inline void gpio_init_pin_func_shadow(void);
+static inline void gpio_write_output_masks(uint32_t set_mask, uint32_t clear_mask);
 
 // Static functions
 static int __init gpio_driver_init(void);
 static void __exit gpio_driver_exit(void);
-static void gpio_set_pin_to_input(uint32_t pin_num, bool is_active_high);
+static int gpio_probe(struct platform_device *p_pdev);
+static CUSTOM_PLATFORM_REMOVE_RET_T gpio_remove(struct platform_device *p_pdev);
 static gpio_func_type_t gpio_determine_pwm_alt_func(uint32_t pin_num);
+static void gpio_soft_pwm_build_schedule(gpio_soft_pwm_schedule_t *p_schedule);
+static enum hrtimer_restart gpio_soft_pwm_timer_callback(struct hrtimer *p_timer);
+static void gpio_set_pin_pull(uint32_t pin_num, gpio_pull_t pull);
+static int gpio_input_configure_locked(gpio_ioc_input_t const *p_input_cfg, gpio_input_mode_t mode,
+                                       u64 *p_capture_buf, uint32_t capture_max_cnt);
+static void gpio_input_release_locked(uint32_t pin_num);
+static irqreturn_t gpio_edge_irq_handler(int irq, void *p_dev_id);
+static irqreturn_t gpio_count_irq_handler(int irq, void *p_dev_id);
+static irqreturn_t gpio_capture_irq_handler(int irq, void *p_dev_id);
+static int gpio_counter_read_locked(gpio_ioc_count_t *p_count);
+static ssize_t gpio_events_drain_locked(gpio_event_t __user *p_user_events, size_t max_event_cnt);
+static int gpio_seq_run(gpio_ioc_sequence_t *p_seq);
+static int gpio_seq_check_steps(gpio_ioc_sequence_t const *p_seq, gpio_seq_step_t const *p_steps, u64 *p_duration_ns);
+static int gpio_seq_run_busy(gpio_ioc_sequence_t *p_seq, gpio_seq_step_t const *p_steps, u64 budget_ns);
+static int gpio_seq_run_timer(gpio_ioc_sequence_t *p_seq, gpio_seq_step_t const *p_steps);
+static enum hrtimer_restart gpio_seq_timer_callback(struct hrtimer *p_timer);
+
+// File operation functions
+static ssize_t gpio_events_read(struct file *, char __user *, size_t, loff_t *);
+static __poll_t gpio_events_poll(struct file *, struct poll_table_struct *);
+static long gpio_events_ioctl(struct file *, unsigned int, unsigned long);
 
 /***************    Private variables    ***************/
 
-static uint32_t volatile * gpio_base_addr = NULL;   // All registers are 32 bit for gpio so use a uint32_t pointer
-static DEFINE_MUTEX(gpio_func_mutex);
+static void __iomem *gpio_base_addr = NULL;   // Part of the shared peripheral mapping, see custom-peri-core.c
+
+static struct of_device_id const gpio_of_match[] =
+{
+  { .compatible = GPIO_DT_COMPATIBLE },
+  { }
+};
+
+static struct platform_driver gpio_platform_driver =
+{
+  .probe = gpio_probe,
+  .remove = gpio_remove,
+  .driver =
+  {
+    .name = GPIO_PLATFORM_NAME,
+    .of_match_table = gpio_of_match,
+    .suppress_bind_attrs = true,    // The other modules call into this one, so it can't be unbound from under them
+  },
+};
+
+static struct platform_device *p_gpio_fallback_dev = NULL;  // Only made when there is no device tree node
+static bool gpio_is_bcm2711 = false;
+
+// Pins 32 and up aren't on the 40 pin header and most of them are used by the board (SD card, wifi, etc.), so
+// only the ones listed in bank1_pins (or the bank1-pins property of the device tree node) can be used, as outputs.
+static unsigned int bank1_pins = 0;
+module_param(bank1_pins, uint, 0444);
+MODULE_PARM_DESC(bank1_pins, "Mask of the free gpio pins from 32 up that can be used as outputs, bit n is pin 32 + n (up to pin 53, or 57 on the BCM2711, default 0)");
+static uint32_t gpio_bank1_pin_mask = 0;
+
+// Raw spinlock so pin functions can also be changed from atomic context (irq handlers, timer callbacks, etc.).
+// It only ever protects a few RAM and register writes so it is never held for long.
+static DEFINE_RAW_SPINLOCK(gpio_func_lock);
+
+// RAM copies of the GPFSEL registers and of the function of every pin. The registers are read once
+// at init and from then on they are only ever written (see peri_shadow_update()), so changing a pin function
+// doesn't need a read over the peripheral bus and the current function of a pin can be looked up for free.
+//
+// NOTE: This assumes no other driver changes the function select of pins sharing a GPFSEL register
+//       with our pins while this module is loaded, since we write back the whole register from the shadow.
+static peri_shadow_reg_t gpio_fsel_shadow[GPFSEL_REG_CNT];
+static uint8_t gpio_pin_func_table[GPIO_MAX_PIN_CNT];
+
+static unsigned int soft_pwm_freq_hz = GPIO_SOFT_PWM_DEFAULT_FREQ_HZ;
+module_param(soft_pwm_freq_hz, uint, 0444);
+MODULE_PARM_DESC(soft_pwm_freq_hz, "Frequency in Hz of the software pwm on pins without a pwm channel (1-500, default 200)");
+
+// Level every output pin was last set to through the output control apis (bit n is GPIO pin n). The soft pwm
+// engine uses it to know which of its pins are on, so turning a soft pwm pin on or off works the same as any other pin.
+static atomic_t gpio_output_on_mask = ATOMIC_INIT(0);
+
+// The soft pwm engine is a single hrtimer for every soft pwm pin. At the start of a period it sets every soft pwm pin that
+// is on with one GPSET write, and then it only wakes up at the time slices where some pins' duty cycles end, clearing all
+// of them with one GPCLR write. So a period costs at most one wakeup per distinct duty cycle plus one, however many pins
+// there are. Duty cycle changes are staged and picked up at the start of the next period.
+//
+// gpio_soft_pwm_lock protects everything below except gpio_soft_pwm_pin_mask, which is read without it.
+// It is a raw spinlock since it is taken in hard irq context by the timer.
+static DEFINE_RAW_SPINLOCK(gpio_soft_pwm_lock);
+static struct hrtimer gpio_soft_pwm_timer;
+static bool gpio_soft_pwm_is_running = false;
+static ktime_t gpio_soft_pwm_period;
+static u64 gpio_soft_pwm_slice_ns;
+static ktime_t gpio_soft_pwm_period_start;
+static bool gpio_soft_pwm_is_at_period_start = true;
+static uint32_t gpio_soft_pwm_next_edge = 0;
+static gpio_soft_pwm_schedule_t gpio_soft_pwm_schedule;             // Schedule of the current period
+static uint32_t gpio_soft_pwm_pending_mask = 0;                     // Pins for the next period's schedule
+static uint16_t gpio_soft_pwm_pending_levels[MAX_PIN_NUM + 1];
+static bool gpio_soft_pwm_is_dirty = false;
+
+// Only one core can change the pull of a pin at a time, since the pull control registers are shared by every pin.
+static DEFINE_RAW_SPINLOCK(gpio_pud_lock);
+
+// The BCM2711 pull registers are only written by us too, so they are kept in RAM like the GPFSEL registers
+static peri_shadow_reg_t gpio_pup_pdn_shadow[GPIO_PUP_PDN_REG_CNT];
+
+static int gpio_linux_base = GPIO_DEFAULT_LINUX_BASE;
+module_param(gpio_linux_base, int, 0444);
+MODULE_PARM_DESC(gpio_linux_base, "Linux gpio number of gpio pin 0, used to find the pin interrupts (default 512 on 6.6+ kernels, 0 before)");
+
+// The input pins and their edge event rings. gpio_input_mutex protects the configuration of the inputs and
+// is held by readers while they empty the rings.
+static DEFINE_MUTEX(gpio_input_mutex);
+static gpio_input_t gpio_inputs[MAX_PIN_NUM + 1];
+static DECLARE_WAIT_QUEUE_HEAD(gpio_events_waitq);
+static atomic_t gpio_events_pending_cnt = ATOMIC_INIT(0);   // Events in all the rings, so waiters don't have to look at them
+static atomic_t gpio_events_dropped_cnt = ATOMIC_INIT(0);
+
+static struct file_operations const gpio_events_fops =
+{
+  .owner = THIS_MODULE,
+  .read = gpio_events_read,
+  .poll = gpio_events_poll,
+  .unlocked_ioctl = gpio_events_ioctl,
+  .compat_ioctl = compat_ptr_ioctl,   // The ioctl structs are the same size for 32 and 64 bit userspace
+};
+
+static struct miscdevice gpio_events_misc_dev =
+{
+  .minor = MISC_DYNAMIC_MINOR,
+  .name = GPIO_EVENTS_DEVICE_NAME,
+  .fops = &gpio_events_fops,
+  .mode = 0666,
+};
+
+// Sequence player. Only one sequence runs at a time, and gpio_seq_mutex is held for the whole run.
+// The timer mode fields are set up before the timer starts and then only used by the timer until gpio_seq_is_done.
+static DEFINE_MUTEX(gpio_seq_mutex);
+static struct hrtimer gpio_seq_timer;
+static DECLARE_WAIT_QUEUE_HEAD(gpio_seq_waitq);
+static gpio_seq_step_t const *gpio_seq_steps = NULL;
+static uint32_t gpio_seq_step_cnt = 0;
+static uint32_t gpio_seq_next_step = 0;
+static uint32_t gpio_seq_repeats_left = 0;
+static ktime_t gpio_seq_next_time;
+static ktime_t gpio_seq_end_time;           // Past it the callback stops the sequence, KTIME_MAX without a budget
+static u64 gpio_seq_max_late_ns = 0;
+static bool gpio_seq_is_done = true;
+static bool gpio_seq_is_over_budget = false;
+
+static unsigned int seq_busy_max_us = GPIO_SEQ_DEFAULT_BUSY_MAX_US;
+module_param(seq_busy_max_us, uint, 0644);
+MODULE_PARM_DESC(seq_busy_max_us, "Longest budget in us a busy mode gpio sequence can have, since it keeps a cpu to itself (default 2000)");
+
+// Pins in the current or next period's schedule. GPSET writes from the output control apis skip these pins, since the
+// engine sets them itself at the start of the next period.
+static uint32_t gpio_soft_pwm_pin_mask = 0;
 
 
 /***************    Function Definitions    ***************/
 
 static int __init gpio_driver_init(void)
 {
-  // Attempt to map the GPIO
-  gpio_base_addr = (uint32_t *)(ioremap(GPIO_BASE, GPIO_SIZE));  // Note, a page size always has to be allocated, so even if it is under a page, it still takes up a page of memory.
+  if ((0 == soft_pwm_freq_hz) || (GPIO_SOFT_PWM_MAX_FREQ_HZ < soft_pwm_freq_hz))
+  {
+    pr_err("GPIO driver soft_pwm_freq_hz must be between 1 and %u Hz!\n", GPIO_SOFT_PWM_MAX_FREQ_HZ);
+    return -EINVAL;
+  }
+
+  struct resource fallback_res = DEFINE_RES_MEM(custom_get_peri_base() + GPIO_PERI_OFFSET,
+                                                custom_soc_is_bcm2711() ? GPIO_BCM2711_SIZE : GPIO_BCM2835_SIZE);
+
+  int error = custom_platform_driver_register(&gpio_platform_driver, &fallback_res, 1, &p_gpio_fallback_dev);
+
+  if (ENONE != error)
+  {
+    pr_err("GPIO driver couldn't be bound to a device! error: %d\n", error);
+    return error;
+  }
+
+  printk("GPIO driver successfully initialized\n");
+  return ENONE;
+}
+
+static void __exit gpio_driver_exit(void)
+{
+  custom_platform_driver_unregister(&gpio_platform_driver, p_gpio_fallback_dev);
+
+  printk("GPIO driver exited\n");
+}
+
+// Ret values:  ENONE       - success
+//              -EBUSY      - failure, the driver is already bound to another device
+//              -EINVAL     - failure, the device has no (or too small of a) register range or bank1_pins has pins the SoC doesn't
+//              -EMAPPING   - failure, the registers aren't in the shared peripheral mapping
+//              other       - failure, error from registering the custom_gpio_events device
+static int gpio_probe(struct platform_device *p_pdev)
+{
+  // The exported apis work on a single gpio block
+  if (NULL != gpio_base_addr)
+  {
+    pr_err("GPIO driver is already bound to a device!\n");
+    return -EBUSY;
+  }
+
+  struct resource *p_res = platform_get_resource(p_pdev, IORESOURCE_MEM, 0);
+
+  gpio_is_bcm2711 = custom_soc_is_bcm2711();
+
+  if ((NULL == p_res) || ((gpio_is_bcm2711 ? GPIO_BCM2711_SIZE : GPIO_BCM2835_SIZE) > resource_size(p_res)))
+  {
+    pr_err("GPIO device doesn't have the whole gpio register range!\n");
+    return -EINVAL;
+  }
+
+  uint32_t gpio_pin_cnt = gpio_is_bcm2711 ? BCM2711_GPIO_PIN_CNT : BCM2835_GPIO_PIN_CNT;
+  uint32_t bank1_soc_mask = (1U << (gpio_pin_cnt - GPIO_BANK_PIN_CNT)) - 1U;
+
+  gpio_bank1_pin_mask = bank1_pins;
+
+  if (0 == gpio_bank1_pin_mask)
+  {
+    of_property_read_u32(p_pdev->dev.of_node, "bank1-pins", &gpio_bank1_pin_mask);
+  }
+
+  if (0 != (gpio_bank1_pin_mask & ~bank1_soc_mask))
+  {
+    pr_err("GPIO bank1_pins %#x has pins above %u, which this SoC doesn't have!\n", gpio_bank1_pin_mask, gpio_pin_cnt - 1);
+    gpio_bank1_pin_mask = 0;
+    return -EINVAL;
+  }
+
+  // The registers come out of the mapping the peripheral core made, so nothing is mapped (or unmapped) here
+  gpio_base_addr = peri_core_get_regs(p_res->start, resource_size(p_res));
 
-  // For some reason the mapping failed
   if (NULL == gpio_base_addr)
   {
     // Exit immediately
-    pr_err("GPIO driver couldn't map the io space!\n");
+    pr_err("GPIO driver couldn't get its registers from the peripheral core!\n");
     return -EMAPPING;
   }
   else
   {
-    printk("GPIO successfully mapped\n");
+    printk("GPIO successfully mapped at %pa (%s)\n", &(p_res->start), gpio_is_bcm2711 ? "BCM2711" : "BCM2835");
   }
 
-  mutex_init(&gpio_func_mutex);
+  gpio_init_pin_func_shadow();
+
+  gpio_soft_pwm_period = ns_to_ktime(NSEC_PER_SEC / soft_pwm_freq_hz);
+  gpio_soft_pwm_slice_ns = ktime_to_ns(gpio_soft_pwm_period) / GPIO_SOFT_PWM_STEPS;
+  hrtimer_init(&gpio_soft_pwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+  gpio_soft_pwm_timer.function = gpio_soft_pwm_timer_callback;
+
+  hrtimer_init(&gpio_seq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+  gpio_seq_timer.function = gpio_seq_timer_callback;
+
+  for (uint32_t pin_num = 0; pin_num <= MAX_PIN_NUM; pin_num++)
+  {
+    gpio_inputs[pin_num].pin_num = pin_num;
+  }
+
+  int error = misc_register(&gpio_events_misc_dev);
+
+  if (ENONE != error)
+  {
+    pr_err("GPIO driver couldn't register the %s device! error: %d\n", GPIO_EVENTS_DEVICE_NAME, error);
+    gpio_base_addr = NULL;
+    return error;
+  }
 
-  printk("GPIO driver successfully initialized\n");
   return ENONE;
 }
 
-static void __exit gpio_driver_exit(void)
+static CUSTOM_PLATFORM_REMOVE_RET_T gpio_remove(struct platform_device *p_pdev)
 {
-  // If the gpio was successfully mapped
-  if (NULL != gpio_base_addr)
+  misc_deregister(&gpio_events_misc_dev);
+
+  mutex_lock(&gpio_input_mutex);
+
+  for (uint32_t pin_num = MIN_PIN_NUM; pin_num <= MAX_PIN_NUM; pin_num++)
   {
-    // Release the GPIO mapping
-    printk("Released GPIO mapping\n");
-    iounmap(gpio_base_addr);
+    gpio_input_release_locked(pin_num);
   }
-  
-  mutex_destroy(&gpio_func_mutex);
 
-  printk("GPIO driver exited\n");
+  mutex_unlock(&gpio_input_mutex);
+
+  hrtimer_cancel(&gpio_soft_pwm_timer);
+
+  // The mapping belongs to the peripheral core
+  printk("Released GPIO registers\n");
+  gpio_base_addr = NULL;
+
+  CUSTOM_PLATFORM_REMOVE_RETURN;
 }
 
 static inline bool gpio_is_valid_pin(uint32_t pin_num)
@@ -120,6 +476,69 @@ static inline bool gpio_is_valid_pin(uint32_t pin_num)
   return ((MIN_PIN_NUM <= pin_num) && (MAX_PIN_NUM >= pin_num));
 }
 
+static inline bool gpio_is_valid_bank1_pin(uint32_t pin_num)
+{
+  return ((GPIO_BANK_PIN_CNT <= pin_num) && (GPIO_MAX_PIN_CNT > pin_num)
+          && (0 != (gpio_bank1_pin_mask & (1U << (pin_num - GPIO_BANK_PIN_CNT)))));
+}
+
+// Pins that can be outputs, which are the valid pins and the bank1_pins
+static inline bool gpio_is_valid_output_pin(uint32_t pin_num)
+{
+  return (gpio_is_valid_pin(pin_num) || gpio_is_valid_bank1_pin(pin_num));
+}
+
+static inline void gpio_init_pin_func_shadow(void)
+{
+  for (uint32_t reg_offset = 0; reg_offset < GPFSEL_REG_CNT; reg_offset++)
+  {
+    peri_shadow_init(&(gpio_fsel_shadow[reg_offset]), gpio_base_addr + GPFSEL_OFFSET + (reg_offset * GPIO_REG_SIZE));
+  }
+
+  if (gpio_is_bcm2711)
+  {
+    for (uint32_t reg_offset = 0; reg_offset < GPIO_PUP_PDN_REG_CNT; reg_offset++)
+    {
+      peri_shadow_init(&(gpio_pup_pdn_shadow[reg_offset]), gpio_base_addr + GPIO_PUP_PDN_OFFSET + (reg_offset * GPIO_REG_SIZE));
+    }
+  }
+
+  for (uint32_t pin_num = 0; pin_num < GPIO_MAX_PIN_CNT; pin_num++)
+  {
+    uint32_t fsel_field_num = pin_num % GPFSEL_GPIO_PINS_PER_REG;
+
+    gpio_pin_func_table[pin_num] = (peri_shadow_get(&(gpio_fsel_shadow[pin_num / GPFSEL_GPIO_PINS_PER_REG])) >> (fsel_field_num * GPFSEL_FIELD_BIT_WIDTH))
+                                   & GPFSEL_FIELD_MASK;
+  }
+}
+
+// Does the output writes of gpio_output_ctl_mask() for masks that were already checked.
+// Can be called from any context.
+static inline void gpio_write_output_masks(uint32_t set_mask, uint32_t clear_mask)
+{
+  atomic_or((int)(set_mask), &gpio_output_on_mask);
+  atomic_andnot((int)(clear_mask), &gpio_output_on_mask);
+
+  // Soft pwm pins are set by the soft pwm engine at the start of its next period
+  set_mask &= ~READ_ONCE(gpio_soft_pwm_pin_mask);
+
+  // Only the first set and clear registers are needed, see gpio_output_ctl()
+  if (0 != set_mask)
+  {
+    peri_write(gpio_base_addr, GPSET_OFFSET, set_mask);
+  }
+
+  if (0 != clear_mask)
+  {
+    peri_write(gpio_base_addr, GPCLR_OFFSET, clear_mask);
+  }
+}
+
+static inline bool gpio_is_valid_pin_mask(uint32_t pin_mask)
+{
+  return (0 == (pin_mask & ~GPIO_VALID_PIN_MASK));
+}
+
 static inline bool gpio_is_valid_pin_func(gpio_func_type_t gpio_func_type)
 {
   switch (gpio_func_type)
@@ -150,7 +569,7 @@ static inline bool gpio_is_valid_pin_func(gpio_func_type_t gpio_func_type)
 //              -EINTERNAL  - failure, other internal failure 
 static int gpio_set_pin_function(uint32_t pin_num, gpio_func_type_t gpio_func_type)
 {
-  if (!gpio_is_valid_pin(pin_num))
+  if (!gpio_is_valid_output_pin(pin_num))
   {
     pr_err("GPIO pin provided is outside valid pin range!\n");
     return -EINVPIN;
@@ -172,65 +591,53 @@ static int gpio_set_pin_function(uint32_t pin_num, gpio_func_type_t gpio_func_ty
     return -EINVREG;
   }
 
-  uint32_t volatile * const pin_GPFSELx_reg = gpio_base_addr + (GPFSEL_OFFSET / sizeof(uint32_t)) + register_offset;
   uint32_t fsel_field_num = pin_num % GPFSEL_GPIO_PINS_PER_REG;
 
-  // Lock this section since we are modifying gpio function values and we have to
-  // read out the value of the register before writing it.
-  mutex_lock(&gpio_func_mutex);
+  unsigned long irq_flags;
 
-  uint32_t reg_value_to_write = (*pin_GPFSELx_reg) & (~(GPFSEL_FIELD_MASK << (fsel_field_num * GPFSEL_FIELD_BIT_WIDTH))); // First clear the alternative function field for that pin without affecting other pins.
-  reg_value_to_write |= (gpio_func_type << (fsel_field_num * GPFSEL_FIELD_BIT_WIDTH));  // Next set that field to be an output
-  
-  printk("gpio_set_pin_function() - gpio_base_addr: %X, pin_GPFSELx_reg: %X, fsel_field_num: %d\n", gpio_base_addr, pin_GPFSELx_reg, fsel_field_num);
-  printk("gpio_set_pin_function() - value of pin_GPFSELx_reg before write:%u, reg_value_to_write: %u\n", (*pin_GPFSELx_reg), reg_value_to_write);
-  *pin_GPFSELx_reg = reg_value_to_write;
+  // Lock this section since we are modifying the shadow of the register, which is shared
+  // with the other pins in the same register.
+  raw_spin_lock_irqsave(&gpio_func_lock, irq_flags);
+
+  // Clear the alternative function field for that pin without affecting other pins and set it to the requested function.
+  // Nothing is written if the pin is already set to this function.
+  if (peri_shadow_update(&(gpio_fsel_shadow[register_offset]), GPFSEL_FIELD_MASK << (fsel_field_num * GPFSEL_FIELD_BIT_WIDTH),
+                         gpio_func_type << (fsel_field_num * GPFSEL_FIELD_BIT_WIDTH)))
+  {
+    gpio_pin_func_table[pin_num] = gpio_func_type;
+  }
+
+  uint32_t reg_value_to_write = peri_shadow_get(&(gpio_fsel_shadow[register_offset]));
   
-  mutex_unlock(&gpio_func_mutex);
+  raw_spin_unlock_irqrestore(&gpio_func_lock, irq_flags);
+
+  custom_trace("gpio_set_pin_function() - pin_num: %u, gpio_func_type: %u, GPFSEL%u value: %#x\n",
+               pin_num, gpio_func_type, register_offset, reg_value_to_write);
 
   return ENONE;
 }
 
 
-// TODO: Fully implement this eventually
-static void gpio_set_pin_to_input(uint32_t pin_num, bool is_active_high)
-{
-  if (!gpio_is_valid_pin(pin_num))
-  {
-    pr_err("GPIO pin provided is outside valid pin range!\n");
-    return;
-  }
-}
-
-// Ret values:  ENONE     - success
-//              -EINVPIN  - failure, invalid pin_num argument
+// Ret values:  The function the pin is currently set to, or GPIO_INVALID_FUNC for an invalid pin_num argument.
 //
-int gpio_output_ctl(uint32_t pin_num, bool do_set)
+// NOTE: This only reads the function table kept by this module and never accesses the registers.
+gpio_func_type_t gpio_get_pin_function(uint32_t pin_num)
 {
-  if (!gpio_is_valid_pin(pin_num))
+  if (!gpio_is_valid_output_pin(pin_num))
   {
-    pr_err("GPIO pin provided is outside valid pin range!\n");
-    return -EINVPIN;
+    return GPIO_INVALID_FUNC;
   }
-  
-  // All registers are 32 bit and we only use the first set or clear register since the Raspberry Pi B
-  // only has up to GPIO pin 27 accessible (so 28 pins total). Therefore they all can be accessed in the
-  // first register of the corresponding set or clear registers. Pick whether we use the set or clear registers
-  // based on the "do_set" function argument.
-  uint32_t gpio_base_offset_reg_cnt = ((do_set ? GPSET_OFFSET : GPCLR_OFFSET ) / sizeof(uint32_t));
 
-  uint32_t volatile * const output_pin_ctl_register = gpio_base_addr + gpio_base_offset_reg_cnt;
-
-  *output_pin_ctl_register = (OUTPUT_CTL_WRT_VAL << pin_num);  
-  return ENONE;
+  return READ_ONCE(gpio_pin_func_table[pin_num]);
 }
 
 
 // Ret values:  ENONE       - success
 //              -EINVPIN    - failure, invalid pin_num argument
+//              -EINVAL     - failure, invalid pull argument
 //              -EINVREG    - failure, invalid register access
 //              -EINTERNAL  - failure, other internal failure
-int gpio_set_pin_to_output(uint32_t pin_num, bool is_on_initially)
+int gpio_set_pin_to_input(uint32_t pin_num, gpio_pull_t pull)
 {
   if (!gpio_is_valid_pin(pin_num))
   {
@@ -238,108 +645,1424 @@ int gpio_set_pin_to_output(uint32_t pin_num, bool is_on_initially)
     return -EINVPIN;
   }
 
-  // Clear or set the pin so that when it is changed to an output, it will immediately be at the correct initial value
-  int error = gpio_output_ctl(pin_num, is_on_initially);
-
-  if (ENONE != error)
+  if (GPIO_PULL_UP < pull)
   {
-    return error;
+    pr_err("GPIO pull provided is not valid!\n");
+    return -EINVAL;
   }
 
-  error = gpio_set_pin_function(pin_num, GPIO_OUTPUT_FUNC);
+  int error = gpio_set_pin_function(pin_num, GPIO_INPUT_FUNC);
 
   if (ENONE != error)
   {
     return error;
   }
 
+  gpio_set_pin_pull(pin_num, pull);
+
   return ENONE;
 }
 
-pwm_channel_t gpio_is_pin_pwm(uint32_t pin_num)
+// Runs the GPPUD/GPPUDCLK0 sequence from the datasheet: write the pull, wait for it to set up, clock it into the pin,
+// wait for it to hold and then remove the pull and the clock.
+// The BCM2711 instead has a 2 bit pull field per pin that is just written.
+static void gpio_set_pin_pull(uint32_t pin_num, gpio_pull_t pull)
 {
-  pwm_channel_t pwm_channel = NOT_PWM;
+  unsigned long irq_flags;
 
-  switch (pin_num)
+  raw_spin_lock_irqsave(&gpio_pud_lock, irq_flags);
+
+  if (gpio_is_bcm2711)
   {
-    case 12:
-    case 18:
-      pwm_channel = PWM_0;
-      break;
+    uint32_t field_shift = (pin_num % GPIO_PUP_PDN_PINS_PER_REG) * 2;
+    uint32_t field_val = (GPIO_PULL_UP == pull) ? GPIO_PUP_PDN_UP : ((GPIO_PULL_DOWN == pull) ? GPIO_PUP_PDN_DOWN : 0);
 
-    case 13:
-    case 19:
-      pwm_channel = PWM_1;
-      break;
+    peri_shadow_update(&(gpio_pup_pdn_shadow[pin_num / GPIO_PUP_PDN_PINS_PER_REG]), GPIO_PUP_PDN_FIELD_MASK << field_shift,
+                       field_val << field_shift);
 
-    default:
-      pwm_channel = NOT_PWM;
-      break;
+    raw_spin_unlock_irqrestore(&gpio_pud_lock, irq_flags);
+
+    custom_trace("gpio_set_pin_pull() - pin_num: %u, pull: %u\n", pin_num, pull);
+    return;
   }
 
-  return pwm_channel;
+  // The pull has to reach the pin before it is clocked in, so the relaxed writes can't be left in the write buffer over the delays
+  peri_write(gpio_base_addr, GPPUD_OFFSET, pull);
+  peri_write_barrier();
+  udelay(GPIO_PUD_SETUP_DELAY_US);
+  peri_write(gpio_base_addr, GPPUDCLK_OFFSET, 1U << pin_num);
+  peri_write_barrier();
+  udelay(GPIO_PUD_SETUP_DELAY_US);
+  peri_write(gpio_base_addr, GPPUD_OFFSET, GPIO_PULL_NONE);
+  peri_write(gpio_base_addr, GPPUDCLK_OFFSET, 0);
+
+  raw_spin_unlock_irqrestore(&gpio_pud_lock, irq_flags);
+
+  custom_trace("gpio_set_pin_pull() - pin_num: %u, pull: %u\n", pin_num, pull);
 }
 
-static gpio_func_type_t gpio_determine_pwm_alt_func(uint32_t pin_num)
+// Ret values:  ENONE     - success
+//              -EINVPIN  - failure, invalid pin_num argument
+//
+// Can be called from any context.
+int gpio_get_level(uint32_t pin_num, bool *p_is_high)
 {
-  gpio_func_type_t gpio_func_type = GPIO_INVALID_FUNC;
+  if (gpio_is_valid_bank1_pin(pin_num))
+  {
+    *p_is_high = (0 != (peri_read(gpio_base_addr, GPIO_BANK1_REG(GPLEV_OFFSET)) & (1U << (pin_num - GPIO_BANK_PIN_CNT))));
+    return ENONE;
+  }
 
-  switch (pin_num)
+  if (!gpio_is_valid_pin(pin_num))
   {
-    case 12:
-    case 13:
-      gpio_func_type = GPIO_ALT_FUNC_0;
-      break;
+    pr_err("GPIO pin provided is outside valid pin range!\n");
+    return -EINVPIN;
+  }
 
-    case 18:
-    case 19:
-      gpio_func_type = GPIO_ALT_FUNC_5;
-      break;
+  *p_is_high = (0 != (gpio_get_level_mask() & (1U << pin_num)));
+  return ENONE;
+}
 
-    default:
-      gpio_func_type = GPIO_INVALID_FUNC;
-      break;
+// Ret values:  The level of every pin from a single GPLEV0 read, bit n is GPIO pin n.
+//
+// Can be called from any context.
+uint32_t gpio_get_level_mask(void)
+{
+  return peri_read(gpio_base_addr, GPLEV_OFFSET) & GPIO_VALID_PIN_MASK;
+}
+
+// Ret values:  The level of every valid pin and bank1_pins pin from the GPLEV0 and GPLEV1 reads, bit n is GPIO pin n.
+//
+// Can be called from any context.
+u64 gpio_get_level_mask64(void)
+{
+  u64 bank1_levels = peri_read(gpio_base_addr, GPIO_BANK1_REG(GPLEV_OFFSET)) & gpio_bank1_pin_mask;
+
+  return (bank1_levels << GPIO_BANK_PIN_CNT) | gpio_get_level_mask();
+}
+
+// Makes pin_num an input and timestamps (CLOCK_MONOTONIC ns) its edge_flags edges into p_timestamps from its
+// interrupt until gpio_capture_stop(), for other kernel modules that measure signals (e.g. loopback tests).
+// The first max_cnt edges are stored and later ones are only counted. p_timestamps must stay valid until the
+// capture is stopped, and setting up the pin again from userspace stops the capture too.
+//
+// Ret values:  ENONE       - success
+//              -EINVAL     - failure, no p_timestamps or max_cnt, or see gpio_input_configure_locked()
+//              other       - failure, error from setting up the input (see gpio_input_configure_locked())
+int gpio_capture_start(uint32_t pin_num, gpio_pull_t pull, uint32_t edge_flags, u64 *p_timestamps, uint32_t max_cnt)
+{
+  gpio_ioc_input_t input_cfg = { .pin = pin_num, .pull = pull, .edge_flags = edge_flags };
+
+  if ((NULL == p_timestamps) || (0 == max_cnt))
+  {
+    return -EINVAL;
   }
 
-  return gpio_func_type;
+  mutex_lock(&gpio_input_mutex);
+
+  int error = gpio_input_configure_locked(&input_cfg, GPIO_INPUT_MODE_CAPTURE, p_timestamps, max_cnt);
+
+  mutex_unlock(&gpio_input_mutex);
+
+  return error;
 }
 
-// Ret values:  ENONE       - success              
+// Stops the capture of pin_num and puts the number of edges it saw in *p_edge_cnt, which is more than the
+// max_cnt passed to gpio_capture_start() if some edges weren't stored. The pin is left as an input.
+//
+// Ret values:  ENONE       - success
 //              -EINVPIN    - failure, invalid pin_num argument
-//              -EINVREG    - failure, invalid register access
-//              -EINVFUNC   - failure, invalid gpio_func_type
-//              -EINTERNAL  - failure, other internal failure
-int gpio_set_pin_to_pwm(uint32_t pin_num)
+//              -EINVAL     - failure, the pin isn't capturing (anymore)
+int gpio_capture_stop(uint32_t pin_num, uint32_t *p_edge_cnt)
 {
-  if (NOT_PWM == gpio_is_pin_pwm(pin_num))
+  if (!gpio_is_valid_pin(pin_num))
   {
+    pr_err("GPIO pin provided is outside valid pin range!\n");
     return -EINVPIN;
   }
 
-  gpio_func_type_t func_type = gpio_determine_pwm_alt_func(pin_num);
+  gpio_input_t *p_input = &(gpio_inputs[pin_num]);
+  int error = -EINVAL;
 
-  if (GPIO_INVALID_FUNC == func_type)
+  mutex_lock(&gpio_input_mutex);
+
+  if (NULL != p_input->p_capture_buf)
   {
-    return -EINVFUNC;
+    gpio_input_release_locked(pin_num);
+
+    // The irq is freed, so the count doesn't change anymore
+    *p_edge_cnt = (uint32_t)(atomic_read(&(p_input->capture_cnt)));
+    error = ENONE;
   }
 
-  int error = gpio_set_pin_function(pin_num, func_type);
+  mutex_unlock(&gpio_input_mutex);
 
-  if (ENONE != error)
+  return error;
+}
+
+// Ret values:  ENONE     - success
+//              -EINVPIN  - failure, invalid pin_num argument
+//
+int gpio_output_ctl(uint32_t pin_num, bool do_set)
+{
+  // Bank 1 pins can't be soft pwm pins, so they are just written to the second set or clear register
+  if (gpio_is_valid_bank1_pin(pin_num))
   {
-    return error;
+    peri_write(gpio_base_addr, GPIO_BANK1_REG(do_set ? GPSET_OFFSET : GPCLR_OFFSET), OUTPUT_CTL_WRT_VAL << (pin_num - GPIO_BANK_PIN_CNT));
+    return ENONE;
+  }
+
+  if (!gpio_is_valid_pin(pin_num))
+  {
+    pr_err("GPIO pin provided is outside valid pin range!\n");
+    return -EINVPIN;
+  }
+  
+  // All registers are 32 bit and we only use the first set or clear register since the 40 pin header
+  // only has up to GPIO pin 27 accessible (so 28 pins total). Therefore they all can be accessed in the
+  // first register of the corresponding set or clear registers. Pick whether we use the set or clear registers
+  // based on the "do_set" function argument.
+  //
+  // No lock is needed since the set and clear registers only act on the bits written as a 1 (no read-modify-write),
+  // so this can be called from any context.
+  uint32_t output_ctl_reg_offset = (do_set ? GPSET_OFFSET : GPCLR_OFFSET);
+  uint32_t pin_bit = (OUTPUT_CTL_WRT_VAL << pin_num);
+
+  if (do_set)
+  {
+    atomic_or((int)(pin_bit), &gpio_output_on_mask);
+
+    // Soft pwm pins are set by the soft pwm engine at the start of its next period
+    if (0 != (READ_ONCE(gpio_soft_pwm_pin_mask) & pin_bit))
+    {
+      return ENONE;
+    }
+  }
+  else
+  {
+    atomic_andnot((int)(pin_bit), &gpio_output_on_mask);
   }
 
+  peri_write(gpio_base_addr, output_ctl_reg_offset, pin_bit);
   return ENONE;
 }
 
-module_init(gpio_driver_init);
-module_exit(gpio_driver_exit);
+// Sets every pin in set_mask and clears every pin in clear_mask (bit n is GPIO pin n).
+// Soft pwm pins in set_mask are turned on at their duty cycle instead, see gpio_soft_pwm_set_duty().
+// The GPSET and GPCLR registers only act on the bits written as a 1, so all pins of a mask
+// are updated by a single register write and pins not in either mask are left untouched.
+// At most two register writes are done, and none for an empty mask.
+//
+// A pin can't be in both masks since it is ambiguous which state the caller wants.
+//
+// Ret values:  ENONE     - success
+//              -EINVPIN  - failure, a mask contains an invalid pin or a pin is in both masks
+//
+int gpio_output_ctl_mask(uint32_t set_mask, uint32_t clear_mask)
+{
+  if (!gpio_is_valid_pin_mask(set_mask | clear_mask))
+  {
+    pr_err("GPIO pin mask provided contains pins outside valid pin range!\n");
+    return -EINVPIN;
+  }
+
+  if (0 != (set_mask & clear_mask))
+  {
+    pr_err("GPIO pin mask provided has pins that are both set and cleared!\n");
+    return -EINVPIN;
+  }
+
+  gpio_write_output_masks(set_mask, clear_mask);
+
+  return ENONE;
+}
+
+// gpio_output_ctl_mask() for both banks of pins (bit n is GPIO pin n), so more than 32 pins can be updated at once
+// on SoCs with more pins, like the 58 of the BCM2711. Pins 32 and up have to be in bank1_pins. Each bank takes its own
+// set and clear register writes, so the pins of a bank change together but bank 1 changes right after bank 0.
+//
+// Ret values:  ENONE     - success
+//              -EINVPIN  - failure, a mask contains an invalid pin or a pin is in both masks
+//
+int gpio_output_ctl_mask64(u64 set_mask, u64 clear_mask)
+{
+  uint32_t bank1_set_mask = (uint32_t)(set_mask >> GPIO_BANK_PIN_CNT);
+  uint32_t bank1_clear_mask = (uint32_t)(clear_mask >> GPIO_BANK_PIN_CNT);
+
+  if (!gpio_is_valid_pin_mask((uint32_t)(set_mask | clear_mask)) || (0 != ((bank1_set_mask | bank1_clear_mask) & ~gpio_bank1_pin_mask)))
+  {
+    pr_err("GPIO pin mask provided contains pins outside valid pin range!\n");
+    return -EINVPIN;
+  }
+
+  if (0 != (set_mask & clear_mask))
+  {
+    pr_err("GPIO pin mask provided has pins that are both set and cleared!\n");
+    return -EINVPIN;
+  }
+
+  gpio_write_output_masks((uint32_t)(set_mask), (uint32_t)(clear_mask));
+
+  if (0 != bank1_set_mask)
+  {
+    peri_write(gpio_base_addr, GPIO_BANK1_REG(GPSET_OFFSET), bank1_set_mask);
+  }
+
+  if (0 != bank1_clear_mask)
+  {
+    peri_write(gpio_base_addr, GPIO_BANK1_REG(GPCLR_OFFSET), bank1_clear_mask);
+  }
+
+  return ENONE;
+}
+
+
+// Ret values:  ENONE       - success
+//              -EINVPIN    - failure, invalid pin_num argument
+//              -EINVREG    - failure, invalid register access
+//              -EINTERNAL  - failure, other internal failure
+int gpio_set_pin_to_output(uint32_t pin_num, bool is_on_initially)
+{
+  if (!gpio_is_valid_output_pin(pin_num))
+  {
+    pr_err("GPIO pin provided is outside valid pin range!\n");
+    return -EINVPIN;
+  }
+
+  // Clear or set the pin so that when it is changed to an output, it will immediately be at the correct initial value
+  int error = gpio_output_ctl(pin_num, is_on_initially);
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  error = gpio_set_pin_function(pin_num, GPIO_OUTPUT_FUNC);
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  return ENONE;
+}
+
+pwm_channel_t gpio_is_pin_pwm(uint32_t pin_num)
+{
+  pwm_channel_t pwm_channel = NOT_PWM;
+
+  switch (pin_num)
+  {
+    case 12:
+    case 18:
+      pwm_channel = PWM_0;
+      break;
+
+    case 13:
+    case 19:
+      pwm_channel = PWM_1;
+      break;
+
+    default:
+      pwm_channel = NOT_PWM;
+      break;
+  }
+
+  return pwm_channel;
+}
+
+static gpio_func_type_t gpio_determine_pwm_alt_func(uint32_t pin_num)
+{
+  gpio_func_type_t gpio_func_type = GPIO_INVALID_FUNC;
+
+  switch (pin_num)
+  {
+    case 12:
+    case 13:
+      gpio_func_type = GPIO_ALT_FUNC_0;
+      break;
+
+    case 18:
+    case 19:
+      gpio_func_type = GPIO_ALT_FUNC_5;
+      break;
+
+    default:
+      gpio_func_type = GPIO_INVALID_FUNC;
+      break;
+  }
+
+  return gpio_func_type;
+}
+
+// Ret values:  ENONE       - success              
+//              -EINVPIN    - failure, invalid pin_num argument
+//              -EINVREG    - failure, invalid register access
+//              -EINVFUNC   - failure, invalid gpio_func_type
+//              -EINTERNAL  - failure, other internal failure
+int gpio_set_pin_to_pwm(uint32_t pin_num)
+{
+  if (NOT_PWM == gpio_is_pin_pwm(pin_num))
+  {
+    return -EINVPIN;
+  }
+
+  gpio_func_type_t func_type = gpio_determine_pwm_alt_func(pin_num);
+
+  if (GPIO_INVALID_FUNC == func_type)
+  {
+    return -EINVFUNC;
+  }
+
+  int error = gpio_set_pin_function(pin_num, func_type);
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  return ENONE;
+}
+
+// Runs the pin at duty_u16 (0 to GPIO_SOFT_PWM_DUTY_MAX) with the software pwm engine while it is on, for pins without
+// a pwm channel. The pin is still turned on and off with gpio_output_ctl() and gpio_output_ctl_mask(), which then
+// turn its pwm output on and off. A duty of GPIO_SOFT_PWM_DUTY_MAX makes the pin a plain output again, and a duty that
+// rounds to 0 holds the pin low even while it is on.
+// The new duty cycle takes effect at the start of the next soft pwm period.
+//
+// Ret values:  ENONE     - success
+//              -EINVPIN  - failure, invalid pin_num argument
+//              -EINVFUNC - failure, the pin isn't set to an output
+//
+// Can be called from any context.
+int gpio_soft_pwm_set_duty(uint32_t pin_num, uint16_t duty_u16)
+{
+  if (!gpio_is_valid_pin(pin_num))
+  {
+    pr_err("GPIO pin provided is outside valid pin range!\n");
+    return -EINVPIN;
+  }
+
+  if (GPIO_OUTPUT_FUNC != gpio_get_pin_function(pin_num))
+  {
+    pr_err("GPIO soft pwm pin %u isn't set to an output!\n", pin_num);
+    return -EINVFUNC;
+  }
+
+  uint32_t level = DIV_ROUND_CLOSEST((uint32_t)(duty_u16) * GPIO_SOFT_PWM_STEPS, GPIO_SOFT_PWM_DUTY_MAX);
+  uint32_t pin_bit = (OUTPUT_CTL_WRT_VAL << pin_num);
+  unsigned long irq_flags;
+
+  raw_spin_lock_irqsave(&gpio_soft_pwm_lock, irq_flags);
+
+  if (GPIO_SOFT_PWM_STEPS == level)
+  {
+    gpio_soft_pwm_pending_mask &= ~pin_bit;
+  }
+  else
+  {
+    gpio_soft_pwm_pending_mask |= pin_bit;
+    gpio_soft_pwm_pending_levels[pin_num] = (uint16_t)(level);
+  }
+
+  gpio_soft_pwm_is_dirty = true;
+  WRITE_ONCE(gpio_soft_pwm_pin_mask, gpio_soft_pwm_schedule.pin_mask | gpio_soft_pwm_pending_mask);
+
+  // The timer also has to run for pins leaving the engine (or going back to a duty of 0), see the period start
+  if (!gpio_soft_pwm_is_running && (0 != (gpio_soft_pwm_pending_mask | gpio_soft_pwm_schedule.pin_mask)))
+  {
+    gpio_soft_pwm_is_running = true;
+    gpio_soft_pwm_is_at_period_start = true;
+    gpio_soft_pwm_period_start = ktime_get();
+    hrtimer_start(&gpio_soft_pwm_timer, gpio_soft_pwm_period_start, HRTIMER_MODE_ABS_HARD);
+  }
+
+  raw_spin_unlock_irqrestore(&gpio_soft_pwm_lock, irq_flags);
+
+  custom_trace("gpio_soft_pwm_set_duty() - pin_num: %u, duty_u16: %u, level: %u\n", pin_num, duty_u16, level);
+
+  return ENONE;
+}
+
+
+// Builds the schedule for the pending soft pwm pins. Must be called with gpio_soft_pwm_lock held.
+static void gpio_soft_pwm_build_schedule(gpio_soft_pwm_schedule_t *p_schedule)
+{
+  p_schedule->pin_mask = gpio_soft_pwm_pending_mask;
+  p_schedule->lit_mask = 0;
+  p_schedule->zero_mask = 0;
+  p_schedule->edge_cnt = 0;
+
+  for (uint32_t pin_num = MIN_PIN_NUM; pin_num <= MAX_PIN_NUM; pin_num++)
+  {
+    uint32_t pin_bit = (OUTPUT_CTL_WRT_VAL << pin_num);
+    uint32_t level = gpio_soft_pwm_pending_levels[pin_num];
+
+    if (0 == (gpio_soft_pwm_pending_mask & pin_bit))
+    {
+      continue;
+    }
+
+    if (0 == level)
+    {
+      p_schedule->zero_mask |= pin_bit;
+      continue;
+    }
+
+    p_schedule->lit_mask |= pin_bit;
+
+    // Insert the pin in the edges by level, pins with the same level share an edge
+    uint32_t edge_num = 0;
+
+    while ((edge_num < p_schedule->edge_cnt) && (p_schedule->edges[edge_num].level < level))
+    {
+      edge_num++;
+    }
+
+    if ((edge_num < p_schedule->edge_cnt) && (p_schedule->edges[edge_num].level == level))
+    {
+      p_schedule->edges[edge_num].clear_mask |= pin_bit;
+      continue;
+    }
+
+    memmove(&(p_schedule->edges[edge_num + 1]), &(p_schedule->edges[edge_num]),
+            (p_schedule->edge_cnt - edge_num) * sizeof(gpio_soft_pwm_edge_t));
+    p_schedule->edges[edge_num].level = level;
+    p_schedule->edges[edge_num].clear_mask = pin_bit;
+    p_schedule->edge_cnt++;
+  }
+}
+
+
+// Runs in hard irq context, at the start of every soft pwm period and at every edge of the period.
+static enum hrtimer_restart gpio_soft_pwm_timer_callback(struct hrtimer *p_timer)
+{
+  gpio_soft_pwm_schedule_t *p_schedule = &gpio_soft_pwm_schedule;
+
+  raw_spin_lock(&gpio_soft_pwm_lock);
+
+  if (gpio_soft_pwm_is_at_period_start)
+  {
+    uint32_t set_mask = 0;
+    uint32_t on_mask = (uint32_t)(atomic_read(&gpio_output_on_mask));
+
+    if (gpio_soft_pwm_is_dirty)
+    {
+      // Pins leaving the engine could have been cleared by the last period, so put them back to their level
+      set_mask = p_schedule->pin_mask & ~gpio_soft_pwm_pending_mask & on_mask;
+
+      gpio_soft_pwm_build_schedule(p_schedule);
+      WRITE_ONCE(gpio_soft_pwm_pin_mask, p_schedule->pin_mask);
+      gpio_soft_pwm_is_dirty = false;
+
+      // Pins that just got a duty cycle of 0 could still be high from before. Nothing else sets them while they
+      // stay in the engine, so they only have to be cleared once.
+      if (0 != p_schedule->zero_mask)
+      {
+        peri_write(gpio_base_addr, GPCLR_OFFSET, p_schedule->zero_mask);
+      }
+    }
+
+    set_mask |= (p_schedule->lit_mask & on_mask);
+
+    if (0 != set_mask)
+    {
+      peri_write(gpio_base_addr, GPSET_OFFSET, set_mask);
+    }
+
+    // Pins held low don't need the timer, gpio_soft_pwm_set_duty() starts it again for the next change
+    if (0 == p_schedule->lit_mask)
+    {
+      gpio_soft_pwm_is_running = false;
+      raw_spin_unlock(&gpio_soft_pwm_lock);
+      return HRTIMER_NORESTART;
+    }
+
+    // Nothing to clear this period if none of the pins are on
+    gpio_soft_pwm_next_edge = (0 != (p_schedule->lit_mask & on_mask)) ? 0 : p_schedule->edge_cnt;
+  }
+  else
+  {
+    peri_write(gpio_base_addr, GPCLR_OFFSET, p_schedule->edges[gpio_soft_pwm_next_edge].clear_mask);
+    gpio_soft_pwm_next_edge++;
+  }
+
+  ktime_t next_expiry;
+
+  if (gpio_soft_pwm_next_edge < p_schedule->edge_cnt)
+  {
+    gpio_soft_pwm_is_at_period_start = false;
+    next_expiry = ktime_add_ns(gpio_soft_pwm_period_start,
+                               p_schedule->edges[gpio_soft_pwm_next_edge].level * gpio_soft_pwm_slice_ns);
+  }
+  else
+  {
+    gpio_soft_pwm_is_at_period_start = true;
+    gpio_soft_pwm_period_start = ktime_add(gpio_soft_pwm_period_start, gpio_soft_pwm_period);
+
+    // We fell more than a whole period behind, so start the next period now instead of running every missed one
+    ktime_t now = ktime_get();
+
+    if (ktime_before(gpio_soft_pwm_period_start, now))
+    {
+      gpio_soft_pwm_period_start = now;
+    }
+
+    next_expiry = gpio_soft_pwm_period_start;
+  }
+
+  hrtimer_set_expires(p_timer, next_expiry);
+
+  raw_spin_unlock(&gpio_soft_pwm_lock);
+  return HRTIMER_RESTART;
+}
+
+
+// Sets up a pin as an input from p_input_cfg, with a pull and edge events, edge counting or edge capture into
+// p_capture_buf (which has room for capture_max_cnt timestamps) depending on mode.
+// Setting up a pin again replaces its old setup (and drops its unread events or its counts, or stops its capture).
+//
+// The edge detect registers (GPREN/GPFEN/GPEDS) are owned by the kernel's bcm2835 gpio irq chip, so the edges
+// are requested through the pin's linux interrupt instead of being written here.
+//
+// Ret values:  ENONE     - success
+//              -EINVPIN  - failure, invalid pin
+//              -EINVAL   - failure, invalid pull or edge flags, or no edge flags for a counter or capture
+//              -ENOMEM   - failure, couldn't allocate the event ring or the counters
+//              other     - failure, error from setting the pin to an input or from requesting its interrupt
+//
+// NOTE: Must be called with gpio_input_mutex held.
+static int gpio_input_configure_locked(gpio_ioc_input_t const *p_input_cfg, gpio_input_mode_t mode,
+                                       u64 *p_capture_buf, uint32_t capture_max_cnt)
+{
+  uint32_t pin_num = p_input_cfg->pin;
+
+  if (!gpio_is_valid_pin(pin_num))
+  {
+    pr_err("GPIO pin provided is outside valid pin range!\n");
+    return -EINVPIN;
+  }
+
+  if (0 != (p_input_cfg->edge_flags & ~GPIO_EDGE_BOTH))
+  {
+    pr_err("GPIO edge flags provided are not valid!\n");
+    return -EINVAL;
+  }
+
+  if ((GPIO_INPUT_MODE_EVENTS != mode) && (0 == p_input_cfg->edge_flags))
+  {
+    pr_err("GPIO counter or capture needs edges to count!\n");
+    return -EINVAL;
+  }
+
+  gpio_input_t *p_input = &(gpio_inputs[pin_num]);
+
+  gpio_input_release_locked(pin_num);
+
+  int error = gpio_set_pin_to_input(pin_num, p_input_cfg->pull);
+
+  if ((ENONE != error) || (0 == p_input_cfg->edge_flags))
+  {
+    return error;
+  }
+
+  int irq = gpio_to_irq(gpio_linux_base + pin_num);
+
+  if (0 > irq)
+  {
+    pr_err("GPIO couldn't find the interrupt of pin %u, check gpio_linux_base! error: %d\n", pin_num, irq);
+    return irq;
+  }
+
+  irq_handler_t irq_handler = gpio_edge_irq_handler;
+
+  if (GPIO_INPUT_MODE_CAPTURE == mode)
+  {
+    p_input->p_capture_buf = p_capture_buf;
+    p_input->capture_max_cnt = capture_max_cnt;
+    atomic_set(&(p_input->capture_cnt), 0);
+
+    irq_handler = gpio_capture_irq_handler;
+  }
+  else if (GPIO_INPUT_MODE_COUNTER == mode)
+  {
+    p_input->p_counters = alloc_percpu(gpio_pin_counter_t);
+
+    if (NULL == p_input->p_counters)
+    {
+      return -ENOMEM;
+    }
+
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+      u64_stats_init(&(per_cpu_ptr(p_input->p_counters, cpu)->syncp));
+    }
+
+    irq_handler = gpio_count_irq_handler;
+  }
+  else
+  {
+    p_input->p_ring = kzalloc(sizeof(gpio_event_ring_t), GFP_KERNEL);
+
+    if (NULL == p_input->p_ring)
+    {
+      return -ENOMEM;
+    }
+  }
+
+  // Must be set before the irq is requested, since it can fire right away
+  p_input->edge_flags = p_input_cfg->edge_flags;
+  p_input->irq = irq;
+
+  unsigned long irq_flags = ((0 != (p_input->edge_flags & GPIO_EDGE_RISING)) ? IRQF_TRIGGER_RISING : 0)
+                          | ((0 != (p_input->edge_flags & GPIO_EDGE_FALLING)) ? IRQF_TRIGGER_FALLING : 0);
+
+  error = request_irq(irq, irq_handler, irq_flags, GPIO_EVENTS_DEVICE_NAME, p_input);
+
+  if (ENONE != error)
+  {
+    pr_err("GPIO couldn't request the interrupt of pin %u! error: %d\n", pin_num, error);
+    kfree(p_input->p_ring);
+    free_percpu(p_input->p_counters);
+    p_input->p_ring = NULL;
+    p_input->p_counters = NULL;
+    p_input->p_capture_buf = NULL;
+    p_input->edge_flags = 0;
+    return error;
+  }
+
+  return ENONE;
+}
+
+// Stops the edge events, counting or capture of a pin and drops its unread events or counts. The pin is left as an input.
+// The buffer of a capture belongs to its caller and isn't written to again once this returns.
+//
+// NOTE: Must be called with gpio_input_mutex held.
+static void gpio_input_release_locked(uint32_t pin_num)
+{
+  gpio_input_t *p_input = &(gpio_inputs[pin_num]);
+  gpio_event_ring_t *p_ring = p_input->p_ring;
+
+  if (0 == p_input->edge_flags)
+  {
+    return;
+  }
+
+  // Waits for a running handler, so nothing uses the ring or counters after this
+  free_irq(p_input->irq, p_input);
+
+  if (NULL != p_ring)
+  {
+    atomic_sub((int)(p_ring->head - p_ring->tail), &gpio_events_pending_cnt);
+    kfree(p_ring);
+  }
+
+  free_percpu(p_input->p_counters);
+
+  p_input->p_ring = NULL;
+  p_input->p_counters = NULL;
+  p_input->p_capture_buf = NULL;
+  p_input->edge_flags = 0;
+}
+
+// Runs in hard irq context on every requested edge of an input pin, and timestamps the edge into the pin's ring.
+static irqreturn_t gpio_edge_irq_handler(int irq, void *p_dev_id)
+{
+  gpio_input_t *p_input = (gpio_input_t *)(p_dev_id);
+  gpio_event_ring_t *p_ring = p_input->p_ring;
+  u64 timestamp_ns = ktime_get_ns();
+  uint32_t edge = p_input->edge_flags;
+
+  // With both edges requested, the level right after the edge tells which one it was. A pulse shorter than the
+  // interrupt latency is still reported, but can be reported as the wrong edge.
+  if (GPIO_EDGE_BOTH == edge)
+  {
+    edge = (0 != (gpio_get_level_mask() & (1U << p_input->pin_num))) ? GPIO_EDGE_RISING : GPIO_EDGE_FALLING;
+  }
+
+  uint32_t head = p_ring->head;
+
+  // Pairs with the release by the reader, so the slot isn't overwritten before the reader is done with it
+  uint32_t tail = smp_load_acquire(&(p_ring->tail));
+
+  if (GPIO_EVENT_RING_SIZE == (head - tail))
+  {
+    atomic_inc(&gpio_events_dropped_cnt);
+    return IRQ_HANDLED;
+  }
+
+  gpio_event_t *p_event = &(p_ring->events[head & (GPIO_EVENT_RING_SIZE - 1)]);
+
+  p_event->timestamp_ns = timestamp_ns;
+  p_event->pin = p_input->pin_num;
+  p_event->edge = edge;
+
+  // Publishes the event to the reader
+  smp_store_release(&(p_ring->head), head + 1);
+
+  atomic_inc(&gpio_events_pending_cnt);
+  wake_up_interruptible(&gpio_events_waitq);
+
+  return IRQ_HANDLED;
+}
+
+// Runs in hard irq context on every requested edge of a counting pin. It only updates the counter of the current cpu.
+static irqreturn_t gpio_count_irq_handler(int irq, void *p_dev_id)
+{
+  gpio_input_t *p_input = (gpio_input_t *)(p_dev_id);
+  gpio_pin_counter_t *p_counter = this_cpu_ptr(p_input->p_counters);
+  u64 timestamp_ns = ktime_get_ns();
+
+  u64_stats_update_begin(&(p_counter->syncp));
+
+  if (0 == p_counter->count)
+  {
+    p_counter->first_edge_ns = timestamp_ns;
+    p_counter->min_period_ns = U64_MAX;
+  }
+  else
+  {
+    u64 period_ns = timestamp_ns - p_counter->last_edge_ns;
+
+    p_counter->min_period_ns = min(p_counter->min_period_ns, period_ns);
+    p_counter->max_period_ns = max(p_counter->max_period_ns, period_ns);
+  }
+
+  p_counter->last_edge_ns = timestamp_ns;
+  p_counter->count++;
+
+  u64_stats_update_end(&(p_counter->syncp));
+
+  return IRQ_HANDLED;
+}
+
+// Runs in hard irq context on every requested edge of a capturing pin, and timestamps the edge into the capture buffer.
+// Edges after the buffer is full are only counted.
+static irqreturn_t gpio_capture_irq_handler(int irq, void *p_dev_id)
+{
+  gpio_input_t *p_input = (gpio_input_t *)(p_dev_id);
+  u64 timestamp_ns = ktime_get_ns();
+  uint32_t edge_num = (uint32_t)(atomic_inc_return(&(p_input->capture_cnt))) - 1;
+
+  if (edge_num < p_input->capture_max_cnt)
+  {
+    p_input->p_capture_buf[edge_num] = timestamp_ns;
+  }
+
+  return IRQ_HANDLED;
+}
+
+// Adds up the per-cpu counters of the counting pin p_count->pin into *p_count.
+//
+// Ret values:  ENONE     - success
+//              -EINVPIN  - failure, invalid pin
+//              -EINVAL   - failure, the pin isn't counting
+//
+// NOTE: Must be called with gpio_input_mutex held.
+static int gpio_counter_read_locked(gpio_ioc_count_t *p_count)
+{
+  uint32_t pin_num = p_count->pin;
+
+  if (!gpio_is_valid_pin(pin_num))
+  {
+    return -EINVPIN;
+  }
+
+  gpio_pin_counter_t __percpu *p_counters = gpio_inputs[pin_num].p_counters;
+
+  if (NULL == p_counters)
+  {
+    return -EINVAL;
+  }
+
+  u64 min_period_ns = U64_MAX;
+  int cpu;
+
+  p_count->count = 0;
+  p_count->first_edge_ns = 0;
+  p_count->last_edge_ns = 0;
+  p_count->max_period_ns = 0;
+
+  for_each_possible_cpu(cpu)
+  {
+    gpio_pin_counter_t const *p_counter = per_cpu_ptr(p_counters, cpu);
+    gpio_pin_counter_t snapshot;
+    unsigned int start;
+
+    do
+    {
+      start = u64_stats_fetch_begin(&(p_counter->syncp));
+      snapshot.count = p_counter->count;
+      snapshot.first_edge_ns = p_counter->first_edge_ns;
+      snapshot.last_edge_ns = p_counter->last_edge_ns;
+      snapshot.min_period_ns = p_counter->min_period_ns;
+      snapshot.max_period_ns = p_counter->max_period_ns;
+    } while (u64_stats_fetch_retry(&(p_counter->syncp), start));
+
+    if (0 == snapshot.count)
+    {
+      continue;
+    }
+
+    if ((0 == p_count->count) || (snapshot.first_edge_ns < p_count->first_edge_ns))
+    {
+      p_count->first_edge_ns = snapshot.first_edge_ns;
+    }
+
+    p_count->count += snapshot.count;
+    p_count->last_edge_ns = max(p_count->last_edge_ns, snapshot.last_edge_ns);
+    p_count->max_period_ns = max(p_count->max_period_ns, snapshot.max_period_ns);
+    min_period_ns = min(min_period_ns, snapshot.min_period_ns);
+  }
+
+  // The periods of the edges that moved between cpus aren't in the min and max, but they are in the mean
+  p_count->mean_period_ns = (1 < p_count->count) ? div64_u64(p_count->last_edge_ns - p_count->first_edge_ns, p_count->count - 1) : 0;
+  p_count->min_period_ns = (U64_MAX == min_period_ns) ? 0 : min_period_ns;
+
+  return ENONE;
+}
+
+// Copies up to max_event_cnt events to p_user_events, oldest first across the rings of every pin.
+//
+// Ret values:  The number of events copied, or -EFAULT if the user buffer isn't writable (the events are lost).
+//
+// NOTE: Must be called with gpio_input_mutex held.
+static ssize_t gpio_events_drain_locked(gpio_event_t __user *p_user_events, size_t max_event_cnt)
+{
+  gpio_event_t chunk[GPIO_EVENTS_READ_CHUNK];
+  size_t event_cnt = 0;
+
+  while (event_cnt < max_event_cnt)
+  {
+    size_t chunk_max = min(max_event_cnt - event_cnt, (size_t)(GPIO_EVENTS_READ_CHUNK));
+    size_t chunk_cnt = 0;
+
+    for (; chunk_cnt < chunk_max; chunk_cnt++)
+    {
+      gpio_event_ring_t *p_oldest_ring = NULL;
+      gpio_event_t const *p_oldest_event = NULL;
+
+      for (uint32_t pin_num = MIN_PIN_NUM; pin_num <= MAX_PIN_NUM; pin_num++)
+      {
+        gpio_event_ring_t *p_ring = gpio_inputs[pin_num].p_ring;
+
+        // Pairs with the release by the irq handler, so the event is read after it was written
+        if ((NULL == p_ring) || (smp_load_acquire(&(p_ring->head)) == p_ring->tail))
+        {
+          continue;
+        }
+
+        gpio_event_t const *p_event = &(p_ring->events[p_ring->tail & (GPIO_EVENT_RING_SIZE - 1)]);
+
+        if ((NULL == p_oldest_event) || (p_event->timestamp_ns < p_oldest_event->timestamp_ns))
+        {
+          p_oldest_ring = p_ring;
+          p_oldest_event = p_event;
+        }
+      }
+
+      if (NULL == p_oldest_ring)
+      {
+        break;
+      }
+
+      chunk[chunk_cnt] = *p_oldest_event;
+      smp_store_release(&(p_oldest_ring->tail), p_oldest_ring->tail + 1);
+      atomic_dec(&gpio_events_pending_cnt);
+    }
+
+    if (0 == chunk_cnt)
+    {
+      break;
+    }
+
+    if (copy_to_user(&(p_user_events[event_cnt]), chunk, chunk_cnt * sizeof(gpio_event_t)))
+    {
+      return -EFAULT;
+    }
+
+    event_cnt += chunk_cnt;
+
+    // The rings ran out before the chunk filled up
+    if (chunk_cnt < chunk_max)
+    {
+      break;
+    }
+  }
+
+  return (ssize_t)(event_cnt);
+}
+
+// Plays the sequence described by p_seq (see custom-gpio-ioctl.h) and returns once it is done.
+// p_seq->max_late_ns is set to how late the latest step ran.
+//
+// Ret values:  ENONE       - success
+//              -EBUSY      - failure, another sequence is running
+//              -EINVAL     - failure, invalid step count, mode or flags, a busy sequence without a budget,
+//                            a timer sequence with too many steps played or a step delay that is too short
+//              -EINVPIN    - failure, a step has invalid pins or a pin that is both set and cleared
+//              -EINVFUNC   - failure, a step has a pin that isn't an output
+//              -ETIME      - failure, the sequence is longer than its budget, or ran over it (it is stopped)
+//              -ENOMEM     - failure, couldn't allocate the steps
+//              -EFAULT     - failure, couldn't copy the steps from userspace
+//              -EINTR      - failure, a signal stopped the sequence
+static int gpio_seq_run(gpio_ioc_sequence_t *p_seq)
+{
+  bool is_busy = (GPIO_SEQ_MODE_BUSY == p_seq->mode);
+  uint32_t repeat_cnt = max(p_seq->repeat_cnt, 1U);
+
+  // A timer sequence runs every step from hard irq context, so it is limited in steps played
+  if (   (0 == p_seq->step_cnt) || (GPIO_SEQ_MAX_STEPS < p_seq->step_cnt)
+      || (GPIO_SEQ_MODE_BUSY < p_seq->mode)
+      || (0 != (p_seq->flags & ~GPIO_SEQ_FLAG_IRQS_OFF))
+      || (!is_busy && (0 != p_seq->flags))
+      || (!is_busy && (GPIO_SEQ_MAX_TIMER_STEPS < ((u64)(p_seq->step_cnt) * repeat_cnt)))
+      || (is_busy && ((0 == p_seq->budget_us) || (seq_busy_max_us < p_seq->budget_us)))
+     )
+  {
+    return -EINVAL;
+  }
+
+  p_seq->repeat_cnt = repeat_cnt;
+
+  if (!mutex_trylock(&gpio_seq_mutex))
+  {
+    return -EBUSY;
+  }
+
+  int error = ENONE;
+  u64 duration_ns = 0;
+  gpio_seq_step_t *p_steps = kvmalloc_array(p_seq->step_cnt, sizeof(gpio_seq_step_t), GFP_KERNEL);
+
+  if (NULL == p_steps)
+  {
+    error = -ENOMEM;
+    goto unlock_seq;
+  }
+
+  if (copy_from_user(p_steps, u64_to_user_ptr(p_seq->steps), p_seq->step_cnt * sizeof(gpio_seq_step_t)))
+  {
+    error = -EFAULT;
+    goto free_steps;
+  }
+
+  error = gpio_seq_check_steps(p_seq, p_steps, &duration_ns);
+
+  if (ENONE != error)
+  {
+    goto free_steps;
+  }
+
+  // The delay of the very last step isn't waited for. A sequence too long to add up is over any budget.
+  u64 budget_ns = (u64)(p_seq->budget_us) * NSEC_PER_USEC;
+  bool is_too_long = check_mul_overflow(duration_ns, (u64)(repeat_cnt), &duration_ns);
+
+  duration_ns -= p_steps[p_seq->step_cnt - 1].delay_ns;
+
+  if ((0 != budget_ns) && (is_too_long || (duration_ns > budget_ns)))
+  {
+    pr_err("GPIO sequence takes %llu ns, which is over its %u us budget!\n", is_too_long ? U64_MAX : duration_ns,
+           p_seq->budget_us);
+    error = -ETIME;
+    goto free_steps;
+  }
+
+  p_seq->max_late_ns = 0;
+
+  error = is_busy ? gpio_seq_run_busy(p_seq, p_steps, budget_ns) : gpio_seq_run_timer(p_seq, p_steps);
+
+free_steps:
+  kvfree(p_steps);
+
+unlock_seq:
+  mutex_unlock(&gpio_seq_mutex);
+
+  return error;
+}
+
+// Checks every step and adds up the delays of all of them into *p_duration_ns. In timer mode every delay that is
+// waited for has to be at least GPIO_SEQ_MIN_TIMER_DELAY_NS, so the timer callback always gives the cpu back
+// in between steps. Expects p_seq->repeat_cnt to be at least 1.
+//
+// Ret values:  ENONE       - success
+//              -EINVAL     - failure, a timer mode step has a delay that is too short
+//              -EINVPIN    - failure, a step has invalid pins or a pin that is both set and cleared
+//              -EINVFUNC   - failure, a step has a pin that isn't an output
+static int gpio_seq_check_steps(gpio_ioc_sequence_t const *p_seq, gpio_seq_step_t const *p_steps, u64 *p_duration_ns)
+{
+  uint32_t step_cnt = p_seq->step_cnt;
+  uint32_t used_pin_mask = 0;
+
+  *p_duration_ns = 0;
+
+  for (uint32_t step_num = 0; step_num < step_cnt; step_num++)
+  {
+    gpio_seq_step_t const *p_step = &(p_steps[step_num]);
+    bool is_delay_waited = ((step_num + 1) < step_cnt) || (1 < p_seq->repeat_cnt);
+
+    if (!gpio_is_valid_pin_mask(p_step->set_mask | p_step->clear_mask) || (0 != (p_step->set_mask & p_step->clear_mask)))
+    {
+      pr_err("GPIO sequence step %u has invalid pin masks!\n", step_num);
+      return -EINVPIN;
+    }
+
+    if ((GPIO_SEQ_MODE_TIMER == p_seq->mode) && is_delay_waited && (GPIO_SEQ_MIN_TIMER_DELAY_NS > p_step->delay_ns))
+    {
+      pr_err("GPIO sequence step %u has a delay under %u ns!\n", step_num, GPIO_SEQ_MIN_TIMER_DELAY_NS);
+      return -EINVAL;
+    }
+
+    used_pin_mask |= (p_step->set_mask | p_step->clear_mask);
+    *p_duration_ns += p_step->delay_ns;
+  }
+
+  for (uint32_t pin_num = MIN_PIN_NUM; pin_num <= MAX_PIN_NUM; pin_num++)
+  {
+    if ((0 != (used_pin_mask & (1U << pin_num))) && (GPIO_OUTPUT_FUNC != gpio_get_pin_function(pin_num)))
+    {
+      pr_err("GPIO sequence uses pin %u, which isn't an output!\n", pin_num);
+      return -EINVFUNC;
+    }
+  }
+
+  return ENONE;
+}
+
+// Plays the sequence from a busy loop with preemption off (and interrupts off with GPIO_SEQ_FLAG_IRQS_OFF),
+// so nothing else runs on this cpu in between the steps. The budget is checked as the sequence runs too,
+// in case interrupts kept the loop from keeping up.
+//
+// Ret values:  ENONE     - success
+//              -ETIME    - failure, the sequence ran over its budget and was stopped
+static int gpio_seq_run_busy(gpio_ioc_sequence_t *p_seq, gpio_seq_step_t const *p_steps, u64 budget_ns)
+{
+  bool is_irqs_off = (0 != (p_seq->flags & GPIO_SEQ_FLAG_IRQS_OFF));
+  unsigned long irq_flags = 0;
+  int error = ENONE;
+
+  preempt_disable();
+
+  if (is_irqs_off)
+  {
+    local_irq_save(irq_flags);
+  }
+
+  u64 start_ns = ktime_get_ns();
+  u64 step_time_ns = start_ns;
+
+  for (uint32_t repeat_num = 0; (ENONE == error) && (repeat_num < p_seq->repeat_cnt); repeat_num++)
+  {
+    for (uint32_t step_num = 0; step_num < p_seq->step_cnt; step_num++)
+    {
+      gpio_seq_step_t const *p_step = &(p_steps[step_num]);
+      u64 now_ns;
+
+      while ((now_ns = ktime_get_ns()) < step_time_ns)
+      {
+        cpu_relax();
+      }
+
+      gpio_write_output_masks(p_step->set_mask, p_step->clear_mask);
+
+      p_seq->max_late_ns = max(p_seq->max_late_ns, now_ns - step_time_ns);
+      step_time_ns += p_step->delay_ns;
+
+      if ((now_ns - start_ns) > budget_ns)
+      {
+        error = -ETIME;
+        break;
+      }
+    }
+  }
+
+  if (is_irqs_off)
+  {
+    local_irq_restore(irq_flags);
+  }
+
+  preempt_enable();
+
+  if (ENONE != error)
+  {
+    pr_err("GPIO busy sequence ran over its %u us budget and was stopped!\n", p_seq->budget_us);
+  }
+
+  return error;
+}
+
+// Plays the sequence from gpio_seq_timer, with every step at an absolute time from the start so the delays
+// don't add up timer latency. Waits for the sequence to finish, a signal stops it.
+//
+// Ret values:  ENONE     - success
+//              -EINTR    - failure, a signal stopped the sequence
+//              -ETIME    - failure, the sequence ran over its budget and was stopped
+static int gpio_seq_run_timer(gpio_ioc_sequence_t *p_seq, gpio_seq_step_t const *p_steps)
+{
+  ktime_t start = ktime_get();
+
+  gpio_seq_steps = p_steps;
+  gpio_seq_step_cnt = p_seq->step_cnt;
+  gpio_seq_next_step = 0;
+  gpio_seq_repeats_left = p_seq->repeat_cnt;
+  gpio_seq_next_time = start;
+  gpio_seq_end_time = (0 == p_seq->budget_us) ? KTIME_MAX : ktime_add_us(start, p_seq->budget_us);
+  gpio_seq_max_late_ns = 0;
+  gpio_seq_is_over_budget = false;
+  gpio_seq_is_done = false;
+
+  hrtimer_start(&gpio_seq_timer, start, HRTIMER_MODE_ABS_HARD);
+
+  int error = ENONE;
+
+  if (0 == p_seq->budget_us)
+  {
+    if (0 != wait_event_interruptible(gpio_seq_waitq, smp_load_acquire(&gpio_seq_is_done)))
+    {
+      error = -EINTR;
+    }
+  }
+  else
+  {
+    long wait_ret = wait_event_interruptible_timeout(gpio_seq_waitq, smp_load_acquire(&gpio_seq_is_done),
+                                                     usecs_to_jiffies(p_seq->budget_us) + 1);
+
+    error = (0 > wait_ret) ? -EINTR : ((0 == wait_ret) ? -ETIME : ENONE);
+  }
+
+  // Stops the sequence if it was cut short, and makes sure the callback is done with the steps either way
+  hrtimer_cancel(&gpio_seq_timer);
+
+  if ((ENONE == error) && gpio_seq_is_over_budget)
+  {
+    error = -ETIME;
+  }
+
+  p_seq->max_late_ns = gpio_seq_max_late_ns;
+  gpio_seq_steps = NULL;
+
+  if (ENONE != error)
+  {
+    pr_err("GPIO sequence was stopped early! error: %d\n", error);
+  }
+
+  return error;
+}
+
+// Runs in hard irq context for every step of a timer mode sequence. Stops the sequence once its budget is used up,
+// e.g. when the timer fell far behind and is catching up on the steps it missed.
+static enum hrtimer_restart gpio_seq_timer_callback(struct hrtimer *p_timer)
+{
+  gpio_seq_step_t const *p_step = &(gpio_seq_steps[gpio_seq_next_step]);
+  ktime_t now = ktime_get();
+
+  if (ktime_after(now, gpio_seq_end_time))
+  {
+    gpio_seq_is_over_budget = true;
+
+    // Pairs with the acquire by the waiting ioctl
+    smp_store_release(&gpio_seq_is_done, true);
+    wake_up_interruptible(&gpio_seq_waitq);
+    return HRTIMER_NORESTART;
+  }
+
+  gpio_write_output_masks(p_step->set_mask, p_step->clear_mask);
+
+  gpio_seq_max_late_ns = max(gpio_seq_max_late_ns, (u64)(max(ktime_to_ns(ktime_sub(now, gpio_seq_next_time)), (s64)(0))));
+  gpio_seq_next_time = ktime_add_ns(gpio_seq_next_time, p_step->delay_ns);
+  gpio_seq_next_step++;
+
+  if (gpio_seq_step_cnt == gpio_seq_next_step)
+  {
+    gpio_seq_next_step = 0;
+    gpio_seq_repeats_left--;
+
+    if (0 == gpio_seq_repeats_left)
+    {
+      // Pairs with the acquire by the waiting ioctl
+      smp_store_release(&gpio_seq_is_done, true);
+      wake_up_interruptible(&gpio_seq_waitq);
+      return HRTIMER_NORESTART;
+    }
+  }
+
+  hrtimer_set_expires(p_timer, gpio_seq_next_time);
+  return HRTIMER_RESTART;
+}
+
+// Reads a whole number of gpio_event_t (see custom-gpio-ioctl.h), as many as fit in len. Blocks until there is
+// at least one event unless the file was opened with O_NONBLOCK.
+static ssize_t gpio_events_read(struct file *p_file, char __user *user_buffer, size_t len, loff_t *p_offset)
+{
+  size_t max_event_cnt = len / sizeof(gpio_event_t);
+
+  if (0 == max_event_cnt)
+  {
+    return -EINVAL;
+  }
+
+  for (;;)
+  {
+    if (0 == atomic_read(&gpio_events_pending_cnt))
+    {
+      if (0 != (p_file->f_flags & O_NONBLOCK))
+      {
+        return -EAGAIN;
+      }
+
+      int error = wait_event_interruptible(gpio_events_waitq, (0 != atomic_read(&gpio_events_pending_cnt)));
+
+      if (ENONE != error)
+      {
+        return error;
+      }
+    }
+
+    if (mutex_lock_interruptible(&gpio_input_mutex))
+    {
+      return -ERESTARTSYS;
+    }
+
+    ssize_t event_cnt = gpio_events_drain_locked((gpio_event_t __user *)(user_buffer), max_event_cnt);
+
+    mutex_unlock(&gpio_input_mutex);
+
+    // Another reader can empty the rings first, in which case wait again
+    if (0 != event_cnt)
+    {
+      return (0 > event_cnt) ? event_cnt : (event_cnt * (ssize_t)(sizeof(gpio_event_t)));
+    }
+  }
+}
+
+static __poll_t gpio_events_poll(struct file *p_file, struct poll_table_struct *p_wait)
+{
+  poll_wait(p_file, &gpio_events_waitq, p_wait);
+
+  return (0 != atomic_read(&gpio_events_pending_cnt)) ? (EPOLLIN | EPOLLRDNORM) : 0;
+}
+
+// Ret values:  ENONE       - success
+//              -EFAULT     - failure, couldn't copy the argument from or to userspace
+//              -EINVPIN    - failure, invalid pin
+//              -EUNSUPCMD  - failure, unknown command
+//              other       - failure, error from setting up the input (see gpio_input_configure_locked())
+static long gpio_events_ioctl(struct file *p_file, unsigned int cmd, unsigned long arg)
+{
+  void __user *p_user_arg = (void __user *)(arg);
+  int error = ENONE;
+
+  switch (cmd)
+  {
+    case GPIO_IOC_SET_INPUT:
+    case GPIO_IOC_SET_COUNTER:
+    {
+      gpio_ioc_input_t input_cfg;
+
+      if (copy_from_user(&input_cfg, p_user_arg, sizeof(input_cfg)))
+      {
+        return -EFAULT;
+      }
+
+      mutex_lock(&gpio_input_mutex);
+      error = gpio_input_configure_locked(&input_cfg, ((GPIO_IOC_SET_COUNTER == cmd) ? GPIO_INPUT_MODE_COUNTER : GPIO_INPUT_MODE_EVENTS),
+                                          NULL, 0);
+      mutex_unlock(&gpio_input_mutex);
+      return error;
+    }
+
+    case GPIO_IOC_GET_COUNT:
+    {
+      gpio_ioc_count_t count;
+
+      if (copy_from_user(&count, p_user_arg, sizeof(count)))
+      {
+        return -EFAULT;
+      }
+
+      mutex_lock(&gpio_input_mutex);
+      error = gpio_counter_read_locked(&count);
+      mutex_unlock(&gpio_input_mutex);
+
+      if (ENONE != error)
+      {
+        return error;
+      }
+
+      return copy_to_user(p_user_arg, &count, sizeof(count)) ? -EFAULT : ENONE;
+    }
+
+    case GPIO_IOC_RELEASE_INPUT:
+    {
+      __u32 pin_num;
+
+      if (copy_from_user(&pin_num, p_user_arg, sizeof(pin_num)))
+      {
+        return -EFAULT;
+      }
+
+      if (!gpio_is_valid_pin(pin_num))
+      {
+        return -EINVPIN;
+      }
+
+      mutex_lock(&gpio_input_mutex);
+      gpio_input_release_locked(pin_num);
+      mutex_unlock(&gpio_input_mutex);
+      return ENONE;
+    }
+
+    case GPIO_IOC_RUN_SEQUENCE:
+    {
+      gpio_ioc_sequence_t seq;
+
+      if (copy_from_user(&seq, p_user_arg, sizeof(seq)))
+      {
+        return -EFAULT;
+      }
+
+      error = gpio_seq_run(&seq);
+
+      if (copy_to_user(p_user_arg, &seq, sizeof(seq)))
+      {
+        return -EFAULT;
+      }
+
+      return error;
+    }
+
+    case GPIO_IOC_GET_LEVELS:
+      return put_user((__u32)(gpio_get_level_mask()), (__u32 __user *)(p_user_arg));
+
+    case GPIO_IOC_GET_DROPPED:
+      return put_user((__u32)(atomic_xchg(&gpio_events_dropped_cnt, 0)), (__u32 __user *)(p_user_arg));
+
+    default:
+      return -EUNSUPCMD;
+  }
+}
+
+
+module_init(gpio_driver_init);
+module_exit(gpio_driver_exit);
+
+MODULE_DEVICE_TABLE(of, gpio_of_match);
 
 EXPORT_SYMBOL(gpio_output_ctl);
+EXPORT_SYMBOL(gpio_output_ctl_mask);
+EXPORT_SYMBOL(gpio_output_ctl_mask64);
 EXPORT_SYMBOL(gpio_set_pin_to_output);
 EXPORT_SYMBOL(gpio_is_pin_pwm);
 EXPORT_SYMBOL(gpio_set_pin_to_pwm);
+EXPORT_SYMBOL(gpio_get_pin_function);
+EXPORT_SYMBOL(gpio_soft_pwm_set_duty);
+EXPORT_SYMBOL(gpio_set_pin_to_input);
+EXPORT_SYMBOL(gpio_get_level);
+EXPORT_SYMBOL(gpio_get_level_mask);
+EXPORT_SYMBOL(gpio_get_level_mask64);
+EXPORT_SYMBOL(gpio_capture_start);
+EXPORT_SYMBOL(gpio_capture_stop);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Trevor Foland");
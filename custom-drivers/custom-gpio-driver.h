@@ -2,10 +2,39 @@
 #define CUSTOM_GPIO_DRIVER_H
 
 #include "custom-driver-shared-info.h"
+#include "custom-gpio-ioctl.h"
+
+// The value is also the GPFSEL field value for that function type.
+typedef uint32_t gpio_func_type_t;
+
+#define GPIO_INPUT_FUNC           (0x00U)
+#define GPIO_OUTPUT_FUNC          (0x01U)
+#define GPIO_ALT_FUNC_0           (0x04U)
+#define GPIO_ALT_FUNC_1           (0x05U)
+#define GPIO_ALT_FUNC_2           (0x06U)
+#define GPIO_ALT_FUNC_3           (0x07U)
+#define GPIO_ALT_FUNC_4           (0x03U)
+#define GPIO_ALT_FUNC_5           (0x02U)
+#define GPIO_INVALID_FUNC         (0xFFU) // Picked max byte value
+
+#define GPIO_SOFT_PWM_DUTY_MAX    (0xFFFFU)   // Fully on soft pwm duty cycle
+
+// GPIO_PULL_* from custom-gpio-ioctl.h
+typedef uint32_t gpio_pull_t;
 
 int gpio_output_ctl(uint32_t pin_num, bool do_set);
+int gpio_output_ctl_mask(uint32_t set_mask, uint32_t clear_mask);
+int gpio_output_ctl_mask64(u64 set_mask, u64 clear_mask);
 int gpio_set_pin_to_output(uint32_t pin_num, bool is_on_initially);
 pwm_channel_t gpio_is_pin_pwm(uint32_t pin_num);
 int gpio_set_pin_to_pwm(uint32_t pin_num);
+gpio_func_type_t gpio_get_pin_function(uint32_t pin_num);
+int gpio_soft_pwm_set_duty(uint32_t pin_num, uint16_t duty_u16);
+int gpio_set_pin_to_input(uint32_t pin_num, gpio_pull_t pull);
+int gpio_get_level(uint32_t pin_num, bool *p_is_high);
+uint32_t gpio_get_level_mask(void);
+u64 gpio_get_level_mask64(void);
+int gpio_capture_start(uint32_t pin_num, gpio_pull_t pull, uint32_t edge_flags, u64 *p_timestamps, uint32_t max_cnt);
+int gpio_capture_stop(uint32_t pin_num, uint32_t *p_edge_cnt);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,98 @@
+#ifndef CUSTOM_GPIO_IOCTL_H
+#define CUSTOM_GPIO_IOCTL_H
+
+// Ioctl interface and event format of the custom_gpio_events device, which configures gpio inputs and
+// reports their edges. This header is shared with userspace, so it only uses the fixed size types from linux/types.h.
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/***************    Macros    ***************/
+
+#define GPIO_IOC_MAGIC            ('G')
+
+// Pull resistor of an input, the value is also the GPPUD register value
+#define GPIO_PULL_NONE            (0U)
+#define GPIO_PULL_DOWN            (1U)
+#define GPIO_PULL_UP              (2U)
+
+// Edges of an input to report events for (gpio_ioc_input_t), and the edge of an event (gpio_event_t)
+#define GPIO_EDGE_RISING          (1U << 0)
+#define GPIO_EDGE_FALLING         (1U << 1)
+#define GPIO_EDGE_BOTH            (GPIO_EDGE_RISING | GPIO_EDGE_FALLING)
+
+// Sequence player modes (gpio_ioc_sequence_t)
+#define GPIO_SEQ_MODE_TIMER       (0U)        // Every step is run from an hrtimer, for sequences of any length
+#define GPIO_SEQ_MODE_BUSY        (1U)        // Steps are run from a busy loop that can't be preempted, for sub-us timing
+
+#define GPIO_SEQ_FLAG_IRQS_OFF    (1U << 0)   // GPIO_SEQ_MODE_BUSY only, also keep interrupts off so nothing delays a step
+
+#define GPIO_SEQ_MAX_STEPS          (4096U)
+#define GPIO_SEQ_MIN_TIMER_DELAY_NS (1000U)       // GPIO_SEQ_MODE_TIMER, shortest delay_ns of a step that is waited for
+#define GPIO_SEQ_MAX_TIMER_STEPS    (1U << 24)    // GPIO_SEQ_MODE_TIMER, most steps played (step_cnt * repeat_cnt)
+
+// Ioctl commands
+#define GPIO_IOC_SET_INPUT        _IOW(GPIO_IOC_MAGIC, 0, gpio_ioc_input_t)
+#define GPIO_IOC_RELEASE_INPUT    _IOW(GPIO_IOC_MAGIC, 1, __u32)    // Stops the edge events or counting of the pin passed in
+#define GPIO_IOC_GET_LEVELS       _IOR(GPIO_IOC_MAGIC, 2, __u32)    // Level of every pin, bit n is pin n
+#define GPIO_IOC_GET_DROPPED      _IOR(GPIO_IOC_MAGIC, 3, __u32)    // Events dropped since the last call because a ring was full
+#define GPIO_IOC_SET_COUNTER      _IOW(GPIO_IOC_MAGIC, 4, gpio_ioc_input_t)   // Like GPIO_IOC_SET_INPUT, but counts the edges instead
+#define GPIO_IOC_GET_COUNT        _IOWR(GPIO_IOC_MAGIC, 5, gpio_ioc_count_t)
+#define GPIO_IOC_RUN_SEQUENCE     _IOWR(GPIO_IOC_MAGIC, 6, gpio_ioc_sequence_t)   // Returns once the sequence is done
+
+
+/***************    Type definitions    ***************/
+
+typedef struct gpio_ioc_input_s
+{
+  __u32 pin;                // 2 to 27
+  __u32 pull;               // GPIO_PULL_*
+  __u32 edge_flags;         // GPIO_EDGE_* to report events for, 0 for a plain input
+} gpio_ioc_input_t;
+
+// Edge count and timing of a counting pin (GPIO_IOC_SET_COUNTER) since it was set up.
+// The periods are the times between counted edges, so the frequency of the pulses is 1000000000 / mean_period_ns Hz
+// when counting GPIO_EDGE_RISING or GPIO_EDGE_FALLING, and 500000000 / mean_period_ns Hz with GPIO_EDGE_BOTH
+// (two edges per pulse).
+typedef struct gpio_ioc_count_s
+{
+  __u32 pin;                // Set by the caller to the pin to read
+  __u32 reserved;
+  __u64 count;              // Edges counted
+  __u64 first_edge_ns;      // CLOCK_MONOTONIC time of the first and the last edge, 0 before the first edge
+  __u64 last_edge_ns;
+  __u64 mean_period_ns;     // Period stats of the time between edges, 0 until there are two edges
+  __u64 min_period_ns;
+  __u64 max_period_ns;
+} gpio_ioc_count_t;
+
+// One step of a sequence. The set and clear masks are applied together and the next step follows delay_ns later.
+typedef struct gpio_seq_step_s
+{
+  __u32 set_mask;           // Output pins to set, bit n is pin n
+  __u32 clear_mask;         // Output pins to clear, can't have pins that are in set_mask
+  __u32 delay_ns;           // Time from this step to the next one (or to the first step of the next repeat),
+                            // at least GPIO_SEQ_MIN_TIMER_DELAY_NS in GPIO_SEQ_MODE_TIMER
+} gpio_seq_step_t;
+
+typedef struct gpio_ioc_sequence_s
+{
+  __u64 steps;              // Userspace address of the gpio_seq_step_t array
+  __u32 step_cnt;           // 1 to GPIO_SEQ_MAX_STEPS
+  __u32 repeat_cnt;         // Times the steps are played, 0 plays them once
+  __u32 mode;               // GPIO_SEQ_MODE_*
+  __u32 flags;              // GPIO_SEQ_FLAG_*
+  __u32 budget_us;          // Longest the sequence may run for, 0 for no limit (required for GPIO_SEQ_MODE_BUSY)
+  __u32 reserved;
+  __u64 max_late_ns;        // Written by the kernel, how late the latest step ran
+} gpio_ioc_sequence_t;
+
+// Reads of custom_gpio_events return a whole number of these, oldest first
+typedef struct gpio_event_s
+{
+  __u64 timestamp_ns;       // CLOCK_MONOTONIC time the edge interrupt ran at
+  __u32 pin;
+  __u32 edge;               // GPIO_EDGE_RISING or GPIO_EDGE_FALLING
+} gpio_event_t;
+
+#endif
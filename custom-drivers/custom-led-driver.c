@@ -4,13 +4,31 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/string.h>
-#include <linux/kthread.h>
-#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
 
 #include "custom-driver-shared-info.h"
+#include "custom-driver-platform.h"
 #include "custom-errno.h"
 #include "custom-gpio-driver.h"
 #include "custom-pwm-driver.h"
+#include "custom-driver-trace.h"
+#include "custom-led-ioctl.h"
+#include "custom-led-fade-lut.h"
 
 
 
@@ -20,16 +38,36 @@
 /***************    Macros    ***************/
 
 #define LED_DEVICE_NAME         "custom_gpio_led"
-#define LED_BLINK_THREAD_NAME   "custom_gpio_led_blink_thread"
+#define LED_PLATFORM_NAME       "custom-gpio-leds"
+#define LED_DT_COMPATIBLE       "custom,gpio-leds"        // The node can list the led pins in a led-pins property
 #define LED_CLASS               "custom_gpio_led_class"
+#define LED_DEV_CACHE_NAME      "custom_gpio_led_dev"
 #define FIRST_LED_PIN           16                        // This is the first pin on the Raspberry Pi 3B that I have dedicated to leds
-#define MAX_LED_DEVICES         4
+#define LED_DEFAULT_DEVICE_CNT  4                         // Leds on pins FIRST_LED_PIN and up are used when no led_pins are given
+#define LED_MIN_PIN             2                         // Pins 0 and 1 are reserved for the HAT ID EEPROM
+#define LED_MAX_PIN             27
+#define MAX_LED_DEVICES         (LED_MAX_PIN - LED_MIN_PIN + 1)
+#define LED_BANK_DEVICE_NAME    "custom_gpio_led_bank"    // Extra device that updates every led at once
+#define LED_SHM_MIN_POLL_US     100                       // Fastest the shared control page is checked for changes
+#define LED_READ_MSG_MAX_SIZE   16                        // Longest read message is "blink off\n"
+#define LED_BLINK_MIN_PERIOD_US 100                       // Shortest on or off blink period allowed, keeps the blink timer from hogging the cpu
+#define LED_FADE_MIN_TICK_US    500                       // Fastest the fade timer updates fading leds
+#define LED_WRITE_BR_CMD_INDEX    4                       // Index of the commands with arguments in led_write_word_cmds/led_write_num_cmds
+#define LED_WRITE_FADE_CMD_INDEX  5
+#define LED_DEBUGFS_DIR_NAME    "custom_gpio_led"         // Stats of every led, one file per led device
+#define LED_STATS_HIST_BUCKET_CNT 16                      // Bucket 0 counts latencies under 1 us and bucket n 2^(n-1) to 2^n us, the last one has the rest
        
 
-// Valid write messages are "on", "off", "toggle" and valid read messages are "on" and "off". 
-// '\0' character can be included in these messages since we might view this data as a string.
-// Therefore "toggle" is the longest message at 7 characters (6 chars + '\0') and is the largest buffer size we need.
-#define MSG_BUF_MAX_SIZE  7
+// A single write can hold a batch of newline separated commands (e.g. "br 50\non\n"), up to this many bytes in total.
+#define LED_WRITE_MAX_SIZE      (PAGE_SIZE)
+
+// Packed led state word (see led_dev_t), so the whole state of an led can be changed with a single cmpxchg
+#define LED_STATE_ON_FIELD      (1U << 0)                 // Whether the led output is on
+#define LED_STATE_MODE_SHIFT    (1)                       // led_state_t of the led
+#define LED_STATE_MODE_MASK     (0x3U << LED_STATE_MODE_SHIFT)
+#define LED_STATE_GEN_SHIFT     (8)                       // Generation, bumped on every state change
+#define LED_STATE_GEN_INC       (1U << LED_STATE_GEN_SHIFT)
+#define LED_STATE_GEN_MASK      (~(LED_STATE_GEN_INC - 1))
 
 
 /***************    Type definitions    ***************/
@@ -41,48 +79,204 @@ typedef enum led_state_e
   LED_BLINK = 2
 } led_state_t;
 
+// State changes that can be made to the state word of an led
+typedef enum led_state_op_e
+{
+  LED_STATE_OP_SET_OFF = 0,
+  LED_STATE_OP_SET_ON,
+  LED_STATE_OP_TOGGLE,
+  LED_STATE_OP_STOP_BLINK,      // Only changes a blinking led, which is left off
+  LED_STATE_OP_BLINK,           // Starts the led blinking
+  LED_STATE_OP_BLINK_TICK       // Only changes a blinking led, used by the blink timer
+} led_state_op_t;
+
+typedef enum led_cmd_type_e
+{
+  LED_CMD_NONE = 0,
+  LED_CMD_OFF,
+  LED_CMD_ON,
+  LED_CMD_TOGGLE,
+  LED_CMD_BLINK,
+  LED_CMD_BRIGHTNESS,
+  LED_CMD_FADE
+} led_cmd_type_t;
+
+#define LED_CMD_TYPE_CNT        (LED_CMD_FADE + 1)
+
+// Errors counted in the led stats, any other error is counted as LED_STATS_ERR_OTHER
+typedef enum led_stats_err_e
+{
+  LED_STATS_ERR_UNSUPCMD = 0,
+  LED_STATS_ERR_MSGSIZE,
+  LED_STATS_ERR_DOM,
+  LED_STATS_ERR_INVAL,
+  LED_STATS_ERR_FAULT,
+  LED_STATS_ERR_OTHER,
+  LED_STATS_ERR_CNT
+} led_stats_err_t;
+
+// Interfaces the stats time the calls of
+typedef enum led_stats_path_e
+{
+  LED_STATS_PATH_WRITE = 0,
+  LED_STATS_PATH_IOCTL,
+  LED_STATS_PATH_CNT
+} led_stats_path_t;
+
+// Per-cpu stats of the calls into an led device. Only updated from process context by the cpu they belong to,
+// so updating them never takes a lock or bounces a cache line.
+typedef struct led_dev_stats_s
+{
+  struct u64_stats_sync syncp;
+  u64 cmd_cnts[LED_CMD_TYPE_CNT];                                 // Indexed by led_cmd_type_t, LED_CMD_NONE isn't used
+  u64 err_cnts[LED_STATS_ERR_CNT];
+  u64 call_cnts[LED_STATS_PATH_CNT];
+  u64 call_total_ns[LED_STATS_PATH_CNT];
+  u64 latency_hist[LED_STATS_PATH_CNT][LED_STATS_HIST_BUCKET_CNT];
+} led_dev_stats_t;
+
+typedef struct led_cmd_s
+{
+  led_cmd_type_t cmd_type;
+  uint32_t brightness;          // Only used by LED_CMD_BRIGHTNESS and LED_CMD_FADE (the target)
+  uint32_t fade_duration_ms;    // The fade fields are only used by LED_CMD_FADE
+  uint32_t fade_curve;
+} led_cmd_t;
+
+// A batch of write commands folded down to what they add up to, so it can be applied as one update.
+typedef struct led_batch_s
+{
+  led_cmd_type_t state_cmd;     // Last on/off/toggle/blink command, LED_CMD_NONE if there wasn't one (or toggles canceled out)
+  led_cmd_t brightness_cmd;     // Last brightness or fade command, LED_CMD_NONE if there wasn't one
+} led_batch_t;
+
 typedef struct led_dev_funcs_s
 {
   int (*led_enable)(uint32_t pin_num, bool do_enable);
 } led_dev_funcs_t;
 
-// TODO: Add a read lock, a write lock, and a state control lock
+// The state of the led (on/off/blink mode, whether the output is on and a generation count) is packed into
+// state_word, so writers and the blink timer change it with cmpxchg instead of taking a lock. See led_state_transition()
+// and led_sync_output() for how the led output is kept matching it.
 typedef struct led_dev_s
 {
-  // TODO: Add in a mutex or semaphore for access protection
+  uint32_t index;               // Device number of the led, i.e. the N in custom_gpio_led_N
   uint32_t pin_num;
   pwm_channel_t pwm_channel;
-  led_state_t led_state;
+  atomic_t state_word;
   struct cdev c_dev;
   struct device * p_device;
-  struct task_struct *p_blink_thread;
+  ktime_t blink_on_period;      // The blink fields are protected by led_blink_lock
+  ktime_t blink_off_period;
+  ktime_t blink_phase_offset;   // Offset of the start of the led's blink cycle from led_blink_epoch
+  ktime_t blink_next_toggle;
+  ktime_t blink_last_toggle;    // 0 until the first toggle since the led started blinking
+  u64 blink_toggle_cnt;         // The blink stats are protected by led_blink_lock too
+  u64 blink_late_total_ns;      // How late the toggles ran after the time they were due
+  u64 blink_late_max_ns;
+  u64 blink_on_ns;              // Time the led was actually on and off for since it started blinking
+  u64 blink_off_ns;
+  atomic64_t blink_stop_cnt;    // Times a blinking led was stopped by a command
+  atomic64_t skipped_cnt;       // Commands that wouldn't have changed the led, so nothing was written
+  atomic64_t coalesced_cnt;     // Updates merged into a pending one, see led_submit_batch()
+  atomic64_t coalesce_err_cnt;  // Pending updates the coalesce timer failed to apply
+  led_batch_t coalesce_batch;   // The coalesce fields are protected by led_coalesce_lock
+  ktime_t coalesce_until;       // Updates before this are merged into coalesce_batch instead of being applied
+  led_dev_stats_t __percpu *p_stats;
+  uint32_t brightness;              // The brightness and fade fields are protected by led_fade_lock
+  uint32_t fade_start_brightness;
+  uint32_t fade_target_brightness;
+  uint32_t fade_curve;
+  ktime_t fade_start;
+  ktime_t fade_duration;
   led_dev_funcs_t led_dev_funcs;
-  char msg_buffer[MSG_BUF_MAX_SIZE]; // valid write messages are "on", "off", "toggle" and valid read messages are "on" and "off".
-  bool is_led_on;
+  wait_queue_head_t state_waitq;    // Woken on every change of state_word
 } led_dev_t;
 
+// Each open of an led device gets one of these, so every reader tracks which state changes it has already seen
+typedef struct led_file_s
+{
+  led_dev_t *led_dev;
+  uint32_t seen_state_gen;          // Generation of the led state when this file last read it
+} led_file_t;
+
 
 /***************    Function declarations    ***************/
 
 // Inline functions
 static inline void unregister_leds_cdev_region(void);
-static inline led_state_t get_led_state_from_physical_state(led_dev_t *led_dev);
+static inline led_state_t led_state_word_get_state(uint32_t state_word);
+static inline bool led_state_word_is_on(uint32_t state_word);
+static inline uint32_t led_state_word_get_gen(uint32_t state_word);
 static inline int clear_led_blinking(led_dev_t *led_dev);
 static inline int led_gpio_enable(uint32_t pin_num, bool do_enable);
 static inline int led_pwm_enable(uint32_t pin_num, bool do_enable);
+static inline uint32_t get_led_dev_index(led_dev_t *led_dev);
+static inline void led_notify_state_change(led_dev_t *led_dev);
+static inline led_dev_t * led_get_file_led_dev(struct file *p_file);
+static inline void led_dev_free(led_dev_t *led_dev);
+static inline led_stats_err_t led_stats_err_index(int error);
+static inline uint32_t led_stats_hist_bucket(u64 latency_ns);
 
 // Normal functions
 static int __init led_driver_init(void);
 static void __exit led_driver_exit(void);
+static int led_probe(struct platform_device *p_pdev);
+static CUSTOM_PLATFORM_REMOVE_RET_T led_remove(struct platform_device *p_pdev);
 static int led_dev_init(led_dev_t *led_dev, uint32_t led_dev_index);
+static int led_setup_pin_map(struct device_node const *p_node);
+static bool led_is_pwm_channel_used(pwm_channel_t pwm_channel, uint32_t led_dev_cnt_to_check);
+static bool led_state_calc_next(uint32_t old_state_word, led_state_op_t op, bool is_blink_on, uint32_t *p_new_state_word);
+static bool led_state_transition(led_dev_t *led_dev, led_state_op_t op, bool is_blink_on, uint32_t *p_new_state_word);
+static int led_sync_output(led_dev_t *led_dev, uint32_t state_word);
 static int led_dev_uevent(struct device *dev, struct kobj_uevent_env *env);
-static int led_blink(void *arg);
+static int led_start_blinking(led_dev_t *led_dev, ktime_t on_period, ktime_t off_period, ktime_t phase_offset);
+static bool led_blink_calc_phase(led_dev_t *led_dev, ktime_t now);
+static void led_blink_rearm_locked(void);
+static enum hrtimer_restart led_blink_timer_callback(struct hrtimer *p_timer);
+static void led_blink_record_toggle_locked(led_dev_t *led_dev, ktime_t now, ktime_t toggle_time, bool is_turned_on, bool is_resynced);
+static void led_stats_record(led_dev_t *led_dev, led_stats_path_t path, uint32_t const *p_cmd_cnts, int error, u64 start_ns);
+static void led_debugfs_init(void);
+static int led_stats_show(struct seq_file *p_seq, void *p_data);
+static int led_stats_open(struct inode *p_inode, struct file *p_file);
+static long led_ioctl_run(led_dev_t *led_dev, unsigned int cmd, void __user *p_user_arg, led_cmd_type_t *p_cmd_type);
+static int led_cmd_set_on(led_dev_t *led_dev, bool do_turn_on);
+static int led_cmd_toggle(led_dev_t *led_dev);
+static int led_cmd_blink(led_dev_t *led_dev, ktime_t on_period, ktime_t off_period, ktime_t phase_offset);
+static int led_cmd_set_brightness(led_dev_t *led_dev, uint32_t brightness);
+static int led_cmd_fade(led_dev_t *led_dev, uint32_t target_brightness, uint32_t duration_ms, uint32_t curve);
+static int led_apply_brightness(led_dev_t *led_dev, uint32_t brightness);
+static uint32_t led_fade_calc_brightness(led_dev_t *led_dev, ktime_t now, bool *p_is_done);
+static enum hrtimer_restart led_fade_timer_callback(struct hrtimer *p_timer);
+static int led_parse_cmd(char *cmd_str, size_t cmd_len, led_cmd_t *p_cmd);
+static size_t led_match_arg_cmd(char const *cmd_str, size_t cmd_len, uint32_t cmd_index);
+static int led_parse_percent(char const *percent_str, uint32_t *p_brightness);
+static int led_parse_fade_args(char *args_str, led_cmd_t *p_cmd);
+static void led_batch_add_cmd(led_batch_t *p_batch, led_cmd_t const *p_cmd);
+static void led_batch_merge(led_batch_t *p_batch, led_batch_t const *p_later_batch);
+static int led_batch_apply(led_dev_t *led_dev, led_batch_t const *p_batch);
+static int led_cmd_check(led_cmd_t const *p_cmd);
+static int led_submit_cmd(led_dev_t *led_dev, led_cmd_t const *p_cmd);
+static int led_submit_batch(led_dev_t *led_dev, led_batch_t const *p_batch);
+static void led_coalesce_flush_mask(uint32_t led_mask);
+static enum hrtimer_restart led_coalesce_timer_callback(struct hrtimer *p_timer);
+static int led_bank_dev_init(void);
+static void led_bank_dev_destroy(void);
+static int led_bank_apply_frame(led_bank_frame_t const *p_frame);
+static int led_bank_mmap(struct file *p_file, struct vm_area_struct *p_vma);
+static void led_shm_vma_open(struct vm_area_struct *p_vma);
+static void led_shm_vma_close(struct vm_area_struct *p_vma);
+static enum hrtimer_restart led_shm_timer_callback(struct hrtimer *p_timer);
+static int led_shm_apply(led_shm_led_t const *p_targets);
 
 // File operation functions
 static int led_open(struct inode *, struct file *);
 static int led_release(struct inode *, struct file *);
 static ssize_t led_read(struct file *, char *, size_t, loff_t *);
 static ssize_t led_write(struct file *, const char *, size_t, loff_t *);
+static long led_ioctl(struct file *, unsigned int, unsigned long);
+static __poll_t led_poll(struct file *, struct poll_table_struct *);
+static ssize_t led_bank_write(struct file *, const char *, size_t, loff_t *);
 
 
 /***************    Private variables    ***************/
@@ -93,22 +287,175 @@ static bool is_led_dev_0_open = false;
 static bool is_led_dev_1_open = false;
 static struct class *p_led_class = NULL; 
 
+// A single timer runs the blinking of every led so no thread or timer is needed per led.
+// Every blinking led is locked to a phase offset from the same epoch, so leds with the same
+// blink periods stay in sync with each other. led_blink_lock is a raw spinlock since the blink timer
+// runs in hard irq context, even on PREEMPT_RT.
+static struct hrtimer led_blink_timer;
+static ktime_t led_blink_epoch;
+static DEFINE_RAW_SPINLOCK(led_blink_lock);
+
+// Blink settings used by the "blink" write command
+static unsigned int blink_on_ms = 125;
+module_param(blink_on_ms, uint, 0644);
+MODULE_PARM_DESC(blink_on_ms, "Time in ms a blinking led is on for (default 125)");
+
+static unsigned int blink_off_ms = 125;
+module_param(blink_off_ms, uint, 0644);
+MODULE_PARM_DESC(blink_off_ms, "Time in ms a blinking led is off for (default 125)");
+
+static unsigned int blink_phase_step_ms = 0;
+module_param(blink_phase_step_ms, uint, 0644);
+MODULE_PARM_DESC(blink_phase_step_ms, "Phase offset in ms added per led device index when blinking (default 0, all leds blink together)");
+
+// A single timer also runs the fades of every led, ticking every fade_tick_us while any led is fading.
+// The brightness of every led (and its fade) is protected by led_fade_lock.
+static struct hrtimer led_fade_timer;
+static DEFINE_SPINLOCK(led_fade_lock);
+static uint32_t led_fade_mask = 0;    // Leds that are fading, bit n is custom_gpio_led_n
+
+static unsigned int fade_tick_us = 2000;
+module_param(fade_tick_us, uint, 0644);
+MODULE_PARM_DESC(fade_tick_us, "Time in us between brightness updates of fading leds (default 2000, min 500)");
+
+// Updates of an led that come in less than coalesce_us after its last applied one are merged into one pending update,
+// which a single shared timer applies once the window is over. Only the pending updates are protected by
+// led_coalesce_lock, so nothing takes it while coalesce_us is 0.
+static struct hrtimer led_coalesce_timer;
+static DEFINE_SPINLOCK(led_coalesce_lock);
+static uint32_t led_coalesce_mask = 0;    // Leds with a pending update, bit n is custom_gpio_led_n
+
+static unsigned int coalesce_us = 0;
+module_param(coalesce_us, uint, 0644);
+MODULE_PARM_DESC(coalesce_us, "Window in us after an led update in which later updates of the led are merged and only the result is applied (default 0, every update is applied right away, max 1000000)");
+
+// PWM settings of the leds on pwm capable pins, only read when the module is installed
+static unsigned int pwm_freq_hz = PWM_FREQ_4_kHZ;
+module_param(pwm_freq_hz, uint, 0444);
+MODULE_PARM_DESC(pwm_freq_hz, "PWM cycle frequency in Hz of the pwm leds (default 4000)");
+
+static bool pwm_mark_space = false;
+module_param(pwm_mark_space, bool, 0444);
+MODULE_PARM_DESC(pwm_mark_space, "Run the pwm leds in mark-space mode instead of balanced mode, which switches less (default false)");
+
+static bool pwm_inverted = false;
+module_param(pwm_inverted, bool, 0444);
+MODULE_PARM_DESC(pwm_inverted, "Invert the pwm output polarity, for leds wired to be on when the pin is low (default false)");
+
 static struct file_operations const led_fops =
 {
   .read = led_read,
   .write = led_write,
+  .unlocked_ioctl = led_ioctl,
+  .compat_ioctl = compat_ptr_ioctl,   // The ioctl structs are the same size for 32 and 64 bit userspace
+  .poll = led_poll,
+  .llseek = default_llseek,           // So the state can be read again from offset 0
   .open = led_open,
   .release = led_release
 };
 
-static led_dev_t led_dev_array[MAX_LED_DEVICES];
+static struct file_operations const led_stats_fops =
+{
+  .owner = THIS_MODULE,
+  .open = led_stats_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static struct dentry *p_led_debugfs_dir = NULL;
+
+static char const * const led_stats_cmd_names[LED_CMD_TYPE_CNT] =
+{
+  [LED_CMD_OFF] = "off",
+  [LED_CMD_ON] = "on",
+  [LED_CMD_TOGGLE] = "toggle",
+  [LED_CMD_BLINK] = "blink",
+  [LED_CMD_BRIGHTNESS] = "brightness",
+  [LED_CMD_FADE] = "fade",
+};
+
+static char const * const led_stats_err_names[LED_STATS_ERR_CNT] =
+{
+  [LED_STATS_ERR_UNSUPCMD] = "EUNSUPCMD",
+  [LED_STATS_ERR_MSGSIZE] = "EMSGSIZE",
+  [LED_STATS_ERR_DOM] = "EDOM",
+  [LED_STATS_ERR_INVAL] = "EINVAL",
+  [LED_STATS_ERR_FAULT] = "EFAULT",
+  [LED_STATS_ERR_OTHER] = "other",
+};
+
+static char const * const led_stats_path_names[LED_STATS_PATH_CNT] =
+{
+  [LED_STATS_PATH_WRITE] = "write",
+  [LED_STATS_PATH_IOCTL] = "ioctl",
+};
+
+static struct file_operations const led_bank_fops =
+{
+  .write = led_bank_write,
+  .mmap = led_bank_mmap,
+};
+
+static struct vm_operations_struct const led_shm_vm_ops =
+{
+  .open = led_shm_vma_open,
+  .close = led_shm_vma_close,
+};
+
+// Leds are allocated from a cache aligned slab, so only the leds in use take up memory and
+// the blink timer doesn't bounce cache lines between leds changed on different cpus.
+static struct kmem_cache *led_dev_cache = NULL;
+static led_dev_t *led_devs[MAX_LED_DEVICES];
+static uint32_t led_dev_cnt = 0;
+
+static unsigned int led_pins[MAX_LED_DEVICES];
+static int led_pins_cnt = 0;
+module_param_array(led_pins, uint, &led_pins_cnt, 0444);
+MODULE_PARM_DESC(led_pins, "Comma separated gpio pins (2-27) of the leds, custom_gpio_led_N is the Nth pin (default the led-pins of the device tree node, or 16,17,18,19)");
+
+static struct of_device_id const led_of_match[] =
+{
+  { .compatible = LED_DT_COMPATIBLE },
+  { }
+};
+
+static struct platform_driver led_platform_driver =
+{
+  .probe = led_probe,
+  .remove = led_remove,
+  .driver =
+  {
+    .name = LED_PLATFORM_NAME,
+    .of_match_table = led_of_match,
+    .suppress_bind_attrs = true,    // Unbinding would pull the led devices out from under open files
+  },
+};
+
+static struct platform_device *p_led_fallback_dev = NULL;  // Only made when there is no device tree node
+static struct cdev led_bank_cdev;
+static struct device *p_led_bank_device = NULL;
+
+// Shared control page of the bank device. Userspace writes led targets into it and the shm timer
+// applies them while the page is mapped, so the kernel still owns the gpio/pwm registers.
+static led_shm_page_t *led_shm_page = NULL;
+static led_shm_led_t led_shm_applied[MAX_LED_DEVICES];   // Targets last applied, so only leds whose targets changed are touched
+static led_shm_led_t led_shm_targets[MAX_LED_DEVICES];   // Only used by the shm timer, which never runs concurrently with itself
+static uint32_t led_shm_applied_seq = 0;
+static atomic_t led_shm_map_cnt = ATOMIC_INIT(0);
+static struct hrtimer led_shm_timer;
+
+static unsigned int shm_poll_us = 1000;
+module_param(shm_poll_us, uint, 0644);
+MODULE_PARM_DESC(shm_poll_us, "How often in us the bank device's shared control page is checked for changes while it is mapped (default 1000, min 100)");
 static char *led_write_word_cmds[] =
 {
   "OFF",
   "ON",
   "TOGGLE",
   "BLINK",
-  "BR "    // Brightness
+  "BR ",   // Brightness
+  "FADE "
 };
 
 static char *led_write_num_cmds[] =
@@ -117,23 +464,78 @@ static char *led_write_num_cmds[] =
   "1",
   "2",
   "3",
-  "4 "
+  "4 ",
+  "5 "
+};
+
+// Curve names of the fade write command, indexed by LED_FADE_CURVE_*
+static char *led_fade_curve_names[] =
+{
+  "LINEAR",
+  "EASE",
+  "GAMMA"
 };
 
 
 /***************    Function Definitions    ***************/
 
 static int __init led_driver_init(void)
+{
+  // The leds have no registers of their own, so the fallback device doesn't need any resources
+  int error = custom_platform_driver_register(&led_platform_driver, NULL, 0, &p_led_fallback_dev);
+
+  if (ENONE != error)
+  {
+    pr_err("LED driver couldn't be bound to a device! error: %d\n", error);
+    return error;
+  }
+
+  printk("LED driver successfully initialized\n");
+  return ENONE;
+}
+
+static void __exit led_driver_exit(void)
+{
+  custom_platform_driver_unregister(&led_platform_driver, p_led_fallback_dev);
+
+  printk("LED driver exited\n");
+}
+
+static int led_probe(struct platform_device *p_pdev)
 {
   dev_t dev_id = 0;
   int error = ENONE;
 
-  error = alloc_chrdev_region(&dev_id, 0, MAX_LED_DEVICES, LED_DEVICE_NAME);
+  // There is one set of led devices
+  if (0 != led_dev_cnt)
+  {
+    pr_err("LED driver is already bound to a device!\n");
+    return -EBUSY;
+  }
+
+  error = led_setup_pin_map(p_pdev->dev.of_node);
+
+  if (ENONE != error)
+  {
+    goto failure_end;
+  }
+
+  led_dev_cache = kmem_cache_create(LED_DEV_CACHE_NAME, sizeof(led_dev_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+
+  if (NULL == led_dev_cache)
+  {
+    pr_err("LED driver couldn't create the led device cache!\n");
+    error = -ENOMEM;
+    goto failure_end;
+  }
+
+  // One minor per led and one for the bank device
+  error = alloc_chrdev_region(&dev_id, 0, led_dev_cnt + 1, LED_DEVICE_NAME);
   
   if (ENONE != error)
   {
     pr_err("LED driver couldn't allocate device ids for all the necessary devices.\n");
-    goto failure_end;
+    goto destroy_led_dev_cache;
   }
 
   major_drv_num = MAJOR(dev_id);
@@ -154,11 +556,47 @@ static int __init led_driver_init(void)
   // is created. We use this to set device permissions at creation.
   p_led_class->dev_uevent = led_dev_uevent;
 
+  // The blink timer has to be ready before any device can be written to
+  hrtimer_init(&led_blink_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+  led_blink_timer.function = led_blink_timer_callback;
+  led_blink_epoch = ktime_get();
+
+  hrtimer_init(&led_fade_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+  led_fade_timer.function = led_fade_timer_callback;
+
+  hrtimer_init(&led_coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+  led_coalesce_timer.function = led_coalesce_timer_callback;
+
   int devices_successfully_inited = 0;
 
-  for (uint32_t led_num = 0; led_num < MAX_LED_DEVICES; led_num++)
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
   {
-    error = led_dev_init(&(led_dev_array[led_num]), led_num);
+    led_devs[led_num] = kmem_cache_zalloc(led_dev_cache, GFP_KERNEL);
+
+    if (NULL == led_devs[led_num])
+    {
+      error = -ENOMEM;
+      goto delete_led_cdevs_and_devices;
+    }
+
+    led_devs[led_num]->p_stats = alloc_percpu(led_dev_stats_t);
+
+    if (NULL == led_devs[led_num]->p_stats)
+    {
+      led_dev_free(led_devs[led_num]);
+      led_devs[led_num] = NULL;
+      error = -ENOMEM;
+      goto delete_led_cdevs_and_devices;
+    }
+
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+      u64_stats_init(&(per_cpu_ptr(led_devs[led_num]->p_stats, cpu)->syncp));
+    }
+
+    error = led_dev_init(led_devs[led_num], led_num);
 
     if (ENONE == error)
     {
@@ -166,11 +604,22 @@ static int __init led_driver_init(void)
     }
     else
     {
+      led_dev_free(led_devs[led_num]);
+      led_devs[led_num] = NULL;
       goto delete_led_cdevs_and_devices;
     }
   }
 
-  printk("LED driver successfully initialized\n");
+  // The bank device updates the led devices, so it goes last
+  error = led_bank_dev_init();
+
+  if (ENONE != error)
+  {
+    goto delete_led_cdevs_and_devices;
+  }
+
+  led_debugfs_init();
+
   return ENONE;
 
 delete_led_cdevs_and_devices:
@@ -179,12 +628,14 @@ delete_led_cdevs_and_devices:
     // We should never have a null pointer for p_device
     // if the device was successfully inited, but we
     // will double-check just to be sure.
-    if (NULL != led_dev_array[i].p_device)
+    if (NULL != led_devs[i]->p_device)
     {
-      device_destroy(p_led_class, led_dev_array[i].c_dev.dev);
+      device_destroy(p_led_class, led_devs[i]->c_dev.dev);
     }
 
-    cdev_del(&(led_dev_array[i].c_dev));
+    cdev_del(&(led_devs[i]->c_dev));
+    led_dev_free(led_devs[i]);
+    led_devs[i] = NULL;
   }
 
 delete_led_class:
@@ -193,28 +644,72 @@ delete_led_class:
 unregister_led_cdev_region:
   unregister_leds_cdev_region();
 
+destroy_led_dev_cache:
+  kmem_cache_destroy(led_dev_cache);
+
 failure_end:
+  led_dev_cnt = 0;
   pr_err("LED failed initialization!\n");
 
   return error;
 }
 
-static void __exit led_driver_exit(void)
+static CUSTOM_PLATFORM_REMOVE_RET_T led_remove(struct platform_device *p_pdev)
 {
   int error = ENONE;
+  uint32_t gpio_led_off_mask = 0;
+
+  // Waits for any open stats file, which reads the led devices
+  debugfs_remove_recursive(p_led_debugfs_dir);
+
+  // No more frames can come in once the bank device is gone
+  led_bank_dev_destroy();
+
+  unsigned long irq_flags;
+
+  // Pending updates are dropped, every led is turned off below anyway
+  spin_lock_irqsave(&led_coalesce_lock, irq_flags);
+  led_coalesce_mask = 0;
+  spin_unlock_irqrestore(&led_coalesce_lock, irq_flags);
+
+  hrtimer_cancel(&led_coalesce_timer);
+
+  spin_lock_irqsave(&led_fade_lock, irq_flags);
+  led_fade_mask = 0;
+  spin_unlock_irqrestore(&led_fade_lock, irq_flags);
+
+  hrtimer_cancel(&led_fade_timer);
+
+  // Stop all the leds from blinking before turning them off and destroying them.
+  // The outputs are all turned off below, so they don't need to be synced here.
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
+  {
+    uint32_t state_word;
+
+    led_state_transition(led_devs[led_num], LED_STATE_OP_SET_OFF, false, &state_word);
+  }
 
-  for (uint32_t led_num = 0; led_num < MAX_LED_DEVICES; led_num++)
+  hrtimer_cancel(&led_blink_timer);
+
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
   {
-    // If the led device is running on another thread (i.e. the blink thread)
-    // then request that thread to stop before trying to destroy the led kernel
-    // module.
-    if (NULL != led_dev_array[led_num].p_blink_thread)
+    // Plain GPIO leds are all turned off together below with a single register write.
+    if (NOT_PWM == led_devs[led_num]->pwm_channel)
     {
-      kthread_stop(led_dev_array[led_num].p_blink_thread);   // Stop the LED flashing thread
+      // Hand the pin back to the gpio driver as a plain output in case it was dimmed
+      error = gpio_soft_pwm_set_duty(led_devs[led_num]->pin_num, GPIO_SOFT_PWM_DUTY_MAX);
+
+      if (unlikely(ENONE != error))
+      {
+        pr_err("Failed to stop the soft pwm of the LED on pin %u! error: %d\n", led_devs[led_num]->pin_num, error);
+      }
+
+
+      gpio_led_off_mask |= (1U << led_devs[led_num]->pin_num);
+      continue;
     }
 
-    // error = gpio_output_ctl(led_dev_array[led_num].pin_num, false);
-    error = led_dev_array[led_num].led_dev_funcs.led_enable(led_dev_array[led_num].pin_num, false);
+    error = led_devs[led_num]->led_dev_funcs.led_enable(led_devs[led_num]->pin_num, false);
     
     if (unlikely(ENONE != error))
     {
@@ -225,63 +720,356 @@ static void __exit led_driver_exit(void)
       // before getting to this point.
       pr_err("Failed trying to turn output pin for LED off! error: %d\n", error); 
     }
+  }
+
+  error = gpio_output_ctl_mask(0, gpio_led_off_mask);
+
+  if (unlikely(ENONE != error))
+  {
+    pr_err("Failed trying to turn output pins for LEDs off! error: %d\n", error); 
+  }
 
-    printk("Destroyed device with device id: %d\n", led_dev_array[led_num].c_dev.dev);
-    device_destroy(p_led_class, led_dev_array[led_num].c_dev.dev);
-    cdev_del(&(led_dev_array[led_num].c_dev));
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
+  {
+    printk("Destroyed device with device id: %d\n", led_devs[led_num]->c_dev.dev);
+    device_destroy(p_led_class, led_devs[led_num]->c_dev.dev);
+    cdev_del(&(led_devs[led_num]->c_dev));
+    led_dev_free(led_devs[led_num]);
+    led_devs[led_num] = NULL;
   }
 
   class_destroy(p_led_class);
   unregister_leds_cdev_region();
-  printk("LED driver exited\n");
+  kmem_cache_destroy(led_dev_cache);
+  led_dev_cnt = 0;
+
+  CUSTOM_PLATFORM_REMOVE_RETURN;
 }
 
 
 static inline void unregister_leds_cdev_region(void)
 {
-  unregister_chrdev_region(MKDEV(major_drv_num, first_minor_drv_num), MAX_LED_DEVICES);
+  unregister_chrdev_region(MKDEV(major_drv_num, first_minor_drv_num), led_dev_cnt + 1);
+}
+
+
+static inline led_state_t led_state_word_get_state(uint32_t state_word)
+{
+  return (led_state_t)((state_word & LED_STATE_MODE_MASK) >> LED_STATE_MODE_SHIFT);
+}
+
+
+static inline bool led_state_word_is_on(uint32_t state_word)
+{
+  return (0 != (state_word & LED_STATE_ON_FIELD));
+}
+
+
+static inline uint32_t led_state_word_get_gen(uint32_t state_word)
+{
+  return (state_word >> LED_STATE_GEN_SHIFT);
+}
+
+
+static inline uint32_t get_led_dev_index(led_dev_t *led_dev)
+{
+  return led_dev->index;
+}
+
+
+// Must be called after every change of an led's state word. Can be called from any context.
+static inline void led_notify_state_change(led_dev_t *led_dev)
+{
+  wake_up_interruptible(&(led_dev->state_waitq));
+}
+
+
+static inline led_dev_t * led_get_file_led_dev(struct file *p_file)
+{
+  return ((led_file_t *)(p_file->private_data))->led_dev;
+}
+
+// Frees an led from led_dev_cache along with its stats
+static inline void led_dev_free(led_dev_t *led_dev)
+{
+  free_percpu(led_dev->p_stats);
+  kmem_cache_free(led_dev_cache, led_dev);
 }
 
+static inline led_stats_err_t led_stats_err_index(int error)
+{
+  switch (error)
+  {
+    case -EUNSUPCMD:
+      return LED_STATS_ERR_UNSUPCMD;
+    case -EMSGSIZE:
+      return LED_STATS_ERR_MSGSIZE;
+    case -EDOM:
+      return LED_STATS_ERR_DOM;
+    case -EINVAL:
+      return LED_STATS_ERR_INVAL;
+    case -EFAULT:
+      return LED_STATS_ERR_FAULT;
+    default:
+      return LED_STATS_ERR_OTHER;
+  }
+}
 
-static inline led_state_t get_led_state_from_physical_state(led_dev_t *led_dev)
+static inline uint32_t led_stats_hist_bucket(u64 latency_ns)
 {
-  return (led_dev->is_led_on ? LED_ON : LED_OFF);
+  u64 latency_us = div_u64(latency_ns, NSEC_PER_USEC);
+
+  return min((uint32_t)(fls64(latency_us)), (uint32_t)(LED_STATS_HIST_BUCKET_CNT - 1));
 }
 
 
+// Leaves the led off if it was blinking. The blink timer finds out on its own that the led stopped blinking.
+//
+// Can be called from any context.
 static inline int clear_led_blinking(led_dev_t *led_dev)
 {
-  // If the led device is running the blink thread
-  // then request that thread to stop before trying to modify the led.
-  if (LED_BLINK == led_dev->led_state)
+  uint32_t state_word;
+
+  if (!led_state_transition(led_dev, LED_STATE_OP_STOP_BLINK, false, &state_word))
+  {
+    return ENONE;
+  }
+
+  return led_sync_output(led_dev, state_word);
+}
+
+
+// Works out the state word that op moves old_state_word to. is_blink_on is whether the output should be on
+// for the blink ops. Returns false if the op doesn't change the state.
+static bool led_state_calc_next(uint32_t old_state_word, led_state_op_t op, bool is_blink_on, uint32_t *p_new_state_word)
+{
+  led_state_t old_state = led_state_word_get_state(old_state_word);
+  bool old_is_on = led_state_word_is_on(old_state_word);
+  led_state_t new_state = old_state;
+  bool new_is_on = old_is_on;
+
+  switch (op)
+  {
+    case LED_STATE_OP_SET_OFF:
+      new_state = LED_OFF;
+      new_is_on = false;
+      break;
+
+    case LED_STATE_OP_SET_ON:
+      new_state = LED_ON;
+      new_is_on = true;
+      break;
+
+    case LED_STATE_OP_TOGGLE:
+      // Toggling stops the blinking, which leaves the led off, and then turns it on
+      new_is_on = (LED_BLINK == old_state) ? true : !old_is_on;
+      new_state = (new_is_on ? LED_ON : LED_OFF);
+      break;
+
+    case LED_STATE_OP_STOP_BLINK:
+      if (LED_BLINK != old_state)
+      {
+        return false;
+      }
+
+      new_state = LED_OFF;
+      new_is_on = false;
+      break;
+
+    case LED_STATE_OP_BLINK_TICK:
+      if (LED_BLINK != old_state)
+      {
+        return false;
+      }
+      fallthrough;
+
+    case LED_STATE_OP_BLINK:
+      new_state = LED_BLINK;
+      new_is_on = is_blink_on;
+      break;
+
+    default:
+      return false;
+  }
+
+  if ((new_state == old_state) && (new_is_on == old_is_on))
+  {
+    return false;
+  }
+
+  *p_new_state_word =   ((old_state_word & LED_STATE_GEN_MASK) + LED_STATE_GEN_INC)
+                      | ((uint32_t)(new_state) << LED_STATE_MODE_SHIFT)
+                      | (new_is_on ? LED_STATE_ON_FIELD : 0);
+
+  return true;
+}
+
+
+// Atomically applies op to the led's state word and wakes anyone waiting on a state change. This only changes the
+// state word, the caller has to call led_sync_output() (or write the output itself) afterwards.
+// Returns false if op didn't change anything, otherwise the new state word is put in *p_new_state_word.
+//
+// Can be called from any context.
+static bool led_state_transition(led_dev_t *led_dev, led_state_op_t op, bool is_blink_on, uint32_t *p_new_state_word)
+{
+  uint32_t old_state_word = (uint32_t)(atomic_read(&(led_dev->state_word)));
+  uint32_t new_state_word = 0;
+
+  for (;;)
   {
-    if (unlikely(NULL == led_dev->p_blink_thread))
+    if (!led_state_calc_next(old_state_word, op, is_blink_on, &new_state_word))
     {
-      pr_err("led_write() - LED device should never be in the blink state but not have a pointer to the blink thread!");
-      return -EINTERNAL;
+      return false;
     }
-    else
+
+    uint32_t prev_state_word = (uint32_t)(atomic_cmpxchg(&(led_dev->state_word), (int)(old_state_word), (int)(new_state_word)));
+
+    if (prev_state_word == old_state_word)
+    {
+      if (   (LED_BLINK == led_state_word_get_state(old_state_word))
+          && (LED_BLINK != led_state_word_get_state(new_state_word))
+         )
+      {
+        atomic64_inc(&(led_dev->blink_stop_cnt));
+      }
+
+      break;
+    }
+
+    // Someone else changed the state first, so redo the op on top of their state
+    old_state_word = prev_state_word;
+  }
+
+  led_notify_state_change(led_dev);
+
+  *p_new_state_word = new_state_word;
+
+  return true;
+}
+
+
+// Sets the led output to match state_word. Another writer can change the state word between our transition and our
+// output write, in which case our write could land after theirs and leave the output showing our older state. So after
+// writing the output the state word is checked again, and the output is rewritten until its on/off part didn't change
+// in between. The last writer to finish then always leaves the output matching the latest state.
+//
+// Ret values:  ENONE     - success
+//              other     - failure, error from turning the led on or off
+//
+// Can be called from any context.
+static int led_sync_output(led_dev_t *led_dev, uint32_t state_word)
+{
+  for (;;)
+  {
+    int error = led_dev->led_dev_funcs.led_enable(led_dev->pin_num, led_state_word_is_on(state_word));
+
+    if (unlikely(ENONE != error))
+    {
+      return error;
+    }
+
+    uint32_t cur_state_word = (uint32_t)(atomic_read(&(led_dev->state_word)));
+
+    if (led_state_word_is_on(cur_state_word) == led_state_word_is_on(state_word))
+    {
+      return ENONE;
+    }
+
+    state_word = cur_state_word;
+  }
+}
+
+
+// Uses the led_pins module parameter as the pin map, or else the led-pins property of the device tree node (p_node,
+// NULL without one), or else the default pins.
+//
+// Ret values:  ENONE     - success
+//              -EINVPIN  - failure, a pin is outside LED_MIN_PIN to LED_MAX_PIN or is used twice
+static int led_setup_pin_map(struct device_node const *p_node)
+{
+  if ((0 == led_pins_cnt) && (NULL != p_node))
+  {
+    int dt_pins_cnt = of_property_read_variable_u32_array(p_node, "led-pins", led_pins, 1, MAX_LED_DEVICES);
+
+    // A missing property just means the default pins
+    if (0 < dt_pins_cnt)
+    {
+      led_pins_cnt = dt_pins_cnt;
+    }
+  }
+
+  if (0 == led_pins_cnt)
+  {
+    for (uint32_t led_num = 0; led_num < LED_DEFAULT_DEVICE_CNT; led_num++)
+    {
+      led_pins[led_num] = FIRST_LED_PIN + led_num;
+    }
+
+    led_pins_cnt = LED_DEFAULT_DEVICE_CNT;
+  }
+
+  uint32_t used_pin_mask = 0;
+
+  for (uint32_t led_num = 0; led_num < led_pins_cnt; led_num++)
+  {
+    uint32_t pin_num = led_pins[led_num];
+
+    if ((LED_MIN_PIN > pin_num) || (LED_MAX_PIN < pin_num))
     {
-      kthread_stop(led_dev->p_blink_thread);   // Stop the LED flashing thread
+      pr_err("LED pin %u is invalid! Led pins must be between %d and %d\n", pin_num, LED_MIN_PIN, LED_MAX_PIN);
+      return -EINVPIN;
     }
+
+    if (0 != (used_pin_mask & (1U << pin_num)))
+    {
+      pr_err("LED pin %u is used more than once!\n", pin_num);
+      return -EINVPIN;
+    }
+
+    used_pin_mask |= (1U << pin_num);
   }
 
+  led_dev_cnt = led_pins_cnt;
+
   return ENONE;
 }
 
 
+// Checks if any of the first led_dev_cnt_to_check leds already use pwm_channel.
+static bool led_is_pwm_channel_used(pwm_channel_t pwm_channel, uint32_t led_dev_cnt_to_check)
+{
+  for (uint32_t led_num = 0; led_num < led_dev_cnt_to_check; led_num++)
+  {
+    if (pwm_channel == led_devs[led_num]->pwm_channel)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
 static int led_dev_init(led_dev_t *led_dev, uint32_t led_dev_index)
 {
   int error = ENONE;
 
   led_dev->p_device = NULL;
-  led_dev->pin_num = FIRST_LED_PIN + led_dev_index;
+  led_dev->index = led_dev_index;
+  led_dev->pin_num = led_pins[led_dev_index];
 
   // Try to set the led pin of the device driver to an output or pwm based on pin number and set it to be off initially
   // If the attempt failed, return the error
 
   led_dev->pwm_channel = gpio_is_pin_pwm(led_dev->pin_num);
 
+  // Two pins can share a pwm channel (e.g. 12 and 18), so only the first led on a channel gets to use it
+  if ((NOT_PWM != led_dev->pwm_channel) && led_is_pwm_channel_used(led_dev->pwm_channel, led_dev_index))
+  {
+    printk("LED on pin %u shares its pwm channel with an earlier led, so it will be a plain gpio led\n", led_dev->pin_num);
+    led_dev->pwm_channel = NOT_PWM;
+  }
+
   if (NOT_PWM == led_dev->pwm_channel)
   {
     error = gpio_set_pin_to_output(led_dev->pin_num, false);
@@ -289,7 +1077,9 @@ static int led_dev_init(led_dev_t *led_dev, uint32_t led_dev_index)
   }
   else
   {
-    error = pwm_init_user_device(led_dev->pwm_channel, 100, PWM_FREQ_4_kHZ, false);
+    uint32_t pwm_mode_flags = (pwm_mark_space ? PWM_MODE_MARK_SPACE : PWM_MODE_BALANCED) | (pwm_inverted ? PWM_MODE_INVERTED : 0);
+
+    error = pwm_init_user_device(led_dev->pwm_channel, 100, pwm_freq_hz, pwm_mode_flags, false);
     
     if (unlikely(ENONE != error))
     {
@@ -305,11 +1095,9 @@ static int led_dev_init(led_dev_t *led_dev, uint32_t led_dev_index)
     return error;
   }
 
-  led_dev->led_state = LED_OFF;
-  led_dev->is_led_on = false;
-
-  // Note there is no need to clear the msg_buffer since different
-  // message lengths will be in it anyway.
+  atomic_set(&(led_dev->state_word), (int)((uint32_t)(LED_OFF) << LED_STATE_MODE_SHIFT));
+  led_dev->brightness = LED_IOC_BRIGHTNESS_MAX;
+  init_waitqueue_head(&(led_dev->state_waitq));
 
   // Setup the cdev
   int dev_id = MKDEV(major_drv_num, first_minor_drv_num + led_dev_index);
@@ -348,285 +1136,1775 @@ static int led_dev_init(led_dev_t *led_dev, uint32_t led_dev_index)
 }
 
 
-static int led_dev_uevent(struct device *dev, struct kobj_uevent_env *env)
+// The bank device takes the minor right after the last led device.
+//
+// Ret values:  ENONE     - success
+//              other     - failure, error from adding or creating the device
+static int led_bank_dev_init(void)
 {
-  // Look at linux/drivers/base/core.c for an example of add_uevent_var
-  add_uevent_var(env, "DEVMODE=%#o", 0666);
-  return ENONE;
-}
+  dev_t dev_id = MKDEV(major_drv_num, first_minor_drv_num + led_dev_cnt);
 
-static int led_open(struct inode *p_inode, struct file *p_file)
-{
-  pr_info("Open was successful\n");
+  led_shm_page = (led_shm_page_t *)(get_zeroed_page(GFP_KERNEL));
 
-  led_dev_t *led_dev = container_of(p_inode->i_cdev, led_dev_t, c_dev);
-  p_file->private_data = led_dev;
+  if (NULL == led_shm_page)
+  {
+    pr_err("Couldn't allocate the LED bank shared control page!\n");
+    return -ENOMEM;
+  }
+
+  // Mapped to userspace with remap_pfn_range(), which needs the page to be reserved
+  SetPageReserved(virt_to_page(led_shm_page));
+
+  hrtimer_init(&led_shm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+  led_shm_timer.function = led_shm_timer_callback;
+
+  cdev_init(&led_bank_cdev, &led_bank_fops);
+  led_bank_cdev.owner = THIS_MODULE;
+
+  int error = cdev_add(&led_bank_cdev, dev_id, 1);
+
+  if (ENONE != error)
+  {
+    pr_err("Adding LED bank cdev failed! error: %d\n", error);
+    goto free_shm_page;
+  }
+
+  printk("Creating device with name: %s\n", LED_BANK_DEVICE_NAME);
+
+  p_led_bank_device = device_create(p_led_class, NULL, dev_id, NULL, LED_BANK_DEVICE_NAME);
+
+  if (IS_ERR(p_led_bank_device))
+  {
+    error = PTR_ERR(p_led_bank_device);
+    pr_err("Creating LED bank device failed! error: %d\n", error);
+    p_led_bank_device = NULL;
+    cdev_del(&led_bank_cdev);
+    goto free_shm_page;
+  }
+
+  return ENONE;
+
+free_shm_page:
+  ClearPageReserved(virt_to_page(led_shm_page));
+  free_page((unsigned long)(led_shm_page));
+  led_shm_page = NULL;
+
+  return error;
+}
+
+static void led_bank_dev_destroy(void)
+{
+  if (NULL != p_led_bank_device)
+  {
+    device_destroy(p_led_class, led_bank_cdev.dev);
+    p_led_bank_device = NULL;
+  }
+
+  cdev_del(&led_bank_cdev);
+
+  // Open mappings hold a reference to the module, so the page can't be mapped anymore here
+  hrtimer_cancel(&led_shm_timer);
+
+  if (NULL != led_shm_page)
+  {
+    ClearPageReserved(virt_to_page(led_shm_page));
+    free_page((unsigned long)(led_shm_page));
+    led_shm_page = NULL;
+  }
+}
+
+static int led_dev_uevent(struct device *dev, struct kobj_uevent_env *env)
+{
+  // Look at linux/drivers/base/core.c for an example of add_uevent_var
+  add_uevent_var(env, "DEVMODE=%#o", 0666);
+  return ENONE;
+}
+
+static int led_open(struct inode *p_inode, struct file *p_file)
+{
+  led_dev_t *led_dev = container_of(p_inode->i_cdev, led_dev_t, c_dev);
+  led_file_t *led_file = kmalloc(sizeof(*led_file), GFP_KERNEL);
+
+  if (NULL == led_file)
+  {
+    return -ENOMEM;
+  }
+
+  led_file->led_dev = led_dev;
+
+  // A new open hasn't seen any state yet, so it can be polled for the current state right away
+  led_file->seen_state_gen = led_state_word_get_gen((uint32_t)(atomic_read(&(led_dev->state_word)))) - 1;
+
+  custom_trace("led_open() - opened LED on pin %u\n", led_dev->pin_num);
+
+  p_file->private_data = led_file;
+	return ENONE;
+}
+
+static int led_release(struct inode * p_inode, struct file *p_file)
+{
+  custom_trace("led_release() - released LED on pin %u\n", led_get_file_led_dev(p_file)->pin_num);
+  kfree(p_file->private_data);
 	return ENONE;
 }
 
-static int led_release(struct inode * p_inode, struct file *p_file)
-{
-  pr_info("Release was successful\n");
-	return ENONE;
+// Reads the current led state as one line: "off", "on", "blink on" or "blink off" (blink then says where the led is in the blink).
+// The whole line is read from offset 0. To read it again after a state change (see led_poll()) seek back to 0 or use pread().
+static ssize_t led_read(struct file *p_file, char *user_buffer, size_t len, loff_t *p_offset)
+{
+  led_file_t *led_file = p_file->private_data;
+  led_dev_t *led_dev = led_file->led_dev;
+  char msg_buffer[LED_READ_MSG_MAX_SIZE];
+
+  // The state and its generation come from the same state word, so the state read always matches the generation seen
+  uint32_t state_word = (uint32_t)(atomic_read(&(led_dev->state_word)));
+  bool is_led_on = led_state_word_is_on(state_word);
+
+  int msg_len = 0;
+
+  switch (led_state_word_get_state(state_word))
+  {
+    case LED_BLINK:
+      msg_len = snprintf(msg_buffer, sizeof(msg_buffer), "blink %s\n", (is_led_on ? "on" : "off"));
+      break;
+
+    default:
+      msg_len = snprintf(msg_buffer, sizeof(msg_buffer), "%s\n", (is_led_on ? "on" : "off"));
+      break;
+  }
+
+  if (0 == *p_offset)
+  {
+    WRITE_ONCE(led_file->seen_state_gen, led_state_word_get_gen(state_word));
+  }
+
+  return simple_read_from_buffer(user_buffer, len, p_offset, msg_buffer, msg_len);
+}
+
+// Readable (EPOLLIN) once the led state changed since this file last read it, including changes made by
+// the blink timer, the bank device and other opens of the led. Always writable.
+static __poll_t led_poll(struct file *p_file, struct poll_table_struct *p_poll_table)
+{
+  led_file_t *led_file = p_file->private_data;
+  led_dev_t *led_dev = led_file->led_dev;
+  __poll_t poll_mask = EPOLLOUT | EPOLLWRNORM;
+
+  poll_wait(p_file, &(led_dev->state_waitq), p_poll_table);
+
+  if (READ_ONCE(led_file->seen_state_gen) != led_state_word_get_gen((uint32_t)(atomic_read(&(led_dev->state_word)))))
+  {
+    poll_mask |= EPOLLIN | EPOLLRDNORM;
+  }
+
+  return poll_mask;
+}
+
+
+// Data written can be raw characters (i.e. char arrays without the NUL terminator) or strings (i.e. char arrays with the NUL terminator)
+// and can hold several commands, one per line (e.g. echo -e "br 20\non" > your_device_path). Empty lines are skipped, so the
+// newline that "echo" appends without "-n" is fine.
+//
+// Every command in the write is parsed before any of it is applied, so a bad command anywhere fails the whole write and
+// leaves the led untouched. The commands are then folded down to the brightness and on/off/blink state they add up to
+// (e.g. "on\ntoggle\ntoggle" is just "on") and applied as one update to the gpio/pwm layer.
+static ssize_t led_write(struct file *p_file, const char *user_buffer, size_t len, loff_t *p_offset)
+{
+  led_dev_t *led_dev = led_get_file_led_dev(p_file);
+  u64 start_ns = ktime_get_ns();
+  uint32_t cmd_cnts[LED_CMD_TYPE_CNT] = { 0 };
+
+  // First check that the message isn't too large
+  if (LED_WRITE_MAX_SIZE < len)
+  {
+    printk(KERN_ERR "led_write() - Length to write is too long! Max msg size: %lu", LED_WRITE_MAX_SIZE);
+    led_stats_record(led_dev, LED_STATS_PATH_WRITE, cmd_cnts, -EMSGSIZE, start_ns);
+    return -EMSGSIZE;
+  }
+  // Nothing to write, so say nothing was written
+  else if (0 >= len)
+  {
+    return 0;
+  }
+
+  // Adds a '\0' after the data, so the commands in it can be used as strings
+  char *msg_buffer = memdup_user_nul(user_buffer, len);
+
+  if (IS_ERR(msg_buffer))
+  {
+    printk(KERN_ERR "led_write() - Failed to get user_buffer data! error: %ld", PTR_ERR(msg_buffer));
+    led_stats_record(led_dev, LED_STATS_PATH_WRITE, cmd_cnts, (int)(PTR_ERR(msg_buffer)), start_ns);
+    return PTR_ERR(msg_buffer);
+  }
+
+  int error = ENONE;
+  led_batch_t batch = { .state_cmd = LED_CMD_NONE, .brightness_cmd = { .cmd_type = LED_CMD_NONE } };
+  char *p_next_cmd = msg_buffer;
+  char *p_cmd_str = NULL;
+
+  // A '\0' from the user ends the data just like the end of the buffer does
+  while ((NULL != (p_cmd_str = strsep(&p_next_cmd, "\n"))) && (ENONE == error))
+  {
+    led_cmd_t cmd;
+    size_t cmd_len = strlen(p_cmd_str);
+
+    if ((0 < cmd_len) && ('\r' == p_cmd_str[cmd_len - 1]))
+    {
+      p_cmd_str[--cmd_len] = '\0';
+    }
+
+    if (0 == cmd_len)
+    {
+      continue;
+    }
+
+    error = led_parse_cmd(p_cmd_str, cmd_len, &cmd);
+
+    if (ENONE == error)
+    {
+      led_batch_add_cmd(&batch, &cmd);
+      cmd_cnts[cmd.cmd_type]++;
+    }
+    else
+    {
+      pr_err("led_write() - invalid command \"%s\"! error: %d\n", p_cmd_str, error);
+    }
+  }
+
+  kfree(msg_buffer);
+
+  if (ENONE == error)
+  {
+    error = led_submit_batch(led_dev, &batch);
+  }
+
+  // Only the commands of a batch that was applied count
+  if (ENONE != error)
+  {
+    memset(cmd_cnts, 0, sizeof(cmd_cnts));
+  }
+
+  led_stats_record(led_dev, LED_STATS_PATH_WRITE, cmd_cnts, error, start_ns);
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  // Note if you return 0 it indicates nothing was written.
+  // The standard c library will try rewriting.
+  // So if we try to write to this device from a terminal
+  // it basically creates an infinite loop of the terminal
+  // trying to write, getting a 0 back, and trying again.
+  // Essentially impossible to uninstall the driver then since it
+  // is almost always processing the write command.
+
+  return len;
+}
+
+// Parses a single command, cmd_str must be a string of cmd_len characters.
+//
+// Ret values:  ENONE       - success
+//              -EUNSUPCMD  - failure, unknown command
+//              -EDOM       - failure, brightness isn't between 0 and 100 or the fade is too long
+//              -EINVAL     - failure, wrong number of fade arguments or unknown fade curve
+//              other       - failure, an argument isn't a number
+static int led_parse_cmd(char *cmd_str, size_t cmd_len, led_cmd_t *p_cmd)
+{
+  static led_cmd_type_t const word_cmd_types[] = { LED_CMD_OFF, LED_CMD_ON, LED_CMD_TOGGLE, LED_CMD_BLINK };
+
+  p_cmd->cmd_type = LED_CMD_NONE;
+  p_cmd->brightness = 0;
+  p_cmd->fade_duration_ms = 0;
+  p_cmd->fade_curve = LED_FADE_CURVE_LINEAR;
+
+  for (uint32_t i = 0; i < ARRAY_SIZE(word_cmd_types); i++)
+  {
+    if (   (0 == strcasecmp(led_write_word_cmds[i], cmd_str))
+        || (0 == strcmp(led_write_num_cmds[i], cmd_str))
+       )
+    {
+      p_cmd->cmd_type = word_cmd_types[i];
+      return ENONE;
+    }
+  }
+
+  // BR (brightness command), the duty cycle percent follows the "BR " or "4 "
+  size_t arg_start_index = led_match_arg_cmd(cmd_str, cmd_len, LED_WRITE_BR_CMD_INDEX);
+
+  if (0 != arg_start_index)
+  {
+    int error = led_parse_percent(&(cmd_str[arg_start_index]), &(p_cmd->brightness));
+
+    if (ENONE != error)
+    {
+      return error;
+    }
+
+    p_cmd->cmd_type = LED_CMD_BRIGHTNESS;
+    return ENONE;
+  }
+
+  // FADE, the target percent, duration in ms and optional curve follow the "FADE " or "5 "
+  arg_start_index = led_match_arg_cmd(cmd_str, cmd_len, LED_WRITE_FADE_CMD_INDEX);
+
+  if (0 != arg_start_index)
+  {
+    return led_parse_fade_args(&(cmd_str[arg_start_index]), p_cmd);
+  }
+
+  return -EUNSUPCMD;
+}
+
+// Ret values:  The index the arguments start at if cmd_str is the command at cmd_index of the write commands
+//              followed by arguments, 0 if it isn't.
+static size_t led_match_arg_cmd(char const *cmd_str, size_t cmd_len, uint32_t cmd_index)
+{
+  size_t word_cmd_len = strlen(led_write_word_cmds[cmd_index]);
+  size_t num_cmd_len = strlen(led_write_num_cmds[cmd_index]);
+
+  if ((word_cmd_len < cmd_len) && (0 == strncasecmp(led_write_word_cmds[cmd_index], cmd_str, word_cmd_len)))
+  {
+    return word_cmd_len;
+  }
+  
+  if ((num_cmd_len < cmd_len) && (0 == strncmp(led_write_num_cmds[cmd_index], cmd_str, num_cmd_len)))
+  {
+    return num_cmd_len;
+  }
+
+  return 0;
+}
+
+// Converts a duty cycle percent (0 to 100) to a brightness.
+//
+// Ret values:  ENONE     - success
+//              -EDOM     - failure, the percent isn't between 0 and 100
+//              other     - failure, the percent isn't a number
+static int led_parse_percent(char const *percent_str, uint32_t *p_brightness)
+{
+  long long duty_cycle = 0;
+
+  int error = kstrtoll(percent_str, 0, &duty_cycle);
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  if (0 > duty_cycle)
+  {
+    pr_err("User written duty cycle cannot be negative. User wrote: %lld!\n", duty_cycle);
+    return -EDOM;
+  }
+  else if (100 < duty_cycle)
+  {
+    pr_err("User written duty cycle can not be above 100. User wrote: %lld!\n", duty_cycle);
+    return -EDOM;
+  }
+
+  *p_brightness = DIV_ROUND_CLOSEST((uint32_t)(duty_cycle) * LED_IOC_BRIGHTNESS_MAX, 100);
+
+  return ENONE;
+}
+
+// Parses the space separated "<percent> <duration ms> [curve]" arguments of a fade command,
+// where curve is one of led_fade_curve_names (case-insensitive) and defaults to linear.
+//
+// Ret values:  ENONE     - success
+//              -EINVAL   - failure, wrong number of arguments or unknown curve
+//              -EDOM     - failure, the percent isn't between 0 and 100 or the duration is above LED_FADE_MAX_DURATION_MS
+//              other     - failure, an argument isn't a number
+static int led_parse_fade_args(char *args_str, led_cmd_t *p_cmd)
+{
+  char *p_args[3] = { NULL, NULL, NULL };
+  uint32_t arg_cnt = 0;
+  char *p_arg = NULL;
+
+  while (NULL != (p_arg = strsep(&args_str, " ")))
+  {
+    // Repeated spaces
+    if ('\0' == *p_arg)
+    {
+      continue;
+    }
+
+    if (ARRAY_SIZE(p_args) == arg_cnt)
+    {
+      return -EINVAL;
+    }
+
+    p_args[arg_cnt++] = p_arg;
+  }
+
+  if (2 > arg_cnt)
+  {
+    return -EINVAL;
+  }
+
+  int error = led_parse_percent(p_args[0], &(p_cmd->brightness));
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  error = kstrtouint(p_args[1], 0, &(p_cmd->fade_duration_ms));
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  if (LED_FADE_MAX_DURATION_MS < p_cmd->fade_duration_ms)
+  {
+    pr_err("User written fade duration can not be above %u ms. User wrote: %u!\n", LED_FADE_MAX_DURATION_MS, p_cmd->fade_duration_ms);
+    return -EDOM;
+  }
+
+  if (NULL != p_args[2])
+  {
+    uint32_t curve = 0;
+
+    while ((curve < ARRAY_SIZE(led_fade_curve_names)) && (0 != strcasecmp(led_fade_curve_names[curve], p_args[2])))
+    {
+      curve++;
+    }
+
+    if (ARRAY_SIZE(led_fade_curve_names) == curve)
+    {
+      return -EINVAL;
+    }
+
+    p_cmd->fade_curve = curve;
+  }
+
+  p_cmd->cmd_type = LED_CMD_FADE;
+  return ENONE;
+}
+
+static void led_batch_add_cmd(led_batch_t *p_batch, led_cmd_t const *p_cmd)
+{
+  switch (p_cmd->cmd_type)
+  {
+    case LED_CMD_OFF:
+    case LED_CMD_ON:
+    case LED_CMD_BLINK:
+      // These set the state outright, so whatever came before them doesn't matter
+      p_batch->state_cmd = p_cmd->cmd_type;
+      break;
+
+    case LED_CMD_TOGGLE:
+      switch (p_batch->state_cmd)
+      {
+        case LED_CMD_OFF:
+          p_batch->state_cmd = LED_CMD_ON;
+          break;
+
+        case LED_CMD_ON:
+          p_batch->state_cmd = LED_CMD_OFF;
+          break;
+
+        case LED_CMD_BLINK:
+          // Toggling stops the blinking, which leaves the led off, and then turns it on
+          p_batch->state_cmd = LED_CMD_ON;
+          break;
+
+        case LED_CMD_TOGGLE:
+          // Two toggles cancel out
+          p_batch->state_cmd = LED_CMD_NONE;
+          break;
+
+        default:
+          p_batch->state_cmd = LED_CMD_TOGGLE;
+          break;
+      }
+      break;
+
+    case LED_CMD_BRIGHTNESS:
+    case LED_CMD_FADE:
+      // A brightness or fade replaces any earlier one
+      p_batch->brightness_cmd = *p_cmd;
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Adds a batch that came after p_batch to it, with the same folding as adding its commands one at a time
+static void led_batch_merge(led_batch_t *p_batch, led_batch_t const *p_later_batch)
+{
+  if (LED_CMD_NONE != p_later_batch->brightness_cmd.cmd_type)
+  {
+    led_batch_add_cmd(p_batch, &(p_later_batch->brightness_cmd));
+  }
+
+  if (LED_CMD_NONE != p_later_batch->state_cmd)
+  {
+    led_cmd_t state_cmd = { .cmd_type = p_later_batch->state_cmd };
+
+    led_batch_add_cmd(p_batch, &state_cmd);
+  }
+}
+
+// Checks the arguments of a command up front, so a command that is only applied later by the coalesce timer
+// fails its own ioctl the same way it would if it was applied right away.
+//
+// Ret values:  ENONE     - success
+//              -EDOM     - failure, brightness above LED_IOC_BRIGHTNESS_MAX or fade above LED_FADE_MAX_DURATION_MS
+//              -EINVAL   - failure, unknown fade curve
+static int led_cmd_check(led_cmd_t const *p_cmd)
+{
+  if ((LED_CMD_BRIGHTNESS != p_cmd->cmd_type) && (LED_CMD_FADE != p_cmd->cmd_type))
+  {
+    return ENONE;
+  }
+
+  if (LED_IOC_BRIGHTNESS_MAX < p_cmd->brightness)
+  {
+    return -EDOM;
+  }
+
+  if (LED_CMD_FADE != p_cmd->cmd_type)
+  {
+    return ENONE;
+  }
+
+  if (LED_FADE_MAX_DURATION_MS < p_cmd->fade_duration_ms)
+  {
+    return -EDOM;
+  }
+
+  return (LED_FADE_CURVE_CNT <= p_cmd->fade_curve) ? -EINVAL : ENONE;
+}
+
+// Ret values:  same as led_cmd_check() and led_submit_batch()
+static int led_submit_cmd(led_dev_t *led_dev, led_cmd_t const *p_cmd)
+{
+  led_batch_t batch = { .state_cmd = LED_CMD_NONE, .brightness_cmd = { .cmd_type = LED_CMD_NONE } };
+  int error = led_cmd_check(p_cmd);
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  led_batch_add_cmd(&batch, p_cmd);
+
+  return led_submit_batch(led_dev, &batch);
+}
+
+// Applies the batch, unless the led was updated less than coalesce_us ago. The batch is then merged into the led's
+// pending update and the coalesce timer applies whatever it all adds up to at the end of the window, so a burst of
+// updates (e.g. a control loop sending the same brightness over and over) costs one update per window.
+// The batch must already be checked, since errors from applying a pending update can't be returned to anyone.
+//
+// Ret values:  ENONE     - success, the batch was applied or is pending
+//              other     - failure, error from led_batch_apply()
+static int led_submit_batch(led_dev_t *led_dev, led_batch_t const *p_batch)
+{
+  ktime_t window = us_to_ktime(min(READ_ONCE(coalesce_us), (unsigned int)(USEC_PER_SEC)));
+  uint32_t led_bit = (1U << get_led_dev_index(led_dev));
+
+  if (0 == window)
+  {
+    // coalesce_us can be set to 0 while an update is still pending, which has to go out before this one
+    led_coalesce_flush_mask(led_bit);
+    return led_batch_apply(led_dev, p_batch);
+  }
+
+  ktime_t now = ktime_get();
+  unsigned long irq_flags;
+  int error = ENONE;
+
+  spin_lock_irqsave(&led_coalesce_lock, irq_flags);
+
+  if (0 != (led_coalesce_mask & led_bit))
+  {
+    led_batch_merge(&(led_dev->coalesce_batch), p_batch);
+    atomic64_inc(&(led_dev->coalesced_cnt));
+  }
+  else if (ktime_before(now, led_dev->coalesce_until))
+  {
+    led_dev->coalesce_batch = *p_batch;
+
+    // The timer only runs while some led has a pending update
+    if (0 == led_coalesce_mask)
+    {
+      hrtimer_start(&led_coalesce_timer, ktime_sub(led_dev->coalesce_until, now), HRTIMER_MODE_REL_SOFT);
+    }
+
+    led_coalesce_mask |= led_bit;
+  }
+  else
+  {
+    // Applied under the lock, so the timer can never apply a later pending update before this one is out
+    error = led_batch_apply(led_dev, p_batch);
+    led_dev->coalesce_until = ktime_add(now, window);
+  }
+
+  spin_unlock_irqrestore(&led_coalesce_lock, irq_flags);
+
+  return error;
+}
+
+// Applies the pending updates of the leds in led_mask right away, for paths that change leds without going through
+// led_submit_batch() (blink ioctls, bank frames and the shared control page), so those changes aren't undone by an
+// older pending update afterwards.
+//
+// Can be called from any context.
+static void led_coalesce_flush_mask(uint32_t led_mask)
+{
+  if (0 == (READ_ONCE(led_coalesce_mask) & led_mask))
+  {
+    return;
+  }
+
+  unsigned long irq_flags;
+
+  spin_lock_irqsave(&led_coalesce_lock, irq_flags);
+
+  for (uint32_t led_num = 0; (0 != (led_coalesce_mask & led_mask)) && (led_num < led_dev_cnt); led_num++)
+  {
+    uint32_t led_bit = (1U << led_num);
+
+    if (0 == (led_coalesce_mask & led_mask & led_bit))
+    {
+      continue;
+    }
+
+    led_coalesce_mask &= ~led_bit;
+
+    if (unlikely(ENONE != led_batch_apply(led_devs[led_num], &(led_devs[led_num]->coalesce_batch))))
+    {
+      atomic64_inc(&(led_devs[led_num]->coalesce_err_cnt));
+    }
+  }
+
+  spin_unlock_irqrestore(&led_coalesce_lock, irq_flags);
+}
+
+// Runs in softirq context at the end of a coalesce window and applies every pending update. Each led then starts a new
+// window, so an led that keeps getting updates keeps having them merged.
+static enum hrtimer_restart led_coalesce_timer_callback(struct hrtimer *p_timer)
+{
+  ktime_t window = us_to_ktime(min(READ_ONCE(coalesce_us), (unsigned int)(USEC_PER_SEC)));
+  ktime_t now = ktime_get();
+  unsigned long irq_flags;
+
+  spin_lock_irqsave(&led_coalesce_lock, irq_flags);
+
+  for (uint32_t led_num = 0; (0 != led_coalesce_mask) && (led_num < led_dev_cnt); led_num++)
+  {
+    led_dev_t *led_dev = led_devs[led_num];
+    uint32_t led_bit = (1U << led_num);
+
+    if (0 == (led_coalesce_mask & led_bit))
+    {
+      continue;
+    }
+
+    led_coalesce_mask &= ~led_bit;
+    led_dev->coalesce_until = ktime_add(now, window);
+
+    int error = led_batch_apply(led_dev, &(led_dev->coalesce_batch));
+
+    if (unlikely(ENONE != error))
+    {
+      pr_err("LED coalesce timer failed to update the led on pin %u! error: %d\n", led_dev->pin_num, error);
+      atomic64_inc(&(led_dev->coalesce_err_cnt));
+    }
+  }
+
+  spin_unlock_irqrestore(&led_coalesce_lock, irq_flags);
+
+  return HRTIMER_NORESTART;
+}
+
+// The brightness is set (or its fade started) before the state, so an led turned on by the batch comes on at the new brightness.
+//
+// Ret values:  ENONE     - success
+//              other     - failure, error from the led_cmd_* functions
+static int led_batch_apply(led_dev_t *led_dev, led_batch_t const *p_batch)
+{
+  led_cmd_t const *p_brightness_cmd = &(p_batch->brightness_cmd);
+  int error = ENONE;
+
+  if (LED_CMD_BRIGHTNESS == p_brightness_cmd->cmd_type)
+  {
+    error = led_cmd_set_brightness(led_dev, p_brightness_cmd->brightness);
+  }
+  else if (LED_CMD_FADE == p_brightness_cmd->cmd_type)
+  {
+    error = led_cmd_fade(led_dev, p_brightness_cmd->brightness, p_brightness_cmd->fade_duration_ms, p_brightness_cmd->fade_curve);
+  }
+
+  if (unlikely(ENONE != error))
+  {
+    return error;
+  }
+
+  switch (p_batch->state_cmd)
+  {
+    case LED_CMD_OFF:
+      error = led_cmd_set_on(led_dev, false);
+      break;
+
+    case LED_CMD_ON:
+      error = led_cmd_set_on(led_dev, true);
+      break;
+
+    case LED_CMD_TOGGLE:
+      error = led_cmd_toggle(led_dev);
+      break;
+
+    case LED_CMD_BLINK:
+      error = led_cmd_blink(led_dev, ms_to_ktime(blink_on_ms), ms_to_ktime(blink_off_ms),
+                            ms_to_ktime((u64)get_led_dev_index(led_dev) * blink_phase_step_ms));
+
+      if (ENONE != error)
+      {
+        pr_err("led_write() - failed to start blinking the led! error: %d\n", error);
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  return error;
+}
+
+// Binary version of the write commands, with the commands and their argument structs in custom-led-ioctl.h.
+// There is no string parsing, so this is the interface to use when sending lots of commands.
+//
+// Ret values:  ENONE       - success
+//              -EFAULT     - failure, couldn't copy the argument struct from userspace
+//              -EUNSUPCMD  - failure, unknown command
+//              -EDOM       - failure, brightness above LED_IOC_BRIGHTNESS_MAX or fade above LED_FADE_MAX_DURATION_MS
+//              -EINVAL     - failure, unknown fade curve
+//              other       - failure, error from the command
+static long led_ioctl(struct file *p_file, unsigned int cmd, unsigned long arg)
+{
+  led_dev_t *led_dev = led_get_file_led_dev(p_file);
+  u64 start_ns = ktime_get_ns();
+  uint32_t cmd_cnts[LED_CMD_TYPE_CNT] = { 0 };
+  led_cmd_type_t cmd_type = LED_CMD_NONE;
+
+  long error = led_ioctl_run(led_dev, cmd, (void __user *)(arg), &cmd_type);
+
+  if (ENONE == error)
+  {
+    cmd_cnts[cmd_type]++;
+  }
+
+  led_stats_record(led_dev, LED_STATS_PATH_IOCTL, cmd_cnts, (int)(error), start_ns);
+
+  return error;
+}
+
+// Runs an ioctl command for led_ioctl() and sets *p_cmd_type to the command it is.
+//
+// Ret values:  same as led_ioctl()
+static long led_ioctl_run(led_dev_t *led_dev, unsigned int cmd, void __user *p_user_arg, led_cmd_type_t *p_cmd_type)
+{
+  switch (cmd)
+  {
+    case LED_IOC_OFF:
+    case LED_IOC_ON:
+    case LED_IOC_TOGGLE:
+    {
+      led_cmd_t state_cmd = { .cmd_type = (LED_IOC_OFF == cmd) ? LED_CMD_OFF : ((LED_IOC_ON == cmd) ? LED_CMD_ON : LED_CMD_TOGGLE) };
+
+      *p_cmd_type = state_cmd.cmd_type;
+      return led_submit_cmd(led_dev, &state_cmd);
+    }
+
+    case LED_IOC_BLINK:
+    {
+      led_ioc_blink_t blink_args;
+
+      *p_cmd_type = LED_CMD_BLINK;
+
+      if (copy_from_user(&blink_args, p_user_arg, sizeof(blink_args)))
+      {
+        return -EFAULT;
+      }
+
+      // Its periods don't fit in a batch, so it is applied right away after anything still pending
+      led_coalesce_flush_mask(1U << get_led_dev_index(led_dev));
+
+      return led_cmd_blink(led_dev, us_to_ktime(blink_args.on_period_us), us_to_ktime(blink_args.off_period_us),
+                           us_to_ktime(blink_args.phase_offset_us));
+    }
+
+    case LED_IOC_SET_BRIGHTNESS:
+    {
+      led_ioc_brightness_t brightness_args;
+
+      *p_cmd_type = LED_CMD_BRIGHTNESS;
+
+      if (copy_from_user(&brightness_args, p_user_arg, sizeof(brightness_args)))
+      {
+        return -EFAULT;
+      }
+
+      led_cmd_t brightness_cmd = { .cmd_type = LED_CMD_BRIGHTNESS, .brightness = brightness_args.brightness };
+
+      return led_submit_cmd(led_dev, &brightness_cmd);
+    }
+
+    case LED_IOC_FADE:
+    {
+      led_ioc_fade_t fade_args;
+
+      *p_cmd_type = LED_CMD_FADE;
+
+      if (copy_from_user(&fade_args, p_user_arg, sizeof(fade_args)))
+      {
+        return -EFAULT;
+      }
+
+      led_cmd_t fade_cmd =
+      {
+        .cmd_type = LED_CMD_FADE,
+        .brightness = fade_args.target_brightness,
+        .fade_duration_ms = fade_args.duration_ms,
+        .fade_curve = fade_args.curve
+      };
+
+      return led_submit_cmd(led_dev, &fade_cmd);
+    }
+
+    default:
+      return -EUNSUPCMD;
+  }
+}
+
+// The led_cmd_* functions run a single command on an led for both the write and the ioctl interfaces.
+// A blinking led stops blinking.
+//
+// Ret values:  ENONE     - success
+//              other     - failure, error from turning the led on or off
+static int led_cmd_set_on(led_dev_t *led_dev, bool do_turn_on)
+{
+  uint32_t state_word;
+
+  // Already in that state, so there is nothing to write
+  if (!led_state_transition(led_dev, (do_turn_on ? LED_STATE_OP_SET_ON : LED_STATE_OP_SET_OFF), false, &state_word))
+  {
+    atomic64_inc(&(led_dev->skipped_cnt));
+    return ENONE;
+  }
+
+  return led_sync_output(led_dev, state_word);
+}
+
+// Ret values:  same as led_cmd_set_on()
+static int led_cmd_toggle(led_dev_t *led_dev)
+{
+  uint32_t state_word;
+
+  // The cmpxchg makes sure concurrent toggles are never lost
+  if (!led_state_transition(led_dev, LED_STATE_OP_TOGGLE, false, &state_word))
+  {
+    return ENONE;
+  }
+
+  return led_sync_output(led_dev, state_word);
+}
+
+// Ret values:  same as led_start_blinking()
+static int led_cmd_blink(led_dev_t *led_dev, ktime_t on_period, ktime_t off_period, ktime_t phase_offset)
+{
+  return led_start_blinking(led_dev, on_period, off_period, phase_offset);
+}
+
+// brightness is 0 (off) to LED_IOC_BRIGHTNESS_MAX (fully on). It doesn't change whether the led is on or off.
+// A fading led stops fading. Nothing is written if the led isn't fading and is already at brightness.
+//
+// Ret values:  ENONE       - success
+//              -EDOM       - failure, brightness above LED_IOC_BRIGHTNESS_MAX
+//              other       - failure, error from the pwm or gpio driver
+static int led_cmd_set_brightness(led_dev_t *led_dev, uint32_t brightness)
+{
+  if (LED_IOC_BRIGHTNESS_MAX < brightness)
+  {
+    return -EDOM;
+  }
+
+  unsigned long irq_flags;
+
+  uint32_t led_bit = (1U << get_led_dev_index(led_dev));
+  int error = ENONE;
+
+  spin_lock_irqsave(&led_fade_lock, irq_flags);
+
+  if ((0 == (led_fade_mask & led_bit)) && (brightness == led_dev->brightness))
+  {
+    spin_unlock_irqrestore(&led_fade_lock, irq_flags);
+
+    atomic64_inc(&(led_dev->skipped_cnt));
+    return ENONE;
+  }
+
+  led_fade_mask &= ~led_bit;
+  error = led_apply_brightness(led_dev, brightness);
+
+  // Only cached once it is out, so a failed brightness isn't skipped the next time it is asked for
+  if (likely(ENONE == error))
+  {
+    led_dev->brightness = brightness;
+  }
+
+  spin_unlock_irqrestore(&led_fade_lock, irq_flags);
+
+  return error;
+}
+
+// Fades the brightness from where it is now to target_brightness over duration_ms along curve (LED_FADE_CURVE_*).
+// The fade timer does the whole fade, so this returns right away. It doesn't change whether the led is on or off,
+// and a fade started on a fading led starts from wherever the old fade got to.
+//
+// Ret values:  ENONE       - success
+//              -EDOM       - failure, target_brightness above LED_IOC_BRIGHTNESS_MAX or duration_ms above LED_FADE_MAX_DURATION_MS
+//              -EINVAL     - failure, unknown curve
+//              other       - failure, error from the pwm or gpio driver (for a duration of 0)
+static int led_cmd_fade(led_dev_t *led_dev, uint32_t target_brightness, uint32_t duration_ms, uint32_t curve)
+{
+  if ((LED_IOC_BRIGHTNESS_MAX < target_brightness) || (LED_FADE_MAX_DURATION_MS < duration_ms))
+  {
+    return -EDOM;
+  }
+
+  if (LED_FADE_CURVE_CNT <= curve)
+  {
+    return -EINVAL;
+  }
+
+  if (0 == duration_ms)
+  {
+    return led_cmd_set_brightness(led_dev, target_brightness);
+  }
+
+  uint32_t led_bit = (1U << get_led_dev_index(led_dev));
+  unsigned long irq_flags;
+
+  spin_lock_irqsave(&led_fade_lock, irq_flags);
+
+  // A fade to where the led already is wouldn't change anything
+  if ((0 == (led_fade_mask & led_bit)) && (target_brightness == led_dev->brightness))
+  {
+    spin_unlock_irqrestore(&led_fade_lock, irq_flags);
+
+    atomic64_inc(&(led_dev->skipped_cnt));
+    return ENONE;
+  }
+
+  led_dev->fade_start_brightness = led_dev->brightness;
+  led_dev->fade_target_brightness = target_brightness;
+  led_dev->fade_curve = curve;
+  led_dev->fade_start = ktime_get();
+  led_dev->fade_duration = ms_to_ktime(duration_ms);
+
+  // The timer only runs while some led is fading
+  if (0 == led_fade_mask)
+  {
+    hrtimer_start(&led_fade_timer, us_to_ktime(max(fade_tick_us, (unsigned int)(LED_FADE_MIN_TICK_US))), HRTIMER_MODE_REL_SOFT);
+  }
+
+  led_fade_mask |= led_bit;
+
+  spin_unlock_irqrestore(&led_fade_lock, irq_flags);
+
+  return ENONE;
+}
+
+// Sets the led output to brightness, leds without a pwm channel are dimmed by the gpio driver's software pwm.
+//
+// Ret values:  ENONE     - success
+//              other     - failure, error from the pwm or gpio driver
+//
+// Can be called from any context.
+static int led_apply_brightness(led_dev_t *led_dev, uint32_t brightness)
+{
+  if (NOT_PWM == led_dev->pwm_channel)
+  {
+    return gpio_soft_pwm_set_duty(led_dev->pin_num, (uint16_t)(brightness));
+  }
+
+  return pwm_set_duty_u16(led_dev->pwm_channel, (uint16_t)(brightness));
+}
+
+// Ret values:  The brightness of the fading led at now, with *p_is_done set once the fade has reached its end.
+//
+// NOTE: Must be called with led_fade_lock held.
+static uint32_t led_fade_calc_brightness(led_dev_t *led_dev, ktime_t now, bool *p_is_done)
+{
+  s64 elapsed_ns = max(ktime_to_ns(ktime_sub(now, led_dev->fade_start)), (s64)(0));
+  s64 duration_ns = ktime_to_ns(led_dev->fade_duration);
+
+  *p_is_done = (elapsed_ns >= duration_ns);
+
+  if (*p_is_done)
+  {
+    return led_dev->fade_target_brightness;
+  }
+
+  // Position in the curve table, with 8 fractional bits to interpolate between its entries
+  u64 lut_pos = div64_u64((u64)(elapsed_ns) * (LED_FADE_LUT_STEPS << 8), (u64)(duration_ns));
+  uint32_t lut_index = (uint32_t)(lut_pos >> 8);
+  s32 lut_frac = (s32)(lut_pos & 0xFFU);
+  uint16_t const *p_lut = led_fade_luts[led_dev->fade_curve];
+
+  s32 progress = (s32)(p_lut[lut_index]) + ((((s32)(p_lut[lut_index + 1]) - (s32)(p_lut[lut_index])) * lut_frac) / 256);
+  s32 brightness_delta = (s32)(led_dev->fade_target_brightness) - (s32)(led_dev->fade_start_brightness);
+
+  return (uint32_t)((s32)(led_dev->fade_start_brightness) + (s32)(div_s64((s64)(brightness_delta) * progress, LED_IOC_BRIGHTNESS_MAX)));
+}
+
+// Runs in softirq context every fade_tick_us while any led is fading, and only touches the leds whose brightness changed.
+static enum hrtimer_restart led_fade_timer_callback(struct hrtimer *p_timer)
+{
+  ktime_t now = ktime_get();
+  unsigned long irq_flags;
+
+  spin_lock_irqsave(&led_fade_lock, irq_flags);
+
+  for (uint32_t led_num = 0; (0 != led_fade_mask) && (led_num < led_dev_cnt); led_num++)
+  {
+    led_dev_t *led_dev = led_devs[led_num];
+    uint32_t led_bit = (1U << led_num);
+    bool is_done = false;
+
+    if (0 == (led_fade_mask & led_bit))
+    {
+      continue;
+    }
+
+    uint32_t brightness = led_fade_calc_brightness(led_dev, now, &is_done);
+
+    if (brightness != led_dev->brightness)
+    {
+      int error = led_apply_brightness(led_dev, brightness);
+
+      if (unlikely(ENONE != error))
+      {
+        pr_err("LED fade timer failed to set the brightness of the led on pin %u! error: %d\n", led_dev->pin_num, error);
+        is_done = true;
+      }
+      else
+      {
+        led_dev->brightness = brightness;
+      }
+    }
+
+    if (is_done)
+    {
+      led_fade_mask &= ~led_bit;
+    }
+  }
+
+  // Forwarded while the lock is held, since once it is released a new fade can restart the timer
+  bool is_fading = (0 != led_fade_mask);
+
+  if (is_fading)
+  {
+    hrtimer_forward_now(p_timer, us_to_ktime(max(fade_tick_us, (unsigned int)(LED_FADE_MIN_TICK_US))));
+  }
+
+  spin_unlock_irqrestore(&led_fade_lock, irq_flags);
+
+  return is_fading ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+
+// Each write must be exactly one led_bank_frame_t (see custom-led-ioctl.h).
+static ssize_t led_bank_write(struct file *p_file, const char *user_buffer, size_t len, loff_t *p_offset)
+{
+  led_bank_frame_t frame;
+
+  if (sizeof(frame) != len)
+  {
+    pr_err("led_bank_write() - writes must be one %zu byte frame, got %zu bytes!\n", sizeof(frame), len);
+    return -EINVAL;
+  }
+
+  if (copy_from_user(&frame, user_buffer, sizeof(frame)))
+  {
+    return -EFAULT;
+  }
+
+  int error = led_bank_apply_frame(&frame);
+
+  if (ENONE != error)
+  {
+    return error;
+  }
+
+  return len;
 }
 
-static ssize_t led_read(struct file *p_file, char *user_buffer, size_t len, loff_t *p_offset)
+// Applies a whole frame at once. The pwm leds are updated first and then all the plain gpio leds are
+// switched together by a single GPSET/GPCLR write, so every led in the frame changes at (nearly) the same time.
+// Leds in the frame stop blinking, leds not in the frame are left alone.
+//
+// Ret values:  ENONE       - success
+//              -EINVAL     - failure, the frame has leds that don't exist
+//              other       - failure, error from the gpio or pwm driver (the rest of the frame is still applied)
+static int led_bank_apply_frame(led_bank_frame_t const *p_frame)
 {
-  printk(KERN_ALERT "Sorry, this operation isn't supported.\n");
-	return -EINVAL;
+  uint32_t update_mask = p_frame->update_mask;
+  uint32_t brightness_mask = p_frame->brightness_mask;
+
+  uint32_t all_leds_mask = (uint32_t)(GENMASK(led_dev_cnt - 1, 0));
+
+  if (0 != ((update_mask | brightness_mask) & ~all_leds_mask))
+  {
+    pr_err("LED bank frame has leds that don't exist! update_mask: %#x, brightness_mask: %#x\n", update_mask, brightness_mask);
+    return -EINVAL;
+  }
+
+  led_coalesce_flush_mask(update_mask | brightness_mask);
+
+  int error = ENONE;
+  int led_error = ENONE;
+  uint32_t gpio_set_mask = 0;
+  uint32_t gpio_clear_mask = 0;
+  uint32_t gpio_changed_mask = 0;
+  uint32_t gpio_state_words[MAX_LED_DEVICES];
+
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
+  {
+    led_dev_t *led_dev = led_devs[led_num];
+    uint32_t led_bit = (1U << led_num);
+    uint32_t state_word;
+
+    if (0 != (brightness_mask & led_bit))
+    {
+      led_error = led_cmd_set_brightness(led_dev, p_frame->brightness[led_num]);
+      error = (ENONE == error) ? led_error : error;
+    }
+
+    if (0 == (update_mask & led_bit))
+    {
+      continue;
+    }
+
+    bool do_turn_on = (0 != (p_frame->on_mask & led_bit));
+
+    if (!led_state_transition(led_dev, (do_turn_on ? LED_STATE_OP_SET_ON : LED_STATE_OP_SET_OFF), false, &state_word))
+    {
+      continue;
+    }
+
+    if (NOT_PWM == led_dev->pwm_channel)
+    {
+      if (do_turn_on)
+      {
+        gpio_set_mask |= (1U << led_dev->pin_num);
+      }
+      else
+      {
+        gpio_clear_mask |= (1U << led_dev->pin_num);
+      }
+
+      gpio_changed_mask |= led_bit;
+      gpio_state_words[led_num] = state_word;
+      continue;
+    }
+
+    led_error = led_sync_output(led_dev, state_word);
+    error = (ENONE == error) ? led_error : error;
+  }
+
+  led_error = gpio_output_ctl_mask(gpio_set_mask, gpio_clear_mask);
+  error = (ENONE == error) ? led_error : error;
+
+  // Same as led_sync_output(), fix up any gpio led that someone else changed while the mask was being written
+  for (uint32_t led_num = 0; (ENONE == led_error) && (led_num < led_dev_cnt); led_num++)
+  {
+    led_dev_t *led_dev = led_devs[led_num];
+    uint32_t cur_state_word = (uint32_t)(atomic_read(&(led_dev->state_word)));
+
+    if (   (0 != (gpio_changed_mask & (1U << led_num)))
+        && (led_state_word_is_on(cur_state_word) != led_state_word_is_on(gpio_state_words[led_num]))
+       )
+    {
+      led_error = led_sync_output(led_dev, cur_state_word);
+      error = (ENONE == error) ? led_error : error;
+    }
+  }
+
+  return error;
 }
 
 
-// Data written can be raw characters (i.e. char arrays without the NUL terminator) or strings (i.e. char arrays with the NUL terminator)
-// 
-// NOTE: Raw characters or strings ending with a newline char are not supported. (Future support may be added)
+// Maps the shared control page (led_shm_page_t in custom-led-ioctl.h). The page is checked for changes
+// every shm_poll_us for as long as any mapping of it exists.
 //
-// NOTE: When writing using the "echo" command from the terminal, the "echo" command will append the '\n' char ("LF" char on Linux).
-//       Either type "echo -n" to eliminate the newline or don't include a space after the last argument.
-//       (e.g. echo -n "1" > your_device_path, echo -n 1 > your_device_path, echo 1> your_device_path)
-static ssize_t led_write(struct file *p_file, const char *user_buffer, size_t len, loff_t *p_offset)
+// Ret values:  ENONE     - success
+//              -EINVAL   - failure, the mapping is larger than a page or doesn't start at offset 0
+//              other     - failure, error from remapping the page
+static int led_bank_mmap(struct file *p_file, struct vm_area_struct *p_vma)
 {
-  // First check that the message isn't too large
-  if (MSG_BUF_MAX_SIZE < len)
-  {
-    printk(KERN_ERR "led_write() - Length to write is too long! Max msg size: %d", MSG_BUF_MAX_SIZE);
-    return -EMSGSIZE;
-  }
-  // Nothing to write, so say nothing was written
-  else if (0 >= len)
+  if ((0 != p_vma->vm_pgoff) || (PAGE_SIZE < (p_vma->vm_end - p_vma->vm_start)))
   {
-    return 0;
+    return -EINVAL;
   }
 
-  led_dev_t *led_dev = p_file->private_data;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_set(p_vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+  p_vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
 
-  int error = copy_from_user(&(led_dev->msg_buffer), user_buffer, len);
+  int error = remap_pfn_range(p_vma, p_vma->vm_start, virt_to_phys(led_shm_page) >> PAGE_SHIFT,
+                              p_vma->vm_end - p_vma->vm_start, p_vma->vm_page_prot);
 
   if (ENONE != error)
   {
-    printk(KERN_ERR "led_write() - Failed to get user_buffer data! error: %d", error);
+    pr_err("led_bank_mmap() - failed to map the shared control page! error: %d\n", error);
     return error;
   }
 
-  // NOTE: We use "len" instead of "MSG_BUF_MAX_SIZE" for the max in strncasecmp calls here
-  //       because the user argument may or may not be a string which means it would have the '\0' char appended.
-  //       We can use "len" instead of "MSG_BUF_MAX_SIZE" because we already checked that the user argument is
-  //       not larger than "MSG_BUF_MAX_SIZE" upon entry into this function.
-  //
-  // NOTE: We don't support having the '\n' char appended to the message, but may support it in the future.  
+  p_vma->vm_ops = &led_shm_vm_ops;
 
-  // OFF command
-  if (   (0 == strncasecmp(led_write_word_cmds[0], led_dev->msg_buffer, len))
-      || (0 == strncasecmp(led_write_num_cmds[0], led_dev->msg_buffer, len))   
-     )
+  // The vm open callback isn't called for the first mapping
+  led_shm_vma_open(p_vma);
+
+  return ENONE;
+}
+
+static void led_shm_vma_open(struct vm_area_struct *p_vma)
+{
+  if (1 == atomic_inc_return(&led_shm_map_cnt))
   {
-    clear_led_blinking(led_dev);
+    hrtimer_start(&led_shm_timer, us_to_ktime(max(shm_poll_us, (unsigned int)(LED_SHM_MIN_POLL_US))), HRTIMER_MODE_REL_SOFT);
+  }
+}
 
-    // TODO: Possibly make this its own function
-    // error = gpio_output_ctl(led_dev->pin_num, false);
-    error = led_dev->led_dev_funcs.led_enable(led_dev->pin_num, false);
-    if (unlikely(ENONE != error))
+static void led_shm_vma_close(struct vm_area_struct *p_vma)
+{
+  if (atomic_dec_and_test(&led_shm_map_cnt))
+  {
+    hrtimer_cancel(&led_shm_timer);
+  }
+}
+
+// Runs in softirq context, since applying targets can take a while with a lot of leds.
+static enum hrtimer_restart led_shm_timer_callback(struct hrtimer *p_timer)
+{
+  // Pairs with the write barrier userspace does between writing the targets and making seq even again
+  uint32_t seq = smp_load_acquire(&(led_shm_page->seq));
+
+  // Odd means userspace is in the middle of writing the targets
+  if ((0 == (seq & 1U)) && (seq != led_shm_applied_seq))
+  {
+    memcpy(led_shm_targets, led_shm_page->leds, led_dev_cnt * sizeof(led_shm_led_t));
+    smp_rmb();
+
+    // Only apply the targets if userspace didn't start changing them again while they were copied,
+    // otherwise try again on the next tick.
+    if (seq == READ_ONCE(led_shm_page->seq))
     {
-      return error;
+      WRITE_ONCE(led_shm_page->last_error, led_shm_apply(led_shm_targets));
+      led_shm_applied_seq = seq;
+      smp_store_release(&(led_shm_page->applied_seq), seq);
     }
-
-    led_dev->is_led_on = false;
-    led_dev->led_state = LED_OFF;
   }
-  // ON command
-  else if (   (0 == strncasecmp(led_write_word_cmds[1], led_dev->msg_buffer, len))
-           || (0 == strncasecmp(led_write_num_cmds[1], led_dev->msg_buffer, len))   
-          )
+
+  hrtimer_forward_now(p_timer, us_to_ktime(max(shm_poll_us, (unsigned int)(LED_SHM_MIN_POLL_US))));
+
+  return HRTIMER_RESTART;
+}
+
+// Applies only the targets that changed since the last time. On/off and brightness changes go out together as one
+// bank frame (see led_bank_apply_frame()), and leds that should blink are then started one at a time.
+// Invalid states are ignored.
+//
+// Ret values:  ENONE     - success
+//              other     - failure, the first error hit while applying (the rest of the targets are still applied)
+static int led_shm_apply(led_shm_led_t const *p_targets)
+{
+  led_bank_frame_t frame = { .update_mask = 0, .on_mask = 0, .brightness_mask = 0 };
+  uint32_t blink_mask = 0;
+  int error = ENONE;
+
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
   {
-    clear_led_blinking(led_dev);
+    led_shm_led_t const *p_target = &(p_targets[led_num]);
+    led_shm_led_t const *p_applied = &(led_shm_applied[led_num]);
+    uint32_t led_bit = (1U << led_num);
 
-    // error = gpio_output_ctl(led_dev->pin_num, true);
-    error = led_dev->led_dev_funcs.led_enable(led_dev->pin_num, true);
-    if (unlikely(ENONE != error))
+    if (p_target->brightness != p_applied->brightness)
     {
-      return error;
+      frame.brightness_mask |= led_bit;
+      frame.brightness[led_num] = (__u16)(min(p_target->brightness, (__u32)(LED_IOC_BRIGHTNESS_MAX)));
     }
 
-    led_dev->is_led_on = true;
-    led_dev->led_state = LED_ON;
+    switch (p_target->state)
+    {
+      case LED_SHM_STATE_OFF:
+      case LED_SHM_STATE_ON:
+        if (p_target->state != p_applied->state)
+        {
+          frame.update_mask |= led_bit;
+          frame.on_mask |= ((LED_SHM_STATE_ON == p_target->state) ? led_bit : 0);
+        }
+        break;
+
+      case LED_SHM_STATE_BLINK:
+        if (   (p_target->state != p_applied->state)
+            || (p_target->blink_on_period_us != p_applied->blink_on_period_us)
+            || (p_target->blink_off_period_us != p_applied->blink_off_period_us)
+            || (p_target->blink_phase_offset_us != p_applied->blink_phase_offset_us)
+           )
+        {
+          blink_mask |= led_bit;
+        }
+        break;
+
+      default:
+        break;
+    }
   }
-  // TOGGLE command
-  else if (   (0 == strncasecmp(led_write_word_cmds[2], led_dev->msg_buffer, len))
-           || (0 == strncasecmp(led_write_num_cmds[2], led_dev->msg_buffer, len))   
-          )
+
+  if ((0 != frame.update_mask) || (0 != frame.brightness_mask))
   {
-    clear_led_blinking(led_dev);
+    error = led_bank_apply_frame(&frame);
+  }
 
-    // error = gpio_output_ctl(led_dev->pin_num, !(led_dev->is_led_on));s
-    error = led_dev->led_dev_funcs.led_enable(led_dev->pin_num, !(led_dev->is_led_on));
-    if (unlikely(ENONE != error))
+  led_coalesce_flush_mask(blink_mask);
+
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
+  {
+    if (0 == (blink_mask & (1U << led_num)))
     {
-      return error;
+      continue;
     }
 
-    led_dev->is_led_on = !(led_dev->is_led_on);
-    led_dev->led_state = get_led_state_from_physical_state(led_dev);
+    led_shm_led_t const *p_target = &(p_targets[led_num]);
+
+    int blink_error = led_cmd_blink(led_devs[led_num], us_to_ktime(p_target->blink_on_period_us),
+                                    us_to_ktime(p_target->blink_off_period_us), us_to_ktime(p_target->blink_phase_offset_us));
+
+    error = (ENONE == error) ? blink_error : error;
   }
-  // BLINK command
-  else if (   (0 == strncasecmp(led_write_word_cmds[3], led_dev->msg_buffer, len))
-           || (0 == strncasecmp(led_write_num_cmds[3], led_dev->msg_buffer, len))   
-          )
+
+  memcpy(led_shm_applied, p_targets, led_dev_cnt * sizeof(led_shm_led_t));
+
+  return error;
+}
+
+
+// Ret values:  ENONE     - success
+//              -EINVAL   - failure, an on or off period is shorter than LED_BLINK_MIN_PERIOD_US
+//              other     - failure, error from turning the led on or off
+//
+// Can be called from any context.
+static int led_start_blinking(led_dev_t *led_dev, ktime_t on_period, ktime_t off_period, ktime_t phase_offset)
+{
+  if (   (ktime_to_us(on_period) < LED_BLINK_MIN_PERIOD_US)
+      || (ktime_to_us(off_period) < LED_BLINK_MIN_PERIOD_US)
+     )
   {
-    clear_led_blinking(led_dev);
+    pr_err("LED blink periods must be at least %d us!\n", LED_BLINK_MIN_PERIOD_US);
+    return -EINVAL;
+  }
 
-    // Create the device name for the actual led device
-    char led_thread_name[40]; // There is nothing special about picking 40 bytes. It just fits the name and a large number of devices.
-    int led_dev_index = led_dev->pin_num - FIRST_LED_PIN;
-    snprintf(led_thread_name, sizeof(led_thread_name), "%s_%d", LED_BLINK_THREAD_NAME, led_dev_index);
-    
-    led_dev->p_blink_thread = kthread_run(led_blink, led_dev, led_thread_name);
-    if (IS_ERR(led_dev->p_blink_thread))
-    {                                     // Kthread name is LED_flash_thread
-      pr_err("led_write() - failed to create blink thread for led\n");
-      return PTR_ERR(led_dev->p_blink_thread);
-    }
+  int error = ENONE;
+  unsigned long irq_flags;
 
-    led_dev->led_state = LED_BLINK;
+  raw_spin_lock_irqsave(&led_blink_lock, irq_flags);
+
+  // Blinking with the same timing again would land on the same phase, since it comes from led_blink_epoch
+  if (   (LED_BLINK == led_state_word_get_state((uint32_t)(atomic_read(&(led_dev->state_word)))))
+      && (on_period == led_dev->blink_on_period)
+      && (off_period == led_dev->blink_off_period)
+      && (phase_offset == led_dev->blink_phase_offset)
+     )
+  {
+    raw_spin_unlock_irqrestore(&led_blink_lock, irq_flags);
+
+    atomic64_inc(&(led_dev->skipped_cnt));
+    return ENONE;
   }
-  // BR (brightness command)
-  else if (   (0 == strncasecmp(led_write_word_cmds[4], led_dev->msg_buffer, 3))
-           || (0 == strncasecmp(led_write_num_cmds[4], led_dev->msg_buffer, 2))   
-          )
+
+  led_dev->blink_on_period = on_period;
+  led_dev->blink_off_period = off_period;
+  led_dev->blink_phase_offset = phase_offset;
+  led_dev->blink_last_toggle = 0;
+  led_dev->blink_on_ns = 0;
+  led_dev->blink_off_ns = 0;
+
+  bool do_turn_on = led_blink_calc_phase(led_dev, ktime_get());
+  uint32_t state_word;
+
+  if (led_state_transition(led_dev, LED_STATE_OP_BLINK, do_turn_on, &state_word))
   {
-    // This led is not pwm and therefore doesn't support changing brightness.
-    if (NOT_PWM == led_dev->pwm_channel)
+    error = led_sync_output(led_dev, state_word);
+  }
+
+  // Rearmed even if the led was already blinking, since its blink timing changed
+  led_blink_rearm_locked();
+
+  raw_spin_unlock_irqrestore(&led_blink_lock, irq_flags);
+
+  return error;
+}
+
+// Works out where the led should be in its blink cycle at "now", based on its phase offset from led_blink_epoch.
+// Sets the time of the led's next toggle and returns whether the led should currently be on.
+//
+// NOTE: Must be called with led_blink_lock held.
+static bool led_blink_calc_phase(led_dev_t *led_dev, ktime_t now)
+{
+  u64 on_period_ns = ktime_to_ns(led_dev->blink_on_period);
+  u64 cycle_period_ns = on_period_ns + ktime_to_ns(led_dev->blink_off_period);
+  u64 cycle_pos_ns = 0;
+  u64 phase_offset_ns = 0;
+
+  // Add a whole cycle so the phase offset can never make the time since the epoch negative
+  u64 time_in_cycles_ns = ktime_to_ns(ktime_sub(now, led_blink_epoch)) + cycle_period_ns;
+
+  div64_u64_rem(ktime_to_ns(led_dev->blink_phase_offset), cycle_period_ns, &phase_offset_ns);
+  time_in_cycles_ns -= phase_offset_ns;
+
+  div64_u64_rem(time_in_cycles_ns, cycle_period_ns, &cycle_pos_ns);
+
+  if (cycle_pos_ns < on_period_ns)
+  {
+    led_dev->blink_next_toggle = ktime_add_ns(now, on_period_ns - cycle_pos_ns);
+    return true;
+  }
+
+  led_dev->blink_next_toggle = ktime_add_ns(now, cycle_period_ns - cycle_pos_ns);
+  return false;
+}
+
+// Arms the blink timer for the next toggle of any blinking led, or stops it if no leds are blinking.
+//
+// NOTE: Must be called with led_blink_lock held and never from the blink timer callback itself.
+static void led_blink_rearm_locked(void)
+{
+  ktime_t next_expiry = KTIME_MAX;
+
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
+  {
+    if (LED_BLINK == led_state_word_get_state((uint32_t)(atomic_read(&(led_devs[led_num]->state_word)))))
     {
-      return -EUNSUPCMD;
+      next_expiry = min(next_expiry, led_devs[led_num]->blink_next_toggle);
     }
+  }
 
-    // We add one to the buffer size since we will manually add a nul terminator character 
-    // since we don't know if the user buffer had one or not
-    char duty_cycle_buffer[MSG_BUF_MAX_SIZE + 1];
-    
-    // The write BR word command should start the duty cycle str arg at index 3
-    uint32_t duty_cycle_str_start_index = 3;
-    uint32_t duty_cycle_str_len = len;
+  if (KTIME_MAX == next_expiry)
+  {
+    // If the callback is running right now this fails, but the callback will see no leds are blinking and won't restart.
+    hrtimer_try_to_cancel(&led_blink_timer);
+  }
+  else
+  {
+    hrtimer_start(&led_blink_timer, next_expiry, HRTIMER_MODE_ABS_HARD);
+  }
+}
+
+static enum hrtimer_restart led_blink_timer_callback(struct hrtimer *p_timer)
+{
+  ktime_t now = ktime_get();
+  ktime_t next_expiry = KTIME_MAX;
+  uint32_t gpio_set_mask = 0;
+  uint32_t gpio_clear_mask = 0;
+  uint32_t gpio_changed_mask = 0;
+  uint32_t gpio_state_words[MAX_LED_DEVICES];
+  int error = ENONE;
+
+  // The lock only protects the blink timing, the led states are changed with led_state_transition()
+  raw_spin_lock(&led_blink_lock);
+
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
+  {
+    led_dev_t *led_dev = led_devs[led_num];
+    uint32_t state_word = (uint32_t)(atomic_read(&(led_dev->state_word)));
 
-    // If the user used the number command, set the index to be 2
-    if (led_write_num_cmds[4][0] == led_dev->msg_buffer[0])
+    if (LED_BLINK != led_state_word_get_state(state_word))
     {
-      duty_cycle_str_start_index = 2;
+      continue;
     }
-    // Else the user used the word command, so instead set the index to be 3
-    else
+
+    if (ktime_before(now, led_dev->blink_next_toggle))
     {
-      duty_cycle_str_start_index = 3;
+      next_expiry = min(next_expiry, led_dev->blink_next_toggle);
+      continue;
     }
 
-    duty_cycle_str_len = len - duty_cycle_str_start_index;
+    bool do_turn_on = !led_state_word_is_on(state_word);
+    bool is_resynced = false;
+    ktime_t toggle_time = led_dev->blink_next_toggle;
+
+    led_dev->blink_next_toggle = ktime_add(led_dev->blink_next_toggle, (do_turn_on ? led_dev->blink_on_period : led_dev->blink_off_period));
 
-    // Copy the duty cycle portion of the msg_buffer over to the duty_cycle_buffer
-    memcpy(&(duty_cycle_buffer[0]), &(led_dev->msg_buffer[duty_cycle_str_start_index]), duty_cycle_str_len);
+    // We fell more than a whole on or off period behind, so jump straight back to where the led should be
+    if (!ktime_after(led_dev->blink_next_toggle, now))
+    {
+      do_turn_on = led_blink_calc_phase(led_dev, now);
+      is_resynced = true;
+    }
 
-    // We don't know if the user buffer had a nul terminator,
-    // so add a '\0' to the end of the buffer to ensure that it is viewed as a string
-    duty_cycle_buffer[duty_cycle_str_len] = '\0';
+    next_expiry = min(next_expiry, led_dev->blink_next_toggle);
 
-    long long duty_cycle = 0;
+    // Fails if the led was stopped from blinking since it was checked above, in which case it is left alone
+    if (!led_state_transition(led_dev, LED_STATE_OP_BLINK_TICK, do_turn_on, &state_word))
+    {
+      continue;
+    }
 
-    error = kstrtoll(duty_cycle_buffer, 0, &duty_cycle);
+    led_blink_record_toggle_locked(led_dev, now, toggle_time, do_turn_on, is_resynced);
 
-    if (ENONE != error)
+    // Update all the plain GPIO leds together below with a single register write
+    if (NOT_PWM == led_dev->pwm_channel)
     {
-      return error;
+      if (do_turn_on)
+      {
+        gpio_set_mask |= (1U << led_dev->pin_num);
+      }
+      else
+      {
+        gpio_clear_mask |= (1U << led_dev->pin_num);
+      }
+
+      gpio_changed_mask |= (1U << led_num);
+      gpio_state_words[led_num] = state_word;
+      continue;
     }
 
-    if (0 > duty_cycle)
+    error = led_sync_output(led_dev, state_word);
+
+    if (unlikely(ENONE != error))
     {
-      pr_err("User written duty cycle cannot be negative. User wrote: %lld!\n", duty_cycle);
-      return -EDOM;
+      pr_err("LED blink timer failed to toggle the led on pin %u! error: %d\n", led_dev->pin_num, error);
     }
-    else if (100 < duty_cycle)
+  }
+
+  error = gpio_output_ctl_mask(gpio_set_mask, gpio_clear_mask);
+
+  if (unlikely(ENONE != error))
+  {
+    pr_err("LED blink timer failed to toggle the gpio leds! error: %d\n", error);
+  }
+
+  // Same as led_sync_output(), fix up any gpio led that someone else changed while the mask was being written
+  for (uint32_t led_num = 0; (ENONE == error) && (led_num < led_dev_cnt); led_num++)
+  {
+    led_dev_t *led_dev = led_devs[led_num];
+    uint32_t cur_state_word = (uint32_t)(atomic_read(&(led_dev->state_word)));
+
+    if (   (0 != (gpio_changed_mask & (1U << led_num)))
+        && (led_state_word_is_on(cur_state_word) != led_state_word_is_on(gpio_state_words[led_num]))
+       )
     {
-      pr_err("User written duty cycle can not be above 100. User wrote: %lld!\n", duty_cycle);
-      return -EDOM;
+      error = led_sync_output(led_dev, cur_state_word);
     }
+  }
+
+  // Someone restarted the timer while this callback was running (see led_blink_rearm_locked()), so it is
+  // already queued for the next toggle and must not be changed here.
+  if (hrtimer_is_queued(p_timer) || (KTIME_MAX == next_expiry))
+  {
+    raw_spin_unlock(&led_blink_lock);
+    return HRTIMER_NORESTART;
+  }
 
-    error = pwm_set_duty_cycle(led_dev->pwm_channel, (int)(duty_cycle));
+  hrtimer_set_expires(p_timer, next_expiry);
 
-    if (unlikely(ENONE != error))
+  raw_spin_unlock(&led_blink_lock);
+  return HRTIMER_RESTART;
+}
+
+// Adds a toggle of the blink timer to the blink stats of the led. The on and off times only count whole periods
+// the timer kept up with, so they show how close the blink duty cycle the led actually gets is to its periods.
+//
+// NOTE: Must be called with led_blink_lock held.
+static void led_blink_record_toggle_locked(led_dev_t *led_dev, ktime_t now, ktime_t toggle_time, bool is_turned_on, bool is_resynced)
+{
+  u64 late_ns = (u64)(ktime_to_ns(ktime_sub(now, toggle_time)));
+
+  led_dev->blink_toggle_cnt++;
+  led_dev->blink_late_total_ns += late_ns;
+  led_dev->blink_late_max_ns = max(led_dev->blink_late_max_ns, late_ns);
+
+  if (!is_resynced && (0 != led_dev->blink_last_toggle))
+  {
+    u64 held_ns = (u64)(ktime_to_ns(ktime_sub(now, led_dev->blink_last_toggle)));
+
+    // Turning on ends an off period and the other way around
+    if (is_turned_on)
     {
-      return error;
+      led_dev->blink_off_ns += held_ns;
     }
+    else
+    {
+      led_dev->blink_on_ns += held_ns;
+    }
+  }
+
+  led_dev->blink_last_toggle = now;
+}
+
+// Adds a call into the led device to the stats of the cpu it ran on. p_cmd_cnts has the number of commands of each
+// led_cmd_type_t the call ran.
+//
+// NOTE: Must be called from process context.
+static void led_stats_record(led_dev_t *led_dev, led_stats_path_t path, uint32_t const *p_cmd_cnts, int error, u64 start_ns)
+{
+  u64 latency_ns = ktime_get_ns() - start_ns;
+  led_dev_stats_t *p_stats = get_cpu_ptr(led_dev->p_stats);
+
+  u64_stats_update_begin(&(p_stats->syncp));
 
+  for (uint32_t cmd_type = LED_CMD_OFF; cmd_type < LED_CMD_TYPE_CNT; cmd_type++)
+  {
+    p_stats->cmd_cnts[cmd_type] += p_cmd_cnts[cmd_type];
   }
-  // Unsupported command
-  else
+
+  if (ENONE != error)
   {
-    // TODO: Add in some error response
-    return -EUNSUPCMD;
+    p_stats->err_cnts[led_stats_err_index(error)]++;
   }
 
-  // Note if you return 0 it indicates nothing was written.
-  // The standard c library will try rewriting.
-  // So if we try to write to this device from a terminal
-  // it basically creates an infinite loop of the terminal
-  // trying to write, getting a 0 back, and trying again.
-  // Essentially impossible to uninstall the driver then since it
-  // is almost always processing the write command.
+  p_stats->call_cnts[path]++;
+  p_stats->call_total_ns[path] += latency_ns;
+  p_stats->latency_hist[path][led_stats_hist_bucket(latency_ns)]++;
 
-  return len;
+  u64_stats_update_end(&(p_stats->syncp));
+
+  put_cpu_ptr(led_dev->p_stats);
+}
+
+// Creates a stats file per led device in debugfs. The leds work without them, so failures are only logged.
+static void led_debugfs_init(void)
+{
+  p_led_debugfs_dir = debugfs_create_dir(LED_DEBUGFS_DIR_NAME, NULL);
+
+  if (IS_ERR_OR_NULL(p_led_debugfs_dir))
+  {
+    pr_err("LED driver couldn't create its debugfs directory, the led stats won't be available\n");
+    return;
+  }
+
+  for (uint32_t led_num = 0; led_num < led_dev_cnt; led_num++)
+  {
+    char led_device_name[24];   // Same as in led_dev_init()
+
+    snprintf(led_device_name, sizeof(led_device_name), "%s_%d", LED_DEVICE_NAME, led_num);
+    debugfs_create_file(led_device_name, 0444, p_led_debugfs_dir, led_devs[led_num], &led_stats_fops);
+  }
 }
 
+static int led_stats_open(struct inode *p_inode, struct file *p_file)
+{
+  return single_open(p_file, led_stats_show, p_inode->i_private);
+}
 
-static int led_blink(void *arg)
+// Adds up the stats of every cpu and shows them as "name: value" lines
+static int led_stats_show(struct seq_file *p_seq, void *p_data)
 {
-  int error = ENONE;
+  led_dev_t *led_dev = p_seq->private;
+  led_dev_stats_t totals = { 0 };
+  int cpu;
 
-  led_dev_t *led_dev = (led_dev_t *)arg;
-  
-  while (!kthread_should_stop())
+  for_each_possible_cpu(cpu)
   {
-    set_current_state(TASK_RUNNING);
+    led_dev_stats_t const *p_stats = per_cpu_ptr(led_dev->p_stats, cpu);
+    led_dev_stats_t snapshot;
+    unsigned int start;
 
-    // TODO: probably just create a generic toggle function that can be used here 
-    //       and for when the user types toggle.
+    do
+    {
+      start = u64_stats_fetch_begin(&(p_stats->syncp));
+      memcpy(&snapshot, p_stats, sizeof(snapshot));
+    } while (u64_stats_fetch_retry(&(p_stats->syncp), start));
 
-    // error = gpio_output_ctl(led_dev->pin_num, !(led_dev->is_led_on));
-    error = led_dev->led_dev_funcs.led_enable(led_dev->pin_num, !(led_dev->is_led_on));
-    if (unlikely(ENONE != error))
+    for (uint32_t cmd_type = LED_CMD_OFF; cmd_type < LED_CMD_TYPE_CNT; cmd_type++)
     {
-      // Set the led state to not be BLINK anymore, base it on the actual current physical
-      // led state.
-      led_dev->led_state = get_led_state_from_physical_state(led_dev);
-      
-      // Clear the thread pointer so that we know
-      // the blink thread is not running for the device.
-      led_dev->p_blink_thread = NULL;
-      return error;
+      totals.cmd_cnts[cmd_type] += snapshot.cmd_cnts[cmd_type];
     }
 
-    led_dev->is_led_on = !(led_dev->is_led_on);
+    for (uint32_t err_index = 0; err_index < LED_STATS_ERR_CNT; err_index++)
+    {
+      totals.err_cnts[err_index] += snapshot.err_cnts[err_index];
+    }
+
+    for (uint32_t path = 0; path < LED_STATS_PATH_CNT; path++)
+    {
+      totals.call_cnts[path] += snapshot.call_cnts[path];
+      totals.call_total_ns[path] += snapshot.call_total_ns[path];
 
-    msleep_interruptible(125);    // Blink 4 times a second
+      for (uint32_t bucket = 0; bucket < LED_STATS_HIST_BUCKET_CNT; bucket++)
+      {
+        totals.latency_hist[path][bucket] += snapshot.latency_hist[path][bucket];
+      }
+    }
   }
 
-  set_current_state(TASK_RUNNING);
+  for (uint32_t cmd_type = LED_CMD_OFF; cmd_type < LED_CMD_TYPE_CNT; cmd_type++)
+  {
+    seq_printf(p_seq, "cmd_%s: %llu\n", led_stats_cmd_names[cmd_type], totals.cmd_cnts[cmd_type]);
+  }
 
-  // Try to turn the led off before exiting
-  // error = gpio_output_ctl(led_dev->pin_num, false);
-  error = led_dev->led_dev_funcs.led_enable(led_dev->pin_num, false);
+  for (uint32_t err_index = 0; err_index < LED_STATS_ERR_CNT; err_index++)
+  {
+    seq_printf(p_seq, "err_%s: %llu\n", led_stats_err_names[err_index], totals.err_cnts[err_index]);
+  }
 
-  if (ENONE == error)
+  for (uint32_t path = 0; path < LED_STATS_PATH_CNT; path++)
   {
-    led_dev->is_led_on = false;
+    u64 call_cnt = totals.call_cnts[path];
+
+    seq_printf(p_seq, "%s_calls: %llu\n", led_stats_path_names[path], call_cnt);
+    seq_printf(p_seq, "%s_mean_ns: %llu\n", led_stats_path_names[path],
+               (0 != call_cnt) ? div64_u64(totals.call_total_ns[path], call_cnt) : 0);
+    seq_printf(p_seq, "%s_latency_us:", led_stats_path_names[path]);
+
+    for (uint32_t bucket = 0; bucket < LED_STATS_HIST_BUCKET_CNT; bucket++)
+    {
+      // Buckets are shown by the lowest latency in them
+      seq_printf(p_seq, " %u+:%llu", (0 == bucket) ? 0 : (1U << (bucket - 1)), totals.latency_hist[path][bucket]);
+    }
+
+    seq_puts(p_seq, "\n");
   }
 
-  // Set the led state to not be BLINK anymore, base it on the actual current physical
-  // led state.
-  led_dev->led_state = get_led_state_from_physical_state(led_dev);
+  unsigned long irq_flags;
 
-  // Clear the thread pointer so that we know
-  // the blink thread is not running for the device.
-  led_dev->p_blink_thread = NULL;
+  raw_spin_lock_irqsave(&led_blink_lock, irq_flags);
 
-  return error;
-};
+  u64 toggle_cnt = led_dev->blink_toggle_cnt;
+  u64 late_total_ns = led_dev->blink_late_total_ns;
+  u64 late_max_ns = led_dev->blink_late_max_ns;
+  u64 blink_on_ns = led_dev->blink_on_ns;
+  u64 blink_off_ns = led_dev->blink_off_ns;
+  u64 on_period_ns = ktime_to_ns(led_dev->blink_on_period);
+  u64 off_period_ns = ktime_to_ns(led_dev->blink_off_period);
+
+  raw_spin_unlock_irqrestore(&led_blink_lock, irq_flags);
+
+  seq_printf(p_seq, "skipped_updates: %lld\n", atomic64_read(&(led_dev->skipped_cnt)));
+  seq_printf(p_seq, "coalesced_updates: %lld\n", atomic64_read(&(led_dev->coalesced_cnt)));
+  seq_printf(p_seq, "coalesce_errors: %lld\n", atomic64_read(&(led_dev->coalesce_err_cnt)));
+  seq_printf(p_seq, "blink_stops: %lld\n", atomic64_read(&(led_dev->blink_stop_cnt)));
+  seq_printf(p_seq, "blink_toggles: %llu\n", toggle_cnt);
+  seq_printf(p_seq, "blink_late_mean_ns: %llu\n", (0 != toggle_cnt) ? div64_u64(late_total_ns, toggle_cnt) : 0);
+  seq_printf(p_seq, "blink_late_max_ns: %llu\n", late_max_ns);
+
+  // The duty cycle the periods of the last blink ask for, and the one the led actually got since then, in parts per 1000
+  seq_printf(p_seq, "blink_duty_set_permille: %llu\n",
+             (0 != (on_period_ns + off_period_ns)) ? div64_u64(on_period_ns * 1000, on_period_ns + off_period_ns) : 0);
+  seq_printf(p_seq, "blink_duty_actual_permille: %llu\n",
+             (0 != (blink_on_ns + blink_off_ns)) ? div64_u64(blink_on_ns * 1000, blink_on_ns + blink_off_ns) : 0);
+
+  return ENONE;
+}
 
 static inline int led_gpio_enable(uint32_t pin_num, bool do_enable)
 {
@@ -649,6 +2927,8 @@ static inline int led_pwm_enable(uint32_t pin_num, bool do_enable)
 module_init(led_driver_init);
 module_exit(led_driver_exit);
 
+MODULE_DEVICE_TABLE(of, led_of_match);
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Trevor Foland");
 MODULE_DESCRIPTION("A practice Linux driver that controls LEDs.");
@@ -0,0 +1,99 @@
+#ifndef CUSTOM_LED_FADE_LUT_H
+#define CUSTOM_LED_FADE_LUT_H
+
+// Easing curves of the led fade engine, one row per LED_FADE_CURVE_* in custom-led-ioctl.h (in the same order).
+// Entry i is the fade progress at i / LED_FADE_LUT_STEPS of the fade duration, from 0 (start brightness) to
+// 0xFFFF (target brightness), so entry n is round(0xFFFF * f(n / LED_FADE_LUT_STEPS)) for the curve f.
+// The fade timer interpolates between neighbouring entries, so the tables are all it needs at run time.
+
+#include <linux/types.h>
+
+/***************    Macros    ***************/
+
+#define LED_FADE_LUT_STEPS    (256U)
+#define LED_FADE_LUT_SIZE     (LED_FADE_LUT_STEPS + 1)    // The last entry is the end of the fade
+#define LED_FADE_CURVE_CNT    (3U)
+
+
+/***************    Private variables    ***************/
+
+static uint16_t const led_fade_luts[LED_FADE_CURVE_CNT][LED_FADE_LUT_SIZE] =
+{
+  // Linear
+  {
+    0x0000, 0x0100, 0x0200, 0x0300, 0x0400, 0x0500, 0x0600, 0x0700, 0x0800, 0x0900, 0x0A00, 0x0B00,
+    0x0C00, 0x0D00, 0x0E00, 0x0F00, 0x1000, 0x1100, 0x1200, 0x1300, 0x1400, 0x1500, 0x1600, 0x1700,
+    0x1800, 0x1900, 0x1A00, 0x1B00, 0x1C00, 0x1D00, 0x1E00, 0x1F00, 0x2000, 0x2100, 0x2200, 0x2300,
+    0x2400, 0x2500, 0x2600, 0x2700, 0x2800, 0x2900, 0x2A00, 0x2B00, 0x2C00, 0x2D00, 0x2E00, 0x2F00,
+    0x3000, 0x3100, 0x3200, 0x3300, 0x3400, 0x3500, 0x3600, 0x3700, 0x3800, 0x3900, 0x3A00, 0x3B00,
+    0x3C00, 0x3D00, 0x3E00, 0x3F00, 0x4000, 0x4100, 0x4200, 0x4300, 0x4400, 0x4500, 0x4600, 0x4700,
+    0x4800, 0x4900, 0x4A00, 0x4B00, 0x4C00, 0x4D00, 0x4E00, 0x4F00, 0x5000, 0x5100, 0x5200, 0x5300,
+    0x5400, 0x5500, 0x5600, 0x5700, 0x5800, 0x5900, 0x5A00, 0x5B00, 0x5C00, 0x5D00, 0x5E00, 0x5F00,
+    0x6000, 0x6100, 0x6200, 0x6300, 0x6400, 0x6500, 0x6600, 0x6700, 0x6800, 0x6900, 0x6A00, 0x6B00,
+    0x6C00, 0x6D00, 0x6E00, 0x6F00, 0x7000, 0x7100, 0x7200, 0x7300, 0x7400, 0x7500, 0x7600, 0x7700,
+    0x7800, 0x7900, 0x7A00, 0x7B00, 0x7C00, 0x7D00, 0x7E00, 0x7F00, 0x8000, 0x80FF, 0x81FF, 0x82FF,
+    0x83FF, 0x84FF, 0x85FF, 0x86FF, 0x87FF, 0x88FF, 0x89FF, 0x8AFF, 0x8BFF, 0x8CFF, 0x8DFF, 0x8EFF,
+    0x8FFF, 0x90FF, 0x91FF, 0x92FF, 0x93FF, 0x94FF, 0x95FF, 0x96FF, 0x97FF, 0x98FF, 0x99FF, 0x9AFF,
+    0x9BFF, 0x9CFF, 0x9DFF, 0x9EFF, 0x9FFF, 0xA0FF, 0xA1FF, 0xA2FF, 0xA3FF, 0xA4FF, 0xA5FF, 0xA6FF,
+    0xA7FF, 0xA8FF, 0xA9FF, 0xAAFF, 0xABFF, 0xACFF, 0xADFF, 0xAEFF, 0xAFFF, 0xB0FF, 0xB1FF, 0xB2FF,
+    0xB3FF, 0xB4FF, 0xB5FF, 0xB6FF, 0xB7FF, 0xB8FF, 0xB9FF, 0xBAFF, 0xBBFF, 0xBCFF, 0xBDFF, 0xBEFF,
+    0xBFFF, 0xC0FF, 0xC1FF, 0xC2FF, 0xC3FF, 0xC4FF, 0xC5FF, 0xC6FF, 0xC7FF, 0xC8FF, 0xC9FF, 0xCAFF,
+    0xCBFF, 0xCCFF, 0xCDFF, 0xCEFF, 0xCFFF, 0xD0FF, 0xD1FF, 0xD2FF, 0xD3FF, 0xD4FF, 0xD5FF, 0xD6FF,
+    0xD7FF, 0xD8FF, 0xD9FF, 0xDAFF, 0xDBFF, 0xDCFF, 0xDDFF, 0xDEFF, 0xDFFF, 0xE0FF, 0xE1FF, 0xE2FF,
+    0xE3FF, 0xE4FF, 0xE5FF, 0xE6FF, 0xE7FF, 0xE8FF, 0xE9FF, 0xEAFF, 0xEBFF, 0xECFF, 0xEDFF, 0xEEFF,
+    0xEFFF, 0xF0FF, 0xF1FF, 0xF2FF, 0xF3FF, 0xF4FF, 0xF5FF, 0xF6FF, 0xF7FF, 0xF8FF, 0xF9FF, 0xFAFF,
+    0xFBFF, 0xFCFF, 0xFDFF, 0xFEFF, 0xFFFF
+  },
+  // Ease in-out, (1 - cos(pi * x)) / 2
+  {
+    0x0000, 0x0002, 0x000A, 0x0016, 0x0027, 0x003E, 0x0059, 0x0079, 0x009E, 0x00C8, 0x00F6, 0x012A,
+    0x0163, 0x01A0, 0x01E2, 0x022A, 0x0276, 0x02C6, 0x031C, 0x0377, 0x03D6, 0x043A, 0x04A3, 0x0511,
+    0x0583, 0x05FA, 0x0676, 0x06F6, 0x077B, 0x0805, 0x0894, 0x0927, 0x09BE, 0x0A5A, 0x0AFB, 0x0BA0,
+    0x0C4A, 0x0CF8, 0x0DAB, 0x0E62, 0x0F1D, 0x0FDD, 0x10A1, 0x1169, 0x1236, 0x1307, 0x13DC, 0x14B5,
+    0x1592, 0x1674, 0x1759, 0x1843, 0x1930, 0x1A22, 0x1B17, 0x1C11, 0x1D0E, 0x1E0F, 0x1F14, 0x201C,
+    0x2128, 0x2238, 0x234C, 0x2463, 0x257D, 0x269B, 0x27BD, 0x28E2, 0x2A0A, 0x2B36, 0x2C65, 0x2D97,
+    0x2ECC, 0x3004, 0x3140, 0x327E, 0x33C0, 0x3504, 0x364C, 0x3796, 0x38E3, 0x3A33, 0x3B85, 0x3CDA,
+    0x3E32, 0x3F8C, 0x40E8, 0x4248, 0x43A9, 0x450D, 0x4673, 0x47DB, 0x4946, 0x4AB2, 0x4C21, 0x4D91,
+    0x4F04, 0x5078, 0x51EF, 0x5367, 0x54E0, 0x565C, 0x57D9, 0x5958, 0x5AD8, 0x5C59, 0x5DDC, 0x5F60,
+    0x60E6, 0x626C, 0x63F4, 0x657D, 0x6707, 0x6892, 0x6A1E, 0x6BAA, 0x6D38, 0x6EC6, 0x7054, 0x71E4,
+    0x7374, 0x7504, 0x7695, 0x7826, 0x79B8, 0x7B49, 0x7CDB, 0x7E6D, 0x7FFF, 0x8192, 0x8324, 0x84B6,
+    0x8647, 0x87D9, 0x896A, 0x8AFB, 0x8C8B, 0x8E1B, 0x8FAB, 0x9139, 0x92C7, 0x9455, 0x95E1, 0x976D,
+    0x98F8, 0x9A82, 0x9C0B, 0x9D93, 0x9F19, 0xA09F, 0xA223, 0xA3A6, 0xA527, 0xA6A7, 0xA826, 0xA9A3,
+    0xAB1F, 0xAC98, 0xAE10, 0xAF87, 0xB0FB, 0xB26E, 0xB3DE, 0xB54D, 0xB6B9, 0xB824, 0xB98C, 0xBAF2,
+    0xBC56, 0xBDB7, 0xBF17, 0xC073, 0xC1CD, 0xC325, 0xC47A, 0xC5CC, 0xC71C, 0xC869, 0xC9B3, 0xCAFB,
+    0xCC3F, 0xCD81, 0xCEBF, 0xCFFB, 0xD133, 0xD268, 0xD39A, 0xD4C9, 0xD5F5, 0xD71D, 0xD842, 0xD964,
+    0xDA82, 0xDB9C, 0xDCB3, 0xDDC7, 0xDED7, 0xDFE3, 0xE0EB, 0xE1F0, 0xE2F1, 0xE3EE, 0xE4E8, 0xE5DD,
+    0xE6CF, 0xE7BC, 0xE8A6, 0xE98B, 0xEA6D, 0xEB4A, 0xEC23, 0xECF8, 0xEDC9, 0xEE96, 0xEF5E, 0xF022,
+    0xF0E2, 0xF19D, 0xF254, 0xF307, 0xF3B5, 0xF45F, 0xF504, 0xF5A5, 0xF641, 0xF6D8, 0xF76B, 0xF7FA,
+    0xF884, 0xF909, 0xF989, 0xFA05, 0xFA7C, 0xFAEE, 0xFB5C, 0xFBC5, 0xFC29, 0xFC88, 0xFCE3, 0xFD39,
+    0xFD89, 0xFDD5, 0xFE1D, 0xFE5F, 0xFE9C, 0xFED5, 0xFF09, 0xFF37, 0xFF61, 0xFF86, 0xFFA6, 0xFFC1,
+    0xFFD8, 0xFFE9, 0xFFF5, 0xFFFD, 0xFFFF
+  },
+  // Gamma 2.2, x^2.2 (perceptually linear brightness)
+  {
+    0x0000, 0x0000, 0x0002, 0x0004, 0x0007, 0x000B, 0x0011, 0x0018, 0x0020, 0x0029, 0x0034, 0x0040,
+    0x004E, 0x005D, 0x006E, 0x0080, 0x0093, 0x00A8, 0x00BF, 0x00D7, 0x00F0, 0x010B, 0x0128, 0x0147,
+    0x0167, 0x0188, 0x01AC, 0x01D1, 0x01F8, 0x0220, 0x024A, 0x0276, 0x02A4, 0x02D3, 0x0304, 0x0337,
+    0x036B, 0x03A2, 0x03DA, 0x0414, 0x0450, 0x048D, 0x04CD, 0x050E, 0x0551, 0x0596, 0x05DD, 0x0626,
+    0x0670, 0x06BD, 0x070B, 0x075C, 0x07AE, 0x0802, 0x0858, 0x08B0, 0x090A, 0x0966, 0x09C4, 0x0A23,
+    0x0A85, 0x0AE9, 0x0B4F, 0x0BB6, 0x0C20, 0x0C8C, 0x0CFA, 0x0D69, 0x0DDB, 0x0E4F, 0x0EC5, 0x0F3C,
+    0x0FB6, 0x1032, 0x10B0, 0x1130, 0x11B2, 0x1237, 0x12BD, 0x1345, 0x13D0, 0x145C, 0x14EB, 0x157B,
+    0x160E, 0x16A3, 0x173A, 0x17D3, 0x186F, 0x190C, 0x19AC, 0x1A4D, 0x1AF1, 0x1B97, 0x1C3F, 0x1CEA,
+    0x1D96, 0x1E45, 0x1EF6, 0x1FA9, 0x205E, 0x2115, 0x21CF, 0x228B, 0x2349, 0x2409, 0x24CB, 0x2590,
+    0x2657, 0x2720, 0x27EB, 0x28B9, 0x2988, 0x2A5A, 0x2B2E, 0x2C05, 0x2CDE, 0x2DB9, 0x2E96, 0x2F75,
+    0x3057, 0x313B, 0x3221, 0x330A, 0x33F5, 0x34E2, 0x35D1, 0x36C3, 0x37B7, 0x38AD, 0x39A6, 0x3AA1,
+    0x3B9E, 0x3C9D, 0x3D9F, 0x3EA3, 0x3FAA, 0x40B3, 0x41BE, 0x42CB, 0x43DB, 0x44ED, 0x4602, 0x4719,
+    0x4832, 0x494D, 0x4A6B, 0x4B8B, 0x4CAE, 0x4DD3, 0x4EFA, 0x5024, 0x5150, 0x527F, 0x53B0, 0x54E3,
+    0x5618, 0x5750, 0x588B, 0x59C8, 0x5B07, 0x5C48, 0x5D8D, 0x5ED3, 0x601C, 0x6167, 0x62B5, 0x6405,
+    0x6557, 0x66AC, 0x6804, 0x695D, 0x6ABA, 0x6C18, 0x6D7A, 0x6EDD, 0x7043, 0x71AC, 0x7316, 0x7484,
+    0x75F4, 0x7766, 0x78DB, 0x7A52, 0x7BCC, 0x7D48, 0x7EC6, 0x8048, 0x81CB, 0x8351, 0x84DA, 0x8665,
+    0x87F2, 0x8982, 0x8B15, 0x8CAA, 0x8E41, 0x8FDB, 0x9178, 0x9317, 0x94B8, 0x965D, 0x9803, 0x99AC,
+    0x9B58, 0x9D06, 0x9EB7, 0xA06A, 0xA21F, 0xA3D8, 0xA593, 0xA750, 0xA910, 0xAAD2, 0xAC97, 0xAE5F,
+    0xB029, 0xB1F5, 0xB3C4, 0xB596, 0xB76A, 0xB941, 0xBB1B, 0xBCF6, 0xBED5, 0xC0B6, 0xC29A, 0xC480,
+    0xC669, 0xC854, 0xCA42, 0xCC33, 0xCE26, 0xD01C, 0xD214, 0xD40F, 0xD60C, 0xD80C, 0xDA0F, 0xDC15,
+    0xDE1C, 0xE027, 0xE234, 0xE444, 0xE656, 0xE86B, 0xEA83, 0xEC9D, 0xEEBA, 0xF0D9, 0xF2FB, 0xF520,
+    0xF747, 0xF971, 0xFB9E, 0xFDCD, 0xFFFF
+  }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+#ifndef CUSTOM_LED_IOCTL_H
+#define CUSTOM_LED_IOCTL_H
+
+// Binary ioctl interface of the custom_gpio_led_x devices and the frame format of the custom_gpio_led_bank device.
+// This header is shared with userspace, so it only uses the fixed size types from linux/types.h.
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/***************    Macros    ***************/
+
+#define LED_IOC_MAGIC             ('L')
+
+#define LED_IOC_BRIGHTNESS_MAX    (0xFFFFU)   // Fully on brightness
+#define LED_BANK_MAX_LEDS         (32)        // Leds a bank frame has room for, the driver may have fewer
+
+// led_shm_led_t states
+#define LED_SHM_STATE_OFF         (0U)
+#define LED_SHM_STATE_ON          (1U)
+#define LED_SHM_STATE_BLINK       (2U)
+
+// led_ioc_fade_t curves, how the brightness moves from its start to the target over the fade
+#define LED_FADE_CURVE_LINEAR         (0U)
+#define LED_FADE_CURVE_EASE_IN_OUT    (1U)    // Starts and ends slowly
+#define LED_FADE_CURVE_GAMMA          (2U)    // Gamma 2.2, looks linear to the eye
+
+#define LED_FADE_MAX_DURATION_MS      (60000U)
+
+// Ioctl commands
+#define LED_IOC_OFF               _IO(LED_IOC_MAGIC, 0)
+#define LED_IOC_ON                _IO(LED_IOC_MAGIC, 1)
+#define LED_IOC_TOGGLE            _IO(LED_IOC_MAGIC, 2)
+#define LED_IOC_BLINK             _IOW(LED_IOC_MAGIC, 3, led_ioc_blink_t)
+#define LED_IOC_SET_BRIGHTNESS    _IOW(LED_IOC_MAGIC, 4, led_ioc_brightness_t)
+#define LED_IOC_FADE              _IOW(LED_IOC_MAGIC, 5, led_ioc_fade_t)
+
+
+/***************    Type definitions    ***************/
+
+typedef struct led_ioc_blink_s
+{
+  __u32 on_period_us;       // Must be at least 100 us
+  __u32 off_period_us;      // Must be at least 100 us
+  __u32 phase_offset_us;    // Offset of the start of the blink cycle, so leds can blink in sync or out of phase
+} led_ioc_blink_t;
+
+// Leds on pins without a pwm channel are dimmed with software pwm
+typedef struct led_ioc_brightness_s
+{
+  __u32 brightness;         // 0 (off) to LED_IOC_BRIGHTNESS_MAX (fully on)
+} led_ioc_brightness_t;
+
+// Fades the brightness from where it is now to target_brightness, the kernel runs the whole fade
+typedef struct led_ioc_fade_s
+{
+  __u32 target_brightness;  // 0 (off) to LED_IOC_BRIGHTNESS_MAX (fully on)
+  __u32 duration_ms;        // Up to LED_FADE_MAX_DURATION_MS, 0 sets the brightness right away
+  __u32 curve;              // LED_FADE_CURVE_*
+} led_ioc_fade_t;
+
+// Frame written to the custom_gpio_led_bank device, bit/index n is led custom_gpio_led_n
+typedef struct led_bank_frame_s
+{
+  __u32 update_mask;                      // Leds to turn on or off from on_mask, other leds keep their state
+  __u32 on_mask;                          // Leds to turn on, the leds in update_mask that aren't set here are turned off
+  __u32 brightness_mask;                  // Leds to set the brightness of from brightness
+  __u16 brightness[LED_BANK_MAX_LEDS];    // 0 (off) to LED_IOC_BRIGHTNESS_MAX (fully on)
+} led_bank_frame_t;
+
+// Target of one led in the shared control page
+typedef struct led_shm_led_s
+{
+  __u32 state;                    // LED_SHM_STATE_*
+  __u32 brightness;               // 0 (off) to LED_IOC_BRIGHTNESS_MAX (fully on)
+  __u32 blink_on_period_us;       // The blink fields are only used in LED_SHM_STATE_BLINK
+  __u32 blink_off_period_us;
+  __u32 blink_phase_offset_us;
+  __u32 reserved[3];
+} led_shm_led_t;
+
+// Page mapped by mmap() on the custom_gpio_led_bank device, index n is led custom_gpio_led_n.
+// The kernel checks the page for changes and only applies the leds whose targets changed, so to update leds:
+//   1. Increment seq (making it odd) and do a write barrier
+//   2. Write the new targets
+//   3. Do a write barrier and increment seq again (making it even)
+// The kernel skips the page while seq is odd and applies it once seq is even and different from applied_seq.
+typedef struct led_shm_page_s
+{
+  __u32 seq;                                // Written by userspace
+  __u32 applied_seq;                        // Written by the kernel, the seq of the last targets applied
+  __s32 last_error;                         // Written by the kernel, the error from applying them (0 on success)
+  __u32 reserved;
+  led_shm_led_t leds[LED_BANK_MAX_LEDS];
+} led_shm_page_t;
+
+#endif
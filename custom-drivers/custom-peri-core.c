@@ -0,0 +1,88 @@
+// Shared core of the custom modules. It maps the peripheral window of the SoC once, and the gpio and pwm modules
+// (and any later ones, like the timer, DMA or SPI) get their registers out of that mapping with peri_core_get_regs()
+// instead of each making its own. The register accessors are in custom-peri-core.h.
+//
+// The window is found from the SoC in the device tree (see custom-driver-platform.h), and the register ranges the
+// modules pass in are the addresses the kernel translated from their device tree nodes, so a range outside of the
+// window means the node doesn't match the board.
+
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <asm/io.h>
+
+#include "custom-peri-core.h"
+#include "custom-driver-platform.h"
+#include "custom-errno.h"
+
+
+/***************    Macros    ***************/
+
+#define PERI_CORE_WINDOW_SIZE   (0x01000000)    // 16 MiB of peripherals from the peripheral base, the same on every SoC
+
+
+/***************    Function declarations    ***************/
+
+// Static functions
+static int __init peri_core_init(void);
+static void __exit peri_core_exit(void);
+
+
+/***************    Private variables    ***************/
+
+static phys_addr_t peri_window_base = 0;
+static void __iomem *peri_window = NULL;
+
+
+/***************    Function Definitions    ***************/
+
+static int __init peri_core_init(void)
+{
+  peri_window_base = custom_get_peri_base();
+  peri_window = ioremap(peri_window_base, PERI_CORE_WINDOW_SIZE);
+
+  if (NULL == peri_window)
+  {
+    pr_err("Peripheral core couldn't map the peripheral window at %pa!\n", &peri_window_base);
+    return -EMAPPING;
+  }
+
+  printk("Peripheral core mapped the peripheral window at %pa\n", &peri_window_base);
+  return ENONE;
+}
+
+static void __exit peri_core_exit(void)
+{
+  // The modules using the window depend on this one, so they are all gone by now
+  iounmap(peri_window);
+
+  printk("Peripheral core exited\n");
+}
+
+// Gets the registers at phys_addr (e.g. from a platform device resource) out of the shared mapping.
+// The mapping lasts as long as this module, which can't be removed while the caller's module uses it.
+//
+// Ret values:  The mapped registers, or NULL if phys_addr to phys_addr + size isn't in the peripheral window.
+void __iomem *peri_core_get_regs(phys_addr_t phys_addr, size_t size)
+{
+  if ((peri_window_base > phys_addr) || (PERI_CORE_WINDOW_SIZE < size)
+      || ((PERI_CORE_WINDOW_SIZE - size) < (phys_addr - peri_window_base)))
+  {
+    pr_err("Registers at %pa (%zu bytes) aren't in the peripheral window at %pa!\n", &phys_addr, size, &peri_window_base);
+    return NULL;
+  }
+
+  return peri_window + (phys_addr - peri_window_base);
+}
+
+
+module_init(peri_core_init);
+module_exit(peri_core_exit);
+
+EXPORT_SYMBOL(peri_core_get_regs);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Trevor Foland");
+MODULE_DESCRIPTION("A practice Linux driver that maps the peripheral registers once for the other custom drivers.");
+MODULE_VERSION("1.0");
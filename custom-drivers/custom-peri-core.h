@@ -0,0 +1,105 @@
+#ifndef CUSTOM_PERI_CORE_H
+#define CUSTOM_PERI_CORE_H
+
+// Shared register access layer of the custom modules (see custom-peri-core.c).
+//
+// The peripheral window is mapped once by the core module and the other modules get their registers out of it
+// with peri_core_get_regs(). Registers are then only accessed through the helpers below, so every access is a
+// relaxed MMIO access unless it needs a barrier, and registers that only the driver writes can be kept in a shadow
+// so changing some of their fields doesn't need an uncached read over the peripheral bus.
+
+#include <linux/types.h>
+#include <linux/io.h>
+
+/***************    Type definitions    ***************/
+
+// RAM copy of a register with no bits that the hardware changes. The owner of the register serializes the updates.
+typedef struct peri_shadow_reg_s
+{
+  void __iomem *p_reg;
+  uint32_t val;
+} peri_shadow_reg_t;
+
+
+/***************    Function declarations    ***************/
+
+void __iomem *peri_core_get_regs(phys_addr_t phys_addr, size_t size);
+
+
+/***************    Function Definitions    ***************/
+
+// Relaxed accessors. Accesses to the registers of one peripheral stay in program order, which is all a register
+// sequence of one block needs, so they skip the barriers that readl()/writel() add around every access.
+static inline uint32_t peri_read(void __iomem *p_regs, uint32_t offset)
+{
+  return readl_relaxed(p_regs + offset);
+}
+
+static inline void peri_write(void __iomem *p_regs, uint32_t offset, uint32_t val)
+{
+  writel_relaxed(val, p_regs + offset);
+}
+
+// For a write that must not pass earlier writes to normal memory, like enabling a DMA request for a buffer
+// the cpu just filled.
+static inline void peri_write_ordered(void __iomem *p_regs, uint32_t offset, uint32_t val)
+{
+  writel(val, p_regs + offset);
+}
+
+// The peripherals sit on different AXI ports and their accesses can be reordered against each other
+// (BCM2835 peripherals doc, section 1.3). Use these when a sequence moves from one peripheral to another:
+// peri_write_barrier() before the first write to the next one, peri_read_barrier() after the last read of the last one.
+static inline void peri_write_barrier(void)
+{
+  wmb();
+}
+
+static inline void peri_read_barrier(void)
+{
+  rmb();
+}
+
+// Reads the register once, after that it is only ever written
+static inline void peri_shadow_init(peri_shadow_reg_t *p_shadow, void __iomem *p_reg)
+{
+  p_shadow->p_reg = p_reg;
+  p_shadow->val = readl_relaxed(p_reg);
+}
+
+static inline uint32_t peri_shadow_get(peri_shadow_reg_t const *p_shadow)
+{
+  return p_shadow->val;
+}
+
+static inline void peri_shadow_write(peri_shadow_reg_t *p_shadow, uint32_t val)
+{
+  p_shadow->val = val;
+  writel_relaxed(val, p_shadow->p_reg);
+}
+
+// Clears clear_mask and then sets set_mask in the register, without writing it if nothing changes.
+//
+// Ret values:  Whether the register was written.
+static inline bool peri_shadow_update(peri_shadow_reg_t *p_shadow, uint32_t clear_mask, uint32_t set_mask)
+{
+  uint32_t val = (p_shadow->val & ~clear_mask) | set_mask;
+
+  if (val == p_shadow->val)
+  {
+    return false;
+  }
+
+  peri_shadow_write(p_shadow, val);
+
+  return true;
+}
+
+// Writes the shadow with one shot bits (bits that act when written as a 1 and read back as 0, like the clear FIFO bit
+// of the pwm) added, which are not kept in the shadow.
+static inline void peri_shadow_write_with_action(peri_shadow_reg_t *p_shadow, uint32_t action_mask)
+{
+  writel_relaxed(p_shadow->val | action_mask, p_shadow->p_reg);
+}
+
+#endif
@@ -1,12 +1,26 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/version.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
 #include <asm/io.h>
 
 #include "custom-driver-shared-info.h"
+#include "custom-driver-platform.h"
+#include "custom-peri-core.h"
 #include "custom-pwm-driver.h"
 #include "custom-errno.h"
+#include "custom-driver-trace.h"
 
 
 // NOTE: The PWM doesn't have the best documentation. Therefore, I had to do a lot of searching of forums to find decent documentation. Even then
@@ -16,16 +30,18 @@
 //          - https://elinux.org/The_Undocumented_Pi (this helps understand the clock tree which isn't documented and tells us that 19.2 MHz is what the PWM peripheral runs at).
 //          - https://elinux.org/BCM2835_registers#CM (this shows different registers of the BCM2835 that you might not find in the original peripheral documentation)
 //
-//       What you can gather from these 2 resources is that peripheral clocks run at 19.2 MHz (for Raspberry Pi 3) and that the clock registers for the PWM peripheral
+//       What you can gather from these 2 resources is that peripheral clocks run at 19.2 MHz (for Raspberry Pi 3, 54 MHz for the Pi 4) and that the clock registers for the PWM peripheral
 //       function similarly to the GPIO clock registers. Again, there really isn't any good documentation available for the clocks on the Raspberry Pi and it honestly
 //       is very annoying.
 //
-//       For now I just use the default 19.2 MHz clock rate for the PWM peripheral and adapt it to what I need using the PWM range registers.
-//       I won't mess with the clock divisors right now since I don't have time to verify that the undocumented registers work like I hope they do.
+//       The PWM clock is run off of the 19.2 MHz oscillator (or PLLD with the use_plld_clk module parameter) through the CM_PWMCTL/CM_PWMDIV
+//       clock manager registers, which work like the GPIO clock registers (see the BCM2835 peripherals doc, section 6.3).
+//       While neither channel is enabled or streaming the clock is gated (ENAB cleared) so the PWM block stops switching, and it is
+//       started again by the next pwm_enable(true) or pwm_stream_start(). The divisor is kept while gated, so waking only needs the ENAB write.
 //
 //       To get the ultimate pwm cycle rate you can use the calculation: pwm_cycle_rate = (clock_rate / clock_divisor / pwm_range_val).
-//       Since I just use the default for now and will only be dealing with percentages with no fractions I will use the formula: 4000 Hz = (19.2 MHz / 1 / (19200 / 4))
-//       or more simply 4000 Hz = (19.2 MHz / 4800)
+//       For example 4000 Hz = (19.2 MHz / 1 / 4800). The clock divisor is shared by both channels, so it is picked when the first channel
+//       is set up to keep the range at no more than 65536 steps, and the range of each channel is then picked for its own cycle rate.
 //
 //       I picked 4 kHz since the research I did showed that above 1 kHz most people can't perceive flickering LEDs while moving. (I've read that 300 Hz for 
 //       stationary LEDs works well for preventing the perception of flickering for most people as well, but if moving, people can identify flickering more from the peripherals
@@ -35,11 +51,62 @@
 
 /***************    Macros    ***************/
 
-// Peripheral addresses
-#define PWM_BASE              (BCM2837_PERI_BASE + 0x20C000)
+// Platform device. The device tree node has the PWM registers first and the PWM clock manager registers second,
+// without one they are found from the peripheral base of the SoC.
+#define PWM_PLATFORM_NAME     "custom-pwm"
+#define PWM_DT_COMPATIBLE     "custom,bcm2835-pwm"
+#define PWM_PERI_OFFSET       (0x20C000)           // Offset of the PWM registers from the peripheral base
 #define PWM_SIZE              (0x28)               // PWM peripheral memory area in bytes
 
-#define PWM_CLK_RATE          (19200000)  // It is 19.2 MHz by default
+// PWM register offsets in bytes. Datasheet calls the channels 0 and 1 but puts 1 and 2 as the register names.
+// I stuck with 1 and 2 since it makes the doc easier to search.
+#define PWM_CTL_OFFSET        (0x00)
+#define PWM_STA_OFFSET        (0x04)
+#define PWM_DMAC_OFFSET       (0x08)
+#define PWM_RNG1_OFFSET       (0x10)
+#define PWM_DAT1_OFFSET       (0x14)
+#define PWM_RNG2_OFFSET       (0x20)
+#define PWM_DAT2_OFFSET       (0x24)
+
+#define PWM_BCM2835_OSC_RATE  (19200000)  // It is 19.2 MHz by default (BCM2835 to BCM2837)
+#define PWM_BCM2711_OSC_RATE  (54000000)
+#define PWM_BCM2835_PLLD_RATE (500000000)
+#define PWM_BCM2711_PLLD_RATE (750000000)
+
+// Clock manager (CM) registers of the PWM clock
+#define CM_PWM_PERI_OFFSET          (0x1010A0)
+#define CM_PWM_SIZE                 (0x08)
+#define CM_PWM_CTL_OFFSET           (0x00)
+#define CM_PWM_DIV_OFFSET           (0x04)
+#define CM_PASSWD                   (0x5AU << 24)   // Every write to a clock manager register must include the password
+#define CM_CTL_SRC_OSC              (1U)            // 19.2 MHz (54 MHz on BCM2711) oscillator
+#define CM_CTL_SRC_PLLD             (6U)
+#define CM_CTL_ENAB_FIELD           (1U << 4)
+#define CM_CTL_BUSY_FIELD           (1U << 7)
+#define CM_DIV_DIVI_SHIFT           (12)
+#define CM_BUSY_WAIT_MAX_US         (100)
+#define CM_WAKE_WAIT_MAX_US         (5)             // Waking is on the pwm_enable() path with irqs off, so it only waits briefly
+
+#define PWM_DEBUGFS_DIR_NAME        "custom_pwm"
+
+#define PWM_MIN_CLK_DIV             (1)
+#define PWM_MAX_CLK_DIV             (4095)          // The integer part of the divisor is a 12 bit field
+#define PWM_MIN_RANGE_VAL           (100)           // Any fewer steps and a 1% change in duty cycle can't be represented
+#define PWM_TARGET_MAX_RANGE_VAL    (65536)         // More steps than this add no useful resolution, so a larger clock divisor is used instead
+
+// FIFO streaming defines
+#define PWM_FIF1_OFFSET             (0x18)
+#define PWM_FIF1_BUS_ADDR           (BCM283X_PERI_BUS_BASE + PWM_PERI_OFFSET + PWM_FIF1_OFFSET) // The DMA engine uses bus addresses, not physical addresses
+#define PWM_DMA_DREQ                (5)       // DREQ (peripheral pacing signal) number of the PWM for the DMA engine
+#define PWM_DMA_NAME                "rx-tx"   // dma-names entry of the "dmas" property that has the DREQ
+#define PWM_STREAM_BUF_SIZE         (PWM_STREAM_MAX_SAMPLES * sizeof(uint32_t))
+
+// PWM DMAC Fields
+#define DMAC_ENAB_FIELD             (1U << 31)
+#define DMAC_PANIC_SHIFT            (8)
+#define DMAC_DREQ_SHIFT             (0)
+#define DMAC_THRESHOLD              (7U)      // Reset value, the DMA is asked for more samples once the FIFO has this many or less
+#define DMAC_STREAM_VAL             (DMAC_ENAB_FIELD | (DMAC_THRESHOLD << DMAC_PANIC_SHIFT) | (DMAC_THRESHOLD << DMAC_DREQ_SHIFT))
 
 // PWM CTL Fields
 // These fields are to be used with the pwm_ctl_field_t as a sort of enum. We don't use
@@ -69,142 +136,361 @@
 
 typedef uint32_t pwm_ctl_field_t;
 
-// Datasheet calls the channels 0 and 1 but puts 1 and 2 as the register names.
-// I stuck with 1 and 2 since it makes the doc easier to search.
-typedef struct pwm_perph_s
+// Clock gating counts and the time from setting ENAB to the clock manager reporting BUSY (running) again.
+// Protected by pwm_lock.
+typedef struct pwm_clk_gate_stats_s
+{
+  u64 gate_cnt;
+  u64 wake_cnt;               // Timed wakes, of a clock that had stopped
+  u64 wake_early_cnt;         // Wakes that came before BUSY dropped after the gate, which aren't timed
+  u64 wake_timeout_cnt;       // Wakes where BUSY wasn't seen within CM_WAKE_WAIT_MAX_US
+  u64 wake_last_ns;
+  u64 wake_max_ns;
+  u64 wake_total_ns;
+} pwm_clk_gate_stats_t;
+
+typedef struct pwm_clk_cfg_s
 {
-  uint32_t volatile ctl;
-  uint32_t volatile sta;
-  uint32_t volatile dmac;
-  uint32_t volatile reserved_0;
-  uint32_t volatile rng_1;
-  uint32_t volatile dat_1;
-  uint32_t volatile fif_1;
-  uint32_t volatile reserved_1;
-  uint32_t volatile rng_2;
-  uint32_t volatile dat_2;
-} pwm_perph_t;
+  uint32_t clk_div;
+  uint32_t range_val;
+} pwm_clk_cfg_t;
+
+// Cached so the duty cycle can be calculated without reading the range register back
+typedef struct pwm_channel_cfg_s
+{
+  pwm_cycle_freq_t cycle_freq;    // PWM_INVALID_FREQ when the channel isn't in use
+  uint32_t range_val;
+  uint32_t duty_u16_mult;         // 16.16 fixed point range_val / PWM_DUTY_U16_MAX, so a 16 bit duty maps to counts without a division
+} pwm_channel_cfg_t;
+
+// There is only one FIFO shared by both channels, so only one channel can stream at a time.
+typedef struct pwm_stream_s
+{
+  struct dma_chan *p_dma_chan;        // From the "dmas" property at probe, or the first stream on the fallback device
+  uint32_t *p_samples;                // Ring buffer of samples that the DMA engine reads from
+  dma_addr_t samples_dma_addr;
+  dma_cookie_t dma_cookie;
+  pwm_channel_t pwm_channel;          // NOT_PWM when nothing is streaming
+} pwm_stream_t;
 
 
 /***************    Function declarations    ***************/
 
 // Inline functions
-static inline bool validate_cycle_freq(pwm_cycle_freq_t cycle_freq);
 static inline bool validate_pwm_channel(pwm_channel_t pwm_channel);
-static inline uint32_t calc_pwm_range_val_from_cycle_freq(pwm_cycle_freq_t cycle_freq);
+static inline uint32_t pwm_get_clk_src(void);
+static inline uint32_t pwm_get_clk_src_rate(void);
 static inline uint32_t calc_pwm_data_val_from_percent(int percent, uint32_t pwm_range_val);
 static inline void pwm_reset_pwm_channels(void);
 static inline int pwm_get_channel_range_val(pwm_channel_t pwm_channel, uint32_t *range_val);
 static inline void pwm_set_channel_data_val(pwm_channel_t pwm_channel, uint32_t data_val);
+static inline void pwm_cache_channel_range_val(pwm_channel_t pwm_channel, uint32_t range_val);
+static inline bool pwm_is_channel_streaming(pwm_channel_t pwm_channel);
+static inline pwm_ctl_field_t pwm_get_stream_ctl_fields(pwm_channel_t pwm_channel, uint32_t flags);
+static inline pwm_ctl_field_t pwm_get_mode_ctl_fields(pwm_channel_t pwm_channel, uint32_t mode_flags);
+static inline void pwm_clk_gate_locked(void);
 
 // Static functions
 static int __init pwm_driver_init(void);
 static void __exit pwm_driver_exit(void);
-static int pwm_init_pwm_channel(pwm_channel_t pwm_channel, uint32_t initial_data_value, uint32_t initial_range_value, bool is_enabled_initially);
+static int pwm_probe(struct platform_device *p_pdev);
+static CUSTOM_PLATFORM_REMOVE_RET_T pwm_remove(struct platform_device *p_pdev);
+static int pwm_init_pwm_channel(pwm_channel_t pwm_channel, uint32_t initial_data_value, uint32_t initial_range_value, uint32_t mode_flags, bool is_enabled_initially);
+static int pwm_stream_setup_dma(void);
+static int pwm_calc_clk_cfg(pwm_channel_t pwm_channel, pwm_cycle_freq_t cycle_freq, pwm_clk_cfg_t *clk_cfg);
+static int pwm_set_clk_div(uint32_t clk_div);
+static void pwm_stream_stop_locked(void);
+static void pwm_clk_ungate_locked(void);
+static void pwm_update_clk_gate_locked(void);
+static void pwm_debugfs_init(void);
+static int pwm_clk_stats_show(struct seq_file *p_seq, void *p_data);
+static int pwm_clk_stats_open(struct inode *p_inode, struct file *p_file);
 
 /***************    Private variables    ***************/
 
-static pwm_perph_t * pwm_perph = NULL;
-static DEFINE_MUTEX(pwm_mutex);
+static bool use_plld_clk = false;
+module_param(use_plld_clk, bool, 0444);
+MODULE_PARM_DESC(use_plld_clk, "Run the PWM clock off of PLLD instead of the oscillator for more resolution at high frequencies (default false)");
+
+static unsigned int plld_clk_rate_hz = 0;
+module_param(plld_clk_rate_hz, uint, 0444);
+MODULE_PARM_DESC(plld_clk_rate_hz, "Rate of PLLD in Hz (default 0, 500000000 or 750000000 on the BCM2711)");
+
+// Rates of the clock sources on the SoC the driver was bound on
+static uint32_t pwm_osc_rate_hz = PWM_BCM2835_OSC_RATE;
+static uint32_t pwm_plld_rate_hz = PWM_BCM2835_PLLD_RATE;
+
+static bool clk_gating = true;
+module_param(clk_gating, bool, 0644);
+MODULE_PARM_DESC(clk_gating, "Stop the PWM clock while neither channel is enabled, takes effect on the next channel change (default true)");
+
+// Both are part of the shared peripheral mapping, see custom-peri-core.c
+static void __iomem *pwm_regs = NULL;
+static void __iomem *cm_pwm_regs = NULL;
+
+// Only the driver changes the CTL register, so it is kept in RAM and every field change is a single write
+// without reading the register back over the peripheral bus. Protected by pwm_lock.
+static peri_shadow_reg_t pwm_ctl_shadow;
+static uint32_t pwm_clk_div = 0;    // 0 until the clock has been programmed, protected by pwm_lock
+static pwm_channel_cfg_t pwm_channel_cfgs[NOT_PWM];
+static bool pwm_clk_is_gated = false;   // Protected by pwm_lock
+static pwm_clk_gate_stats_t pwm_clk_gate_stats;
+
+// Raw spinlock so the exported functions can be called from atomic context (irq handlers, hrtimer callbacks, etc.).
+// It only protects the register read-modify-writes, so it is never held for long and nothing that sleeps
+// or logs to the console is done while holding it.
+static DEFINE_RAW_SPINLOCK(pwm_lock);
+
+// Divisor changes wait for the clock to stop without pwm_lock, so they are serialized by pwm_clk_mutex instead.
+// While pwm_clk_is_stopping is set the gating leaves the clock alone (protected by pwm_lock).
+static DEFINE_MUTEX(pwm_clk_mutex);
+static bool pwm_clk_is_stopping = false;
+
+// Streaming is only ever started or stopped from process context since the DMA setup can sleep
+static DEFINE_MUTEX(pwm_stream_mutex);
+static pwm_stream_t pwm_stream =
+{
+  .p_dma_chan = NULL,
+  .p_samples = NULL,
+  .pwm_channel = NOT_PWM,
+};
+
+static struct file_operations const pwm_clk_stats_fops =
+{
+  .owner = THIS_MODULE,
+  .open = pwm_clk_stats_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static struct dentry *p_pwm_debugfs_dir = NULL;
+
+static struct of_device_id const pwm_of_match[] =
+{
+  { .compatible = PWM_DT_COMPATIBLE },
+  { }
+};
+
+static struct platform_driver pwm_platform_driver =
+{
+  .probe = pwm_probe,
+  .remove = pwm_remove,
+  .driver =
+  {
+    .name = PWM_PLATFORM_NAME,
+    .of_match_table = pwm_of_match,
+    .suppress_bind_attrs = true,    // The led module calls into this one, so it can't be unbound from under it
+  },
+};
+
+static struct platform_device *p_pwm_fallback_dev = NULL;  // Only made when there is no device tree node
 
 
 /***************    Function Definitions    ***************/
 
 static int __init pwm_driver_init(void)
 {
-  // Attempt to map the PWM peripheral
-  pwm_perph = (pwm_perph_t *)(ioremap(PWM_BASE, PWM_SIZE));  // Note, a page size always has to be allocated, so even if it is under a page, it still takes up a page of memory.
+  phys_addr_t peri_base = custom_get_peri_base();
+  struct resource fallback_res[] =
+  {
+    DEFINE_RES_MEM(peri_base + PWM_PERI_OFFSET, PWM_SIZE),
+    DEFINE_RES_MEM(peri_base + CM_PWM_PERI_OFFSET, CM_PWM_SIZE),
+  };
+
+  int error = custom_platform_driver_register(&pwm_platform_driver, fallback_res, ARRAY_SIZE(fallback_res), &p_pwm_fallback_dev);
 
-  // For some reason the mapping failed
-  if (NULL == pwm_perph)
+  if (ENONE != error)
   {
-    // Exit immediately
-    pr_err("PWM driver couldn't map the io space!\n");
-    return -EMAPPING;
+    pr_err("PWM driver couldn't be bound to a device! error: %d\n", error);
+    return error;
   }
-  else
+
+  printk("PWM driver successfully initialized\n");
+  return ENONE;
+}
+
+static void __exit pwm_driver_exit(void)
+{
+  custom_platform_driver_unregister(&pwm_platform_driver, p_pwm_fallback_dev);
+
+  printk("PWM driver exited\n");
+}
+
+// Ret values:  ENONE         - success
+//              -EBUSY        - failure, the driver is already bound to another device
+//              -EINVAL       - failure, the device is missing (or has too small of) a register range
+//              -EPROBE_DEFER - failure, the DMA controller of the "dmas" property isn't probed yet
+//              -EMAPPING     - failure, the registers aren't in the shared peripheral mapping
+static int pwm_probe(struct platform_device *p_pdev)
+{
+  // The exported apis work on a single PWM block
+  if (NULL != pwm_regs)
   {
-    printk("PWM successfully mapped\n");
+    pr_err("PWM driver is already bound to a device!\n");
+    return -EBUSY;
   }
 
-  mutex_init(&pwm_mutex);
+  struct resource *p_pwm_res = platform_get_resource(p_pdev, IORESOURCE_MEM, 0);
+  struct resource *p_cm_res = platform_get_resource(p_pdev, IORESOURCE_MEM, 1);
+
+  if ((NULL == p_pwm_res) || (NULL == p_cm_res) || (PWM_SIZE > resource_size(p_pwm_res)) || (CM_PWM_SIZE > resource_size(p_cm_res)))
+  {
+    pr_err("PWM device needs the PWM and the PWM clock manager register ranges!\n");
+    return -EINVAL;
+  }
+
+  // The "dmas" property gives the channel along with the PWM DREQ, which is the only way to set the DREQ since 5.17.
+  // Streaming is optional, so a node without the property (or the fallback device) only loses it.
+  if (NULL != p_pdev->dev.of_node)
+  {
+    struct dma_chan *p_dma_chan = dma_request_chan(&(p_pdev->dev), PWM_DMA_NAME);
+
+    if (IS_ERR(p_dma_chan))
+    {
+      if (-EPROBE_DEFER == PTR_ERR(p_dma_chan))
+      {
+        return -EPROBE_DEFER;
+      }
+
+      pr_err("PWM device has no \"%s\" DMA channel, streaming is disabled! error: %ld\n", PWM_DMA_NAME, PTR_ERR(p_dma_chan));
+    }
+    else
+    {
+      pwm_stream.p_dma_chan = p_dma_chan;
+    }
+  }
+
+  bool is_bcm2711 = custom_soc_is_bcm2711();
+
+  // The device tree node can also give the oscillator rate, for boards that don't run it at the SoC default
+  pwm_osc_rate_hz = is_bcm2711 ? PWM_BCM2711_OSC_RATE : PWM_BCM2835_OSC_RATE;
+  of_property_read_u32(p_pdev->dev.of_node, "clock-frequency", &pwm_osc_rate_hz);
+  pwm_plld_rate_hz = (0 != plld_clk_rate_hz) ? plld_clk_rate_hz : (is_bcm2711 ? PWM_BCM2711_PLLD_RATE : PWM_BCM2835_PLLD_RATE);
+
+  // The registers come out of the mapping the peripheral core made, so nothing is mapped (or unmapped) here
+  cm_pwm_regs = peri_core_get_regs(p_cm_res->start, CM_PWM_SIZE);
+  pwm_regs = peri_core_get_regs(p_pwm_res->start, PWM_SIZE);
+
+  if ((NULL == pwm_regs) || (NULL == cm_pwm_regs))
+  {
+    // Exit immediately
+    pr_err("PWM driver couldn't get its registers from the peripheral core!\n");
+    pwm_regs = NULL;
+    cm_pwm_regs = NULL;
+
+    if (NULL != pwm_stream.p_dma_chan)
+    {
+      dma_release_channel(pwm_stream.p_dma_chan);
+      pwm_stream.p_dma_chan = NULL;
+    }
+
+    return -EMAPPING;
+  }
+
+  printk("PWM registers at %pa, %u Hz oscillator\n", &(p_pwm_res->start), pwm_osc_rate_hz);
+
+  peri_shadow_init(&pwm_ctl_shadow, pwm_regs + PWM_CTL_OFFSET);
+
+  pwm_debugfs_init();
 
-  printk("PWM driver successfully initialized\n");
   return ENONE;
 }
 
-static void __exit pwm_driver_exit(void)
+static CUSTOM_PLATFORM_REMOVE_RET_T pwm_remove(struct platform_device *p_pdev)
 {
-  // If the gpio was successfully mapped
-  if (NULL != pwm_perph)
+  debugfs_remove_recursive(p_pwm_debugfs_dir);
+  p_pwm_debugfs_dir = NULL;
+
+  mutex_lock(&pwm_stream_mutex);
+
+  pwm_stream_stop_locked();
+
+  if (NULL != pwm_stream.p_samples)
   {
-    // Reset the pwm channels to inital values before unmapping
-    pwm_reset_pwm_channels();
+    dma_free_coherent(pwm_stream.p_dma_chan->device->dev, PWM_STREAM_BUF_SIZE, pwm_stream.p_samples, pwm_stream.samples_dma_addr);
+    pwm_stream.p_samples = NULL;
+  }
 
-    // Release the GPIO mapping
-    printk("Released PWM mapping\n");
-    iounmap(pwm_perph);
+  if (NULL != pwm_stream.p_dma_chan)
+  {
+    dma_release_channel(pwm_stream.p_dma_chan);
+    pwm_stream.p_dma_chan = NULL;
   }
-  
-  mutex_destroy(&pwm_mutex);
 
-  printk("PWM driver exited\n");
+  mutex_unlock(&pwm_stream_mutex);
+
+  // Reset the pwm channels to inital values before unmapping
+  pwm_reset_pwm_channels();
+
+  // The mapping belongs to the peripheral core
+  printk("Released PWM registers\n");
+  pwm_regs = NULL;
+
+  // With both channels reset the clock is left gated (unless clk_gating is off), with its divisor still set
+  cm_pwm_regs = NULL;
+  pwm_clk_div = 0;
+  pwm_clk_is_gated = false;
+
+  CUSTOM_PLATFORM_REMOVE_RETURN;
 }
 
-static int pwm_init_pwm_channel(pwm_channel_t pwm_channel, uint32_t initial_data_value, uint32_t initial_range_value, bool is_enabled_initially)
+static int pwm_init_pwm_channel(pwm_channel_t pwm_channel, uint32_t initial_data_value, uint32_t initial_range_value, uint32_t mode_flags, bool is_enabled_initially)
 {
   int error = ENONE;
+  unsigned long irq_flags;
+  pwm_ctl_field_t mode_ctl_fields = pwm_get_mode_ctl_fields(pwm_channel, mode_flags);
 
-  mutex_lock(&pwm_mutex);
+  custom_trace("Trying to initialize PWM channel %d with initial_data_value: %u, initial_range_value: %u, mode_flags: %#x, is_enabled_initially: %d\n", 
+               pwm_channel, initial_data_value, initial_range_value, mode_flags, is_enabled_initially
+              );
 
-  printk("Trying to initialize PWM channel %d with initial_data_value: %d, initial_range_value: %d, is_enabled_initially: %d\n", 
-          pwm_channel, initial_data_value, initial_range_value, is_enabled_initially
-        );
+  raw_spin_lock_irqsave(&pwm_lock, irq_flags);
 
   switch (pwm_channel)
   {
     case PWM_0:
       // Clear the lower 8 bits of the register since these are all
       // for PWM_0
-      pwm_perph->ctl &= 0xFFFFFF00;
-      pwm_perph->rng_1 = initial_range_value;
-      pwm_perph->dat_1 = initial_data_value;
-      
-
-      if (is_enabled_initially)
-      {
-        pwm_perph->ctl |= PWEN_1_FIELD;
-      }
+      peri_shadow_update(&pwm_ctl_shadow, 0x000000FF, 0);
+      peri_write(pwm_regs, PWM_RNG1_OFFSET, initial_range_value);
+      peri_write(pwm_regs, PWM_DAT1_OFFSET, initial_data_value);
+      pwm_cache_channel_range_val(PWM_0, initial_range_value);
+      peri_shadow_update(&pwm_ctl_shadow, 0, mode_ctl_fields | (is_enabled_initially ? PWEN_1_FIELD : 0));
 
       break;
 
     case PWM_1:
       // Clear the second lowest 8 bits of the register since these are all
       // for PWM_1
-      pwm_perph->ctl &= 0xFFFF00FF;
-      pwm_perph->rng_2 = initial_range_value;
-      pwm_perph->dat_2 = initial_data_value;
-      
-
-      if (is_enabled_initially)
-      {
-        pwm_perph->ctl |= PWEN_2_FIELD;
-      }
+      peri_shadow_update(&pwm_ctl_shadow, 0x0000FF00, 0);
+      peri_write(pwm_regs, PWM_RNG2_OFFSET, initial_range_value);
+      peri_write(pwm_regs, PWM_DAT2_OFFSET, initial_data_value);
+      pwm_cache_channel_range_val(PWM_1, initial_range_value);
+      peri_shadow_update(&pwm_ctl_shadow, 0, mode_ctl_fields | (is_enabled_initially ? PWEN_2_FIELD : 0));
 
       break;
 
     default:
       // Exit immediately
-      pr_err("PWM channel %d doesn't exist!\n", pwm_channel);
       error = -EINVFUNC;
-      goto exit_release_mutex;
       break;
   }
 
-  printk("PWM ctl reg val: %d, data1 val: %d, range1 val: %d, data2 val: %d, range2 val: %d\n", pwm_perph->ctl, pwm_perph->dat_1, pwm_perph->rng_1, pwm_perph->dat_2, pwm_perph->rng_2);
+  pwm_update_clk_gate_locked();
+
+  raw_spin_unlock_irqrestore(&pwm_lock, irq_flags);
+
+  if (ENONE != error)
+  {
+    pr_err("PWM channel %d doesn't exist!\n", pwm_channel);
+    return error;
+  }
+
+  custom_trace("PWM ctl reg val: %#x, data1 val: %u, range1 val: %u, data2 val: %u, range2 val: %u\n",
+               peri_shadow_get(&pwm_ctl_shadow), peri_read(pwm_regs, PWM_DAT1_OFFSET), peri_read(pwm_regs, PWM_RNG1_OFFSET),
+               peri_read(pwm_regs, PWM_DAT2_OFFSET), peri_read(pwm_regs, PWM_RNG2_OFFSET));
 
-exit_release_mutex:
-  mutex_unlock(&pwm_mutex);
   return error;
 }
 
@@ -212,20 +498,24 @@ static inline void pwm_reset_pwm_channels(void)
 {
   // Set the pwm channel channels we have modified back to their
   // reset values listed in the peripheral data sheet.
-  pwm_init_pwm_channel(PWM_0, 0, 0x20, false);
-  pwm_init_pwm_channel(PWM_1, 0, 0x20, false);
+  pwm_init_pwm_channel(PWM_0, 0, 0x20, PWM_MODE_BALANCED, false);
+  pwm_init_pwm_channel(PWM_1, 0, 0x20, PWM_MODE_BALANCED, false);
+
+  pwm_channel_cfgs[PWM_0].cycle_freq = PWM_INVALID_FREQ;
+  pwm_channel_cfgs[PWM_1].cycle_freq = PWM_INVALID_FREQ;
 }
 
-static inline bool validate_cycle_freq(pwm_cycle_freq_t cycle_freq)
+static inline bool validate_pwm_channel(pwm_channel_t pwm_channel)
 {
-  switch (cycle_freq)
+  switch (pwm_channel)
   {
-    case PWM_FREQ_4_kHZ:
+    case PWM_0:
+    case PWM_1:
       return true;
       break;
-
+    
     default:
-      pr_err("PWM channel invalid cycle frequency of %d!\n", cycle_freq);
+      pr_err("PWM channel %d is an invalid channel!\n", pwm_channel);
       return false;
       break;
   }
@@ -233,32 +523,197 @@ static inline bool validate_cycle_freq(pwm_cycle_freq_t cycle_freq)
   return false;
 }
 
-static inline bool validate_pwm_channel(pwm_channel_t pwm_channel)
+static inline uint32_t pwm_get_clk_src(void)
 {
-  switch (pwm_channel)
+  return (use_plld_clk ? CM_CTL_SRC_PLLD : CM_CTL_SRC_OSC);
+}
+
+static inline uint32_t pwm_get_clk_src_rate(void)
+{
+  return (use_plld_clk ? pwm_plld_rate_hz : pwm_osc_rate_hz);
+}
+
+// Picks the clock divisor and range for a channel to run at cycle_freq. The clock divisor is shared by both
+// channels, so while the other channel is in use its divisor is kept and only the range is picked.
+//
+// Ret values:  ENONE     - success
+//              -EINVFUNC - failure, cycle_freq can't be reached with at least PWM_MIN_RANGE_VAL steps
+//
+// NOTE: Must be called with pwm_lock held.
+static int pwm_calc_clk_cfg(pwm_channel_t pwm_channel, pwm_cycle_freq_t cycle_freq, pwm_clk_cfg_t *clk_cfg)
+{
+  uint32_t clk_src_rate = pwm_get_clk_src_rate();
+  pwm_channel_t other_pwm_channel = (PWM_0 == pwm_channel) ? PWM_1 : PWM_0;
+
+  if (PWM_INVALID_FREQ == cycle_freq)
   {
-    case PWM_0:
-    case PWM_1:
-      return true;
+    return -EINVFUNC;
+  }
+
+  if ((0 != pwm_clk_div) && (PWM_INVALID_FREQ != pwm_channel_cfgs[other_pwm_channel].cycle_freq))
+  {
+    clk_cfg->clk_div = pwm_clk_div;
+  }
+  else
+  {
+    // Use the smallest divisor that keeps the range under PWM_TARGET_MAX_RANGE_VAL
+    clk_cfg->clk_div = DIV_ROUND_UP(clk_src_rate / cycle_freq, PWM_TARGET_MAX_RANGE_VAL);
+    clk_cfg->clk_div = clamp_t(uint32_t, clk_cfg->clk_div, PWM_MIN_CLK_DIV, PWM_MAX_CLK_DIV);
+  }
+
+  clk_cfg->range_val = DIV_ROUND_CLOSEST(clk_src_rate / clk_cfg->clk_div, cycle_freq);
+
+  if (PWM_MIN_RANGE_VAL > clk_cfg->range_val)
+  {
+    return -EINVFUNC;
+  }
+
+  return ENONE;
+}
+
+// The divisor must not be changed while the clock is running, and the clock only stops at the end of its current
+// divided cycle (up to ~200 us at the largest divisor). So the clock is stopped under pwm_lock, the wait for it to
+// stop is done without the lock with irqs on, and the divisor is written under the lock again.
+// On a timeout the clock is left gated with its old divisor, and woken again if a channel still needs it.
+//
+// Ret values:  ENONE       - success
+//              -ETIMEDOUT  - failure, the clock didn't stop in time to change the divisor
+//
+// NOTE: Must be called with pwm_clk_mutex held and without pwm_lock. Busy waits for at most CM_BUSY_WAIT_MAX_US,
+//       but can be preempted while it does.
+static int pwm_set_clk_div(uint32_t clk_div)
+{
+  uint32_t clk_src = pwm_get_clk_src();
+  unsigned long irq_flags;
+  int error = ENONE;
+
+  raw_spin_lock_irqsave(&pwm_lock, irq_flags);
+
+  peri_write(cm_pwm_regs, CM_PWM_CTL_OFFSET, CM_PASSWD | clk_src);
+  pwm_clk_is_stopping = true;
+
+  raw_spin_unlock_irqrestore(&pwm_lock, irq_flags);
+
+  for (uint32_t wait_us = 0; 0 != (peri_read(cm_pwm_regs, CM_PWM_CTL_OFFSET) & CM_CTL_BUSY_FIELD); wait_us++)
+  {
+    if (CM_BUSY_WAIT_MAX_US <= wait_us)
+    {
+      error = -ETIMEDOUT;
       break;
-    
-    default:
-      pr_err("PWM channel %d is an invalid channel!\n", pwm_channel);
-      return false;
+    }
+
+    udelay(1);
+  }
+
+  raw_spin_lock_irqsave(&pwm_lock, irq_flags);
+
+  pwm_clk_is_stopping = false;
+
+  if (ENONE == error)
+  {
+    peri_write(cm_pwm_regs, CM_PWM_DIV_OFFSET, CM_PASSWD | (clk_div << CM_DIV_DIVI_SHIFT));
+    peri_write(cm_pwm_regs, CM_PWM_CTL_OFFSET, CM_PASSWD | clk_src | CM_CTL_ENAB_FIELD);
+
+    // The channel is set up next, which is a different peripheral than the clock manager
+    peri_write_barrier();
+
+    pwm_clk_div = clk_div;
+    pwm_clk_is_gated = false;
+  }
+  else
+  {
+    pwm_clk_is_gated = true;
+    pwm_update_clk_gate_locked();
+  }
+
+  raw_spin_unlock_irqrestore(&pwm_lock, irq_flags);
+
+  return error;
+}
+
+// Clears ENAB, the clock manager then stops the clock at the end of its current cycle.
+// The divisor is left alone, so pwm_clk_ungate_locked() doesn't have to program it again.
+//
+// NOTE: Must be called with pwm_lock held.
+static inline void pwm_clk_gate_locked(void)
+{
+  peri_write(cm_pwm_regs, CM_PWM_CTL_OFFSET, CM_PASSWD | pwm_get_clk_src());
+
+  pwm_clk_is_gated = true;
+  pwm_clk_gate_stats.gate_cnt++;
+}
+
+// Sets ENAB again and busy waits for the clock manager to report the clock as running, which is timed for the
+// wake latency stats. A wake that times out is only counted, since the channel is enabled either way
+// and the clock still starts as soon as the clock manager gets to it.
+//
+// The gate doesn't wait for the clock to stop (that takes up to a whole divided clock cycle), so a wake soon after it
+// can find BUSY still set. The clock then never stopped and there is nothing to time, so it is only counted as early.
+//
+// NOTE: Must be called with pwm_lock held. Busy waits for at most CM_WAKE_WAIT_MAX_US.
+static void pwm_clk_ungate_locked(void)
+{
+  bool is_still_running = (0 != (peri_read(cm_pwm_regs, CM_PWM_CTL_OFFSET) & CM_CTL_BUSY_FIELD));
+  u64 start_ns = ktime_get_ns();
+  u64 wake_ns;
+
+  peri_write(cm_pwm_regs, CM_PWM_CTL_OFFSET, CM_PASSWD | pwm_get_clk_src() | CM_CTL_ENAB_FIELD);
+
+  pwm_clk_is_gated = false;
+
+  if (is_still_running)
+  {
+    pwm_clk_gate_stats.wake_early_cnt++;
+    return;
+  }
+
+  // Polled without a delay so the latency isn't rounded up to whole microseconds
+  while (0 == (peri_read(cm_pwm_regs, CM_PWM_CTL_OFFSET) & CM_CTL_BUSY_FIELD))
+  {
+    if ((ktime_get_ns() - start_ns) >= (CM_WAKE_WAIT_MAX_US * NSEC_PER_USEC))
+    {
+      pwm_clk_gate_stats.wake_timeout_cnt++;
       break;
+    }
+
+    cpu_relax();
   }
 
-  return false;
+  wake_ns = ktime_get_ns() - start_ns;
+
+  pwm_clk_gate_stats.wake_cnt++;
+  pwm_clk_gate_stats.wake_last_ns = wake_ns;
+  pwm_clk_gate_stats.wake_total_ns += wake_ns;
+  pwm_clk_gate_stats.wake_max_ns = max(pwm_clk_gate_stats.wake_max_ns, wake_ns);
 }
 
-static inline uint32_t calc_pwm_range_val_from_cycle_freq(pwm_cycle_freq_t cycle_freq)
+// Gates the clock once neither channel is enabled or fed from the FIFO and wakes it when one is, so it has to be called
+// after every change of the PWEN and USEF fields. Nothing is done before the clock has been programmed, since there is
+// no divisor to run it at, or while pwm_set_clk_div() is changing the divisor, which runs the clock once it is done.
+//
+// NOTE: Must be called with pwm_lock held.
+static void pwm_update_clk_gate_locked(void)
 {
-  if (!validate_cycle_freq(cycle_freq))
+  if ((0 == pwm_clk_div) || pwm_clk_is_stopping)
   {
-    return 0;
+    return;
   }
 
-  return (PWM_CLK_RATE / cycle_freq);
+  // A streaming channel needs the clock to drain the FIFO and pace the DMA
+  pwm_ctl_field_t clk_ctl_fields = PWEN_1_FIELD | PWEN_2_FIELD | USEF_1_FIELD | USEF_2_FIELD;
+  bool is_clk_needed = (0 != (peri_shadow_get(&pwm_ctl_shadow) & clk_ctl_fields)) || !READ_ONCE(clk_gating);
+
+  // The PWEN write has to reach the PWM before the clock manager is told to start or stop its clock
+  if (is_clk_needed && pwm_clk_is_gated)
+  {
+    peri_write_barrier();
+    pwm_clk_ungate_locked();
+  }
+  else if (!is_clk_needed && !pwm_clk_is_gated)
+  {
+    peri_write_barrier();
+    pwm_clk_gate_locked();
+  }
 }
 
 static inline uint32_t calc_pwm_data_val_from_percent(int percent, uint32_t pwm_range_val)
@@ -281,44 +736,100 @@ static inline uint32_t calc_pwm_data_val_from_percent(int percent, uint32_t pwm_
     return 0;
   }
 
-  return ((pwm_range_val / 100) * percent);
+  // Multiply first so the range isn't truncated to a multiple of 100 before scaling
+  return ((pwm_range_val * (uint32_t)(percent)) / 100);
+}
+
+static inline void pwm_cache_channel_range_val(pwm_channel_t pwm_channel, uint32_t range_val)
+{
+  // Rounded up so a duty of PWM_DUTY_U16_MAX comes out as exactly range_val. div_u64() since a plain u64 division doesn't link on arm32
+  uint32_t duty_u16_mult = (uint32_t)(div_u64(((u64)(range_val) << 16) + PWM_DUTY_U16_MAX - 1, PWM_DUTY_U16_MAX));
+
+  WRITE_ONCE(pwm_channel_cfgs[pwm_channel].range_val, range_val);
+  WRITE_ONCE(pwm_channel_cfgs[pwm_channel].duty_u16_mult, duty_u16_mult);
+}
+
+static inline bool pwm_is_channel_streaming(pwm_channel_t pwm_channel)
+{
+  // The data register is ignored while the channel plays from the FIFO
+  return (pwm_channel == READ_ONCE(pwm_stream.pwm_channel));
 }
 
 static inline int pwm_get_channel_range_val(pwm_channel_t pwm_channel, uint32_t *range_val)
 {
-  switch (pwm_channel)
+  if (!validate_pwm_channel(pwm_channel))
   {
-    case PWM_0:
-      *range_val = pwm_perph->rng_1;
-      break;
-
-    case PWM_1:
-      *range_val = pwm_perph->rng_2;
-      break;
-    
-    default:
-      pr_err("PWM channel %d is an invalid channel!\n", pwm_channel);
-      return -EINVFUNC;
-      break;
+    return -EINVFUNC;
   }
 
+  *range_val = READ_ONCE(pwm_channel_cfgs[pwm_channel].range_val);
+
   return ENONE;
 }
 
-int pwm_init_user_device(pwm_channel_t pwm_channel, int duty_cycle, pwm_cycle_freq_t cycle_freq, bool is_enabled_initially)
+// Any cycle_freq can be used as long as the channel still gets at least PWM_MIN_RANGE_VAL steps.
+// The clock divisor and range for it are worked out here once and cached, so they are never recalculated
+// when the duty cycle changes. Since both channels share the clock divisor, the second channel to be set up
+// keeps the divisor of the first and only gets its own range.
+//
+// mode_flags picks how the duty cycle is output (see the PWM_MODE_* defines in the header).
+//
+// Ret values:  ENONE       - success
+//              -EINVFUNC   - failure, invalid pwm_channel, cycle_freq or mode_flags argument
+//              -ETIMEDOUT  - failure, the clock couldn't be reprogrammed
+//
+// NOTE: Can sleep, so it must not be called from atomic context.
+int pwm_init_user_device(pwm_channel_t pwm_channel, int duty_cycle, pwm_cycle_freq_t cycle_freq, uint32_t mode_flags, bool is_enabled_initially)
 {
-  uint32_t range_val = calc_pwm_range_val_from_cycle_freq(cycle_freq);
+  if (!validate_pwm_channel(pwm_channel))
+  {
+    return -EINVFUNC;
+  }
 
-  // Unsupported cycle_freq provided
-  if (0 == range_val)
+  if (0 != (mode_flags & ~PWM_MODE_VALID_MASK))
   {
-    pr_err("PWM channel %d has an invalid cycle frequency of %d!\n", pwm_channel, cycle_freq);
+    pr_err("PWM mode flags %#x are invalid!\n", mode_flags);
     return -EINVFUNC;
   }
 
-  uint32_t data_val = calc_pwm_data_val_from_percent(duty_cycle, range_val);
+  pwm_clk_cfg_t clk_cfg = { 0 };
+  unsigned long irq_flags;
+
+  mutex_lock(&pwm_clk_mutex);
 
-  return pwm_init_pwm_channel(pwm_channel, data_val, range_val, is_enabled_initially);
+  raw_spin_lock_irqsave(&pwm_lock, irq_flags);
+
+  int error = pwm_calc_clk_cfg(pwm_channel, cycle_freq, &clk_cfg);
+  bool is_new_clk_div = (clk_cfg.clk_div != pwm_clk_div);
+
+  raw_spin_unlock_irqrestore(&pwm_lock, irq_flags);
+
+  // The divisor only changes with pwm_clk_mutex held, so it is still the one the config was worked out for
+  if ((ENONE == error) && is_new_clk_div)
+  {
+    error = pwm_set_clk_div(clk_cfg.clk_div);
+  }
+
+  if (ENONE == error)
+  {
+    raw_spin_lock_irqsave(&pwm_lock, irq_flags);
+    pwm_channel_cfgs[pwm_channel].cycle_freq = cycle_freq;
+    raw_spin_unlock_irqrestore(&pwm_lock, irq_flags);
+  }
+
+  mutex_unlock(&pwm_clk_mutex);
+
+  if (ENONE != error)
+  {
+    pr_err("PWM channel %d can't be set to a cycle frequency of %u Hz! error: %d\n", pwm_channel, cycle_freq, error);
+    return error;
+  }
+
+  custom_trace("PWM channel %d cycle frequency: %u Hz, clock divisor: %u, range: %u\n", pwm_channel, cycle_freq, clk_cfg.clk_div, clk_cfg.range_val);
+
+  uint32_t data_val = calc_pwm_data_val_from_percent(duty_cycle, clk_cfg.range_val);
+
+  return pwm_init_pwm_channel(pwm_channel, data_val, clk_cfg.range_val, mode_flags, is_enabled_initially);
 }
 
 static inline void pwm_set_channel_data_val(pwm_channel_t pwm_channel, uint32_t data_val)
@@ -326,14 +837,20 @@ static inline void pwm_set_channel_data_val(pwm_channel_t pwm_channel, uint32_t
   switch (pwm_channel)
   {
     case PWM_0:
-      pwm_perph->dat_1 = data_val;
+      peri_write(pwm_regs, PWM_DAT1_OFFSET, data_val);
       break;
     case PWM_1:
-      pwm_perph->dat_2 = data_val;
+      peri_write(pwm_regs, PWM_DAT2_OFFSET, data_val);
       break;
   }
 }
 
+// The duty cycle setters below are lock free. Each one is a single store to the channel's data register
+// with the range taken from the cache, so they can be called from any context at a high rate (e.g. fades).
+//
+// Ret values:  ENONE     - success
+//              -EINVFUNC - failure, invalid pwm_channel argument
+//              -EBUSY    - failure, the channel is streaming from the FIFO
 int pwm_set_duty_cycle(pwm_channel_t pwm_channel, int duty_cycle)
 {
   if (!validate_pwm_channel(pwm_channel))
@@ -341,33 +858,77 @@ int pwm_set_duty_cycle(pwm_channel_t pwm_channel, int duty_cycle)
     return -EINVFUNC;
   }
 
-  int error = ENONE;
-  uint32_t range_val = 0;
-  uint32_t data_val = 0;
+  if (pwm_is_channel_streaming(pwm_channel))
+  {
+    return -EBUSY;
+  }
 
-  mutex_lock(&pwm_mutex);
+  uint32_t range_val = READ_ONCE(pwm_channel_cfgs[pwm_channel].range_val);
 
-  error = pwm_get_channel_range_val(pwm_channel, &range_val);
+  pwm_set_channel_data_val(pwm_channel, calc_pwm_data_val_from_percent(duty_cycle, range_val));
 
-  if (ENONE != error)
+  return ENONE;
+}
+
+// duty is a fraction of the cycle in 1/PWM_DUTY_U16_MAX steps, so 0 is fully off and PWM_DUTY_U16_MAX fully on.
+// The channel resolves fewer steps than that when its range is smaller than PWM_DUTY_U16_MAX (see pwm_get_range_val()).
+//
+// Ret values:  same as pwm_set_duty_cycle()
+int pwm_set_duty_u16(pwm_channel_t pwm_channel, uint16_t duty)
+{
+  if (!validate_pwm_channel(pwm_channel))
   {
-    goto exit_release_mutex;
+    return -EINVFUNC;
   }
 
-  data_val = calc_pwm_data_val_from_percent(duty_cycle, range_val);
+  if (pwm_is_channel_streaming(pwm_channel))
+  {
+    return -EBUSY;
+  }
 
-  pwm_set_channel_data_val(pwm_channel, data_val);
+  uint32_t duty_u16_mult = READ_ONCE(pwm_channel_cfgs[pwm_channel].duty_u16_mult);
 
-exit_release_mutex:
-  mutex_unlock(&pwm_mutex);
+  pwm_set_channel_data_val(pwm_channel, (uint32_t)(((uint64_t)(duty) * duty_u16_mult) >> 16));
 
-  return error;
+  return ENONE;
+}
+
+// data_val is the raw number of clock counts the output is high for each cycle. Anything above the
+// channel's range is clamped to the range (fully on).
+//
+// Ret values:  same as pwm_set_duty_cycle()
+int pwm_set_duty_raw(pwm_channel_t pwm_channel, uint32_t data_val)
+{
+  if (!validate_pwm_channel(pwm_channel))
+  {
+    return -EINVFUNC;
+  }
+
+  if (pwm_is_channel_streaming(pwm_channel))
+  {
+    return -EBUSY;
+  }
+
+  uint32_t range_val = READ_ONCE(pwm_channel_cfgs[pwm_channel].range_val);
+
+  pwm_set_channel_data_val(pwm_channel, min(data_val, range_val));
+
+  return ENONE;
+}
+
+// Gets the number of clock counts in one cycle of the channel, which is the full on value for pwm_set_duty_raw().
+//
+// Ret values:  ENONE     - success
+//              -EINVFUNC - failure, invalid pwm_channel argument
+int pwm_get_range_val(pwm_channel_t pwm_channel, uint32_t *range_val)
+{
+  return pwm_get_channel_range_val(pwm_channel, range_val);
 }
 
 int pwm_enable(pwm_channel_t pwm_channel, bool do_enable)
 {
-  int error = ENONE;
   pwm_ctl_field_t ctl_field;
+  unsigned long irq_flags;
 
   switch (pwm_channel)
   {
@@ -385,31 +946,366 @@ int pwm_enable(pwm_channel_t pwm_channel, bool do_enable)
       break;
   }
 
-  mutex_lock(&pwm_mutex);
+  raw_spin_lock_irqsave(&pwm_lock, irq_flags);
+
+  peri_shadow_update(&pwm_ctl_shadow, do_enable ? 0 : ctl_field, do_enable ? ctl_field : 0);
+
+  pwm_update_clk_gate_locked();
+
+  raw_spin_unlock_irqrestore(&pwm_lock, irq_flags);
+
+  custom_trace("PWM ctl reg val: %#x, data1 val: %u, range1 val: %u, data2 val: %u, range2 val: %u\n",
+               peri_shadow_get(&pwm_ctl_shadow), peri_read(pwm_regs, PWM_DAT1_OFFSET), peri_read(pwm_regs, PWM_RNG1_OFFSET),
+               peri_read(pwm_regs, PWM_DAT2_OFFSET), peri_read(pwm_regs, PWM_RNG2_OFFSET));
+  
+  return ENONE;
+}
+
+static inline pwm_ctl_field_t pwm_get_stream_ctl_fields(pwm_channel_t pwm_channel, uint32_t flags)
+{
+  // In one-shot mode RPTL makes the channel keep repeating the last sample once the FIFO empties
+  bool do_repeat_last = (0 == (flags & PWM_STREAM_LOOP));
+
+  switch (pwm_channel)
+  {
+    case PWM_0:
+      return (USEF_1_FIELD | (do_repeat_last ? RPTL_1_FIELD : 0));
+
+    case PWM_1:
+      return (USEF_2_FIELD | (do_repeat_last ? RPTL_2_FIELD : 0));
+
+    default:
+      return 0;
+  }
+}
+
+static inline pwm_ctl_field_t pwm_get_mode_ctl_fields(pwm_channel_t pwm_channel, uint32_t mode_flags)
+{
+  bool is_mark_space = (0 != (mode_flags & PWM_MODE_MARK_SPACE));
+  bool is_inverted = (0 != (mode_flags & PWM_MODE_INVERTED));
+
+  switch (pwm_channel)
+  {
+    case PWM_0:
+      return ((is_mark_space ? MSEN_1_FIELD : 0) | (is_inverted ? POLA_1_FIELD : 0));
+
+    case PWM_1:
+      return ((is_mark_space ? MSEN_2_FIELD : 0) | (is_inverted ? POLA_2_FIELD : 0));
+
+    default:
+      return 0;
+  }
+}
+
+// Gets the DMA channel ready the first time a stream is started. The channel from the "dmas" property of the device
+// tree node comes with the DREQ already. The fallback device has no node, so before 5.17 any channel is taken and given
+// the DREQ with slave_id, and since 5.17 (which dropped slave_id) it can't stream.
+//
+// Ret values:  ENONE         - success
+//              -EOPNOTSUPP   - failure, there is no "dmas" channel and the DREQ can't be set up without one
+//              -ENOMEM       - failure, couldn't allocate the stream buffer
+//              other         - failure, error from requesting or configuring the DMA channel
+//
+// NOTE: Must be called with pwm_stream_mutex held.
+static int pwm_stream_setup_dma(void)
+{
+  if (NULL != pwm_stream.p_samples)
+  {
+    return ENONE;
+  }
+
+  struct dma_chan *p_dma_chan = pwm_stream.p_dma_chan;
+  bool is_dt_chan = (NULL != p_dma_chan);
 
-  if (do_enable)
+  if (!is_dt_chan)
   {
-    pwm_perph->ctl |= ctl_field;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    // Without the DREQ the DMA engine isn't paced by the PWM and would just overrun the FIFO
+    pr_err("PWM streaming needs a \"%s\" DMA channel in the device tree on this kernel version!\n", PWM_DMA_NAME);
+    return -EOPNOTSUPP;
+#else
+    dma_cap_mask_t dma_mask;
+    dma_cap_zero(dma_mask);
+    dma_cap_set(DMA_SLAVE, dma_mask);
+    dma_cap_set(DMA_CYCLIC, dma_mask);
+
+    p_dma_chan = dma_request_chan_by_mask(&dma_mask);
+
+    if (IS_ERR(p_dma_chan))
+    {
+      pr_err("PWM couldn't get a DMA channel! error: %ld\n", PTR_ERR(p_dma_chan));
+      return PTR_ERR(p_dma_chan);
+    }
+#endif
+  }
+
+  struct dma_slave_config dma_config =
+  {
+    .direction = DMA_MEM_TO_DEV,
+    .dst_addr = PWM_FIF1_BUS_ADDR,
+    .dst_addr_width = DMA_SLAVE_BUSWIDTH_4_BYTES,
+    .dst_maxburst = 1,
+  };
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+  if (!is_dt_chan)
+  {
+    dma_config.slave_id = PWM_DMA_DREQ;   // Pace the DMA off of the PWM DREQ so it only writes when the FIFO has room
+  }
+#endif
+
+  int error = dmaengine_slave_config(p_dma_chan, &dma_config);
+
+  if (ENONE != error)
+  {
+    pr_err("PWM couldn't configure the DMA channel! error: %d\n", error);
+    goto release_fallback_chan;
+  }
+
+  pwm_stream.p_samples = dma_alloc_coherent(p_dma_chan->device->dev, PWM_STREAM_BUF_SIZE, &(pwm_stream.samples_dma_addr), GFP_KERNEL);
+
+  if (NULL == pwm_stream.p_samples)
+  {
+    pr_err("PWM couldn't allocate the stream buffer!\n");
+    error = -ENOMEM;
+    goto release_fallback_chan;
+  }
+
+  pwm_stream.p_dma_chan = p_dma_chan;
+
+  return ENONE;
+
+release_fallback_chan:
+  // The device tree channel is kept until remove, so the next stream can try again with it
+  if (!is_dt_chan)
+  {
+    dma_release_channel(p_dma_chan);
+  }
+
+  return error;
+}
+
+// NOTE: Must be called with pwm_stream_mutex held.
+static void pwm_stream_stop_locked(void)
+{
+  pwm_channel_t pwm_channel = pwm_stream.pwm_channel;
+  unsigned long irq_flags;
+
+  if (NOT_PWM == pwm_channel)
+  {
+    return;
+  }
+
+  dmaengine_terminate_sync(pwm_stream.p_dma_chan);
+
+  raw_spin_lock_irqsave(&pwm_lock, irq_flags);
+
+  // Go back to using the data register and throw away whatever is left in the FIFO
+  peri_write(pwm_regs, PWM_DMAC_OFFSET, 0);
+  peri_shadow_update(&pwm_ctl_shadow, pwm_get_stream_ctl_fields(pwm_channel, 0), 0);
+  peri_shadow_write_with_action(&pwm_ctl_shadow, CLRF_1_FIELD);
+
+  pwm_update_clk_gate_locked();
+
+  raw_spin_unlock_irqrestore(&pwm_lock, irq_flags);
+
+  WRITE_ONCE(pwm_stream.pwm_channel, NOT_PWM);
+}
+
+// Plays the samples on the channel through the PWM FIFO, fed by the DMA engine, so no cpu time is used per sample.
+// Each sample is a raw data (duty) value and is clamped to the range of the channel. The hardware consumes one
+// sample per pwm cycle, so samples play at the cycle frequency the channel was set up with.
+//
+// Without PWM_STREAM_LOOP the samples play once and the channel then keeps outputting the last sample,
+// with PWM_STREAM_LOOP the samples are played as a ring buffer until pwm_stream_stop() is called.
+// Either way, the channel stays in streaming mode (and pwm_set_duty_cycle() returns -EBUSY) until pwm_stream_stop().
+//
+// Ret values:  ENONE     - success
+//              -EINVFUNC - failure, invalid pwm_channel argument
+//              -EINVAL   - failure, sample_cnt is 0 or more than PWM_STREAM_MAX_SAMPLES
+//              -EBUSY    - failure, a channel is already streaming
+//              other     - failure, error from setting up the DMA
+//
+// NOTE: Can sleep, so it must not be called from atomic context.
+int pwm_stream_start(pwm_channel_t pwm_channel, uint32_t const *samples, uint32_t sample_cnt, uint32_t flags)
+{
+  if (!validate_pwm_channel(pwm_channel))
+  {
+    return -EINVFUNC;
+  }
+
+  if ((0 == sample_cnt) || (PWM_STREAM_MAX_SAMPLES < sample_cnt))
+  {
+    pr_err("PWM stream must have between 1 and %d samples!\n", PWM_STREAM_MAX_SAMPLES);
+    return -EINVAL;
+  }
+
+  int error = ENONE;
+  uint32_t range_val = 0;
+  unsigned long irq_flags;
+  struct dma_async_tx_descriptor *p_dma_desc = NULL;
+  size_t stream_len = sample_cnt * sizeof(uint32_t);
+
+  mutex_lock(&pwm_stream_mutex);
+
+  if (NOT_PWM != pwm_stream.pwm_channel)
+  {
+    error = -EBUSY;
+    goto exit_release_mutex;
+  }
+
+  error = pwm_stream_setup_dma();
+
+  if (ENONE != error)
+  {
+    goto exit_release_mutex;
+  }
+
+  pwm_get_channel_range_val(pwm_channel, &range_val);
+
+  for (uint32_t i = 0; i < sample_cnt; i++)
+  {
+    pwm_stream.p_samples[i] = min(samples[i], range_val);
+  }
+
+  if (0 != (flags & PWM_STREAM_LOOP))
+  {
+    p_dma_desc = dmaengine_prep_dma_cyclic(pwm_stream.p_dma_chan, pwm_stream.samples_dma_addr, stream_len, stream_len,
+                                           DMA_MEM_TO_DEV, 0);
   }
   else
   {
-    pwm_perph->ctl &= ~(ctl_field);
+    p_dma_desc = dmaengine_prep_slave_single(pwm_stream.p_dma_chan, pwm_stream.samples_dma_addr, stream_len,
+                                             DMA_MEM_TO_DEV, 0);
+  }
+
+  if (NULL == p_dma_desc)
+  {
+    pr_err("PWM couldn't prepare the DMA transfer!\n");
+    error = -EINTERNAL;
+    goto exit_release_mutex;
+  }
+
+  pwm_stream.dma_cookie = dmaengine_submit(p_dma_desc);
+  error = dma_submit_error(pwm_stream.dma_cookie);
+
+  if (ENONE != error)
+  {
+    pr_err("PWM couldn't submit the DMA transfer! error: %d\n", error);
+    goto exit_release_mutex;
   }
 
-  printk("PWM ctl reg val: %d, data1 val: %d, range1 val: %d, data2 val: %d, range2 val: %d\n", pwm_perph->ctl, pwm_perph->dat_1, pwm_perph->rng_1, pwm_perph->dat_2, pwm_perph->rng_2);
+  raw_spin_lock_irqsave(&pwm_lock, irq_flags);
+
+  // Start from an empty FIFO, switch the channel over to the FIFO and let the PWM request data from the DMA engine
+  // The DMA engine reads the samples the cpu wrote, so the DMAC write is the ordered one
+  peri_shadow_write_with_action(&pwm_ctl_shadow, CLRF_1_FIELD);
+  peri_shadow_update(&pwm_ctl_shadow, 0, pwm_get_stream_ctl_fields(pwm_channel, flags));
+  peri_write_ordered(pwm_regs, PWM_DMAC_OFFSET, DMAC_STREAM_VAL);
+
+  pwm_update_clk_gate_locked();
+
+  raw_spin_unlock_irqrestore(&pwm_lock, irq_flags);
+
+  WRITE_ONCE(pwm_stream.pwm_channel, pwm_channel);
+
+  dma_async_issue_pending(pwm_stream.p_dma_chan);
 
 exit_release_mutex:
-  mutex_unlock(&pwm_mutex);
-  
+  mutex_unlock(&pwm_stream_mutex);
+
+  return error;
+}
+
+// Stops any stream playing on the channel and switches it back to the data register.
+// The channel's duty cycle should be set again afterwards.
+//
+// Ret values:  ENONE     - success (including when the channel wasn't streaming)
+//              -EINVFUNC - failure, invalid pwm_channel argument
+//
+// NOTE: Can sleep, so it must not be called from atomic context.
+int pwm_stream_stop(pwm_channel_t pwm_channel)
+{
+  if (!validate_pwm_channel(pwm_channel))
+  {
+    return -EINVFUNC;
+  }
+
+  mutex_lock(&pwm_stream_mutex);
+
+  if (pwm_channel == pwm_stream.pwm_channel)
+  {
+    pwm_stream_stop_locked();
+  }
+
+  mutex_unlock(&pwm_stream_mutex);
+
   return ENONE;
 }
 
+// Creates the clock stats file in debugfs. The PWM works without it, so failures are only logged.
+static void pwm_debugfs_init(void)
+{
+  p_pwm_debugfs_dir = debugfs_create_dir(PWM_DEBUGFS_DIR_NAME, NULL);
+
+  if (IS_ERR_OR_NULL(p_pwm_debugfs_dir))
+  {
+    pr_err("PWM driver couldn't create its debugfs directory, the clock stats won't be available\n");
+    return;
+  }
+
+  debugfs_create_file("clock", 0444, p_pwm_debugfs_dir, NULL, &pwm_clk_stats_fops);
+}
+
+static int pwm_clk_stats_open(struct inode *p_inode, struct file *p_file)
+{
+  return single_open(p_file, pwm_clk_stats_show, p_inode->i_private);
+}
+
+// Shows the clock state and gating stats as "name: value" lines
+static int pwm_clk_stats_show(struct seq_file *p_seq, void *p_data)
+{
+  pwm_clk_gate_stats_t stats;
+  uint32_t clk_div;
+  bool is_gated;
+  unsigned long irq_flags;
+
+  // Copied out so nothing is printed while holding the raw spinlock
+  raw_spin_lock_irqsave(&pwm_lock, irq_flags);
+
+  stats = pwm_clk_gate_stats;
+  clk_div = pwm_clk_div;
+  is_gated = pwm_clk_is_gated;
+
+  raw_spin_unlock_irqrestore(&pwm_lock, irq_flags);
+
+  seq_printf(p_seq, "state: %s\n", (0 == clk_div) ? "unprogrammed" : (is_gated ? "gated" : "running"));
+  seq_printf(p_seq, "clk_div: %u\n", clk_div);
+  seq_printf(p_seq, "gate_cnt: %llu\n", stats.gate_cnt);
+  seq_puts(p_seq, "wake_timing: stopped clock only, wakes before it stopped are counted in wake_early_cnt\n");
+  seq_printf(p_seq, "wake_cnt: %llu\n", stats.wake_cnt);
+  seq_printf(p_seq, "wake_early_cnt: %llu\n", stats.wake_early_cnt);
+  seq_printf(p_seq, "wake_timeout_cnt: %llu\n", stats.wake_timeout_cnt);
+  seq_printf(p_seq, "wake_last_ns: %llu\n", stats.wake_last_ns);
+  seq_printf(p_seq, "wake_mean_ns: %llu\n", (0 != stats.wake_cnt) ? div64_u64(stats.wake_total_ns, stats.wake_cnt) : 0);
+  seq_printf(p_seq, "wake_max_ns: %llu\n", stats.wake_max_ns);
+
+  return 0;
+}
+
 module_init(pwm_driver_init);
 module_exit(pwm_driver_exit);
 
+MODULE_DEVICE_TABLE(of, pwm_of_match);
+
 EXPORT_SYMBOL(pwm_init_user_device);
 EXPORT_SYMBOL(pwm_set_duty_cycle);
+EXPORT_SYMBOL(pwm_set_duty_u16);
+EXPORT_SYMBOL(pwm_set_duty_raw);
+EXPORT_SYMBOL(pwm_get_range_val);
 EXPORT_SYMBOL(pwm_enable);
+EXPORT_SYMBOL(pwm_stream_start);
+EXPORT_SYMBOL(pwm_stream_stop);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Trevor Foland");
@@ -1,14 +1,38 @@
 #ifndef CUSTOM_PWM_DRIVER_H
 #define CUSTOM_PWM_DRIVER_H
 
-typedef enum pwm_cycle_freq_e
-{
-  PWM_FREQ_4_kHZ = 4000,
-  PWM_INVALID_FREQ = 0,
-} pwm_cycle_freq_t;
+#define PWM_STREAM_MAX_SAMPLES  (4096)      // Max samples in one stream (16 KiB ring buffer)
 
-int pwm_init_user_device(pwm_channel_t pwm_channel, int duty_cycle, pwm_cycle_freq_t cycle_freq, bool is_enabled_initially);
+// pwm_stream_start() flags
+#define PWM_STREAM_LOOP         (1U << 0)   // Keep playing the samples in a loop until stopped
+
+#define PWM_DUTY_U16_MAX        (0xFFFFU)   // Fully on duty for pwm_set_duty_u16()
+
+// pwm_init_user_device() mode flags
+// In balanced mode (the default) the high time of each cycle is spread out by the PWM algorithm, so the output switches
+// as often as it can at the cycle frequency. In mark-space mode the output is high once for data counts and then low
+// for the rest of the range, so it only switches twice per cycle, which means less EMI and switching losses for leds and servos.
+#define PWM_MODE_BALANCED       (0U)
+#define PWM_MODE_MARK_SPACE     (1U << 0)
+#define PWM_MODE_INVERTED       (1U << 1)   // Output is low for the duty and high for the rest of the cycle
+#define PWM_MODE_VALID_MASK     (PWM_MODE_MARK_SPACE | PWM_MODE_INVERTED)
+
+// Cycle frequency in Hz. Any frequency can be used as long as the channel still gets at least 100 steps of range
+// (up to 192 kHz off of the default 19.2 MHz clock). Below are just some common ones.
+typedef uint32_t pwm_cycle_freq_t;
+
+#define PWM_FREQ_4_kHZ          (4000U)
+#define PWM_FREQ_20_kHZ         (20000U)
+#define PWM_FREQ_100_kHZ        (100000U)
+#define PWM_INVALID_FREQ        (0U)
+
+int pwm_init_user_device(pwm_channel_t pwm_channel, int duty_cycle, pwm_cycle_freq_t cycle_freq, uint32_t mode_flags, bool is_enabled_initially);
 int pwm_set_duty_cycle(pwm_channel_t pwm_channel, int duty_cycle);
+int pwm_set_duty_u16(pwm_channel_t pwm_channel, uint16_t duty);
+int pwm_set_duty_raw(pwm_channel_t pwm_channel, uint32_t data_val);
+int pwm_get_range_val(pwm_channel_t pwm_channel, uint32_t *range_val);
 int pwm_enable(pwm_channel_t pwm_channel, bool do_enable);
+int pwm_stream_start(pwm_channel_t pwm_channel, uint32_t const *samples, uint32_t sample_cnt, uint32_t flags);
+int pwm_stream_stop(pwm_channel_t pwm_channel);
 
 #endif
\ No newline at end of file
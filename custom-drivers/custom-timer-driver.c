@@ -0,0 +1,621 @@
+// Timer module using the BCM2835 system timer (a free running 1 MHz counter with 4 compare channels).
+// The top half of the irq only acknowledges the match, reprograms the compare register for the next tick and
+// increases a tick counter atomically. The bottom half of the irq (a threaded irq) then runs the registered
+// callbacks whose period has elapsed, in priority order.
+//
+// Compare channels 0 and 2 are used by the GPU and channel 3 is used by the kernel's own bcm2835 timer driver,
+// so this module uses channel 1.
+
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/string.h>
+#include <linux/bsearch.h>
+#include <linux/interrupt.h>
+#include <linux/of.h>
+#include <linux/of_address.h>
+#include <linux/of_irq.h>
+#include <asm/io.h>
+
+#include "custom-timer-driver.h"
+#include "custom-errno.h"
+
+
+/***************    Macros    ***************/
+
+#define TIMER_DT_COMPATIBLE               "brcm,bcm2835-system-timer"
+#define TIMER_IRQ_NAME                    "custom_timer"
+
+// All offsets are defined in bytes
+#define ST_CS_OFFSET                      (0x00)
+#define ST_CLO_OFFSET                     (0x04)
+#define ST_C0_OFFSET                      (0x0C)
+
+#define TIMER_CHANNEL                     (1)
+#define ST_CS_MATCH_FIELD                 (1U << TIMER_CHANNEL)   // Write a 1 to clear the match of the channel
+#define ST_CX_OFFSET                      (ST_C0_OFFSET + (TIMER_CHANNEL * sizeof(uint32_t)))
+
+#define MIN_TICK_PERIOD_US                50    // Anything faster than this and the irq overhead starts to take over the cpu
+
+#define MAX_TIMER_CALLBACKS               20
+#define LOWEST_CALLBACK_PRIORITY_NUM      (MAX_TIMER_CALLBACKS - 1)
+
+/***************    Type definitions    ***************/
+
+typedef struct timer_device_callback_s
+{
+  // The actual device number this callback should apply to.
+  dev_t dev_id;
+
+  // A function id determined by a kernel module.
+  // dev_id and func_id together are the key of a callback.
+  int func_id;
+
+  // The priority for a callback to be run at.
+  //
+  // Priorities can be shared, in which case callbacks with the same priority are run
+  // in order of dev_id and then func_id.
+  //
+  // Lower the number (down to zero, the higher the priority)
+  //
+  // If the number is greater than the number of callbacks allowed
+  // internally or the number is negative, then the priority is set to lowest priority possible
+  // (NOTE *possible* not *available*).
+  // For example, if the max number of callbacks is 20, and the priority provided is -5 or 22,
+  // then the priority will ultimately be assigned to 19.
+  int priority;
+
+  // How often the callback is run, in timer ticks.
+  uint32_t period_ticks;
+
+  // The tick the callback is run at next.
+  uint64_t next_tick;
+
+  // The actual pointer to the callback function.
+  timer_callback_t callback;
+} timer_device_callback_t;
+
+// Index entry used to look up the priority of a callback from its dev_id and func_id,
+// since the callbacks themselves are sorted by priority.
+typedef struct timer_cb_key_s
+{
+  dev_t dev_id;
+  int func_id;
+  int priority;
+} timer_cb_key_t;
+
+typedef struct timer_dev_cbs_wrapper_s
+{
+  uint32_t const max_cb_cnt;
+  uint32_t const lowest_priority_num;
+  uint32_t registered_cb_cnt;
+  timer_device_callback_t * const p_timer_dev_cbs;    // Sorted by priority so index 0 has the highest priority
+  timer_cb_key_t * const p_timer_cb_keys;             // Sorted by dev_id and then func_id
+} timer_dev_cbs_wrapper_t;
+
+
+/***************    Function declarations    ***************/
+
+// Inline functions
+static inline bool are_timer_cbs_full(timer_dev_cbs_wrapper_t * cbs_wrapper);
+static inline int cmp_timer_cb_keys(dev_t dev_id_a, int func_id_a, dev_t dev_id_b, int func_id_b);
+static inline int cmp_timer_cbs(int priority_a, dev_t dev_id_a, int func_id_a, timer_device_callback_t const *dev_cb_b);
+static inline void timer_set_compare(uint32_t compare_val);
+
+// Static functions
+static int __init timer_driver_init(void);
+static void __exit timer_driver_exit(void);
+static int add_timer_callback(dev_t dev_id, int func_id, int priority, uint32_t period_ticks,
+                              timer_callback_t callback);
+static int delete_timer_callback(dev_t dev_id, int func_id);
+static uint32_t find_timer_cb_key_insert_index(dev_t dev_id, int func_id);
+static uint32_t find_timer_cb_insert_index(int priority, dev_t dev_id, int func_id);
+static int bsearch_cmp_timer_cb_key(const void *p_key, const void *p_elem);
+static int bsearch_cmp_timer_cb(const void *p_key, const void *p_elem);
+static void timer_start(void);
+static void timer_stop(void);
+static irqreturn_t timer_irq_top_half(int irq, void *dev_id);
+static irqreturn_t timer_irq_bottom_half(int irq, void *dev_id);
+
+
+/***************    Private variables    ***************/
+
+static unsigned int tick_period_us = 1000;
+module_param(tick_period_us, uint, 0444);
+MODULE_PARM_DESC(tick_period_us, "Period of the timer tick in us, callback periods are multiples of it (default 1000, min 50)");
+
+static uint32_t volatile * timer_base_addr = NULL;   // All registers are 32 bit for the system timer so use a uint32_t pointer
+static unsigned int timer_irq = 0;
+
+static timer_device_callback_t timer_dev_callbacks[MAX_TIMER_CALLBACKS];
+static timer_cb_key_t timer_cb_keys[MAX_TIMER_CALLBACKS];
+
+static timer_dev_cbs_wrapper_t dev_cbs_wrapper =
+{
+  .max_cb_cnt = MAX_TIMER_CALLBACKS,
+  .lowest_priority_num = LOWEST_CALLBACK_PRIORITY_NUM,
+  .registered_cb_cnt = 0,
+  .p_timer_dev_cbs = timer_dev_callbacks,   // Point to the start of the array of callbacks
+  .p_timer_cb_keys = timer_cb_keys,
+};
+
+// Protects dev_cbs_wrapper. Held by the bottom half while it runs the callbacks.
+static DEFINE_MUTEX(timer_cbs_mutex);
+
+// Serializes starting and stopping the timer. Never taken by the irq handlers.
+static DEFINE_MUTEX(timer_run_mutex);
+
+// Only the top half changes these while the timer is running, so the top half needs no locks.
+static atomic_t timer_is_running = ATOMIC_INIT(0);
+static atomic64_t timer_tick_cnt = ATOMIC64_INIT(0);
+static uint32_t timer_next_compare = 0;
+
+
+/***************    Function Definitions    ***************/
+
+static int __init timer_driver_init(void)
+{
+  int error = ENONE;
+
+  if (MIN_TICK_PERIOD_US > tick_period_us)
+  {
+    pr_err("Timer tick period of %u us is too short! Min tick period: %d us\n", tick_period_us, MIN_TICK_PERIOD_US);
+    return -EINVAL;
+  }
+
+  // The system timer node tells us both where the registers are (for any Raspberry Pi model) and which irq
+  // each compare channel uses.
+  struct device_node *p_timer_node = of_find_compatible_node(NULL, NULL, TIMER_DT_COMPATIBLE);
+
+  if (NULL == p_timer_node)
+  {
+    pr_err("Timer driver couldn't find the system timer in the device tree!\n");
+    return -ENODEV;
+  }
+
+  timer_base_addr = (uint32_t *)(of_iomap(p_timer_node, 0));
+
+  if (NULL == timer_base_addr)
+  {
+    pr_err("Timer driver couldn't map the io space!\n");
+    error = -EMAPPING;
+    goto put_timer_node;
+  }
+
+  timer_irq = irq_of_parse_and_map(p_timer_node, TIMER_CHANNEL);
+
+  if (0 == timer_irq)
+  {
+    pr_err("Timer driver couldn't get the irq of compare channel %d!\n", TIMER_CHANNEL);
+    error = -ENODEV;
+    goto unmap_timer;
+  }
+
+  // Clear any old match before the irq can fire
+  timer_base_addr[ST_CS_OFFSET / sizeof(uint32_t)] = ST_CS_MATCH_FIELD;
+
+  error = request_threaded_irq(timer_irq, timer_irq_top_half, timer_irq_bottom_half, 0, TIMER_IRQ_NAME, &dev_cbs_wrapper);
+
+  if (ENONE != error)
+  {
+    pr_err("Timer driver couldn't request irq %u! error: %d\n", timer_irq, error);
+    goto dispose_timer_irq;
+  }
+
+  of_node_put(p_timer_node);
+
+  printk("Timer driver successfully initialized with a tick period of %u us\n", tick_period_us);
+  return ENONE;
+
+dispose_timer_irq:
+  irq_dispose_mapping(timer_irq);
+
+unmap_timer:
+  iounmap(timer_base_addr);
+  timer_base_addr = NULL;
+
+put_timer_node:
+  of_node_put(p_timer_node);
+
+  return error;
+}
+
+static void __exit timer_driver_exit(void)
+{
+  // Every callback should be unregistered by now since the modules that
+  // registered them depend on this module, but stop the timer anyway.
+  mutex_lock(&timer_run_mutex);
+  timer_stop();
+  mutex_unlock(&timer_run_mutex);
+
+  free_irq(timer_irq, &dev_cbs_wrapper);
+  irq_dispose_mapping(timer_irq);
+
+  iounmap(timer_base_addr);
+
+  printk("Timer driver exited\n");
+}
+
+static inline void timer_set_compare(uint32_t compare_val)
+{
+  timer_base_addr[ST_CX_OFFSET / sizeof(uint32_t)] = compare_val;
+}
+
+// NOTE: Must be called with timer_run_mutex held.
+static void timer_start(void)
+{
+  if (0 != atomic_read(&timer_is_running))
+  {
+    return;
+  }
+
+  // The tick count keeps going up across restarts so the next_tick of callbacks never goes backwards.
+  timer_next_compare = timer_base_addr[ST_CLO_OFFSET / sizeof(uint32_t)] + tick_period_us;
+  timer_set_compare(timer_next_compare);
+
+  // Make sure the top half sees the new compare value before it sees the timer running
+  smp_wmb();
+  atomic_set(&timer_is_running, 1);
+}
+
+// NOTE: Must be called with timer_run_mutex held and without timer_cbs_mutex held,
+//       since it waits for the bottom half to finish.
+static void timer_stop(void)
+{
+  atomic_set(&timer_is_running, 0);
+
+  // Once the handlers are done, the top half won't reprogram the compare register anymore.
+  // (The old compare value will still match again once the counter wraps, but the top half just ignores it.)
+  synchronize_irq(timer_irq);
+
+  timer_base_addr[ST_CS_OFFSET / sizeof(uint32_t)] = ST_CS_MATCH_FIELD;
+}
+
+// Lock free, the only state it changes is its own.
+static irqreturn_t timer_irq_top_half(int irq, void *dev_id)
+{
+  // Acknowledge the match
+  timer_base_addr[ST_CS_OFFSET / sizeof(uint32_t)] = ST_CS_MATCH_FIELD;
+
+  if (0 == atomic_read(&timer_is_running))
+  {
+    return IRQ_HANDLED;
+  }
+
+  uint32_t ticks_elapsed = 1;
+  uint32_t counter_val = timer_base_addr[ST_CLO_OFFSET / sizeof(uint32_t)];
+
+  timer_next_compare += tick_period_us;
+
+  // If we were held up past the next tick, skip the ticks we missed so we never set a compare value
+  // that is already in the past (it wouldn't match again until the counter wraps around). The ticks
+  // are still counted so callback periods stay tied to real time.
+  if (0 >= (int32_t)(timer_next_compare - counter_val))
+  {
+    uint32_t ticks_missed = ((counter_val - timer_next_compare) / tick_period_us) + 1;
+
+    ticks_elapsed += ticks_missed;
+    timer_next_compare += (ticks_missed * tick_period_us);
+  }
+
+  timer_set_compare(timer_next_compare);
+
+  atomic64_add(ticks_elapsed, &timer_tick_cnt);
+
+  return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t timer_irq_bottom_half(int irq, void *dev_id)
+{
+  uint64_t tick_cnt = atomic64_read(&timer_tick_cnt);
+
+  mutex_lock(&timer_cbs_mutex);
+
+  for (uint32_t i = 0; i < dev_cbs_wrapper.registered_cb_cnt; i++)
+  {
+    timer_device_callback_t *dev_cb = &(dev_cbs_wrapper.p_timer_dev_cbs[i]);
+
+    if (tick_cnt < dev_cb->next_tick)
+    {
+      continue;
+    }
+
+    dev_cb->callback(dev_cb->func_id);
+
+    dev_cb->next_tick += dev_cb->period_ticks;
+
+    // If we fell behind by a whole period or more, only run the callback once and
+    // line it back up with the current tick instead of running it back to back.
+    if (dev_cb->next_tick <= tick_cnt)
+    {
+      dev_cb->next_tick = tick_cnt + dev_cb->period_ticks;
+    }
+  }
+
+  mutex_unlock(&timer_cbs_mutex);
+
+  return IRQ_HANDLED;
+}
+
+static inline int cmp_timer_cb_keys(dev_t dev_id_a, int func_id_a, dev_t dev_id_b, int func_id_b)
+{
+  if (dev_id_a != dev_id_b)
+  {
+    return (dev_id_a < dev_id_b) ? -1 : 1;
+  }
+
+  if (func_id_a != func_id_b)
+  {
+    return (func_id_a < func_id_b) ? -1 : 1;
+  }
+
+  return 0;
+}
+
+static inline int cmp_timer_cbs(int priority_a, dev_t dev_id_a, int func_id_a, timer_device_callback_t const *dev_cb_b)
+{
+  if (priority_a != dev_cb_b->priority)
+  {
+    return (priority_a < dev_cb_b->priority) ? -1 : 1;
+  }
+
+  return cmp_timer_cb_keys(dev_id_a, func_id_a, dev_cb_b->dev_id, dev_cb_b->func_id);
+}
+
+static int bsearch_cmp_timer_cb_key(const void *p_key, const void *p_elem)
+{
+  timer_cb_key_t const *cb_key = p_key;
+  timer_cb_key_t const *elem = p_elem;
+
+  return cmp_timer_cb_keys(cb_key->dev_id, cb_key->func_id, elem->dev_id, elem->func_id);
+}
+
+static int bsearch_cmp_timer_cb(const void *p_key, const void *p_elem)
+{
+  timer_cb_key_t const *cb_key = p_key;
+
+  return cmp_timer_cbs(cb_key->priority, cb_key->dev_id, cb_key->func_id, p_elem);
+}
+
+// Binary search for the index the key would be inserted at to keep p_timer_cb_keys sorted.
+//
+// NOTE: Must be called with timer_cbs_mutex held.
+static uint32_t find_timer_cb_key_insert_index(dev_t dev_id, int func_id)
+{
+  uint32_t low = 0;
+  uint32_t high = dev_cbs_wrapper.registered_cb_cnt;
+
+  while (low < high)
+  {
+    uint32_t mid = low + ((high - low) / 2);
+    timer_cb_key_t const *cb_key = &(dev_cbs_wrapper.p_timer_cb_keys[mid]);
+
+    if (0 < cmp_timer_cb_keys(dev_id, func_id, cb_key->dev_id, cb_key->func_id))
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+// Binary search for the index the callback would be inserted at to keep p_timer_dev_cbs sorted.
+//
+// NOTE: Must be called with timer_cbs_mutex held.
+static uint32_t find_timer_cb_insert_index(int priority, dev_t dev_id, int func_id)
+{
+  uint32_t low = 0;
+  uint32_t high = dev_cbs_wrapper.registered_cb_cnt;
+
+  while (low < high)
+  {
+    uint32_t mid = low + ((high - low) / 2);
+
+    if (0 < cmp_timer_cbs(priority, dev_id, func_id, &(dev_cbs_wrapper.p_timer_dev_cbs[mid])))
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+// Both arrays stay sorted, so finding where a callback goes is O(log n). Shifting the
+// entries after it is a single memmove of at most MAX_TIMER_CALLBACKS small structs.
+//
+// NOTE: Must be called with timer_cbs_mutex held.
+static int add_timer_callback(dev_t dev_id, int func_id, int priority, uint32_t period_ticks,
+                              timer_callback_t callback)
+{
+  // Return an error indicating that this callback couldn't be added
+  // because the limit for registered callbacks has been reached.
+  if (are_timer_cbs_full(&dev_cbs_wrapper))
+  {
+    return -ECBFULL;
+  }
+
+  uint32_t cb_cnt = dev_cbs_wrapper.registered_cb_cnt;
+  uint32_t key_index = find_timer_cb_key_insert_index(dev_id, func_id);
+
+  // This dev_id and func_id are already registered
+  if (   (key_index < cb_cnt)
+      && (0 == cmp_timer_cb_keys(dev_id, func_id, dev_cbs_wrapper.p_timer_cb_keys[key_index].dev_id, dev_cbs_wrapper.p_timer_cb_keys[key_index].func_id))
+     )
+  {
+    return -EEXIST;
+  }
+
+  uint32_t cb_index = find_timer_cb_insert_index(priority, dev_id, func_id);
+
+  timer_cb_key_t *cb_key = &(dev_cbs_wrapper.p_timer_cb_keys[key_index]);
+  memmove(cb_key + 1, cb_key, (cb_cnt - key_index) * sizeof(*cb_key));
+  cb_key->dev_id = dev_id;
+  cb_key->func_id = func_id;
+  cb_key->priority = priority;
+
+  timer_device_callback_t *dev_cb = &(dev_cbs_wrapper.p_timer_dev_cbs[cb_index]);
+  memmove(dev_cb + 1, dev_cb, (cb_cnt - cb_index) * sizeof(*dev_cb));
+  dev_cb->dev_id = dev_id;
+  dev_cb->func_id = func_id;
+  dev_cb->priority = priority;
+  dev_cb->period_ticks = period_ticks;
+  dev_cb->next_tick = atomic64_read(&timer_tick_cnt) + period_ticks;
+  dev_cb->callback = callback;
+
+  dev_cbs_wrapper.registered_cb_cnt++;
+
+  return ENONE;
+}
+
+// NOTE: Must be called with timer_cbs_mutex held.
+static int delete_timer_callback(dev_t dev_id, int func_id)
+{
+  uint32_t cb_cnt = dev_cbs_wrapper.registered_cb_cnt;
+  timer_cb_key_t search_key = { .dev_id = dev_id, .func_id = func_id, .priority = 0 };
+
+  timer_cb_key_t *cb_key = bsearch(&search_key, dev_cbs_wrapper.p_timer_cb_keys, cb_cnt,
+                                   sizeof(timer_cb_key_t), bsearch_cmp_timer_cb_key);
+
+  if (NULL == cb_key)
+  {
+    return -ENOENT;
+  }
+
+  search_key.priority = cb_key->priority;
+
+  timer_device_callback_t *dev_cb = bsearch(&search_key, dev_cbs_wrapper.p_timer_dev_cbs, cb_cnt,
+                                            sizeof(timer_device_callback_t), bsearch_cmp_timer_cb);
+
+  if (unlikely(NULL == dev_cb))
+  {
+    pr_err("Timer callback key exists but the callback doesn't!\n");
+    return -EINTERNAL;
+  }
+
+  uint32_t key_index = cb_key - dev_cbs_wrapper.p_timer_cb_keys;
+  uint32_t cb_index = dev_cb - dev_cbs_wrapper.p_timer_dev_cbs;
+
+  memmove(cb_key, cb_key + 1, (cb_cnt - key_index - 1) * sizeof(*cb_key));
+  memmove(dev_cb, dev_cb + 1, (cb_cnt - cb_index - 1) * sizeof(*dev_cb));
+
+  dev_cbs_wrapper.registered_cb_cnt--;
+
+  return ENONE;
+}
+
+static inline bool are_timer_cbs_full(timer_dev_cbs_wrapper_t * cbs_wrapper)
+{
+  return (cbs_wrapper->max_cb_cnt <= cbs_wrapper->registered_cb_cnt);
+}
+
+
+// The callback runs every period_us, rounded up to a whole number of timer ticks.
+//
+// Ret values:  ENONE     - success
+//              -EINVAL   - failure, invalid argument
+//              -EEXIST   - failure, dev_id and func_id are already registered
+//              -ECBFULL  - failure, the max number of callbacks are registered
+//
+// NOTE: Must not be called from a timer callback.
+int register_timer_dev_cb(dev_t dev_id, int func_id, int priority, uint32_t period_us,
+                          timer_callback_t callback)
+{
+  // Validate the arguments
+  if (0 == dev_id)
+  {
+    return -EINVAL;
+  }
+
+  if (0 > func_id)
+  {
+    return -EINVAL;
+  }
+
+  if (0 == period_us)
+  {
+    return -EINVAL;
+  }
+
+  if (NULL == callback)
+  {
+    return -EINVAL;
+  }
+
+  // Set priority to lowest if a valid priority was not passed in
+  if ( (0 > priority) || (dev_cbs_wrapper.lowest_priority_num < priority))
+  {
+    priority = dev_cbs_wrapper.lowest_priority_num;
+  }
+
+  uint32_t period_ticks = DIV_ROUND_UP(period_us, tick_period_us);
+
+  mutex_lock(&timer_run_mutex);
+  mutex_lock(&timer_cbs_mutex);
+
+  int error = add_timer_callback(dev_id, func_id, priority, period_ticks, callback);
+
+  mutex_unlock(&timer_cbs_mutex);
+
+  // Only run the timer while there is something for it to do
+  if (ENONE == error)
+  {
+    timer_start();
+  }
+
+  mutex_unlock(&timer_run_mutex);
+
+  return error;
+}
+
+// Ret values:  ENONE       - success
+//              -ENOENT     - failure, dev_id and func_id are not registered
+//              -EINTERNAL  - failure, other internal failure
+//
+// NOTE: Must not be called from a timer callback.
+int unregister_timer_dev_cb(dev_t dev_id, int func_id)
+{
+  mutex_lock(&timer_run_mutex);
+  mutex_lock(&timer_cbs_mutex);
+
+  int error = delete_timer_callback(dev_id, func_id);
+  uint32_t cb_cnt = dev_cbs_wrapper.registered_cb_cnt;
+
+  mutex_unlock(&timer_cbs_mutex);
+
+  if (0 == cb_cnt)
+  {
+    timer_stop();
+  }
+
+  mutex_unlock(&timer_run_mutex);
+
+  return error;
+}
+
+uint32_t timer_get_tick_period_us(void)
+{
+  return tick_period_us;
+}
+
+module_init(timer_driver_init);
+module_exit(timer_driver_exit);
+
+EXPORT_SYMBOL(register_timer_dev_cb);
+EXPORT_SYMBOL(unregister_timer_dev_cb);
+EXPORT_SYMBOL(timer_get_tick_period_us);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Trevor Foland");
+MODULE_DESCRIPTION("A practice Linux driver that runs periodic callbacks off of the system timer.");
+MODULE_VERSION("1.0");
@@ -0,0 +1,19 @@
+#ifndef CUSTOM_TIMER_DRIVER_H
+#define CUSTOM_TIMER_DRIVER_H
+
+/***************    Type definitions    ***************/
+
+// Callbacks are passed the func_id they were registered with, so one function can serve several registrations.
+// They run in the bottom half (threaded irq) of the timer interrupt, so they run in process context and
+// must not register or unregister timer callbacks themselves. The return value is currently ignored.
+typedef int (*timer_callback_t)(int func_id);
+
+
+/***************    Function declarations    ***************/
+
+int register_timer_dev_cb(dev_t dev_id, int func_id, int priority, uint32_t period_us,
+                          timer_callback_t callback);
+int unregister_timer_dev_cb(dev_t dev_id, int func_id);
+uint32_t timer_get_tick_period_us(void);
+
+#endif
@@ -0,0 +1,309 @@
+// Userspace side of the benchmarks (see custom-bench-driver.c).
+// Times the full write() and ioctl() round trips of a led device, prints their min/median/p99/max latency and call rate,
+// and adds them to /sys/kernel/debug/custom_bench/results. With -k it also runs the kernel benchmarks first and
+// prints the whole results file, so one run of the tool gives every number for a build.
+//
+// Build with "make tools" from the custom-drivers directory and run it as root (debugfs is root only), e.g.
+//   sudo tools/custom-bench-tool -k -d /dev/custom_gpio_led_0 -n 20000
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "../custom-led-ioctl.h"
+
+
+/***************    Macros    ***************/
+
+#define BENCH_RUN_PATH            "/sys/kernel/debug/custom_bench/run"
+#define BENCH_RESULTS_PATH        "/sys/kernel/debug/custom_bench/results"
+
+#define DEFAULT_LED_DEV_PATH      "/dev/custom_gpio_led_0"
+#define DEFAULT_SAMPLE_CNT        (10000U)
+#define MAX_SAMPLE_CNT            (1000000U)
+
+#define NSEC_PER_SEC              (1000000000ULL)
+
+// Same as in custom-bench-driver.c
+#define PERCENTILE_INDEX(cnt, percent)    ((((cnt) - 1) * (percent)) / 100)
+
+
+/***************    Type definitions    ***************/
+
+typedef struct bench_stats_s
+{
+  uint64_t min_ns;
+  uint64_t median_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+  uint64_t rate_hz;
+} bench_stats_t;
+
+
+/***************    Function declarations    ***************/
+
+static inline uint64_t now_ns(void);
+static int cmp_u64(const void *p_a, const void *p_b);
+static void calc_stats(uint64_t *p_samples, uint32_t sample_cnt, bench_stats_t *p_stats);
+static int bench_led_write(int fd, uint64_t *p_samples, uint32_t sample_cnt);
+static int bench_led_ioctl(int fd, uint64_t *p_samples, uint32_t sample_cnt);
+static void report(char const *name, uint64_t *p_samples, uint32_t sample_cnt);
+static int run_kernel_benchmarks(void);
+static void print_results(void);
+static void print_usage(char const *prog_name);
+
+
+/***************    Function Definitions    ***************/
+
+int main(int argc, char *argv[])
+{
+  char const *led_dev_path = DEFAULT_LED_DEV_PATH;
+  uint32_t sample_cnt = DEFAULT_SAMPLE_CNT;
+  bool do_run_kernel = false;
+  int opt;
+
+  while (-1 != (opt = getopt(argc, argv, "d:n:kh")))
+  {
+    switch (opt)
+    {
+      case 'd':
+        led_dev_path = optarg;
+        break;
+      case 'n':
+        sample_cnt = (uint32_t)(strtoul(optarg, NULL, 0));
+        break;
+      case 'k':
+        do_run_kernel = true;
+        break;
+      default:
+        print_usage(argv[0]);
+        return ('h' == opt) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if ((0 == sample_cnt) || (MAX_SAMPLE_CNT < sample_cnt))
+  {
+    fprintf(stderr, "The sample count must be 1 to %u\n", MAX_SAMPLE_CNT);
+    return EXIT_FAILURE;
+  }
+
+  if (do_run_kernel && (0 != run_kernel_benchmarks()))
+  {
+    return EXIT_FAILURE;
+  }
+
+  uint64_t *p_samples = calloc(sample_cnt, sizeof(uint64_t));
+  int fd = open(led_dev_path, O_RDWR);
+  int error = 0;
+
+  if (NULL == p_samples)
+  {
+    fprintf(stderr, "Couldn't allocate the samples\n");
+    error = -ENOMEM;
+    goto close_fd;
+  }
+
+  if (0 > fd)
+  {
+    error = -errno;
+    fprintf(stderr, "Couldn't open %s: %s\n", led_dev_path, strerror(-error));
+    goto free_samples;
+  }
+
+  error = bench_led_write(fd, p_samples, sample_cnt);
+
+  if (0 == error)
+  {
+    report("led_write", p_samples, sample_cnt);
+    error = bench_led_ioctl(fd, p_samples, sample_cnt);
+  }
+
+  if (0 == error)
+  {
+    report("led_ioctl_toggle", p_samples, sample_cnt);
+  }
+
+  // Leave the led off
+  ioctl(fd, LED_IOC_OFF);
+
+  if (do_run_kernel)
+  {
+    print_results();
+  }
+
+close_fd:
+  if (0 <= fd)
+  {
+    close(fd);
+  }
+
+free_samples:
+  free(p_samples);
+
+  return (0 == error) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static inline uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((uint64_t)(ts.tv_sec) * NSEC_PER_SEC) + (uint64_t)(ts.tv_nsec);
+}
+
+static int cmp_u64(const void *p_a, const void *p_b)
+{
+  uint64_t a = *((uint64_t const *)(p_a));
+  uint64_t b = *((uint64_t const *)(p_b));
+
+  return (a > b) - (a < b);
+}
+
+// Sorts the samples in place
+static void calc_stats(uint64_t *p_samples, uint32_t sample_cnt, bench_stats_t *p_stats)
+{
+  qsort(p_samples, sample_cnt, sizeof(uint64_t), cmp_u64);
+
+  p_stats->min_ns = p_samples[0];
+  p_stats->median_ns = p_samples[PERCENTILE_INDEX(sample_cnt, 50)];
+  p_stats->p99_ns = p_samples[PERCENTILE_INDEX(sample_cnt, 99)];
+  p_stats->max_ns = p_samples[sample_cnt - 1];
+  p_stats->rate_hz = (0 != p_stats->median_ns) ? (NSEC_PER_SEC / p_stats->median_ns) : 0;
+}
+
+// Times one text command write per sample, alternating on and off so every write changes the led
+static int bench_led_write(int fd, uint64_t *p_samples, uint32_t sample_cnt)
+{
+  static char const * const cmds[] = { "off", "on" };
+
+  for (uint32_t sample_num = 0; sample_num < sample_cnt; sample_num++)
+  {
+    char const *cmd = cmds[sample_num & 1];
+    size_t cmd_len = strlen(cmd);
+    uint64_t start_ns = now_ns();
+
+    if ((ssize_t)(cmd_len) != write(fd, cmd, cmd_len))
+    {
+      int error = -errno;
+
+      fprintf(stderr, "Led write failed: %s\n", strerror(-error));
+      return error;
+    }
+
+    p_samples[sample_num] = now_ns() - start_ns;
+  }
+
+  return 0;
+}
+
+static int bench_led_ioctl(int fd, uint64_t *p_samples, uint32_t sample_cnt)
+{
+  for (uint32_t sample_num = 0; sample_num < sample_cnt; sample_num++)
+  {
+    uint64_t start_ns = now_ns();
+
+    if (0 != ioctl(fd, LED_IOC_TOGGLE))
+    {
+      int error = -errno;
+
+      fprintf(stderr, "Led toggle ioctl failed: %s\n", strerror(-error));
+      return error;
+    }
+
+    p_samples[sample_num] = now_ns() - start_ns;
+  }
+
+  return 0;
+}
+
+// Prints the stats of the samples and adds them to the kernel results, in the format the results file uses
+static void report(char const *name, uint64_t *p_samples, uint32_t sample_cnt)
+{
+  bench_stats_t stats;
+  char line[128];
+
+  calc_stats(p_samples, sample_cnt, &stats);
+
+  int line_len = snprintf(line, sizeof(line), "%-24s %10u %6u %10llu %10llu %10llu %10llu %12llu\n", name, sample_cnt, 1U,
+                          (unsigned long long)(stats.min_ns), (unsigned long long)(stats.median_ns),
+                          (unsigned long long)(stats.p99_ns), (unsigned long long)(stats.max_ns),
+                          (unsigned long long)(stats.rate_hz));
+
+  fputs(line, stdout);
+
+  int fd = open(BENCH_RESULTS_PATH, O_WRONLY);
+
+  // The results still get printed without the benchmark module
+  if (0 <= fd)
+  {
+    if (line_len != write(fd, line, (size_t)(line_len)))
+    {
+      fprintf(stderr, "Couldn't add %s to %s: %s\n", name, BENCH_RESULTS_PATH, strerror(errno));
+    }
+
+    close(fd);
+  }
+}
+
+static int run_kernel_benchmarks(void)
+{
+  int fd = open(BENCH_RUN_PATH, O_WRONLY);
+
+  if (0 > fd)
+  {
+    int error = -errno;
+
+    fprintf(stderr, "Couldn't open %s (is custom-bench-driver.ko installed?): %s\n", BENCH_RUN_PATH, strerror(-error));
+    return error;
+  }
+
+  int error = 0;
+
+  if (3 != write(fd, "all", 3))
+  {
+    error = -errno;
+    fprintf(stderr, "Kernel benchmarks failed: %s\n", strerror(-error));
+  }
+
+  close(fd);
+
+  return error;
+}
+
+static void print_results(void)
+{
+  FILE *p_file = fopen(BENCH_RESULTS_PATH, "r");
+  char line[256];
+
+  if (NULL == p_file)
+  {
+    fprintf(stderr, "Couldn't open %s: %s\n", BENCH_RESULTS_PATH, strerror(errno));
+    return;
+  }
+
+  printf("\n%s:\n", BENCH_RESULTS_PATH);
+
+  while (NULL != fgets(line, sizeof(line), p_file))
+  {
+    fputs(line, stdout);
+  }
+
+  fclose(p_file);
+}
+
+static void print_usage(char const *prog_name)
+{
+  printf("Usage: %s [-k] [-d led_device] [-n sample_count]\n", prog_name);
+  printf("  -k  run the kernel benchmarks too and print every result\n");
+  printf("  -d  led device to benchmark (default %s)\n", DEFAULT_LED_DEV_PATH);
+  printf("  -n  samples per benchmark (default %u)\n", DEFAULT_SAMPLE_CNT);
+}
@@ -0,0 +1,145 @@
+// Example of the C++ client library (see client/custom-drivers-client.hpp).
+// Chases the leds with single bank frames, fades led 0 out with a batch and waits on its completion, then plays a
+// short blink sequence on the pin of led 0 from the sequence player while it waits on that completion asynchronously.
+//
+// Build with "make tools" from the custom-drivers directory and run it as root, e.g.
+//   sudo tools/custom-led-client-demo -l 4 -p 16
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <unistd.h>
+
+#include "../client/custom-drivers-client.hpp"
+
+using namespace custom_drivers;
+using namespace std::chrono_literals;
+
+
+/***************    Macros    ***************/
+
+#define DEFAULT_LED_CNT       (4U)
+#define DEFAULT_LED_0_PIN     (16U)   // Default led_pins of the led module
+#define CHASE_STEP_MS         (100)
+#define BLINK_CNT             (10U)
+
+
+/***************    Function Definitions    ***************/
+
+int main(int argc, char *argv[])
+{
+  uint32_t led_cnt = DEFAULT_LED_CNT;
+  uint32_t led_0_pin_num = DEFAULT_LED_0_PIN;
+  int opt;
+
+  while (-1 != (opt = getopt(argc, argv, "l:p:h")))
+  {
+    switch (opt)
+    {
+      case 'l':
+        led_cnt = static_cast<uint32_t>(strtoul(optarg, nullptr, 0));
+        break;
+      case 'p':
+        led_0_pin_num = static_cast<uint32_t>(strtoul(optarg, nullptr, 0));
+        break;
+      default:
+        printf("Usage: %s [-l led_count] [-p pin_of_led_0]\n", argv[0]);
+        return ('h' == opt) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  std::optional<gpio_pin> led_0_pin = gpio_pin::from(led_0_pin_num);
+
+  if ((0 == led_cnt) || !led_num::from(led_cnt - 1) || !led_0_pin)
+  {
+    fprintf(stderr, "The led count must be 1 to %u and the pin %u to %u\n", MAX_LED_DEVICES, MIN_PIN_NUM, MAX_PIN_NUM);
+    return EXIT_FAILURE;
+  }
+
+  led_bank bank;
+  led_device led_0;
+  gpio_events events;
+  int error = bank.open();
+
+  if (0 == error)
+  {
+    error = led_0.open(led_num::make<0>());
+  }
+
+  if (0 == error)
+  {
+    error = events.open();
+  }
+
+  if (0 != error)
+  {
+    fprintf(stderr, "Couldn't open the devices (are the gpio and led modules installed?): %s\n", strerror(-error));
+    return EXIT_FAILURE;
+  }
+
+  // Every led changes with the one write of its frame
+  for (uint32_t step_num = 0; (0 == error) && (step_num <= led_cnt); step_num++)
+  {
+    led_bank_frame frame;
+
+    error = frame.set_on_mask((1U << led_cnt) - 1U, (step_num < led_cnt) ? (1U << step_num) : 0);
+
+    if (0 == error)
+    {
+      error = bank.apply(frame);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(CHASE_STEP_MS));
+  }
+
+  // One write for all of it, the kernel runs the fade
+  led_cmd_batch batch;
+
+  batch.brightness(100).on().fade(0, 1000, led_fade_curve::gamma);
+
+  if (0 == error)
+  {
+    error = led_0.flush(batch).wait();
+  }
+
+  gpio_sequence sequence;
+
+  for (uint32_t blink_num = 0; (0 == error) && (blink_num < BLINK_CNT); blink_num++)
+  {
+    error = sequence.set_pin(*led_0_pin, 50ms);
+
+    if (0 == error)
+    {
+      error = sequence.clear_pin(*led_0_pin, 50ms);
+    }
+  }
+
+  if (0 == error)
+  {
+    led_0.set_brightness(LED_BRIGHTNESS_MAX);
+
+    std::future<gpio_sequence_result_t> sequence_done = events.run_sequence_async(sequence);
+
+    while (std::future_status::ready != sequence_done.wait_for(100ms))
+    {
+      printf("Sequence is still playing\n");
+    }
+
+    gpio_sequence_result_t result = sequence_done.get();
+
+    error = result.error;
+    printf("Sequence done, latest step was %lld ns late\n", static_cast<long long>(result.max_late.count()));
+  }
+
+  led_0.off();
+
+  if (0 != error)
+  {
+    fprintf(stderr, "Demo failed: %s\n", strerror(-error));
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}